@@ -14,36 +14,52 @@ namespace OpenTracerCore
 
 		void Woopify(float4* input, float4* output)
 		{
-			float4& v0 = input[0];
-			float4& v1 = input[1];
-			float4& v2 = input[2];
-			float4 a = v0 - v2;
-			float4 b = v1 - v2;
-			float4 c = cross(a, b);
-
-			mat4 m = inverse(mat4(a.x, b.x, c.x, v2.x,
-				a.y, b.y, c.y, v2.y,
-				a.z, b.z, c.z, v2.z,
-				0.0f, 0.0f, 0.0f, 1.0f));
-
-			output[0] = m[2] * float4(1.0f, 1.0f, 1.0f, -1.0f);
-			output[1] = m[0];
-			output[2] = m[1];
+			((const Triangle*)input)->Woopify(output);
 		}
 
-	public:
-		Aggregate(Context* context, Scene* scene)
+		Aggregate()
 		{
-			mWoop = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(float4) * 3 * scene->GetTriangleCount());
+			mWoop = NULL;
+			mWoopCount = 0;
+		}
 
+		void WoopifyScene(Scene* scene, float4* output)
+		{
 			float4* input = (float4*)scene->GetGeometryCPU();
-			float4* output = new float4[scene->GetVertexCount()];
 			for (int i = 0; i < scene->GetVertexCount(); i += 3)
 			{
 				Woopify(input + i, output + i);
 			}
-			mWoopCount = scene->GetTriangleCount();
-			context->GetCommandQueue().enqueueWriteBuffer(*mWoop, CL_TRUE, 0, sizeof(float4) * scene->GetVertexCount(), output);
+		}
+
+		// Buffer is allocated only once for given triangle count, updates rewrite it in place
+		void UploadTriangles(Context* context, const float4* woop, size_t count)
+		{
+			// Native context traces scene triangles on host, only the count is kept
+			if (context->IsNative())
+			{
+				mWoopCount = count;
+				return;
+			}
+
+			if (!mWoop || mWoopCount != count)
+			{
+				delete mWoop;
+				mWoop = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(float4) * 3 * count);
+				mWoopCount = count;
+			}
+			context->GetCommandQueue().enqueueWriteBuffer(*mWoop, CL_TRUE, 0, sizeof(float4) * 3 * count, woop);
+		}
+
+	public:
+		Aggregate(Context* context, Scene* scene)
+		{
+			mWoop = NULL;
+			mWoopCount = 0;
+
+			float4* output = new float4[scene->GetVertexCount()];
+			WoopifyScene(scene, output);
+			UploadTriangles(context, output, scene->GetTriangleCount());
 			delete[] output;
 		}
 		
@@ -52,6 +68,15 @@ namespace OpenTracerCore
 			delete mWoop;
 		}
 
+		// Follows vertex positions changed by Scene::Update
+		virtual void Update(Context* context, Scene* scene)
+		{
+			float4* output = new float4[scene->GetVertexCount()];
+			WoopifyScene(scene, output);
+			UploadTriangles(context, output, scene->GetTriangleCount());
+			delete[] output;
+		}
+
 		cl::Buffer* GetTriangles() { return mWoop; }
 
 		size_t GetTriangleCount() { return mWoopCount; }
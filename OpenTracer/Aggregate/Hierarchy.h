@@ -0,0 +1,178 @@
+#ifndef __HIERARCHY_AGGREGATE__H__
+#define __HIERARCHY_AGGREGATE__H__
+
+#include "Aggregate.h"
+#include "../Graph/Trees/BVH.h"
+#include "../Graph/Trees/WideBVH.h"
+#include "../Util/CPU.h"
+
+namespace OpenTracerCore
+{
+	class Hierarchy : public Aggregate
+	{
+	protected:
+		BVH* mTree;
+		cl::Buffer* mNodes;
+		cl::Buffer* mIndices;
+		BVH4* mWide4;
+		BVH8* mWide8;
+		BVH16* mWide16;
+		bool mCompressed;
+
+		size_t GetNodeSize()
+		{
+			return mCompressed ? sizeof(float4) : sizeof(float4) * 4;
+		}
+
+		void UploadNodes(Context* context)
+		{
+			if (!mNodes)
+			{
+				return;
+			}
+
+			void* nodes = mCompressed ? (void*)mTree->GetCompressedNodes() : (void*)mTree->GetNodes();
+			context->GetCommandQueue().enqueueWriteBuffer(*mNodes, CL_TRUE, 0, GetNodeSize() * mTree->GetNodeCount(), nodes);
+		}
+
+	public:
+		Hierarchy(Context* context, Scene* scene, const std::string& config) : Aggregate(context, scene)
+		{
+			mTree = new BVH(config, scene);
+
+			Config* cfg = new Config(config);
+			int width = cfg->Get<int>("BVH.Wide.Width");
+			int compressed = cfg->Get<int>("BVH.Compressed");
+			delete cfg;
+
+			// Nodes are 64 bytes - 4 unsigned ints followed by 3 float4 holding both child bounds,
+			// compressed nodes are 16 bytes and replace them on the device
+			mCompressed = compressed == 1 && mTree->Compress();
+			mNodes = NULL;
+			mIndices = NULL;
+			if (!context->IsNative())
+			{
+				mNodes = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, GetNodeSize() * mTree->GetNodeCount());
+				UploadNodes(context);
+				mIndices = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(unsigned int) * mTree->GetIndexCount());
+				context->GetCommandQueue().enqueueWriteBuffer(*mIndices, CL_TRUE, 0, sizeof(unsigned int) * mTree->GetIndexCount(), mTree->GetIndices());
+			}
+
+			// Width 0 picks the widest tree the CPU runs natively, wider ones fall back to it
+			unsigned int simd = GetSimdWidth();
+			if (width == 0)
+			{
+				width = (int)simd;
+			}
+			else if ((width == 8 || width == 16) && width > (int)simd)
+			{
+				std::cout << "\tWide BVH" << width << " is not supported by " << GetSimdIsaName(GetSimdIsa()) << " CPU, using BVH" << simd << std::endl;
+				width = (int)simd;
+			}
+
+			// Wide tree serves CPU queries, it packs its own copy of leaf triangles
+			mWide4 = width == 4 ? new BVH4(mTree, scene->GetGeometryCPU()) : NULL;
+			mWide8 = width == 8 ? new BVH8(mTree, scene->GetGeometryCPU()) : NULL;
+			mWide16 = width == 16 ? new BVH16(mTree, scene->GetGeometryCPU()) : NULL;
+		}
+
+		virtual ~Hierarchy()
+		{
+			delete mNodes;
+			delete mIndices;
+			if (mWide4)
+			{
+				delete mWide4;
+			}
+			if (mWide8)
+			{
+				delete mWide8;
+			}
+			if (mWide16)
+			{
+				delete mWide16;
+			}
+			delete mTree;
+		}
+
+		AABB& GetBounds()
+		{
+			return mTree->GetAABB();
+		}
+
+		BVH* GetTree()
+		{
+			return mTree;
+		}
+
+		cl::Buffer* GetNodes()
+		{
+			return mNodes;
+		}
+
+		cl::Buffer* GetIndices()
+		{
+			return mIndices;
+		}
+
+		// Nodes buffer holds compressed nodes (BVH.Compressed = 1)
+		bool IsCompressed()
+		{
+			return mCompressed;
+		}
+
+		// Refits the tree to moved vertices, only triangle and node buffers are uploaded again
+		virtual void Update(Context* context, Scene* scene)
+		{
+			Aggregate::Update(context, scene);
+
+			mTree->Refit(scene->GetGeometryCPU());
+			if (mCompressed)
+			{
+				mTree->Compress();
+			}
+			UploadNodes(context);
+
+			if (mWide4)
+			{
+				mWide4->Update(mTree);
+			}
+			if (mWide8)
+			{
+				mWide8->Update(mTree);
+			}
+			if (mWide16)
+			{
+				mWide16->Update(mTree);
+			}
+		}
+
+		// Closest hit on CPU, false when there is no hit or no wide tree was built
+		bool Intersect(const Ray& r, float& distance, float4& barycentric, int& id)
+		{
+			if (mWide16)
+			{
+				return mWide16->Intersect(r, distance, barycentric, id);
+			}
+
+			if (mWide8)
+			{
+				return mWide8->Intersect(r, distance, barycentric, id);
+			}
+
+			if (mWide4)
+			{
+				return mWide4->Intersect(r, distance, barycentric, id);
+			}
+
+			return false;
+		}
+
+		const TreeStatistics& GetStatistics()
+		{
+			return mTree->GetStatistics();
+		}
+	};
+}
+
+#endif
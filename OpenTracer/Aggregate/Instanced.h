@@ -0,0 +1,242 @@
+#ifndef __INSTANCED_AGGREGATE__H__
+#define __INSTANCED_AGGREGATE__H__
+
+#include "Aggregate.h"
+#include "../Graph/Trees/BVH.h"
+
+namespace OpenTracerCore
+{
+	// Two level aggregate - top level BVH over instances, every instance references one of the
+	// shared bottom level BVHs (meshes) through an affine transform. Memory and build time scale
+	// with unique geometry, instance count only affects the top level.
+	class Instanced : public Aggregate
+	{
+	protected:
+		// GPU instance record - world to object rows followed by offsets of the referenced mesh
+		// inside concatenated node, index and triangle buffers
+		class __declspec(align(16)) InstanceData
+		{
+		public:
+			float4 mRows[3];
+			unsigned int mNodeOffset;
+			unsigned int mIndexOffset;
+			unsigned int mTriangleOffset;
+			unsigned int mMesh;
+		};
+
+		std::string mConfig;
+
+		BVH** mMeshes;
+		unsigned int* mNodeOffsets;
+		unsigned int* mIndexOffsets;
+		unsigned int* mTriangleOffsets;
+		unsigned int mMeshCount;
+
+		unsigned int* mInstanceMeshes;
+		InstanceData* mInstances;
+		unsigned int mInstanceCount;
+
+		BVH* mTop;
+
+		cl::Buffer* mNodes;
+		cl::Buffer* mIndices;
+		cl::Buffer* mTopNodes;
+		cl::Buffer* mTopIndices;
+		cl::Buffer* mInstanceData;
+
+		// Transform given as 3x4 row-major object to world matrix
+		void SetTransform(unsigned int instance, const float* m, AABB* bounds)
+		{
+			mat4 inv = inverse(mat4(m[0], m[1], m[2], m[3],
+				m[4], m[5], m[6], m[7],
+				m[8], m[9], m[10], m[11],
+				0.0f, 0.0f, 0.0f, 1.0f));
+
+			mInstances[instance].mRows[0] = inv[0];
+			mInstances[instance].mRows[1] = inv[1];
+			mInstances[instance].mRows[2] = inv[2];
+
+			// World bounds enclose all transformed corners of mesh bounds
+			const AABB& b = mMeshes[mInstanceMeshes[instance]]->GetAABB();
+			*bounds = AABB();
+			for (int c = 0; c < 8; c++)
+			{
+				float x = (c & 1) ? b.mMax.x : b.mMin.x;
+				float y = (c & 2) ? b.mMax.y : b.mMin.y;
+				float z = (c & 4) ? b.mMax.z : b.mMin.z;
+				bounds->Union(float4(m[0] * x + m[1] * y + m[2] * z + m[3],
+					m[4] * x + m[5] * y + m[6] * z + m[7],
+					m[8] * x + m[9] * y + m[10] * z + m[11],
+					0.0f));
+			}
+		}
+
+		void BuildTopLevel(Context* context, const float* transforms)
+		{
+			AABB* bounds = (AABB*)_aligned_malloc(sizeof(AABB) * mInstanceCount, 16);
+			for (unsigned int i = 0; i < mInstanceCount; i++)
+			{
+				SetTransform(i, transforms + i * 12, &bounds[i]);
+			}
+
+			if (mTop)
+			{
+				delete mTop;
+				delete mTopNodes;
+				delete mTopIndices;
+			}
+			mTop = new BVH(mConfig, bounds, mInstanceCount);
+			_aligned_free(bounds);
+
+			if (context->IsNative())
+			{
+				mTopNodes = NULL;
+				mTopIndices = NULL;
+				return;
+			}
+
+			mTopNodes = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(float4) * 4 * mTop->GetNodeCount());
+			context->GetCommandQueue().enqueueWriteBuffer(*mTopNodes, CL_TRUE, 0, sizeof(float4) * 4 * mTop->GetNodeCount(), mTop->GetNodes());
+			mTopIndices = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(unsigned int) * mTop->GetIndexCount());
+			context->GetCommandQueue().enqueueWriteBuffer(*mTopIndices, CL_TRUE, 0, sizeof(unsigned int) * mTop->GetIndexCount(), mTop->GetIndices());
+			context->GetCommandQueue().enqueueWriteBuffer(*mInstanceData, CL_TRUE, 0, sizeof(InstanceData) * mInstanceCount, mInstances);
+		}
+
+	public:
+		Instanced(Context* context, Scene** meshes, unsigned int mesh_count, const unsigned int* instance_meshes, const float* transforms, unsigned int instance_count, const std::string& config) : Aggregate()
+		{
+			mConfig = config;
+			mMeshCount = mesh_count;
+			mMeshes = new BVH*[mesh_count];
+			mNodeOffsets = new unsigned int[mesh_count];
+			mIndexOffsets = new unsigned int[mesh_count];
+			mTriangleOffsets = new unsigned int[mesh_count];
+
+			// Bottom levels are built once per mesh, their buffers are concatenated
+			unsigned int nodes = 0, indices = 0, triangles = 0;
+			for (unsigned int i = 0; i < mesh_count; i++)
+			{
+				mMeshes[i] = new BVH(config, meshes[i]);
+				mNodeOffsets[i] = nodes;
+				mIndexOffsets[i] = indices;
+				mTriangleOffsets[i] = triangles;
+				nodes += (unsigned int)mMeshes[i]->GetNodeCount();
+				indices += (unsigned int)mMeshes[i]->GetIndexCount();
+				triangles += meshes[i]->GetTriangleCount();
+			}
+
+			float4* woop = new float4[triangles * 3];
+			for (unsigned int i = 0; i < mesh_count; i++)
+			{
+				WoopifyScene(meshes[i], woop + mTriangleOffsets[i] * 3);
+			}
+			UploadTriangles(context, woop, triangles);
+			delete[] woop;
+
+			mNodes = NULL;
+			mIndices = NULL;
+			if (!context->IsNative())
+			{
+				mNodes = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(float4) * 4 * nodes);
+				mIndices = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(unsigned int) * indices);
+				for (unsigned int i = 0; i < mesh_count; i++)
+				{
+					context->GetCommandQueue().enqueueWriteBuffer(*mNodes, CL_TRUE, sizeof(float4) * 4 * mNodeOffsets[i], sizeof(float4) * 4 * mMeshes[i]->GetNodeCount(), mMeshes[i]->GetNodes());
+					context->GetCommandQueue().enqueueWriteBuffer(*mIndices, CL_TRUE, sizeof(unsigned int) * mIndexOffsets[i], sizeof(unsigned int) * mMeshes[i]->GetIndexCount(), mMeshes[i]->GetIndices());
+				}
+			}
+
+			mInstanceCount = instance_count;
+			mInstanceMeshes = new unsigned int[instance_count];
+			mInstances = (InstanceData*)_aligned_malloc(sizeof(InstanceData) * instance_count, 16);
+			for (unsigned int i = 0; i < instance_count; i++)
+			{
+				unsigned int mesh = instance_meshes[i];
+				mInstanceMeshes[i] = mesh;
+				mInstances[i].mNodeOffset = mNodeOffsets[mesh];
+				mInstances[i].mIndexOffset = mIndexOffsets[mesh];
+				mInstances[i].mTriangleOffset = mTriangleOffsets[mesh];
+				mInstances[i].mMesh = mesh;
+			}
+			mInstanceData = context->IsNative() ? NULL : new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(InstanceData) * instance_count);
+
+			mTop = NULL;
+			mTopNodes = NULL;
+			mTopIndices = NULL;
+			BuildTopLevel(context, transforms);
+		}
+
+		virtual ~Instanced()
+		{
+			delete mNodes;
+			delete mIndices;
+			delete mTopNodes;
+			delete mTopIndices;
+			delete mInstanceData;
+			delete mTop;
+			for (unsigned int i = 0; i < mMeshCount; i++)
+			{
+				delete mMeshes[i];
+			}
+			delete[] mMeshes;
+			delete[] mNodeOffsets;
+			delete[] mIndexOffsets;
+			delete[] mTriangleOffsets;
+			delete[] mInstanceMeshes;
+			_aligned_free(mInstances);
+		}
+
+		// Moves instances, only the top level is rebuilt - bottom levels stay untouched
+		void SetTransforms(Context* context, const float* transforms)
+		{
+			BuildTopLevel(context, transforms);
+		}
+
+		// Meshes are static, animation is limited to instance transforms (SetTransforms)
+		virtual void Update(Context* context, Scene* scene)
+		{
+		}
+
+		AABB& GetBounds()
+		{
+			return mTop->GetAABB();
+		}
+
+		cl::Buffer* GetNodes()
+		{
+			return mNodes;
+		}
+
+		cl::Buffer* GetIndices()
+		{
+			return mIndices;
+		}
+
+		cl::Buffer* GetTopNodes()
+		{
+			return mTopNodes;
+		}
+
+		cl::Buffer* GetTopIndices()
+		{
+			return mTopIndices;
+		}
+
+		cl::Buffer* GetInstances()
+		{
+			return mInstanceData;
+		}
+
+		unsigned int GetInstanceCount()
+		{
+			return mInstanceCount;
+		}
+
+		const TreeStatistics& GetStatistics()
+		{
+			return mTop->GetStatistics();
+		}
+	};
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "Aggregate.h"
 #include "../Graph/Trees/KDTree.h"
+#include "SpatialCache.h"
 
 namespace OpenTracerCore
 {
@@ -12,29 +13,148 @@ namespace OpenTracerCore
 		KDTree* mTree;
 		cl::Buffer* mNodes;
 		cl::Buffer* mIndices;
+		cl::Buffer* mRopes;
+		cl::Buffer* mLeafBounds;
+		size_t mNodeCapacity;
+		size_t mIndexCapacity;
+
+		// Buffers are reallocated only when the tree outgrows them
+		void UploadTree(Context* context, const void* nodes, const unsigned int* indices)
+		{
+			if (context->IsNative())
+			{
+				return;
+			}
+
+			size_t node_count = mTree->GetNodeCount() > 0 ? mTree->GetNodeCount() : 1;
+			size_t index_count = mTree->GetIndexCount() > 0 ? mTree->GetIndexCount() : 1;
+
+			if (node_count > mNodeCapacity)
+			{
+				delete mNodes;
+				delete mRopes;
+				delete mLeafBounds;
+				mNodes = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(unsigned int) * 2 * node_count);
+				mRopes = NULL;
+				mLeafBounds = NULL;
+				mNodeCapacity = node_count;
+			}
+
+			if (index_count > mIndexCapacity)
+			{
+				delete mIndices;
+				mIndices = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(unsigned int) * index_count);
+				mIndexCapacity = index_count;
+			}
+
+			context->GetCommandQueue().enqueueWriteBuffer(*mNodes, CL_TRUE, 0, sizeof(unsigned int) * 2 * mTree->GetNodeCount(), nodes);
+			context->GetCommandQueue().enqueueWriteBuffer(*mIndices, CL_TRUE, 0, sizeof(unsigned int) * mTree->GetIndexCount(), indices);
+
+			if (mTree->HasRopes())
+			{
+				if (!mRopes)
+				{
+					mRopes = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(unsigned int) * 6 * mNodeCapacity);
+					mLeafBounds = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(float4) * 2 * mNodeCapacity);
+				}
+				context->GetCommandQueue().enqueueWriteBuffer(*mRopes, CL_TRUE, 0, sizeof(unsigned int) * 6 * mTree->GetNodeCount(), mTree->GetRopes());
+				context->GetCommandQueue().enqueueWriteBuffer(*mLeafBounds, CL_TRUE, 0, sizeof(float4) * 2 * mTree->GetNodeCount(), mTree->GetLeafBounds());
+			}
+		}
 
 	public:
-		Spatial(Context* context, Scene* scene, const std::string& config) : Aggregate(context, scene)
+		Spatial(Context* context, Scene* scene, const std::string& config) : Aggregate()
 		{
-			mTree = new KDTree(config, scene);
-			mNodes = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(unsigned int) * 2 * mTree->GetNodeCount());
-			context->GetCommandQueue().enqueueWriteBuffer(*mNodes, CL_TRUE, 0, sizeof(unsigned int) * 2 * mTree->GetNodeCount(), mTree->GetNodes());
-			mIndices = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(unsigned int) * mTree->GetIndexCount());
-			context->GetCommandQueue().enqueueWriteBuffer(*mIndices, CL_TRUE, 0, sizeof(unsigned int) * mTree->GetIndexCount(), mTree->GetIndices());
+			mTree = new KDTree(config);
+
+			Config* cfg = new Config(config);
+			std::string cache_directory = cfg->Get<std::string>("KDTree.Cache");
+			delete cfg;
+
+			// Cache is keyed by geometry and build settings, any change makes a new file
+			bool use_cache = cache_directory != "Undefined" && cache_directory != "";
+			unsigned long long cache_key = use_cache ? SpatialCache::ComputeKey(scene, mTree->GetBuildHash()) : 0;
+			std::string cache_path = use_cache ? SpatialCache::GetPath(cache_directory, cache_key) : "";
+
+			SpatialCache cache;
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			const void* nodes;
+			const unsigned int* indices;
+			bool cached = use_cache && cache.Open(cache_path, cache_key, scene->GetTriangleCount());
+
+			if (cached)
+			{
+				std::cout << "Loading KD-Tree from cache " << cache_path << "..." << std::endl;
+
+				// Buffers are uploaded straight from the mapped file
+				mTree->SetTree(cache.GetNodes(), cache.GetNodeCount(), cache.GetIndices(), cache.GetIndexCount(), cache.GetBounds(), scene->GetTriangleCount());
+				this->UploadTriangles(context, cache.GetTriangles(), scene->GetTriangleCount());
+				nodes = cache.GetNodes();
+				indices = cache.GetIndices();
+			}
+			else
+			{
+				mTree->Build(scene);
+				start = std::chrono::high_resolution_clock::now();
+
+				float4* woop = new float4[scene->GetVertexCount()];
+				this->WoopifyScene(scene, woop);
+				this->UploadTriangles(context, woop, scene->GetTriangleCount());
+
+				if (use_cache && !SpatialCache::Write(cache_directory, cache_key, mTree, woop, scene->GetTriangleCount()))
+				{
+					std::cout << "Failed to write KD-Tree cache " << cache_path << std::endl;
+				}
+
+				delete[] woop;
+				nodes = mTree->GetNodes();
+				indices = mTree->GetIndices();
+			}
+
+			mNodes = NULL;
+			mIndices = NULL;
+			mRopes = NULL;
+			mLeafBounds = NULL;
+			mNodeCapacity = 0;
+			mIndexCapacity = 0;
+			UploadTree(context, nodes, indices);
+
+			// Loading from cache is dominated by reading the mapped pages during upload
+			mTree->AddPhaseTime(cached ? "cache_load" : "upload", std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
 		}
 
 		virtual ~Spatial()
 		{
 			delete mNodes;
 			delete mIndices;
+			if (mRopes)
+			{
+				delete mRopes;
+				delete mLeafBounds;
+			}
 			delete mTree;
 		}
 
+		// KD-tree split planes cannot follow moved geometry, so the tree is rebuilt, device buffers
+		// are kept whenever the new tree fits into them. Cache is not written for animated frames.
+		virtual void Update(Context* context, Scene* scene)
+		{
+			Aggregate::Update(context, scene);
+
+			mTree->Build(scene);
+			UploadTree(context, mTree->GetNodes(), mTree->GetIndices());
+		}
+
 		AABB& GetBounds()
 		{
 			return mTree->GetAABB();
 		}
 
+		KDTree* GetTree()
+		{
+			return mTree;
+		}
+
 		cl::Buffer* GetNodes()
 		{
 			return mNodes;
@@ -44,6 +164,26 @@ namespace OpenTracerCore
 		{
 			return mIndices;
 		}
+
+		cl::Buffer* GetRopes()
+		{
+			return mRopes;
+		}
+
+		cl::Buffer* GetLeafBounds()
+		{
+			return mLeafBounds;
+		}
+
+		int GetLayout()
+		{
+			return mTree->GetLayout();
+		}
+
+		const TreeStatistics& GetStatistics()
+		{
+			return mTree->GetStatistics();
+		}
 	};
 }
 
@@ -0,0 +1,188 @@
+#ifndef __SPATIAL_CACHE__H__
+#define __SPATIAL_CACHE__H__
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include "../Scene.h"
+#include "../Graph/Trees/KDTree.h"
+#include "../Util/Hash.h"
+#include "../Util/MappedFile.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace OpenTracerCore
+{
+	// On-disk copy of built KD-tree together with Woop triangles, file layout is the header followed
+	// by node, index and triangle arrays (each aligned to 16 bytes) exactly as they are uploaded
+	class SpatialCache
+	{
+	public:
+		// Increase whenever layout of the file, of the stored buffers or computation of the key changes
+		enum { VERSION = 2 };
+
+		struct Header
+		{
+			char mMagic[8];
+			unsigned int mVersion;
+			unsigned int mTriangleCount;
+			unsigned long long mKey;
+			unsigned long long mNodeCount;
+			unsigned long long mIndexCount;
+			unsigned long long mNodesOffset;
+			unsigned long long mIndicesOffset;
+			unsigned long long mTrianglesOffset;
+			float mBounds[8];
+		};
+
+	private:
+		MappedFile mFile;
+		const Header* mHeader;
+
+		static size_t Align(size_t offset)
+		{
+			return (offset + 15) & ~(size_t)15;
+		}
+
+		static bool CheckRange(unsigned long long offset, unsigned long long size, size_t file_size)
+		{
+			return offset % 16 == 0 && offset <= file_size && size <= file_size - offset;
+		}
+
+	public:
+		SpatialCache()
+		{
+			mHeader = NULL;
+		}
+
+		// Key identifies geometry together with build settings, vertices are hashed as uploaded
+		static unsigned long long ComputeKey(Scene* scene, unsigned long long build_hash)
+		{
+			unsigned long long h = Hash((unsigned int)VERSION, build_hash);
+			h = Hash(scene->GetTriangleCount(), h);
+			return Hash(scene->GetGeometryCPU(), sizeof(Triangle) * scene->GetTriangleCount(), h);
+		}
+
+		static std::string GetPath(const std::string& directory, unsigned long long key)
+		{
+			std::ostringstream name;
+			name << directory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".kdtree";
+			return name.str();
+		}
+
+		// Maps the file and validates it against the key, on failure the cache stays closed
+		bool Open(const std::string& path, unsigned long long key, unsigned int triangle_count)
+		{
+			mHeader = NULL;
+
+			if (!mFile.Open(path) || mFile.GetSize() < sizeof(Header))
+			{
+				mFile.Close();
+				return false;
+			}
+
+			const Header* header = (const Header*)mFile.GetData();
+			size_t size = mFile.GetSize();
+
+			if (memcmp(header->mMagic, "OTKDTREE", 8) != 0 ||
+				header->mVersion != VERSION ||
+				header->mKey != key ||
+				header->mTriangleCount != triangle_count ||
+				!CheckRange(header->mNodesOffset, header->mNodeCount * sizeof(unsigned int) * 2, size) ||
+				!CheckRange(header->mIndicesOffset, header->mIndexCount * sizeof(unsigned int), size) ||
+				!CheckRange(header->mTrianglesOffset, (unsigned long long)triangle_count * sizeof(float4) * 3, size))
+			{
+				mFile.Close();
+				return false;
+			}
+
+			mHeader = header;
+
+			return true;
+		}
+
+		const void* GetNodes() { return (const char*)mFile.GetData() + mHeader->mNodesOffset; }
+		size_t GetNodeCount() { return (size_t)mHeader->mNodeCount; }
+
+		const unsigned int* GetIndices() { return (const unsigned int*)((const char*)mFile.GetData() + mHeader->mIndicesOffset); }
+		size_t GetIndexCount() { return (size_t)mHeader->mIndexCount; }
+
+		const float4* GetTriangles() { return (const float4*)((const char*)mFile.GetData() + mHeader->mTrianglesOffset); }
+
+		AABB GetBounds()
+		{
+			const float* b = mHeader->mBounds;
+			AABB bounds;
+			bounds.mMin = float4(b[0], b[1], b[2], b[3]);
+			bounds.mMax = float4(b[4], b[5], b[6], b[7]);
+			return bounds;
+		}
+
+		// Writes into temporary file first and renames it, a crashed write never leaves a valid-looking cache
+		static bool Write(const std::string& directory, unsigned long long key, KDTree* tree, const float4* triangles, unsigned int triangle_count)
+		{
+#ifdef _WIN32
+			_mkdir(directory.c_str());
+#else
+			mkdir(directory.c_str(), 0755);
+#endif
+
+			std::string path = GetPath(directory, key);
+			std::string temp_path = path + ".tmp";
+
+			Header header;
+			memset(&header, 0, sizeof(Header));
+			memcpy(header.mMagic, "OTKDTREE", 8);
+			header.mVersion = VERSION;
+			header.mTriangleCount = triangle_count;
+			header.mKey = key;
+			header.mNodeCount = tree->GetNodeCount();
+			header.mIndexCount = tree->GetIndexCount();
+			header.mNodesOffset = Align(sizeof(Header));
+			header.mIndicesOffset = Align((size_t)header.mNodesOffset + sizeof(unsigned int) * 2 * tree->GetNodeCount());
+			header.mTrianglesOffset = Align((size_t)header.mIndicesOffset + sizeof(unsigned int) * tree->GetIndexCount());
+
+			const AABB& bounds = tree->GetAABB();
+			for (int i = 0; i < 4; i++)
+			{
+				header.mBounds[i] = bounds.mMin[i];
+				header.mBounds[4 + i] = bounds.mMax[i];
+			}
+
+			FILE* fp = NULL;
+			if (fopen_s(&fp, temp_path.c_str(), "wb") != 0 || !fp)
+			{
+				return false;
+			}
+
+			const char padding[16] = { 0 };
+			bool ok = fwrite(&header, sizeof(Header), 1, fp) == 1;
+			ok = ok && fwrite(padding, 1, (size_t)header.mNodesOffset - sizeof(Header), fp) == (size_t)header.mNodesOffset - sizeof(Header);
+			ok = ok && fwrite(tree->GetNodes(), sizeof(unsigned int) * 2, tree->GetNodeCount(), fp) == tree->GetNodeCount();
+			size_t pad = (size_t)(header.mIndicesOffset - header.mNodesOffset) - sizeof(unsigned int) * 2 * tree->GetNodeCount();
+			ok = ok && fwrite(padding, 1, pad, fp) == pad;
+			ok = ok && fwrite(tree->GetIndices(), sizeof(unsigned int), tree->GetIndexCount(), fp) == tree->GetIndexCount();
+			pad = (size_t)(header.mTrianglesOffset - header.mIndicesOffset) - sizeof(unsigned int) * tree->GetIndexCount();
+			ok = ok && fwrite(padding, 1, pad, fp) == pad;
+			ok = ok && fwrite(triangles, sizeof(float4) * 3, triangle_count, fp) == triangle_count;
+			ok = fclose(fp) == 0 && ok;
+
+			remove(path.c_str());
+			if (!ok || rename(temp_path.c_str(), path.c_str()) != 0)
+			{
+				remove(temp_path.c_str());
+				return false;
+			}
+
+			return true;
+		}
+	};
+}
+
+#endif
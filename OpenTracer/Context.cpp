@@ -5,6 +5,12 @@ using namespace OpenTracerCore;
 
 Context::Context(const ContextType& type)
 {
+	mType = type;
+	if (type == ContextType::CONTEXT_NATIVE)
+	{
+		return;
+	}
+
 	std::vector<cl::Platform> platforms;
 	cl::Platform::get(&platforms);
 	cl_context_properties props[] =
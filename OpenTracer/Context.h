@@ -11,7 +11,8 @@ namespace OpenTracerCore
 		enum ContextType
 		{
 			CONTEXT_CPU = 0,
-			CONTEXT_GPU
+			CONTEXT_GPU,
+			CONTEXT_NATIVE		// No OpenCL, rendering runs on host (see NativeRenderer)
 		};
 
 	private:
@@ -26,6 +27,9 @@ namespace OpenTracerCore
 		cl::Context& GetContext() { return mContext; }
 		cl::CommandQueue& GetCommandQueue() { return mCommandQueue; }
 		std::vector<cl::Device>& GetDevices() { return mDevices; }
+
+		// Native context has no OpenCL objects, device buffers are never created
+		bool IsNative() const { return mType == CONTEXT_NATIVE; }
 	};
 }
 
@@ -0,0 +1,1574 @@
+#include "BVH.h"
+#include <new>
+#include <algorithm>
+#include <limits>
+#include <mutex>
+#include <cmath>
+#include <cstring>
+#include "../../Util/RadixSort.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace OpenTracerCore;
+
+// Number of leading zero bits, 64 for zero
+static inline int CountLeadingZeros(unsigned long long x)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	if (_BitScanReverse(&index, (unsigned long)(x >> 32)))
+	{
+		return 31 - (int)index;
+	}
+	return _BitScanReverse(&index, (unsigned long)x) ? 63 - (int)index : 64;
+#else
+	return x ? __builtin_clzll(x) : 64;
+#endif
+}
+
+// Spreads lowest 10 bits so that there are 2 zero bits between each of them
+static inline unsigned long long ExpandBits10(unsigned int x)
+{
+	x = (x * 0x00010001u) & 0xFF0000FFu;
+	x = (x * 0x00000101u) & 0x0F00F00Fu;
+	x = (x * 0x00000011u) & 0xC30C30C3u;
+	x = (x * 0x00000005u) & 0x49249249u;
+	return x;
+}
+
+// Spreads lowest 21 bits so that there are 2 zero bits between each of them
+static inline unsigned long long ExpandBits21(unsigned long long x)
+{
+	x &= 0x1FFFFF;
+	x = (x | x << 32) & 0x1F00000000FFFFull;
+	x = (x | x << 16) & 0x1F0000FF0000FFull;
+	x = (x | x << 8) & 0x100F00F00F00F00Full;
+	x = (x | x << 4) & 0x10C30C30C30C30C3ull;
+	x = (x | x << 2) & 0x1249249249249249ull;
+	return x;
+}
+
+// Length of common prefix of keys i and j, equal keys are told apart by their indices
+static inline int MortonDelta(const unsigned long long* codes, unsigned int count, long long i, long long j)
+{
+	if (j < 0 || j >= (long long)count)
+	{
+		return -1;
+	}
+
+	if (codes[i] == codes[j])
+	{
+		return 64 + CountLeadingZeros((unsigned long long)(i ^ j)) - 32;
+	}
+
+	return CountLeadingZeros(codes[i] ^ codes[j]);
+}
+
+// Step of compressed node offsets, 254 instead of 255 steps leave a margin so that the largest
+// offset always reaches past the parent box
+static const float COMPRESSED_SCALE = 1.0f / 254.0f;
+
+// Conservative 8-bit offsets of interval [lo, hi] within frame decoded as frame_min + q * scale. Kernel
+// may fuse the decoding into mad and round differently, tolerance covers a few ulps of that.
+static inline void QuantizeInterval(float lo, float hi, float frame_min, float scale, unsigned char* q_lo, unsigned char* q_hi)
+{
+	float tolerance = (fabsf(lo) + fabsf(hi) + fabsf(frame_min) + 255.0f * scale) * (1.0f / 1048576.0f);
+	int a = 0;
+	int b = 255;
+
+	if (scale > 0.0f)
+	{
+		a = std::min(std::max((int)floorf((lo - frame_min) / scale), 0), 255);
+		b = std::min(std::max((int)ceilf((hi - frame_min) / scale), 0), 255);
+	}
+
+	while (a > 0 && frame_min + (float)a * scale > lo - tolerance)
+	{
+		a--;
+	}
+
+	while (b < 255 && frame_min + (float)b * scale < hi + tolerance)
+	{
+		b++;
+	}
+
+	*q_lo = (unsigned char)a;
+	*q_hi = (unsigned char)b;
+}
+
+BVH::BVH(const std::string& config, Scene* scene)
+{
+	this->Setup(config);
+
+	const Triangle* prims = scene->GetGeometryCPU();
+	this->mTriangles = prims;
+	this->Build([prims](unsigned int i) { return prims[i].GetBounds(); }, scene->GetTriangleCount());
+}
+
+BVH::BVH(const std::string& config, const AABB* bounds, unsigned int count)
+{
+	this->Setup(config);
+	this->Build([bounds](unsigned int i) { return bounds[i]; }, count);
+}
+
+void BVH::Setup(const std::string& config)
+{
+	Config* cfg = new Config(config);
+	int max_prims = cfg->Get<int>("BVH.MaxPrimsInNode");
+	int buckets = cfg->Get<int>("BVH.SAH.Buckets");
+	float traversal_cost = cfg->GetFloat("BVH.SAH.TraversalCost");
+	float isect_cost = cfg->GetFloat("BVH.SAH.IntersectCost");
+	std::string builder = cfg->Get<std::string>("BVH.Builder");
+	int morton_bits = cfg->Get<int>("BVH.LBVH.MortonBits");
+	int treelet_size = cfg->Get<int>("BVH.LBVH.TreeletSize");
+	int treelet_passes = cfg->Get<int>("BVH.LBVH.TreeletPasses");
+	int threads = cfg->Get<int>("BVH.Threads");
+	float alpha = cfg->GetFloat("BVH.SBVH.Alpha");
+	float budget = cfg->GetFloat("BVH.SBVH.DuplicationBudget");
+	delete cfg;
+
+	mBuildMethod = builder == "LBVH" ? BUILD_LBVH : (builder == "SBVH" ? BUILD_SBVH : BUILD_SAH);
+	mMortonBits = morton_bits == 63 ? 63 : 30;
+	// Subsets of treelet leaves are enumerated, so the treelet size stays small
+	mTreeletSize = treelet_size >= 3 ? std::min(treelet_size, (int)MAX_TREELET_SIZE) : 0;
+	mTreeletPasses = treelet_passes > 0 ? treelet_passes : 3;
+	mThreads = threads > 0 ? threads : std::thread::hardware_concurrency();
+	mScheduler = NULL;
+
+	mMaxPrimsInNode = max_prims > 0 ? max_prims : 4;
+	mSahBuckets = buckets > 1 ? buckets : 16;
+	// Missing float settings read as the smallest positive float
+	mSahTraversalCost = traversal_cost > std::numeric_limits<float>::min() ? traversal_cost : 0.125f;
+	mSahIsectCost = isect_cost > std::numeric_limits<float>::min() ? isect_cost : 1.0f;
+	// Zero is valid for both, it disables the overlap test or spatial splits respectively
+	mSpatialAlpha = alpha != std::numeric_limits<float>::min() && alpha >= 0.0f ? alpha : 1e-5f;
+	mSpatialBudget = budget != std::numeric_limits<float>::min() && budget >= 0.0f ? budget : 0.25f;
+	mTriangles = NULL;
+	mReferenceCount = 0;
+	mReferenceLimit = 0;
+
+	mNodes = NULL;
+	mNodeCount = 0;
+	mCompressedNodes = NULL;
+	mIndices = NULL;
+	mIndexCount = 0;
+	mPrimsCount = 0;
+}
+
+void BVH::Build(const std::function<AABB(unsigned int)>& prim_bounds, unsigned int prims_count)
+{
+	mScheduler = mThreads > 1 ? new TaskScheduler(mThreads) : NULL;
+
+	if (mBuildMethod == BUILD_LBVH)
+	{
+		std::cout << "Building BVH using LBVH algorithm (" << mMortonBits << "-bit Morton codes, " << (mScheduler ? mScheduler->GetWorkerCount() : 1) << " threads";
+		if (mTreeletSize > 0)
+		{
+			std::cout << ", " << mTreeletPasses << " passes over treelets of " << mTreeletSize;
+		}
+		std::cout << ")..." << std::endl;
+	}
+	else if (mBuildMethod == BUILD_SBVH && mTriangles)
+	{
+		std::cout << "Building BVH using SBVH algorithm (" << mSahBuckets << " buckets, " << mSpatialBudget << " duplication budget)..." << std::endl;
+	}
+	else
+	{
+		std::cout << "Building BVH using binned SAH algorithm (" << mSahBuckets << " buckets)..." << std::endl;
+	}
+
+	BuildTree(prim_bounds, prims_count);
+	LimitDepth();
+	UpdateStatistics();
+
+	if (mScheduler)
+	{
+		delete mScheduler;
+		mScheduler = NULL;
+	}
+
+	std::cout << "Statistics:" << std::endl;
+	std::cout << "\tTotal number of primitives: " << this->mIndexCount << std::endl;
+	std::cout << "\tTotal number of nodes: " << this->mNodeCount << std::endl;
+	std::cout << "\tDuplication factor: " << this->mStatistics.GetDuplicationFactor() << std::endl;
+	std::cout << "\tSAH cost: " << this->mStatistics.mSAHCost << std::endl;
+	std::cout << "\tMaximal depth: " << this->mStatistics.mMaxDepth << std::endl;
+	std::cout << "\tBuild time: " << (long long)this->mStatistics.GetTotalTime() << "ms" << std::endl;
+}
+
+BVH::~BVH()
+{
+	if (this->mNodes)
+	{
+		_aligned_free(this->mNodes);
+		this->mNodes = NULL;
+	}
+	this->mNodeCount = 0;
+
+	if (this->mCompressedNodes)
+	{
+		_aligned_free(this->mCompressedNodes);
+		this->mCompressedNodes = NULL;
+	}
+
+	if (this->mIndices)
+	{
+		free(this->mIndices);
+		this->mIndices = NULL;
+	}
+	this->mIndexCount = 0;
+}
+
+void BVH::BuildTree(const std::function<AABB(unsigned int)>& prim_bounds, unsigned int prims_count)
+{
+	std::chrono::high_resolution_clock::time_point phase_start = std::chrono::high_resolution_clock::now();
+
+	this->mPrimsCount = prims_count;
+	this->mBounds = AABB();
+
+	if (prims_count == 0)
+	{
+		return;
+	}
+
+	BVHPrimInfo* build_data = (BVHPrimInfo*)_aligned_malloc(sizeof(BVHPrimInfo) * prims_count, 16);
+	std::mutex bounds_mutex;
+	this->ParallelFor(0, prims_count, [&](size_t first, size_t last)
+	{
+		AABB bounds;
+		for (size_t i = first; i < last; i++)
+		{
+			new (&build_data[i]) BVHPrimInfo((int)i, prim_bounds((unsigned int)i));
+			bounds.Union(build_data[i].mBounds);
+		}
+
+		std::lock_guard<std::mutex> lock(bounds_mutex);
+		this->mBounds.Union(bounds);
+	});
+
+	this->mIndices = (unsigned int*)malloc(sizeof(unsigned int) * prims_count);
+	this->mIndexCount = prims_count;
+
+	this->RecordPhase("setup", phase_start);
+
+	if (this->mBuildMethod == BUILD_LBVH)
+	{
+		this->BuildLinear(build_data, prims_count, phase_start);
+		_aligned_free(build_data);
+		return;
+	}
+
+	// Temporary nodes are freed all at once with the arena
+	MemoryArena* arena = new MemoryArena();
+	unsigned int total_nodes = 0;
+	unsigned int ordered_count = 0;
+	BVHNode* root = NULL;
+
+	if (this->mBuildMethod == BUILD_SBVH && this->mTriangles)
+	{
+		// Index buffer is sized for the whole budget, the build never exceeds it
+		this->mReferenceCount = prims_count;
+		this->mReferenceLimit = prims_count + (unsigned int)(prims_count * this->mSpatialBudget);
+		free(this->mIndices);
+		this->mIndices = (unsigned int*)malloc(sizeof(unsigned int) * this->mReferenceLimit);
+
+		// Build data is consumed by the build
+		root = this->SpatialBuild(arena, build_data, prims_count, this->mBounds.GetSurfaceArea(), &total_nodes, &ordered_count);
+		build_data = NULL;
+
+		this->mIndexCount = ordered_count;
+	}
+	else
+	{
+		root = this->RecursiveBuild(arena, build_data, 0, prims_count, &total_nodes, this->mIndices, &ordered_count);
+	}
+
+	this->RecordPhase("build", phase_start);
+
+	this->mNodes = (LBVHNode*)_aligned_malloc(sizeof(LBVHNode) * total_nodes, 16);
+	this->mNodeCount = total_nodes;
+	unsigned int offset = 0;
+	this->Linearize(root, &offset);
+
+	delete arena;
+	if (build_data)
+	{
+		_aligned_free(build_data);
+	}
+
+	this->RecordPhase("linearize", phase_start);
+}
+
+BVH::BVHNode* BVH::RecursiveBuild(MemoryArena* arena,
+	BVHPrimInfo* build_data,
+	unsigned int start,
+	unsigned int end,
+	unsigned int* total_nodes,
+	unsigned int* ordered_prim_ids,
+	unsigned int* ordered_count)
+{
+	(*total_nodes)++;
+	BVHNode* node = arena->Allocate<BVHNode>(1);
+
+	AABB bounds;
+	AABB centroid_bounds;
+	for (unsigned int i = start; i < end; i++)
+	{
+		bounds.Union(build_data[i].mBounds);
+		centroid_bounds.Union(build_data[i].mCentroid);
+	}
+
+	unsigned int prims_count = end - start;
+
+	// Leaves take primitives in order they end up in, so the index buffer is filled sequentially
+	if (prims_count == 1)
+	{
+		ordered_prim_ids[*ordered_count] = build_data[start].mPrimitiveID;
+		node->InitLeaf((*ordered_count)++, 1, bounds);
+		return node;
+	}
+
+	float4 extent = centroid_bounds.mMax - centroid_bounds.mMin;
+	unsigned int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+	unsigned int mid = (start + end) / 2;
+
+	if (centroid_bounds.mMax[axis] == centroid_bounds.mMin[axis])
+	{
+		// All centroids coincide, no split separates them
+		if (prims_count <= this->mMaxPrimsInNode)
+		{
+			for (unsigned int i = start; i < end; i++)
+			{
+				ordered_prim_ids[*ordered_count + i - start] = build_data[i].mPrimitiveID;
+			}
+			node->InitLeaf(*ordered_count, prims_count, bounds);
+			(*ordered_count) += prims_count;
+			return node;
+		}
+	}
+	else if (prims_count <= 4)
+	{
+		std::nth_element(&build_data[start], &build_data[mid], &build_data[end - 1] + 1,
+			[axis](const BVHPrimInfo& a, const BVHPrimInfo& b) { return a.mCentroid[axis] < b.mCentroid[axis]; });
+	}
+	else
+	{
+		// Binned SAH over centroid bounds
+		MemoryArena::Marker marker = arena->GetMarker();
+		unsigned int* bucket_count = arena->Allocate<unsigned int>(this->mSahBuckets);
+		AABB* bucket_bounds = arena->Allocate<AABB>(this->mSahBuckets);
+		AABB* right_bounds = arena->Allocate<AABB>(this->mSahBuckets);
+
+		for (unsigned int b = 0; b < this->mSahBuckets; b++)
+		{
+			bucket_count[b] = 0;
+			bucket_bounds[b] = AABB();
+		}
+
+		float scale = (float)this->mSahBuckets / (centroid_bounds.mMax[axis] - centroid_bounds.mMin[axis]);
+		for (unsigned int i = start; i < end; i++)
+		{
+			unsigned int b = (unsigned int)((build_data[i].mCentroid[axis] - centroid_bounds.mMin[axis]) * scale);
+			b = b < this->mSahBuckets ? b : this->mSahBuckets - 1;
+			bucket_count[b]++;
+			bucket_bounds[b].Union(build_data[i].mBounds);
+		}
+
+		// Sweep from the right stores bounds of buckets above each split, sweep from the left
+		// then evaluates all splits in linear time
+		right_bounds[this->mSahBuckets - 1] = bucket_bounds[this->mSahBuckets - 1];
+		for (unsigned int b = this->mSahBuckets - 1; b > 0; b--)
+		{
+			right_bounds[b - 1] = bucket_bounds[b - 1];
+			right_bounds[b - 1].Union(right_bounds[b]);
+		}
+
+		float inv_area = 1.0f / bounds.GetSurfaceArea();
+		float best_cost = std::numeric_limits<float>::infinity();
+		unsigned int best_split = 0;
+		AABB left_bounds;
+		unsigned int left_count = 0;
+
+		for (unsigned int b = 0; b < this->mSahBuckets - 1; b++)
+		{
+			left_bounds.Union(bucket_bounds[b]);
+			left_count += bucket_count[b];
+			unsigned int right_count = prims_count - left_count;
+
+			if (left_count == 0 || right_count == 0)
+			{
+				continue;
+			}
+
+			float cost = this->mSahTraversalCost + this->mSahIsectCost * inv_area *
+				(left_count * left_bounds.GetSurfaceArea() + right_count * right_bounds[b + 1].GetSurfaceArea());
+
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_split = b;
+			}
+		}
+
+		arena->Release(marker);
+
+		float leaf_cost = this->mSahIsectCost * prims_count;
+
+		if (prims_count <= this->mMaxPrimsInNode && best_cost >= leaf_cost)
+		{
+			for (unsigned int i = start; i < end; i++)
+			{
+				ordered_prim_ids[*ordered_count + i - start] = build_data[i].mPrimitiveID;
+			}
+			node->InitLeaf(*ordered_count, prims_count, bounds);
+			(*ordered_count) += prims_count;
+			return node;
+		}
+
+		float min_centroid = centroid_bounds.mMin[axis];
+		unsigned int buckets = this->mSahBuckets;
+		BVHPrimInfo* pmid = std::partition(&build_data[start], &build_data[end - 1] + 1,
+			[=](const BVHPrimInfo& p)
+			{
+				unsigned int b = (unsigned int)((p.mCentroid[axis] - min_centroid) * scale);
+				b = b < buckets ? b : buckets - 1;
+				return b <= best_split;
+			});
+		mid = (unsigned int)(pmid - build_data);
+
+		if (mid == start || mid == end)
+		{
+			mid = (start + end) / 2;
+			std::nth_element(&build_data[start], &build_data[mid], &build_data[end - 1] + 1,
+				[axis](const BVHPrimInfo& a, const BVHPrimInfo& b) { return a.mCentroid[axis] < b.mCentroid[axis]; });
+		}
+	}
+
+	BVHNode* left = this->RecursiveBuild(arena, build_data, start, mid, total_nodes, ordered_prim_ids, ordered_count);
+	BVHNode* right = this->RecursiveBuild(arena, build_data, mid, end, total_nodes, ordered_prim_ids, ordered_count);
+	node->InitInterior(axis, left, right);
+
+	return node;
+}
+
+BVH::BVHNode* BVH::SpatialLeaf(BVHNode* node, BVHPrimInfo* refs, unsigned int count, const AABB& bounds, unsigned int* ordered_count)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		this->mIndices[*ordered_count + i] = refs[i].mPrimitiveID;
+	}
+	node->InitLeaf(*ordered_count, count, bounds);
+	(*ordered_count) += count;
+	_aligned_free(refs);
+	return node;
+}
+
+BVH::BVHNode* BVH::SpatialBuild(MemoryArena* arena,
+	BVHPrimInfo* refs,
+	unsigned int count,
+	float root_area,
+	unsigned int* total_nodes,
+	unsigned int* ordered_count)
+{
+	(*total_nodes)++;
+	BVHNode* node = arena->Allocate<BVHNode>(1);
+
+	AABB bounds;
+	AABB centroid_bounds;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		bounds.Union(refs[i].mBounds);
+		centroid_bounds.Union(refs[i].mCentroid);
+	}
+
+	if (count == 1)
+	{
+		return this->SpatialLeaf(node, refs, count, bounds, ordered_count);
+	}
+
+	const float infinity = std::numeric_limits<float>::infinity();
+	float inv_area = 1.0f / bounds.GetSurfaceArea();
+	unsigned int buckets = this->mSahBuckets;
+	MemoryArena::Marker marker = arena->GetMarker();
+	AABB* bin_bounds = arena->Allocate<AABB>(buckets);
+	AABB* right_bounds = arena->Allocate<AABB>(buckets);
+	unsigned int* enter = arena->Allocate<unsigned int>(buckets);
+	unsigned int* exit = arena->Allocate<unsigned int>(buckets);
+
+	// Object split - binned SAH over centroids, same as the plain SAH build
+	float4 extent = centroid_bounds.mMax - centroid_bounds.mMin;
+	unsigned int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+	float object_cost = infinity;
+	unsigned int object_split = 0;
+	float object_scale = 0.0f;
+	AABB object_left;
+	AABB object_right;
+
+	if (centroid_bounds.mMax[axis] > centroid_bounds.mMin[axis])
+	{
+		for (unsigned int b = 0; b < buckets; b++)
+		{
+			enter[b] = 0;
+			bin_bounds[b] = AABB();
+		}
+
+		object_scale = (float)buckets / extent[axis];
+		for (unsigned int i = 0; i < count; i++)
+		{
+			unsigned int b = (unsigned int)((refs[i].mCentroid[axis] - centroid_bounds.mMin[axis]) * object_scale);
+			b = b < buckets ? b : buckets - 1;
+			enter[b]++;
+			bin_bounds[b].Union(refs[i].mBounds);
+		}
+
+		right_bounds[buckets - 1] = bin_bounds[buckets - 1];
+		for (unsigned int b = buckets - 1; b > 0; b--)
+		{
+			right_bounds[b - 1] = bin_bounds[b - 1];
+			right_bounds[b - 1].Union(right_bounds[b]);
+		}
+
+		AABB left_bounds;
+		unsigned int left_count = 0;
+		for (unsigned int b = 0; b < buckets - 1; b++)
+		{
+			left_bounds.Union(bin_bounds[b]);
+			left_count += enter[b];
+			unsigned int right_count = count - left_count;
+
+			if (left_count == 0 || right_count == 0)
+			{
+				continue;
+			}
+
+			float cost = this->mSahTraversalCost + this->mSahIsectCost * inv_area *
+				(left_count * left_bounds.GetSurfaceArea() + right_count * right_bounds[b + 1].GetSurfaceArea());
+
+			if (cost < object_cost)
+			{
+				object_cost = cost;
+				object_split = b;
+				object_left = left_bounds;
+				object_right = right_bounds[b + 1];
+			}
+		}
+	}
+
+	// Spatial split - searched only when object split children overlap considerably, triangles
+	// crossing bin boundaries are clipped into every bin they touch
+	AABB overlap;
+	overlap.mMin = f4max(object_left.mMin, object_right.mMin);
+	overlap.mMax = f4min(object_left.mMax, object_right.mMax);
+	bool try_spatial = this->mReferenceCount < this->mReferenceLimit &&
+		(object_cost == infinity || (!overlap.IsEmpty() && overlap.GetSurfaceArea() > this->mSpatialAlpha * root_area));
+
+	float spatial_cost = infinity;
+	unsigned int spatial_split = 0;
+	float4 node_extent = bounds.mMax - bounds.mMin;
+	unsigned int spatial_axis = (node_extent.x > node_extent.y && node_extent.x > node_extent.z) ? 0 : (node_extent.y > node_extent.z ? 1 : 2);
+	float bin_origin = bounds.mMin[spatial_axis];
+	float bin_width = node_extent[spatial_axis] / (float)buckets;
+	AABB spatial_left;
+	AABB spatial_right;
+	unsigned int spatial_left_count = 0;
+	unsigned int spatial_right_count = 0;
+
+	if (try_spatial && bin_width > 0.0f)
+	{
+		for (unsigned int b = 0; b < buckets; b++)
+		{
+			enter[b] = 0;
+			exit[b] = 0;
+			bin_bounds[b] = AABB();
+		}
+
+		float inv_width = 1.0f / bin_width;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			const BVHPrimInfo& r = refs[i];
+			unsigned int first = (unsigned int)std::max((r.mBounds.mMin[spatial_axis] - bin_origin) * inv_width, 0.0f);
+			unsigned int last = (unsigned int)std::max((r.mBounds.mMax[spatial_axis] - bin_origin) * inv_width, 0.0f);
+			first = first < buckets ? first : buckets - 1;
+			last = last < buckets ? last : buckets - 1;
+
+			if (first == last)
+			{
+				bin_bounds[first].Union(r.mBounds);
+			}
+			else
+			{
+				// Reference is chopped progressively, the remainder moves on to the next bin
+				const Triangle& tri = this->mTriangles[r.mPrimitiveID];
+				AABB rest = r.mBounds;
+				for (unsigned int b = first; b < last; b++)
+				{
+					AABB part;
+					tri.SplitBounds(rest, spatial_axis, bin_origin + (b + 1) * bin_width, &part, &rest);
+					bin_bounds[b].Union(part);
+				}
+				bin_bounds[last].Union(rest);
+			}
+
+			enter[first]++;
+			exit[last]++;
+		}
+
+		right_bounds[buckets - 1] = bin_bounds[buckets - 1];
+		for (unsigned int b = buckets - 1; b > 0; b--)
+		{
+			right_bounds[b - 1] = bin_bounds[b - 1];
+			right_bounds[b - 1].Union(right_bounds[b]);
+		}
+
+		AABB left_bounds;
+		unsigned int left_count = 0;
+		unsigned int exited = 0;
+		for (unsigned int b = 0; b < buckets - 1; b++)
+		{
+			left_bounds.Union(bin_bounds[b]);
+			left_count += enter[b];
+			exited += exit[b];
+			unsigned int right_count = count - exited;
+
+			// References straddling the plane are duplicated
+			if (left_count == 0 || right_count == 0 || this->mReferenceCount + left_count + right_count - count > this->mReferenceLimit)
+			{
+				continue;
+			}
+
+			float cost = this->mSahTraversalCost + this->mSahIsectCost * inv_area *
+				(left_count * left_bounds.GetSurfaceArea() + right_count * right_bounds[b + 1].GetSurfaceArea());
+
+			if (cost < spatial_cost)
+			{
+				spatial_cost = cost;
+				spatial_split = b;
+				spatial_left = left_bounds;
+				spatial_right = right_bounds[b + 1];
+				spatial_left_count = left_count;
+				spatial_right_count = right_count;
+			}
+		}
+	}
+
+	arena->Release(marker);
+
+	float best_cost = std::min(object_cost, spatial_cost);
+	float leaf_cost = this->mSahIsectCost * count;
+
+	if (count <= this->mMaxPrimsInNode && (best_cost >= leaf_cost || best_cost == infinity))
+	{
+		return this->SpatialLeaf(node, refs, count, bounds, ordered_count);
+	}
+
+	BVHPrimInfo* left = (BVHPrimInfo*)_aligned_malloc(sizeof(BVHPrimInfo) * count, 16);
+	BVHPrimInfo* right = (BVHPrimInfo*)_aligned_malloc(sizeof(BVHPrimInfo) * count, 16);
+	unsigned int left_n = 0;
+	unsigned int right_n = 0;
+	unsigned int split_axis = axis;
+
+	if (spatial_cost < object_cost)
+	{
+		split_axis = spatial_axis;
+		float plane = bin_origin + (spatial_split + 1) * bin_width;
+		AABB lb = spatial_left;
+		AABB rb = spatial_right;
+		unsigned int lc = spatial_left_count;
+		unsigned int rc = spatial_right_count;
+
+		for (unsigned int i = 0; i < count; i++)
+		{
+			const BVHPrimInfo& r = refs[i];
+
+			if (r.mBounds.mMax[spatial_axis] <= plane)
+			{
+				left[left_n++] = r;
+				continue;
+			}
+
+			if (r.mBounds.mMin[spatial_axis] >= plane)
+			{
+				right[right_n++] = r;
+				continue;
+			}
+
+			// Reference unsplitting - whole reference goes to one side when it is cheaper than
+			// duplicating it
+			AABB lu = lb;
+			lu.Union(r.mBounds);
+			AABB ru = rb;
+			ru.Union(r.mBounds);
+			float split_cost = lb.GetSurfaceArea() * lc + rb.GetSurfaceArea() * rc;
+			float left_cost = lu.GetSurfaceArea() * lc + rb.GetSurfaceArea() * (rc - 1);
+			float right_cost = lb.GetSurfaceArea() * (lc - 1) + ru.GetSurfaceArea() * rc;
+
+			if (left_cost < split_cost && left_cost <= right_cost)
+			{
+				left[left_n++] = r;
+				lb = lu;
+				rc--;
+				continue;
+			}
+
+			if (right_cost < split_cost)
+			{
+				right[right_n++] = r;
+				rb = ru;
+				lc--;
+				continue;
+			}
+
+			AABB lclip;
+			AABB rclip;
+			this->mTriangles[r.mPrimitiveID].SplitBounds(r.mBounds, spatial_axis, plane, &lclip, &rclip);
+
+			if (lclip.IsEmpty())
+			{
+				right[right_n++] = r;
+			}
+			else if (rclip.IsEmpty())
+			{
+				left[left_n++] = r;
+			}
+			else
+			{
+				new (&left[left_n++]) BVHPrimInfo(r.mPrimitiveID, lclip);
+				new (&right[right_n++]) BVHPrimInfo(r.mPrimitiveID, rclip);
+				this->mReferenceCount++;
+			}
+		}
+	}
+	else if (object_cost < infinity)
+	{
+		float min_centroid = centroid_bounds.mMin[axis];
+		for (unsigned int i = 0; i < count; i++)
+		{
+			unsigned int b = (unsigned int)((refs[i].mCentroid[axis] - min_centroid) * object_scale);
+			b = b < buckets ? b : buckets - 1;
+			if (b <= object_split)
+			{
+				left[left_n++] = refs[i];
+			}
+			else
+			{
+				right[right_n++] = refs[i];
+			}
+		}
+	}
+
+	// No split separates the references (all centroids coincide, or unsplitting emptied a side)
+	if (left_n == 0 || right_n == 0)
+	{
+		left_n = count / 2;
+		right_n = count - left_n;
+		std::nth_element(&refs[0], &refs[left_n], &refs[count - 1] + 1,
+			[axis](const BVHPrimInfo& a, const BVHPrimInfo& b) { return a.mCentroid[axis] < b.mCentroid[axis]; });
+		memcpy(left, refs, sizeof(BVHPrimInfo) * left_n);
+		memcpy(right, refs + left_n, sizeof(BVHPrimInfo) * right_n);
+	}
+
+	_aligned_free(refs);
+
+	BVHNode* l = this->SpatialBuild(arena, left, left_n, root_area, total_nodes, ordered_count);
+	BVHNode* r = this->SpatialBuild(arena, right, right_n, root_area, total_nodes, ordered_count);
+	node->InitInterior(split_axis, l, r);
+
+	return node;
+}
+
+unsigned int BVH::Linearize(BVHNode* n, unsigned int* offset)
+{
+	unsigned int node = (*offset)++;
+	LBVHNode* ln = &this->mNodes[node];
+
+	if (n->mPrimitiveCount > 0)
+	{
+		ln->InitLeaf(n->mPrimitiveOffset, n->mPrimitiveCount);
+		return node;
+	}
+
+	const AABB& l = n->mChildren[0]->mBounds;
+	const AABB& r = n->mChildren[1]->mBounds;
+
+	ln->mPrimitiveCount = 0;
+	ln->mAxis = n->mSplitAxis;
+	ln->mLeaf = 0;
+	ln->mLXY = float4(l.mMin.x, l.mMax.x, l.mMin.y, l.mMax.y);
+	ln->mRXY = float4(r.mMin.x, r.mMax.x, r.mMin.y, r.mMax.y);
+	ln->mLRZ = float4(l.mMin.z, l.mMax.z, r.mMin.z, r.mMax.z);
+
+	this->Linearize(n->mChildren[0], offset);
+	ln->mPrimitiveOffset = this->Linearize(n->mChildren[1], offset);
+
+	return node;
+}
+
+void BVH::ParallelFor(size_t begin, size_t end, const std::function<void(size_t, size_t)>& body)
+{
+	if (this->mScheduler)
+	{
+		this->mScheduler->ParallelFor(begin, end, PARALLEL_MIN_PRIMS, body);
+	}
+	else
+	{
+		body(begin, end);
+	}
+}
+
+void BVH::BuildLinear(BVHPrimInfo* build_data, unsigned int prims_count, std::chrono::high_resolution_clock::time_point& phase_start)
+{
+	// Centroids are quantized within their own bounds, scene bounds would waste code bits
+	AABB centroid_bounds;
+	std::mutex bounds_mutex;
+	this->ParallelFor(0, prims_count, [&](size_t first, size_t last)
+	{
+		AABB bounds;
+		for (size_t i = first; i < last; i++)
+		{
+			bounds.Union(build_data[i].mCentroid);
+		}
+
+		std::lock_guard<std::mutex> lock(bounds_mutex);
+		centroid_bounds.Union(bounds);
+	});
+
+	unsigned long long* codes = (unsigned long long*)malloc(sizeof(unsigned long long) * prims_count);
+	unsigned long long* temp_codes = (unsigned long long*)malloc(sizeof(unsigned long long) * prims_count);
+	unsigned int* temp_ids = (unsigned int*)malloc(sizeof(unsigned int) * prims_count);
+
+	float cells = (float)(1 << (this->mMortonBits / 3));
+	float4 extent = centroid_bounds.mMax - centroid_bounds.mMin;
+	float4 scale = float4(extent.x > 0.0f ? cells / extent.x : 0.0f,
+		extent.y > 0.0f ? cells / extent.y : 0.0f,
+		extent.z > 0.0f ? cells / extent.z : 0.0f,
+		0.0f);
+	unsigned int max_cell = (1 << (this->mMortonBits / 3)) - 1;
+
+	this->ParallelFor(0, prims_count, [&](size_t first, size_t last)
+	{
+		for (size_t i = first; i < last; i++)
+		{
+			float4 p = (build_data[i].mCentroid - centroid_bounds.mMin) * scale;
+			unsigned int x = (unsigned int)p.x < max_cell ? (unsigned int)p.x : max_cell;
+			unsigned int y = (unsigned int)p.y < max_cell ? (unsigned int)p.y : max_cell;
+			unsigned int z = (unsigned int)p.z < max_cell ? (unsigned int)p.z : max_cell;
+
+			if (this->mMortonBits == 63)
+			{
+				codes[i] = (ExpandBits21(x) << 2) | (ExpandBits21(y) << 1) | ExpandBits21(z);
+			}
+			else
+			{
+				codes[i] = (ExpandBits10(x) << 2) | (ExpandBits10(y) << 1) | ExpandBits10(z);
+			}
+			this->mIndices[i] = (unsigned int)i;
+		}
+	});
+
+	this->RecordPhase("morton", phase_start);
+
+	RadixSort(this->mScheduler, codes, this->mIndices, temp_codes, temp_ids, prims_count, this->mMortonBits);
+
+	free(temp_codes);
+	free(temp_ids);
+
+	this->RecordPhase("sort", phase_start);
+
+	if (prims_count == 1)
+	{
+		this->mNodes = (LBVHNode*)_aligned_malloc(sizeof(LBVHNode), 16);
+		this->mNodeCount = 1;
+		this->mNodes[0].InitLeaf(0, 1);
+		free(codes);
+		this->RecordPhase("linearize", phase_start);
+		return;
+	}
+
+	// N primitives give N - 1 internal nodes, every one of them is found independently
+	MortonNode* nodes = (MortonNode*)_aligned_malloc(sizeof(MortonNode) * (prims_count - 1), 16);
+	this->ParallelFor(0, prims_count - 1, [&](size_t first, size_t last)
+	{
+		this->BuildMortonNodes(nodes, codes, (unsigned int)first, (unsigned int)last, prims_count);
+	});
+
+	free(codes);
+
+	this->RecordPhase("hierarchy", phase_start);
+
+	this->FitMortonNode(nodes, build_data, 0);
+
+	this->RecordPhase("fit", phase_start);
+
+	if (this->mTreeletSize > 0)
+	{
+		// Later passes only revisit larger subtrees, where most of the cost is
+		for (unsigned int pass = 0; pass < this->mTreeletPasses; pass++)
+		{
+			this->OptimizeTreelets(nodes, build_data, 0, this->mTreeletSize << pass);
+		}
+
+		unsigned int* sorted = (unsigned int*)malloc(sizeof(unsigned int) * prims_count);
+		memcpy(sorted, this->mIndices, sizeof(unsigned int) * prims_count);
+		this->ReorderMortonNode(nodes, sorted, 0, 0);
+		free(sorted);
+
+		this->RecordPhase("treelets", phase_start);
+	}
+
+	this->mNodeCount = nodes[0].mSize;
+	this->mNodes = (LBVHNode*)_aligned_malloc(sizeof(LBVHNode) * this->mNodeCount, 16);
+	this->EmitMortonNode(nodes, build_data, 0, 0);
+
+	_aligned_free(nodes);
+
+	this->RecordPhase("linearize", phase_start);
+}
+
+void BVH::BuildMortonNodes(MortonNode* nodes, const unsigned long long* codes, unsigned int first, unsigned int last, unsigned int count)
+{
+	for (unsigned int n = first; n < last; n++)
+	{
+		long long i = n;
+
+		// Direction of the range is given by the neighbour sharing longer prefix
+		int d = MortonDelta(codes, count, i, i + 1) > MortonDelta(codes, count, i, i - 1) ? 1 : -1;
+		int delta_min = MortonDelta(codes, count, i, i - d);
+
+		// Upper bound of range length, then its exact end by binary search
+		long long length_max = 2;
+		while (MortonDelta(codes, count, i, i + length_max * d) > delta_min)
+		{
+			length_max *= 2;
+		}
+
+		long long length = 0;
+		for (long long t = length_max / 2; t >= 1; t /= 2)
+		{
+			if (MortonDelta(codes, count, i, i + (length + t) * d) > delta_min)
+			{
+				length += t;
+			}
+		}
+
+		long long j = i + length * d;
+		int delta_node = MortonDelta(codes, count, i, j);
+
+		// Split lies where the common prefix of the range ends
+		long long split = 0;
+		long long step = length;
+		do
+		{
+			step = (step + 1) >> 1;
+			if (MortonDelta(codes, count, i, i + (split + step) * d) > delta_node)
+			{
+				split += step;
+			}
+		} while (step > 1);
+
+		long long gamma = i + split * d + (d < 0 ? -1 : 0);
+		long long range_first = i < j ? i : j;
+		long long range_last = i < j ? j : i;
+
+		MortonNode& node = nodes[n];
+		node.mFirst = (unsigned int)range_first;
+		node.mLast = (unsigned int)range_last;
+		node.mChildren[0] = (unsigned int)gamma | (range_first == gamma ? MORTON_LEAF : 0);
+		node.mChildren[1] = (unsigned int)(gamma + 1) | (range_last == gamma + 1 ? MORTON_LEAF : 0);
+	}
+}
+
+void BVH::FitMortonNode(MortonNode* nodes, BVHPrimInfo* build_data, unsigned int node)
+{
+	MortonNode& n = nodes[node];
+	unsigned int count = n.mLast - n.mFirst + 1;
+	unsigned int left_child = n.mChildren[0];
+
+	// Large left subtree is fitted as a task, right one on this thread
+	TaskScheduler::TaskGroup group;
+	bool spawned = this->mScheduler && count >= PARALLEL_MIN_PRIMS && !(left_child & MORTON_LEAF);
+	if (spawned)
+	{
+		this->mScheduler->Spawn(group, [=]() { this->FitMortonNode(nodes, build_data, left_child); });
+	}
+
+	for (unsigned int c = (spawned ? 1 : 0); c < 2; c++)
+	{
+		if (!(n.mChildren[c] & MORTON_LEAF))
+		{
+			this->FitMortonNode(nodes, build_data, n.mChildren[c]);
+		}
+	}
+
+	if (spawned)
+	{
+		this->mScheduler->Wait(group);
+	}
+
+	this->UpdateMortonNode(nodes, build_data, node);
+}
+
+void BVH::UpdateMortonNode(MortonNode* nodes, BVHPrimInfo* build_data, unsigned int node)
+{
+	MortonNode& n = nodes[node];
+	unsigned int count = n.mLast - n.mFirst + 1;
+	float children_cost = 0.0f;
+	unsigned int children_size = 0;
+	n.mBounds = AABB();
+
+	for (unsigned int c = 0; c < 2; c++)
+	{
+		unsigned int child = n.mChildren[c];
+		if (child & MORTON_LEAF)
+		{
+			const AABB& b = build_data[this->mIndices[child & ~MORTON_LEAF]].mBounds;
+			n.mBounds.Union(b);
+			children_cost += this->mSahIsectCost * b.GetSurfaceArea();
+			children_size += 1;
+		}
+		else
+		{
+			n.mBounds.Union(nodes[child].mBounds);
+			children_cost += nodes[child].mCost;
+			children_size += nodes[child].mSize;
+		}
+	}
+
+	// Small subtrees collapse into single leaf when it is cheaper by SAH
+	float area = n.mBounds.GetSurfaceArea();
+	float split_cost = this->mSahTraversalCost * area + children_cost;
+	float leaf_cost = this->mSahIsectCost * count * area;
+
+	if (count <= this->mMaxPrimsInNode && leaf_cost <= split_cost)
+	{
+		n.mCost = leaf_cost;
+		n.mSize = 1;
+	}
+	else
+	{
+		n.mCost = split_cost;
+		n.mSize = 1 + children_size;
+	}
+}
+
+void BVH::OptimizeTreelets(MortonNode* nodes, BVHPrimInfo* build_data, unsigned int node, unsigned int min_prims)
+{
+	MortonNode& n = nodes[node];
+	unsigned int count = n.mLast - n.mFirst + 1;
+
+	// Treelets are optimized bottom-up, disjoint subtrees in parallel. Subtrees below the
+	// threshold keep their topology from previous passes.
+	TaskScheduler::TaskGroup group;
+	bool spawned = false;
+
+	for (unsigned int c = 0; c < 2; c++)
+	{
+		unsigned int child = n.mChildren[c];
+		if ((child & MORTON_LEAF) || nodes[child].mLast - nodes[child].mFirst + 1 < min_prims)
+		{
+			continue;
+		}
+
+		if (c == 0 && this->mScheduler && count >= PARALLEL_MIN_PRIMS)
+		{
+			this->mScheduler->Spawn(group, [=]() { this->OptimizeTreelets(nodes, build_data, child, min_prims); });
+			spawned = true;
+		}
+		else
+		{
+			this->OptimizeTreelets(nodes, build_data, child, min_prims);
+		}
+	}
+
+	if (spawned)
+	{
+		this->mScheduler->Wait(group);
+	}
+
+	this->UpdateMortonNode(nodes, build_data, node);
+	this->RestructureTreelet(nodes, build_data, node);
+}
+
+void BVH::RestructureTreelet(MortonNode* nodes, BVHPrimInfo* build_data, unsigned int root)
+{
+	// Treelet grows from the root by opening the leaf with the largest surface area, opened
+	// internal nodes are reused for the new topology
+	unsigned int leaves[MAX_TREELET_SIZE];
+	unsigned int internals[MAX_TREELET_SIZE];
+	unsigned int leaf_count = 2;
+	unsigned int internal_count = 0;
+	leaves[0] = nodes[root].mChildren[0];
+	leaves[1] = nodes[root].mChildren[1];
+
+	while (leaf_count < this->mTreeletSize)
+	{
+		int largest = -1;
+		float largest_area = -1.0f;
+		for (unsigned int i = 0; i < leaf_count; i++)
+		{
+			if (!(leaves[i] & MORTON_LEAF) && nodes[leaves[i]].mBounds.GetSurfaceArea() > largest_area)
+			{
+				largest = (int)i;
+				largest_area = nodes[leaves[i]].mBounds.GetSurfaceArea();
+			}
+		}
+
+		if (largest < 0)
+		{
+			break;
+		}
+
+		unsigned int opened = leaves[largest];
+		internals[internal_count++] = opened;
+		leaves[largest] = nodes[opened].mChildren[0];
+		leaves[leaf_count++] = nodes[opened].mChildren[1];
+	}
+
+	if (leaf_count < 3)
+	{
+		return;
+	}
+
+	// Optimal topology by dynamic programming over all subsets of leaves, subsets are processed
+	// in increasing order, so both parts of every partition are already solved
+	const unsigned int subsets = 1 << leaf_count;
+	AABB bounds[1 << MAX_TREELET_SIZE];
+	float cost[1 << MAX_TREELET_SIZE];
+	unsigned int prims[1 << MAX_TREELET_SIZE];
+	unsigned int partition[1 << MAX_TREELET_SIZE];
+
+	for (unsigned int i = 0; i < leaf_count; i++)
+	{
+		unsigned int leaf = leaves[i];
+		unsigned int s = 1 << i;
+		if (leaf & MORTON_LEAF)
+		{
+			bounds[s] = build_data[this->mIndices[leaf & ~MORTON_LEAF]].mBounds;
+			cost[s] = this->mSahIsectCost * bounds[s].GetSurfaceArea();
+			prims[s] = 1;
+		}
+		else
+		{
+			bounds[s] = nodes[leaf].mBounds;
+			cost[s] = nodes[leaf].mCost;
+			prims[s] = nodes[leaf].mLast - nodes[leaf].mFirst + 1;
+		}
+	}
+
+	for (unsigned int s = 1; s < subsets; s++)
+	{
+		unsigned int lowest = s & (0 - s);
+		if (s == lowest)
+		{
+			continue;
+		}
+
+		bounds[s] = bounds[s ^ lowest];
+		bounds[s].Union(bounds[lowest]);
+		prims[s] = prims[s ^ lowest] + prims[lowest];
+
+		// Parts containing the lowest leaf cover every split once
+		float best = std::numeric_limits<float>::infinity();
+		unsigned int rest = s ^ lowest;
+		for (unsigned int q = (rest - 1) & rest; ; q = (q - 1) & rest)
+		{
+			unsigned int p = q | lowest;
+			if (cost[p] + cost[s ^ p] < best)
+			{
+				best = cost[p] + cost[s ^ p];
+				partition[s] = p;
+			}
+
+			if (q == 0)
+			{
+				break;
+			}
+		}
+
+		float area = bounds[s].GetSurfaceArea();
+		cost[s] = this->mSahTraversalCost * area + best;
+		if (prims[s] <= this->mMaxPrimsInNode)
+		{
+			cost[s] = std::min(cost[s], this->mSahIsectCost * prims[s] * area);
+		}
+	}
+
+	if (cost[subsets - 1] >= nodes[root].mCost)
+	{
+		return;
+	}
+
+	// Topology is rebuilt top-down, nodes are updated afterwards in reverse order so that
+	// children precede their parents
+	unsigned int stack_subsets[MAX_TREELET_SIZE];
+	unsigned int stack_nodes[MAX_TREELET_SIZE];
+	unsigned int order[MAX_TREELET_SIZE];
+	unsigned int stack_ptr = 0;
+	unsigned int order_count = 0;
+	stack_subsets[stack_ptr] = subsets - 1;
+	stack_nodes[stack_ptr++] = root;
+
+	while (stack_ptr != 0)
+	{
+		stack_ptr--;
+		unsigned int s = stack_subsets[stack_ptr];
+		unsigned int node = stack_nodes[stack_ptr];
+		order[order_count++] = node;
+
+		unsigned int parts[2] = { partition[s], s ^ partition[s] };
+		for (unsigned int c = 0; c < 2; c++)
+		{
+			unsigned int q = parts[c];
+			if ((q & (q - 1)) == 0)
+			{
+				unsigned int i = 0;
+				while ((1u << i) != q)
+				{
+					i++;
+				}
+				nodes[node].mChildren[c] = leaves[i];
+			}
+			else
+			{
+				// Range only holds the primitive count until the reorder pass assigns it
+				unsigned int child = internals[--internal_count];
+				nodes[child].mFirst = 0;
+				nodes[child].mLast = prims[q] - 1;
+				nodes[node].mChildren[c] = child;
+				stack_subsets[stack_ptr] = q;
+				stack_nodes[stack_ptr++] = child;
+			}
+		}
+	}
+
+	for (unsigned int i = order_count; i > 0; i--)
+	{
+		this->UpdateMortonNode(nodes, build_data, order[i - 1]);
+	}
+}
+
+void BVH::ReorderMortonNode(MortonNode* nodes, const unsigned int* sorted, unsigned int node, unsigned int first)
+{
+	// Leaves of restructured treelets no longer cover contiguous ranges of sorted primitives, so
+	// primitives are permuted into depth-first order and node ranges reassigned
+	MortonNode& n = nodes[node];
+	n.mLast = first + (n.mLast - n.mFirst);
+	n.mFirst = first;
+
+	TaskScheduler::TaskGroup group;
+	bool spawned = false;
+	unsigned int offset = first;
+
+	for (unsigned int c = 0; c < 2; c++)
+	{
+		unsigned int child = n.mChildren[c];
+		if (child & MORTON_LEAF)
+		{
+			this->mIndices[offset] = sorted[child & ~MORTON_LEAF];
+			n.mChildren[c] = offset | MORTON_LEAF;
+			offset++;
+			continue;
+		}
+
+		unsigned int count = nodes[child].mLast - nodes[child].mFirst + 1;
+		if (c == 0 && this->mScheduler && count >= PARALLEL_MIN_PRIMS)
+		{
+			this->mScheduler->Spawn(group, [=]() { this->ReorderMortonNode(nodes, sorted, child, offset); });
+			spawned = true;
+		}
+		else
+		{
+			this->ReorderMortonNode(nodes, sorted, child, offset);
+		}
+		offset += count;
+	}
+
+	if (spawned)
+	{
+		this->mScheduler->Wait(group);
+	}
+}
+
+void BVH::EmitMortonNode(MortonNode* nodes, BVHPrimInfo* build_data, unsigned int node, unsigned int offset)
+{
+	const MortonNode& n = nodes[node];
+	LBVHNode* ln = &this->mNodes[offset];
+
+	if (n.mSize == 1)
+	{
+		ln->InitLeaf(n.mFirst, n.mLast - n.mFirst + 1);
+		return;
+	}
+
+	AABB bounds[2];
+	unsigned int size[2];
+	for (unsigned int c = 0; c < 2; c++)
+	{
+		unsigned int child = n.mChildren[c];
+		bounds[c] = (child & MORTON_LEAF) ? build_data[this->mIndices[child & ~MORTON_LEAF]].mBounds : nodes[child].mBounds;
+		size[c] = (child & MORTON_LEAF) ? 1 : nodes[child].mSize;
+	}
+
+	// Left subtree follows its parent, so position of the right one is known from the left size
+	unsigned int left = offset + 1;
+	unsigned int right = offset + 1 + size[0];
+
+	float4 extent = n.mBounds.mMax - n.mBounds.mMin;
+	ln->mPrimitiveOffset = right;
+	ln->mPrimitiveCount = 0;
+	ln->mAxis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+	ln->mLeaf = 0;
+	ln->mLXY = float4(bounds[0].mMin.x, bounds[0].mMax.x, bounds[0].mMin.y, bounds[0].mMax.y);
+	ln->mRXY = float4(bounds[1].mMin.x, bounds[1].mMax.x, bounds[1].mMin.y, bounds[1].mMax.y);
+	ln->mLRZ = float4(bounds[0].mMin.z, bounds[0].mMax.z, bounds[1].mMin.z, bounds[1].mMax.z);
+
+	unsigned int positions[2] = { left, right };
+	TaskScheduler::TaskGroup group;
+	bool spawned = false;
+
+	for (unsigned int c = 0; c < 2; c++)
+	{
+		unsigned int child = n.mChildren[c];
+		if (child & MORTON_LEAF)
+		{
+			this->mNodes[positions[c]].InitLeaf(child & ~MORTON_LEAF, 1);
+		}
+		else if (c == 0 && this->mScheduler && size[0] >= PARALLEL_MIN_PRIMS)
+		{
+			this->mScheduler->Spawn(group, [=]() { this->EmitMortonNode(nodes, build_data, child, left); });
+			spawned = true;
+		}
+		else
+		{
+			this->EmitMortonNode(nodes, build_data, child, positions[c]);
+		}
+	}
+
+	if (spawned)
+	{
+		this->mScheduler->Wait(group);
+	}
+}
+
+void BVH::Refit(Triangle* prims)
+{
+	if (this->mNodeCount == 0)
+	{
+		return;
+	}
+
+	// Children always follow their parent, so reverse order visits children before parents
+	AABB* bounds = (AABB*)_aligned_malloc(sizeof(AABB) * this->mNodeCount, 16);
+
+	for (unsigned int i = this->mNodeCount; i > 0; i--)
+	{
+		unsigned int node = i - 1;
+		LBVHNode& n = this->mNodes[node];
+
+		if (n.mLeaf)
+		{
+			bounds[node] = AABB();
+			for (unsigned int k = 0; k < n.mPrimitiveCount; k++)
+			{
+				bounds[node].Union(prims[this->mIndices[n.mPrimitiveOffset + k]].GetBounds());
+			}
+			continue;
+		}
+
+		const AABB& l = bounds[node + 1];
+		const AABB& r = bounds[n.mPrimitiveOffset];
+
+		n.mLXY = float4(l.mMin.x, l.mMax.x, l.mMin.y, l.mMax.y);
+		n.mRXY = float4(r.mMin.x, r.mMax.x, r.mMin.y, r.mMax.y);
+		n.mLRZ = float4(l.mMin.z, l.mMax.z, r.mMin.z, r.mMax.z);
+
+		bounds[node] = l;
+		bounds[node].Union(r);
+	}
+
+	this->mBounds = bounds[0];
+
+	_aligned_free(bounds);
+
+	// Quality of refitted tree degrades with motion, cost tells when rebuild pays off
+	this->UpdateStatistics();
+}
+
+bool BVH::Compress()
+{
+	if (this->mNodeCount == 0)
+	{
+		return false;
+	}
+
+	if (!this->mCompressedNodes)
+	{
+		this->mCompressedNodes = (CompressedNode*)_aligned_malloc(sizeof(CompressedNode) * this->mNodeCount, 16);
+	}
+
+	// Root frame is the scene box, traversal gets it as kernel argument
+	return this->CompressNode(0, this->mBounds.mMin, (this->mBounds.mMax - this->mBounds.mMin) * COMPRESSED_SCALE);
+}
+
+bool BVH::CompressNode(unsigned int node, const float4& frame_min, const float4& frame_scale)
+{
+	const LBVHNode& n = this->mNodes[node];
+	CompressedNode& c = this->mCompressedNodes[node];
+
+	if (n.mLeaf)
+	{
+		if (n.mPrimitiveCount == 0 || n.mPrimitiveCount > COMPRESSED_MAX_COUNT || n.mPrimitiveOffset > COMPRESSED_OFFSET_MASK)
+		{
+			return false;
+		}
+
+		memset(&c, 0, sizeof(CompressedNode));
+		c.mData = COMPRESSED_LEAF | ((n.mPrimitiveCount - 1) << COMPRESSED_COUNT_SHIFT) | n.mPrimitiveOffset;
+		return true;
+	}
+
+	// Slabs per axis as (left min, left max, right min, right max)
+	const float4 slabs[3] = {
+		float4(n.mLXY.x, n.mLXY.y, n.mRXY.x, n.mRXY.y),
+		float4(n.mLXY.z, n.mLXY.w, n.mRXY.z, n.mRXY.w),
+		n.mLRZ
+	};
+	unsigned char* bytes[3] = { c.mX, c.mY, c.mZ };
+
+	// Children are framed by their decoded boxes, exactly as traversal sees them
+	float4 child_min[2];
+	float4 child_max[2];
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		for (int child = 0; child < 2; child++)
+		{
+			unsigned char* q = bytes[axis] + child * 2;
+			QuantizeInterval(slabs[axis][child * 2], slabs[axis][child * 2 + 1], frame_min[axis], frame_scale[axis], &q[0], &q[1]);
+			child_min[child][axis] = frame_min[axis] + (float)q[0] * frame_scale[axis];
+			child_max[child][axis] = frame_min[axis] + (float)q[1] * frame_scale[axis];
+		}
+	}
+
+	c.mData = n.mPrimitiveOffset;
+
+	child_min[0].w = child_max[0].w = child_min[1].w = child_max[1].w = 0.0f;
+	return this->CompressNode(node + 1, child_min[0], (child_max[0] - child_min[0]) * COMPRESSED_SCALE) &&
+		this->CompressNode(n.mPrimitiveOffset, child_min[1], (child_max[1] - child_min[1]) * COMPRESSED_SCALE);
+}
+
+void BVH::RecordPhase(const std::string& phase, std::chrono::high_resolution_clock::time_point& start)
+{
+	std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+	this->mStatistics.AddPhaseTime(phase, std::chrono::duration<double, std::milli>(now - start).count());
+	start = now;
+}
+
+void BVH::LimitDepth()
+{
+	if (this->mNodeCount == 0 || this->GetDepth(0) <= MAX_DEPTH)
+	{
+		return;
+	}
+
+	// Nodes are copied in the same depth-first order, primitives of collapsed subtrees become one
+	// contiguous range
+	std::vector<LBVHNode> nodes;
+	std::vector<unsigned int> indices;
+	nodes.reserve(this->mNodeCount);
+	indices.reserve(this->mIndexCount);
+	this->CopyLimited(0, 0, nodes, indices);
+
+	_aligned_free(this->mNodes);
+	this->mNodeCount = (unsigned int)nodes.size();
+	this->mNodes = (LBVHNode*)_aligned_malloc(sizeof(LBVHNode) * this->mNodeCount, 16);
+	memcpy(this->mNodes, nodes.data(), sizeof(LBVHNode) * this->mNodeCount);
+	memcpy(this->mIndices, indices.data(), sizeof(unsigned int) * indices.size());
+	this->mIndexCount = (unsigned int)indices.size();
+
+	std::cout << "\tSubtrees below depth " << (unsigned int)MAX_DEPTH << " collapsed into leaves" << std::endl;
+}
+
+unsigned int BVH::GetDepth(unsigned int node)
+{
+	const LBVHNode& n = this->mNodes[node];
+	if (n.mLeaf)
+	{
+		return 0;
+	}
+
+	return 1 + std::max(this->GetDepth(node + 1), this->GetDepth(n.mPrimitiveOffset));
+}
+
+void BVH::CopyLimited(unsigned int node, unsigned int depth, std::vector<LBVHNode>& nodes, std::vector<unsigned int>& indices)
+{
+	const LBVHNode& n = this->mNodes[node];
+	unsigned int copy = (unsigned int)nodes.size();
+	nodes.push_back(n);
+
+	if (n.mLeaf || depth == MAX_DEPTH)
+	{
+		unsigned int first = (unsigned int)indices.size();
+		this->GatherPrimitives(node, indices);
+		nodes[copy].InitLeaf(first, (unsigned int)indices.size() - first);
+		return;
+	}
+
+	// Bounds of both children stay in the copied parent
+	this->CopyLimited(node + 1, depth + 1, nodes, indices);
+	nodes[copy].mPrimitiveOffset = (unsigned int)nodes.size();
+	this->CopyLimited(n.mPrimitiveOffset, depth + 1, nodes, indices);
+}
+
+void BVH::GatherPrimitives(unsigned int node, std::vector<unsigned int>& indices)
+{
+	const LBVHNode& n = this->mNodes[node];
+	if (n.mLeaf)
+	{
+		indices.insert(indices.end(), this->mIndices + n.mPrimitiveOffset, this->mIndices + n.mPrimitiveOffset + n.mPrimitiveCount);
+		return;
+	}
+
+	this->GatherPrimitives(node + 1, indices);
+	this->GatherPrimitives(n.mPrimitiveOffset, indices);
+}
+
+void BVH::UpdateStatistics()
+{
+	std::vector<std::pair<std::string, double> > phases;
+	phases.swap(this->mStatistics.mPhaseTimes);
+	this->mStatistics.Clear();
+	phases.swap(this->mStatistics.mPhaseTimes);
+
+	this->mStatistics.mPrimitives = this->mPrimsCount;
+	this->mStatistics.mNodes = this->mNodeCount;
+
+	if (this->mNodeCount > 0)
+	{
+		this->mStatistics.mSAHCost = this->CollectStatistics(0, this->mBounds, 0) / this->mBounds.GetSurfaceArea();
+	}
+}
+
+float BVH::CollectStatistics(unsigned int node, const AABB& node_bounds, unsigned int depth)
+{
+	const LBVHNode& n = this->mNodes[node];
+
+	if (n.mLeaf)
+	{
+		this->mStatistics.AddLeaf(depth, n.mPrimitiveCount);
+		return node_bounds.GetSurfaceArea() * this->mSahIsectCost * n.mPrimitiveCount;
+	}
+
+	AABB left;
+	left.mMin = float4(n.mLXY.x, n.mLXY.z, n.mLRZ.x, 0.0f);
+	left.mMax = float4(n.mLXY.y, n.mLXY.w, n.mLRZ.y, 0.0f);
+
+	AABB right;
+	right.mMin = float4(n.mRXY.x, n.mRXY.z, n.mLRZ.z, 0.0f);
+	right.mMax = float4(n.mRXY.y, n.mRXY.w, n.mLRZ.w, 0.0f);
+
+	return node_bounds.GetSurfaceArea() * this->mSahTraversalCost +
+		this->CollectStatistics(node + 1, left, depth + 1) +
+		this->CollectStatistics(n.mPrimitiveOffset, right, depth + 1);
+}
@@ -2,16 +2,33 @@
 #define __BVH_H__
 
 #include <string>
+#include <chrono>
+#include <functional>
+#include <vector>
 #include "../../Math/Numeric/Float4.h"
 #include "../../Math/Shapes/AABB.h"
 #include "../../Util/Config.h"
 #include "../../Math/Shapes/Triangle.h"
 #include "../../Scene.h"
+#include "../../Util/MemoryArena.h"
+#include "../../Util/TaskScheduler.h"
+#include "TreeStatistics.h"
 
 namespace OpenTracerCore
 {
+	template<unsigned int N>
+	class WideBVH;
+
+	template<unsigned int N>
+	class PacketTracer;
+
 	class BVH
 	{
+		template<unsigned int N>
+		friend class WideBVH;
+		template<unsigned int N>
+		friend class PacketTracer;
+
 	protected:
 		class __declspec(align(16)) BVHPrimInfo
 		{
@@ -54,20 +71,105 @@ namespace OpenTracerCore
 			}
 		};
 
+		// Linear node, children follow depth-first order - left child is the next node, right child is
+		// at mPrimitiveOffset. Bounds of both children are stored in the parent, so that traversal
+		// tests them at once.
 		class __declspec(align(16)) LBVHNode
 		{
 		public:
-			unsigned int mPrimitiveOffset;
+			unsigned int mPrimitiveOffset;		// First primitive index for leaves, right child for interior nodes
 			unsigned int mPrimitiveCount;
 			unsigned int mAxis;
 			unsigned int mLeaf;
 			float4 mLXY;		// Left child float4(min0.x, max0.x, min0.y, max0.y)
 			float4 mRXY;		// Right child float4(min1.x, max1.x, min1.y, max1.y)
 			float4 mLRZ;		// Both children float4(min0.z, max0.z, min1.z, max1.z)
+
+			void InitLeaf(unsigned int first, unsigned int n)
+			{
+				mPrimitiveOffset = first;
+				mPrimitiveCount = n;
+				mAxis = 0;
+				mLeaf = 1;
+				mLXY = float4(0.0f, 0.0f, 0.0f, 0.0f);
+				mRXY = float4(0.0f, 0.0f, 0.0f, 0.0f);
+				mLRZ = float4(0.0f, 0.0f, 0.0f, 0.0f);
+			}
+		};
+
+		// Compressed node (16 bytes) - child boxes are 8-bit offsets within the decoded parent box,
+		// rounded outwards. Bytes of each axis hold (left min, left max, right min, right max) like
+		// slabs tested by traversal. Data holds right child for interior nodes, leaves store flag,
+		// primitive count - 1 and first primitive.
+		class __declspec(align(16)) CompressedNode
+		{
+		public:
+			unsigned char mX[4];
+			unsigned char mY[4];
+			unsigned char mZ[4];
+			unsigned int mData;
 		};
 
+		enum
+		{
+			COMPRESSED_LEAF = 0x80000000,
+			COMPRESSED_COUNT_SHIFT = 27,
+			COMPRESSED_OFFSET_MASK = 0x07FFFFFF,
+			COMPRESSED_MAX_COUNT = 16
+		};
+
+		// Internal node of Morton ordered hierarchy (Karras), node 0 is the root
+		class __declspec(align(16)) MortonNode
+		{
+		public:
+			AABB mBounds;
+			unsigned int mChildren[2];		// Internal node index, or sorted primitive index flagged with MORTON_LEAF
+			unsigned int mFirst;			// Range of sorted primitives covered by the node
+			unsigned int mLast;
+			unsigned int mSize;				// Number of linear nodes of the subtree, 1 when collapsed into a leaf
+			float mCost;					// SAH cost of the subtree, not normalized by root area
+		};
+
+		enum BuildMethod
+		{
+			BUILD_SAH = 0,		// Top-down binned SAH - O(N log N)
+			BUILD_LBVH,			// Hierarchy emitted from sorted Morton codes (Karras) - O(N) after the sort
+			BUILD_SBVH			// Binned SAH with spatial splits of triangles (Stich) - references are duplicated
+		};
+
+		enum { MORTON_LEAF = 0x80000000 };
+
+		// Subtrees with fewer primitives are never processed as separate tasks
+		enum { PARALLEL_MIN_PRIMS = 4096 };
+
+		// Largest treelet, its optimization enumerates 2^N subsets of leaves
+		enum { MAX_TREELET_SIZE = 8 };
+
+		// Deepest leaf, traversal stacks (BVH_STACK_SIZE in Renderer.cl, NATIVE_STACK_SIZE in
+		// NativeRenderer.cpp) hold at most one entry per level of the path to the current node
+		enum { MAX_DEPTH = 63 };
+
+		BuildMethod mBuildMethod;
+		unsigned int mMortonBits;
+		unsigned int mTreeletSize;		// Leaves of treelets restructured after LBVH build (Karras, Aila), 0 disables
+		unsigned int mTreeletPasses;
+		unsigned int mThreads;
+		TaskScheduler* mScheduler;
+
 		unsigned int mMaxPrimsInNode;
 		unsigned int mSahBuckets;
+		float mSahTraversalCost;
+		float mSahIsectCost;
+
+		// Spatial splits are searched only when overlap of object split children exceeds alpha
+		// times root area, duplicated references are limited by budget (fraction of primitives)
+		const Triangle* mTriangles;
+		float mSpatialAlpha;
+		float mSpatialBudget;
+		unsigned int mReferenceCount;
+		unsigned int mReferenceLimit;
+
+		AABB mBounds;
 
 		LBVHNode* mNodes;
 		unsigned int mNodeCount;
@@ -75,27 +177,108 @@ namespace OpenTracerCore
 		unsigned int* mIndices;
 		unsigned int mIndexCount;
 
+		CompressedNode* mCompressedNodes;
+
+		size_t mPrimsCount;
+		TreeStatistics mStatistics;
+
+		void Setup(const std::string& config);
+
+		void Build(const std::function<AABB(unsigned int)>& prim_bounds, unsigned int prims_count);
+
+		void BuildTree(const std::function<AABB(unsigned int)>& prim_bounds, unsigned int prims_count);
+
+		BVHNode* RecursiveBuild(MemoryArena* arena,
+			BVHPrimInfo* build_data,
+			unsigned int start,
+			unsigned int end,
+			unsigned int* total_nodes,
+			unsigned int* ordered_prim_ids,
+			unsigned int* ordered_count);
+
+		BVHNode* SpatialBuild(MemoryArena* arena,
+			BVHPrimInfo* refs,
+			unsigned int count,
+			float root_area,
+			unsigned int* total_nodes,
+			unsigned int* ordered_count);
+
+		BVHNode* SpatialLeaf(BVHNode* node, BVHPrimInfo* refs, unsigned int count, const AABB& bounds, unsigned int* ordered_count);
+
+		unsigned int Linearize(BVHNode* n, unsigned int* offset);
+
+		bool CompressNode(unsigned int node, const float4& frame_min, const float4& frame_scale);
+
+		void ParallelFor(size_t begin, size_t end, const std::function<void(size_t, size_t)>& body);
+
+		void BuildLinear(BVHPrimInfo* build_data, unsigned int prims_count, std::chrono::high_resolution_clock::time_point& phase_start);
+
+		void BuildMortonNodes(MortonNode* nodes, const unsigned long long* codes, unsigned int first, unsigned int last, unsigned int count);
+
+		void FitMortonNode(MortonNode* nodes, BVHPrimInfo* build_data, unsigned int node);
+
+		void UpdateMortonNode(MortonNode* nodes, BVHPrimInfo* build_data, unsigned int node);
+
+		void OptimizeTreelets(MortonNode* nodes, BVHPrimInfo* build_data, unsigned int node, unsigned int min_prims);
+
+		void RestructureTreelet(MortonNode* nodes, BVHPrimInfo* build_data, unsigned int root);
+
+		void ReorderMortonNode(MortonNode* nodes, const unsigned int* sorted, unsigned int node, unsigned int first);
+
+		void EmitMortonNode(MortonNode* nodes, BVHPrimInfo* build_data, unsigned int node, unsigned int offset);
+
+		void RecordPhase(const std::string& phase, std::chrono::high_resolution_clock::time_point& start);
+
+		// Collapses subtrees reaching below MAX_DEPTH into leaves, skewed splits and long Morton
+		// codes can otherwise build trees that overflow traversal stacks
+		void LimitDepth();
+
+		unsigned int GetDepth(unsigned int node);
+
+		void CopyLimited(unsigned int node, unsigned int depth, std::vector<LBVHNode>& nodes, std::vector<unsigned int>& indices);
+
+		void GatherPrimitives(unsigned int node, std::vector<unsigned int>& indices);
+
+		void UpdateStatistics();
+
+		float CollectStatistics(unsigned int node, const AABB& node_bounds, unsigned int depth);
+
 	public:
 		BVH(const std::string& config, Scene* scene);
+
+		// Hierarchy over arbitrary primitives given by their bounds, e.g. instances of a top level
+		BVH(const std::string& config, const AABB* bounds, unsigned int count);
 		~BVH();
 
+		// Recomputes bounds of all nodes for moved primitives, topology and indices stay the same
+		void Refit(Triangle* prims);
+
+		AABB& GetAABB() { return mBounds; }
+
 		float* GetNodes() { return (float*)mNodes; }
 		size_t GetNodeCount() { return mNodeCount; }
 
+		// Builds compressed copy of nodes, again after Refit. Fails when a leaf does not fit the format.
+		bool Compress();
+
+		float* GetCompressedNodes() { return (float*)mCompressedNodes; }
+
 		unsigned int* GetIndices() { return mIndices; }
 		size_t GetIndexCount() { return mIndexCount; }
 
+		const TreeStatistics& GetStatistics() { return mStatistics; }
+
 		void* operator new(size_t size)
 		{
 			return _aligned_malloc(size, 16);
 		}
 
-			void* operator new[](size_t size)
+		void* operator new[](size_t size)
 		{
 			return _aligned_malloc(size, 16);
 		}
 
-			void operator delete(void* ptr)
+		void operator delete(void* ptr)
 		{
 			_aligned_free(ptr);
 		}
@@ -105,29 +288,6 @@ namespace OpenTracerCore
 			_aligned_free(ptr);
 		}
 	};
-	/*
-	class __attribute__((aligned(16))) CBVH
-	{
-	public:
-		unsigned int max_prims_in_node;
-		unsigned int sah_buckets;
-
-		CLBVHNode* nodes;
-		unsigned int nodes_count;
-
-		unsigned int* indexes;
-		unsigned int indexes_count;
-
-		CBVH(unsigned int max_prims = 8, unsigned int buckets = 16);
-		~CBVH();
-
-		void BuildTree(CTriangle* prims, unsigned int prims_count);
-		CBVHNode* RecursiveBuild(vector<CBVHPrimInfo> &build_data, unsigned int start, unsigned int end, unsigned int* total_nodes, vector<unsigned int> &ordered_prim_ids);
-		unsigned int Linearize(CBVHNode* n, unsigned int* offset);
-
-		int Intersect(CTriangle* prims, const CRay &ray, float4 &bary, float &depth, int &id);
-		float4 IntersectPacket(CTriangle* prims, const CRayPacket &ray, mat4 &bary, float4 &depth, int &id);
-	};*/
 }
 
 #endif
\ No newline at end of file
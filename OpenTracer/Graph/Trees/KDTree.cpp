@@ -2,7 +2,7 @@
 
 using namespace OpenTracerCore;
 
-KDTree::KDTree(const std::string& config, Scene* scene)
+KDTree::KDTree(const std::string& config)
 {
 	Config* cfg = new Config(config);
 	mMaxPrimsInNode = cfg->Get<int>("KDTree.MaxPrimsInNode");
@@ -10,15 +10,446 @@ KDTree::KDTree(const std::string& config, Scene* scene)
 	mSahTraversalCost = cfg->Get<int>("KDTree.SAH.TraversalCost");
 	mSahIsectCost = cfg->Get<int>("KDTree.SAH.IntersectCost");
 	mSahEmptyBonus = cfg->Get<float>("KDTree.SAH.EmptyBonus");
+	std::string builder = cfg->Get<std::string>("KDTree.Builder");
+	int bins = cfg->Get<int>("KDTree.SAH.Bins");
+	int all_axes = cfg->Get<int>("KDTree.SAH.AllAxes");
+	int perfect_splits = cfg->Get<int>("KDTree.PerfectSplits");
+	int threads = cfg->Get<int>("KDTree.Threads");
+	std::string layout = cfg->Get<std::string>("KDTree.Layout");
+	int layout_block = cfg->Get<int>("KDTree.LayoutBlock");
+	int ropes = cfg->Get<int>("KDTree.Ropes");
 	delete cfg;
 
-	std::cout << "Building KD-Tree using SAH algorithm..." << std::endl;
+	mBuildMethod = builder == "Events" ? BUILD_EVENTS : builder == "Binned" ? BUILD_BINNED : BUILD_SORT;
+	mSahBins = bins > 1 ? bins : 32;
+	mSahAllAxes = all_axes > 0;
+	mPerfectSplits = perfect_splits > 0;
+	mLayout = layout == "Treelet" ? LAYOUT_TREELET : LAYOUT_DEPTH_FIRST;
+	mLayoutBlock = layout_block >= 4 ? layout_block & ~1 : 16;
+	mBuildRopes = ropes > 0;
+	mRopes = NULL;
+	mLeafBounds = NULL;
+	mThreads = threads > 0 ? threads : std::thread::hardware_concurrency();
+	mScheduler = NULL;
+	mPrimsSide = NULL;
+	mArenas = NULL;
+
+	mNodes = NULL;
+	mNodes_alloc = 0;
+	mNodes_next = 0;
+
+	mIndices = NULL;
+	mIndices_alloc = 0;
+	mIndices_next = 0;
+
+	mPrimsCount = 0;
+}
+
+KDTree::KDTree(const std::string& config, Scene* scene) : KDTree(config)
+{
+	Build(scene);
+}
+
+void KDTree::Build(Scene* scene)
+{
+	mScheduler = mThreads > 1 ? new TaskScheduler(mThreads) : NULL;
+
+	const char* method_names[] = { "per-node sort", "presorted events", "binned" };
+	std::cout << "Building KD-Tree using SAH algorithm (" << method_names[mBuildMethod] << ", " << (mSahAllAxes ? "all axes" : "longest axis") << ", " << (mPerfectSplits ? "perfect splits" : "bounding box splits") << ", " << (mScheduler ? mScheduler->GetWorkerCount() : 1) << " threads)..." << std::endl;
+
+	if (this->mNodes)
+	{
+		free(this->mNodes);
+		this->mNodes = NULL;
+	}
+	this->mNodes_alloc = 0;
+	this->mNodes_next = 0;
+
+	if (this->mIndices)
+	{
+		free(this->mIndices);
+		this->mIndices = NULL;
+	}
+	this->mIndices_alloc = 0;
+	this->mIndices_next = 0;
 
+	this->mBounds = AABB();
+
+	this->mStatistics.Clear();
 	BuildTree(scene->GetGeometryCPU(), scene->GetTriangleCount());
 
+	if (mScheduler)
+	{
+		delete mScheduler;
+		mScheduler = NULL;
+	}
+
+	if (this->mBuildRopes)
+	{
+		std::chrono::high_resolution_clock::time_point phase_start = std::chrono::high_resolution_clock::now();
+		this->BuildRopes();
+		this->RecordPhase("ropes", phase_start);
+	}
+
+	this->UpdateStatistics();
+
 	std::cout << "Statistics:" << std::endl;
 	std::cout << "\tTotal number of primitives: " << this->mIndices_next << std::endl;
 	std::cout << "\tTotal number of nodes: " << this->mNodes_next << std::endl;
+	std::cout << "\tSAH cost: " << this->mStatistics.mSAHCost << std::endl;
+	std::cout << "\tEmpty leaves: " << this->mStatistics.GetEmptyLeafRatio() * 100.0f << "%" << std::endl;
+	std::cout << "\tDuplication factor: " << this->mStatistics.GetDuplicationFactor() << std::endl;
+	std::cout << "\tMaximal depth: " << this->mStatistics.mMaxDepth << std::endl;
+	std::cout << "\tBuild time: " << (long long)this->mStatistics.GetTotalTime() << "ms" << std::endl;
+}
+
+void KDTree::SetTree(const void* nodes, size_t nodes_count, const unsigned int* indices, size_t indices_count, const AABB& bounds, size_t prims_count)
+{
+	this->mNodes = (KdNode*)realloc(this->mNodes, sizeof(KdNode) * (nodes_count > 0 ? nodes_count : 1));
+	this->mNodes_alloc = nodes_count;
+	this->mNodes_next = nodes_count;
+	memcpy(this->mNodes, nodes, sizeof(KdNode) * nodes_count);
+
+	this->mIndices = (unsigned int*)realloc(this->mIndices, sizeof(unsigned int) * (indices_count > 0 ? indices_count : 1));
+	this->mIndices_alloc = indices_count;
+	this->mIndices_next = indices_count;
+	memcpy(this->mIndices, indices, sizeof(unsigned int) * indices_count);
+
+	this->mBounds = bounds;
+	this->mPrimsCount = prims_count;
+
+	this->mStatistics.Clear();
+
+	// Ropes are not stored in the cache, rebuilding them is a single linear pass
+	if (this->mBuildRopes)
+	{
+		std::chrono::high_resolution_clock::time_point phase_start = std::chrono::high_resolution_clock::now();
+		this->BuildRopes();
+		this->RecordPhase("ropes", phase_start);
+	}
+
+	this->UpdateStatistics();
+}
+
+void KDTree::AddPhaseTime(const std::string& phase, double milliseconds)
+{
+	this->mStatistics.AddPhaseTime(phase, milliseconds);
+}
+
+void KDTree::RelayoutTreelets()
+{
+	// Every interior node references a pair of its children. Blocks of mLayoutBlock nodes (16 nodes
+	// is a 128-byte GPU cache line) are filled greedily with the pairs most likely to be visited (largest
+	// parent surface area) reachable from the first pair, pairs that no longer fit start new blocks.
+	// Blocks start on block boundaries and are emitted depth-first, so subtrees stay close to their
+	// parents. Free space left in a block is used for following subtrees that fit into it whole, the
+	// rest is padded. The root block has one padding node, which keeps pairs aligned to 16 bytes.
+	struct Pending
+	{
+		unsigned int mNode;			// Parent index in depth-first layout
+		unsigned int mNewNode;		// Parent index in new layout
+		float mMin[3];				// Parent bounds
+		float mMax[3];
+	};
+
+	// Number of interior nodes (i.e. children pairs) in each subtree, children follow their parents
+	unsigned int* subtree_pairs = (unsigned int*)malloc(sizeof(unsigned int) * this->mNodes_next);
+	for (size_t i = this->mNodes_next; i > 0; i--)
+	{
+		const KdNode& n = this->mNodes[i - 1];
+		subtree_pairs[i - 1] = n.IsLeaf() ? 0 : 1 + subtree_pairs[i] + subtree_pairs[n.GetAboveChild()];
+	}
+
+	size_t nodes_alloc = this->mNodes_next + 1;
+	KdNode* nodes = (KdNode*)malloc(sizeof(KdNode) * nodes_alloc);
+
+	std::vector<Pending> blocks;
+	std::vector<Pending> frontier;
+
+	nodes[0] = this->mNodes[0];
+	nodes[1].InitLeaf(0, 0);
+	size_t next = 2;
+
+	if (!this->mNodes[0].IsLeaf())
+	{
+		Pending root;
+		root.mNode = 0;
+		root.mNewNode = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			root.mMin[i] = this->mBounds.mMin[i];
+			root.mMax[i] = this->mBounds.mMax[i];
+		}
+		blocks.push_back(root);
+	}
+
+	unsigned int capacity = this->mLayoutBlock / 2 - 1;
+
+	while (!blocks.empty())
+	{
+		frontier.clear();
+		frontier.push_back(blocks.back());
+		blocks.pop_back();
+
+		// Partially filled blocks are padded with empty leaves up to the next boundary
+		size_t block_end = next + 2 * capacity;
+		if (block_end > nodes_alloc)
+		{
+			nodes_alloc = 2 * nodes_alloc > block_end ? 2 * nodes_alloc : block_end;
+			nodes = (KdNode*)realloc(nodes, sizeof(KdNode) * nodes_alloc);
+		}
+
+		unsigned int pairs = 0;
+		while (pairs < capacity)
+		{
+			if (frontier.empty())
+			{
+				if (blocks.empty() || subtree_pairs[blocks.back().mNode] > capacity - pairs)
+				{
+					break;
+				}
+
+				frontier.push_back(blocks.back());
+				blocks.pop_back();
+			}
+
+			size_t best = 0;
+			float best_area = -1.0f;
+			for (size_t i = 0; i < frontier.size(); i++)
+			{
+				const Pending& p = frontier[i];
+				float dx = p.mMax[0] - p.mMin[0];
+				float dy = p.mMax[1] - p.mMin[1];
+				float dz = p.mMax[2] - p.mMin[2];
+				float area = dx * dy + dy * dz + dz * dx;
+				if (area > best_area)
+				{
+					best_area = area;
+					best = i;
+				}
+			}
+
+			Pending parent = frontier[best];
+			frontier.erase(frontier.begin() + best);
+
+			const KdNode& n = this->mNodes[parent.mNode];
+			unsigned int axis = n.GetSplitAxis();
+			unsigned int children[2] = { parent.mNode + 1, n.GetAboveChild() };
+
+			nodes[parent.mNewNode].SetAboveChild((unsigned int)next);
+
+			for (unsigned int c = 0; c < 2; c++)
+			{
+				nodes[next] = this->mNodes[children[c]];
+
+				if (!nodes[next].IsLeaf())
+				{
+					Pending child = parent;
+					child.mNode = children[c];
+					child.mNewNode = (unsigned int)next;
+					if (c == 0)
+					{
+						child.mMax[axis] = n.GetSplitPosition();
+					}
+					else
+					{
+						child.mMin[axis] = n.GetSplitPosition();
+					}
+					frontier.push_back(child);
+				}
+
+				next++;
+			}
+
+			pairs++;
+		}
+
+		for (; next < block_end; next++)
+		{
+			nodes[next].InitLeaf(0, 0);
+		}
+
+		// Pairs are pushed in reverse, so the first remaining one is emitted right after this block
+		for (size_t i = frontier.size(); i > 0; i--)
+		{
+			blocks.push_back(frontier[i - 1]);
+		}
+
+		capacity = this->mLayoutBlock / 2;
+	}
+
+	free(subtree_pairs);
+
+	free(this->mNodes);
+	this->mNodes = nodes;
+	this->mNodes_alloc = nodes_alloc;
+	this->mNodes_next = next;
+}
+
+void KDTree::BuildRopes()
+{
+	if (this->mRopes)
+	{
+		free(this->mRopes);
+	}
+
+	if (this->mLeafBounds)
+	{
+		_aligned_free(this->mLeafBounds);
+	}
+
+	this->mRopes = (unsigned int*)malloc(sizeof(unsigned int) * 6 * this->mNodes_next);
+	this->mLeafBounds = (AABB*)_aligned_malloc(sizeof(AABB) * this->mNodes_next, 16);
+
+	// Interior nodes (and padding in treelet layout) keep rope-less entries
+	for (size_t i = 0; i < 6 * this->mNodes_next; i++)
+	{
+		this->mRopes[i] = ROPE_NONE;
+	}
+
+	for (size_t i = 0; i < this->mNodes_next; i++)
+	{
+		this->mLeafBounds[i] = AABB();
+	}
+
+	if (this->mNodes_next == 0)
+	{
+		return;
+	}
+
+	unsigned int ropes[6] = { ROPE_NONE, ROPE_NONE, ROPE_NONE, ROPE_NONE, ROPE_NONE, ROPE_NONE };
+	this->RecursiveBuildRopes(0, ropes, this->mBounds);
+}
+
+unsigned int KDTree::OptimizeRope(unsigned int rope, unsigned int face, const AABB& node_bounds)
+{
+	// Pushes rope down to the smallest node still covering the whole face (Popov et al.)
+	if (rope == ROPE_NONE)
+	{
+		return rope;
+	}
+
+	unsigned int face_axis = face >> 1;
+	bool positive = (face & 1) != 0;
+
+	while (!this->mNodes[rope].IsLeaf())
+	{
+		unsigned int axis = this->mNodes[rope].GetSplitAxis();
+		float split = this->mNodes[rope].GetSplitPosition();
+
+		if (axis == face_axis)
+		{
+			rope = positive ? this->GetBelowChild(rope) : this->GetAboveChild(rope);
+		}
+		else if (split <= node_bounds.mMin[axis])
+		{
+			rope = this->GetAboveChild(rope);
+		}
+		else if (split >= node_bounds.mMax[axis])
+		{
+			rope = this->GetBelowChild(rope);
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	return rope;
+}
+
+void KDTree::RecursiveBuildRopes(unsigned int node, unsigned int ropes[6], const AABB& node_bounds)
+{
+	for (unsigned int face = 0; face < 6; face++)
+	{
+		ropes[face] = this->OptimizeRope(ropes[face], face, node_bounds);
+	}
+
+	const KdNode& n = this->mNodes[node];
+
+	if (n.IsLeaf())
+	{
+		memcpy(&this->mRopes[6 * node], ropes, sizeof(unsigned int) * 6);
+		this->mLeafBounds[node] = node_bounds;
+		return;
+	}
+
+	unsigned int axis = n.GetSplitAxis();
+
+	AABB below_bounds = node_bounds;
+	AABB above_bounds = node_bounds;
+
+	below_bounds.mMax[axis] = n.GetSplitPosition();
+	above_bounds.mMin[axis] = n.GetSplitPosition();
+
+	unsigned int below_ropes[6];
+	unsigned int above_ropes[6];
+
+	memcpy(below_ropes, ropes, sizeof(unsigned int) * 6);
+	memcpy(above_ropes, ropes, sizeof(unsigned int) * 6);
+
+	below_ropes[2 * axis + 1] = this->GetAboveChild(node);
+	above_ropes[2 * axis] = this->GetBelowChild(node);
+
+	this->RecursiveBuildRopes(this->GetBelowChild(node), below_ropes, below_bounds);
+	this->RecursiveBuildRopes(this->GetAboveChild(node), above_ropes, above_bounds);
+}
+
+void KDTree::RecordPhase(const std::string& phase, std::chrono::high_resolution_clock::time_point& start)
+{
+	std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+	this->mStatistics.AddPhaseTime(phase, std::chrono::duration<double, std::milli>(now - start).count());
+	start = now;
+}
+
+void KDTree::UpdateStatistics()
+{
+	// Phase times are kept, everything else is measured again from the current tree
+	std::vector<std::pair<std::string, double> > phases;
+	phases.swap(this->mStatistics.mPhaseTimes);
+	this->mStatistics.Clear();
+	phases.swap(this->mStatistics.mPhaseTimes);
+
+	this->mStatistics.mPrimitives = this->mPrimsCount;
+	this->mStatistics.mNodes = this->mNodes_next;
+	this->mStatistics.mSAHCost = this->GetSAHCost();
+
+	if (this->mNodes_next > 0)
+	{
+		this->CollectStatistics(0, 0);
+	}
+}
+
+void KDTree::CollectStatistics(unsigned int node, unsigned int depth)
+{
+	const KdNode& n = this->mNodes[node];
+
+	if (n.IsLeaf())
+	{
+		this->mStatistics.AddLeaf(depth, n.GetPrimitivesCount());
+		return;
+	}
+
+	this->CollectStatistics(this->GetBelowChild(node), depth + 1);
+	this->CollectStatistics(this->GetAboveChild(node), depth + 1);
+}
+
+unsigned long long KDTree::GetBuildHash()
+{
+	// Thread count is left out on purpose, builders produce the same tree with any number of threads
+	unsigned long long h = HASH_SEED;
+	h = Hash(this->mMaxPrimsInNode, h);
+	h = Hash(this->mMaxRecursionDepth, h);
+	h = Hash(this->mSahTraversalCost, h);
+	h = Hash(this->mSahIsectCost, h);
+	h = Hash(this->mSahEmptyBonus, h);
+	h = Hash(this->mSahBins, h);
+	h = Hash(this->mSahAllAxes, h);
+	h = Hash(this->mPerfectSplits, h);
+	h = Hash(this->mBuildMethod, h);
+	h = Hash(this->mLayout, h);
+	h = Hash(this->mLayout == LAYOUT_TREELET ? this->mLayoutBlock : 0, h);
+	return h;
 }
 
 KDTree::~KDTree()
@@ -39,12 +470,27 @@ KDTree::~KDTree()
 	this->mIndices_alloc = 0;
 	this->mIndices_next = 0;
 
+	if (this->mRopes)
+	{
+		free(this->mRopes);
+		this->mRopes = NULL;
+	}
+
+	if (this->mLeafBounds)
+	{
+		_aligned_free(this->mLeafBounds);
+		this->mLeafBounds = NULL;
+	}
+
 	this->mBounds = AABB();
 }
 
 void KDTree::BuildTree(Triangle* prims, unsigned int prims_count)
 {
+	std::chrono::high_resolution_clock::time_point phase_start = std::chrono::high_resolution_clock::now();
+
 	this->mMaxRecursionDepth = this->mMaxRecursionDepth == 0 ? EstimateRecursionDepth(prims_count) : this->mMaxRecursionDepth;
+	this->mPrimsCount = prims_count;
 
 	AABB* prims_bounds = (AABB*)_aligned_malloc(sizeof(AABB) * prims_count, 16);
 	for (unsigned int i = 0; i < prims_count; i++)
@@ -56,38 +502,416 @@ void KDTree::BuildTree(Triangle* prims, unsigned int prims_count)
 	BoundEdge* prims_bound_edges[3];
 	for (unsigned int i = 0; i < 3; i++)
 	{
-		prims_bound_edges[i] = (BoundEdge*)malloc(sizeof(BoundEdge) * prims_count * 2);
-	}
+		prims_bound_edges[i] = (BoundEdge*)malloc(sizeof(BoundEdge) * prims_count * 2);
+	}
+
+	unsigned int *prims_ids = (unsigned int*)malloc(sizeof(unsigned int) * prims_count);
+
+	for (unsigned int i = 0; i < prims_count; i++)
+	{
+		prims_ids[i] = i;
+	}
+
+	// Classification scratch is per worker, concurrent subtrees may share straddling primitives
+	unsigned int workers = this->mScheduler ? this->mScheduler->GetWorkerCount() : 1;
+	this->mPrimsSide = new unsigned char*[workers];
+	this->mArenas = new MemoryArena*[workers];
+	for (unsigned int i = 0; i < workers; i++)
+	{
+		this->mPrimsSide[i] = (unsigned char*)malloc(sizeof(unsigned char) * prims_count);
+		this->mArenas[i] = new MemoryArena();
+	}
+
+	// Rough estimate of the output size, saves most of the regrowth on typical scenes
+	BuildBuffer out;
+	this->ReserveNodes(&out, 2 * (prims_count / (this->mMaxPrimsInNode > 0 ? this->mMaxPrimsInNode : 1)) + 1);
+	this->ReserveIndices(&out, 2 * prims_count);
+
+	this->RecordPhase("setup", phase_start);
+
+	if (this->mBuildMethod == BUILD_EVENTS)
+	{
+		// Events are sorted only once here, each node then splits its sorted lists in linear time
+		for (unsigned int axis = 0; axis < 3; axis++)
+		{
+			for (unsigned int i = 0; i < prims_count; i++)
+			{
+				prims_bound_edges[axis][2 * i] = BoundEdge(prims_bounds[i].mMin[axis], i, true);
+				prims_bound_edges[axis][2 * i + 1] = BoundEdge(prims_bounds[i].mMax[axis], i, false);
+			}
+			std::sort(&prims_bound_edges[axis][0], &prims_bound_edges[axis][2 * prims_count]);
+		}
+
+		this->RecordPhase("sort_events", phase_start);
+
+		this->RecursiveBuildEvents(&out, 0, prims, prims_bound_edges, &this->mBounds, prims_count, 0, 0);
+	}
+	else if (this->mBuildMethod == BUILD_BINNED)
+	{
+		this->RecursiveBuildBinned(&out, 0, prims, prims_bounds, &this->mBounds, prims_ids, prims_count, 0, 0);
+	}
+	else
+	{
+		this->RecursiveBuild(&out, 0, prims, prims_bounds, prims_bound_edges, prims_count, &this->mBounds, prims_ids, prims_count, 0, 0);
+	}
+
+	this->RecordPhase("build", phase_start);
+
+	this->mNodes = out.mNodes;
+	this->mNodes_alloc = out.mNodes_alloc;
+	this->mNodes_next = out.mNodes_next;
+
+	this->mIndices = out.mIndices;
+	this->mIndices_alloc = out.mIndices_alloc;
+	this->mIndices_next = out.mIndices_next;
+
+	if (this->mLayout == LAYOUT_TREELET)
+	{
+		this->RelayoutTreelets();
+		this->RecordPhase("layout", phase_start);
+	}
+
+	for (unsigned int i = 0; i < workers; i++)
+	{
+		free(this->mPrimsSide[i]);
+		delete this->mArenas[i];
+	}
+	delete[] this->mPrimsSide;
+	this->mPrimsSide = NULL;
+	delete[] this->mArenas;
+	this->mArenas = NULL;
+
+	free(prims_ids);
+	prims_ids = NULL;
+
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		free(prims_bound_edges[i]);
+		prims_bound_edges[i] = NULL;
+	}
+
+	_aligned_free(prims_bounds);
+	prims_bounds = NULL;
+
+	this->RecordPhase("cleanup", phase_start);
+}
+
+void KDTree::ReserveNodes(BuildBuffer* out, size_t count)
+{
+	if (count <= out->mNodes_alloc)
+	{
+		return;
+	}
+
+	size_t alloc_count = out->mNodes_alloc > 256 ? out->mNodes_alloc : 256;
+	while (alloc_count < count)
+	{
+		alloc_count *= 2;
+	}
+
+	out->mNodes = (KdNode*)realloc(out->mNodes, sizeof(KdNode) * alloc_count);
+	out->mNodes_alloc = alloc_count;
+}
+
+void KDTree::ReserveIndices(BuildBuffer* out, size_t count)
+{
+	if (count <= out->mIndices_alloc)
+	{
+		return;
+	}
+
+	size_t alloc_count = out->mIndices_alloc > 256 ? out->mIndices_alloc : 256;
+	while (alloc_count < count)
+	{
+		alloc_count *= 2;
+	}
+
+	out->mIndices = (unsigned int*)realloc(out->mIndices, sizeof(unsigned int) * alloc_count);
+	out->mIndices_alloc = alloc_count;
+}
+
+unsigned int KDTree::AllocateNode(BuildBuffer* out)
+{
+	this->ReserveNodes(out, out->mNodes_next + 1);
+
+	return (unsigned int)(out->mNodes_next++);
+}
+
+unsigned int KDTree::AllocateIndices(BuildBuffer* out, unsigned int count)
+{
+	this->ReserveIndices(out, out->mIndices_next + count);
+
+	unsigned int base_index = (unsigned int)out->mIndices_next;
+	out->mIndices_next += count;
+
+	return base_index;
+}
+
+void KDTree::CreateLeaf(BuildBuffer* out, unsigned int node, unsigned int* current_ids, unsigned int current_count)
+{
+	unsigned int base_index = this->AllocateIndices(out, current_count);
+
+	for (unsigned int i = 0; i < current_count; i++)
+	{
+		out->mIndices[base_index + i] = current_ids[i];
+	}
+
+	out->mNodes[node].InitLeaf(base_index, current_count);
+}
+
+void KDTree::AppendBuffer(BuildBuffer* out, BuildBuffer* in)
+{
+	unsigned int node_base = out->mNodes_next;
+	unsigned int index_base = out->mIndices_next;
+
+	this->ReserveNodes(out, out->mNodes_next + in->mNodes_next);
+
+	for (size_t i = 0; i < in->mNodes_next; i++)
+	{
+		unsigned int node = this->AllocateNode(out);
+		out->mNodes[node] = in->mNodes[i];
+
+		// Subtree was built with its own numbering, rebase child links and primitive offsets
+		if (out->mNodes[node].IsLeaf())
+		{
+			if (out->mNodes[node].GetPrimitivesCount() > 0)
+			{
+				out->mNodes[node].mPrimitiveID += index_base;
+			}
+		}
+		else
+		{
+			out->mNodes[node].mAboveChild += (node_base << 2);
+		}
+	}
+
+	if (in->mIndices_next > 0)
+	{
+		this->AllocateIndices(out, (unsigned int)in->mIndices_next);
+		memcpy(out->mIndices + index_base, in->mIndices, sizeof(unsigned int) * in->mIndices_next);
+	}
+}
+
+void KDTree::BuildChildren(BuildBuffer* out,
+	unsigned int node,
+	unsigned int axis,
+	float split,
+	unsigned int current_count,
+	const std::function<void(BuildBuffer*, unsigned int, bool)>& build_below,
+	const std::function<void(BuildBuffer*, unsigned int, bool)>& build_above)
+{
+	if (this->mScheduler && current_count >= PARALLEL_MIN_PRIMS)
+	{
+		// Above child becomes a stealable task, below child is built by this worker, both into
+		// private buffers that are stitched behind the node once both are finished
+		BuildBuffer below;
+		BuildBuffer above;
+
+		TaskScheduler::TaskGroup group;
+		this->mScheduler->Spawn(group, [&]() { build_above(&above, 0, true); });
+
+		build_below(&below, 0, false);
+
+		this->mScheduler->Wait(group);
+
+		this->AppendBuffer(out, &below);
+		unsigned int above_child = out->mNodes_next;
+		out->mNodes[node].InitInterior(axis, above_child, split);
+		this->AppendBuffer(out, &above);
+
+		below.Release();
+		above.Release();
+	}
+	else
+	{
+		build_below(out, node + 1, false);
+
+		unsigned int above_child = out->mNodes_next;
+		out->mNodes[node].InitInterior(axis, above_child, split);
+
+		build_above(out, above_child, false);
+	}
+}
+
+float KDTree::EvaluateSAH(AABB* node_bounds, int axis, float split, unsigned int below, unsigned int above)
+{
+	int other_axis[3][2] = { { 1, 2 }, { 0, 2 }, { 0, 1 } };
+	int other_axis0 = other_axis[axis][0];
+	int other_axis1 = other_axis[axis][1];
+
+	float4 d = node_bounds->mMax - node_bounds->mMin;
+	float total_sa = (2.0f * (d.x * d.y + d.x * d.z + d.y * d.z));
+	float inv_total_sa = 1.0f / total_sa;
+
+	float below_sa = 2 * (d[other_axis0] * d[other_axis1] + (split - node_bounds->mMin[axis]) * (d[other_axis0] + d[other_axis1]));
+	float above_sa = 2 * (d[other_axis0] * d[other_axis1] + (node_bounds->mMax[axis] - split) * (d[other_axis0] + d[other_axis1]));
+
+	float below_p = below_sa * inv_total_sa;
+	float above_p = above_sa * inv_total_sa;
+
+	float eb = (above == 0 || below == 0) ? this->mSahEmptyBonus : 0.0f;
+	return this->mSahTraversalCost + this->mSahIsectCost * (1.0f - eb) * (below_p * below + above_p * above);
+}
+
+void KDTree::FindSplit(BoundEdge* edges,
+	unsigned int edges_count,
+	int axis,
+	AABB* node_bounds,
+	unsigned int current_count,
+	int& best_axis,
+	int& best_offset,
+	float& best_cost)
+{
+	int below = 0, above = current_count;
+	for (unsigned int i = 0; i < edges_count; i++)
+	{
+		if (edges[i].type == BoundEdge::END)
+		{
+			above--;
+		}
+
+		float edge_t = edges[i].mPosition;
+
+		if (edge_t > node_bounds->mMin[axis] && edge_t < node_bounds->mMax[axis])
+		{
+			float cost = this->EvaluateSAH(node_bounds, axis, edge_t, below, above);
+
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_offset = i;
+			}
+		}
+
+		if (edges[i].type == BoundEdge::START)
+		{
+			below++;
+		}
+	}
+}
+
+void KDTree::FindSplitBinned(AABB* prims_bounds,
+	AABB* clipped_bounds,
+	unsigned int* current_ids,
+	unsigned int current_count,
+	int axis,
+	AABB* node_bounds,
+	unsigned int* bins,
+	int& best_axis,
+	float& best_split,
+	float& best_cost)
+{
+	float axis_min = node_bounds->mMin[axis];
+	float axis_max = node_bounds->mMax[axis];
+
+	if (axis_max <= axis_min)
+	{
+		return;
+	}
+
+	// First half of bins counts primitives starting in bin, second half primitives ending in bin
+	unsigned int* bins_start = bins;
+	unsigned int* bins_end = bins + this->mSahBins;
+	memset(bins, 0, sizeof(unsigned int) * 2 * this->mSahBins);
+
+	float bin_scale = (float)this->mSahBins / (axis_max - axis_min);
+	int last_bin = (int)this->mSahBins - 1;
+
+	for (unsigned int i = 0; i < current_count; i++)
+	{
+		const AABB& bbox = clipped_bounds ? clipped_bounds[i] : prims_bounds[current_ids[i]];
+		int bin_min = (int)((bbox.mMin[axis] - axis_min) * bin_scale);
+		int bin_max = (int)((bbox.mMax[axis] - axis_min) * bin_scale);
+		bins_start[bin_min < 0 ? 0 : bin_min > last_bin ? last_bin : bin_min]++;
+		bins_end[bin_max < 0 ? 0 : bin_max > last_bin ? last_bin : bin_max]++;
+	}
+
+	// Candidate planes lie on bin boundaries
+	unsigned int below = 0, above = current_count;
+	for (unsigned int i = 1; i < this->mSahBins; i++)
+	{
+		below += bins_start[i - 1];
+		above -= bins_end[i - 1];
+
+		float split = axis_min + (float)i / bin_scale;
+		float cost = this->EvaluateSAH(node_bounds, axis, split, below, above);
+
+		if (cost < best_cost)
+		{
+			best_cost = cost;
+			best_axis = axis;
+			best_split = split;
+		}
+	}
+}
+
+AABB* KDTree::ClipPrimitives(MemoryArena* arena,
+	Triangle* prims,
+	AABB* node_bounds,
+	unsigned int* current_ids,
+	unsigned int& current_count)
+{
+	AABB* clipped_bounds = arena->Allocate<AABB>(current_count);
+	unsigned int clipped_count = 0;
+
+	for (unsigned int i = 0; i < current_count; i++)
+	{
+		AABB bbox = prims[current_ids[i]].GetClippedBounds(*node_bounds);
 
-	this->mNodes_alloc = 0;
-	this->mNodes_next = 0;
+		// Bounding box of the triangle overlapped the node, but the triangle itself does not
+		if (bbox.IsEmpty())
+		{
+			continue;
+		}
 
-	this->mIndices_alloc = 0;
-	this->mIndices_next = 0;
+		current_ids[clipped_count] = current_ids[i];
+		clipped_bounds[clipped_count] = bbox;
+		clipped_count++;
+	}
 
-	unsigned int *prims_ids = (unsigned int*)malloc(sizeof(unsigned int) * prims_count);
+	current_count = clipped_count;
 
-	for (unsigned int i = 0; i < prims_count; i++)
-	{
-		prims_ids[i] = i;
-	}
+	return clipped_bounds;
+}
 
-	this->RecursiveBuild(0, prims, prims_bounds, prims_bound_edges, prims_count, &this->mBounds, prims_ids, prims_count, 0, 0);
+unsigned int KDTree::MergeClippedEdges(MemoryArena* arena,
+	BoundEdge* edges,
+	unsigned int edges_count,
+	int axis,
+	unsigned int* straddle_ids,
+	AABB* straddle_bounds,
+	unsigned int straddle_count,
+	unsigned char* prims_side,
+	unsigned int child)
+{
+	MemoryArena::Marker marker = arena->GetMarker();
 
-	free(prims_ids);
-	prims_ids = NULL;
+	BoundEdge* clipped = arena->Allocate<BoundEdge>(2 * straddle_count);
+	unsigned int clipped_count = 0;
 
-	for (unsigned int i = 0; i < 3; i++)
+	for (unsigned int i = 0; i < straddle_count; i++)
 	{
-		free(prims_bound_edges[i]);
-		prims_bound_edges[i] = NULL;
+		if (prims_side[straddle_ids[i]] & (1 << child))
+		{
+			const AABB& bbox = straddle_bounds[2 * i + child];
+			clipped[clipped_count++] = BoundEdge(bbox.mMin[axis], straddle_ids[i], true);
+			clipped[clipped_count++] = BoundEdge(bbox.mMax[axis], straddle_ids[i], false);
+		}
 	}
+	std::sort(clipped, clipped + clipped_count);
 
-	_aligned_free(prims_bounds);
-	prims_bounds = NULL;
+	BoundEdge* kept = arena->Allocate<BoundEdge>(edges_count);
+	memcpy(kept, edges, sizeof(BoundEdge) * edges_count);
+	std::merge(kept, kept + edges_count, clipped, clipped + clipped_count, edges);
+
+	arena->Release(marker);
+
+	return edges_count + clipped_count;
 }
 
-void KDTree::RecursiveBuild(unsigned int node,
+void KDTree::RecursiveBuild(BuildBuffer* out,
+	unsigned int node,
 	Triangle* prims,
 	AABB* prims_bounds,
 	BoundEdge* prims_bound_edges[3],
@@ -98,189 +922,416 @@ void KDTree::RecursiveBuild(unsigned int node,
 	unsigned int bad_refines,
 	unsigned int recursion_depth)
 {
-	if (node != this->mNodes_next)
+	if (node != out->mNodes_next)
 	{
 		std::cout << "Error: Something strange happened in KdTree builder" << std::endl;
 		return;
 	}
 
-	if (node == this->mNodes_alloc)
+	this->AllocateNode(out);
+
+	MemoryArena* arena = this->mArenas[this->GetWorkerIndex()];
+	MemoryArena::Marker marker = arena->GetMarker();
+
+	// Root bounds enclose every primitive, clipping pays off only below it
+	AABB* clipped_bounds = NULL;
+	if (this->mPerfectSplits && recursion_depth > 0)
+	{
+		clipped_bounds = this->ClipPrimitives(arena, prims, node_bounds, current_ids, current_count);
+	}
+
+	if (current_count <= this->mMaxPrimsInNode || recursion_depth > this->mMaxRecursionDepth)
 	{
-		int alloc_count = this->mNodes_alloc > 256 ? this->mNodes_alloc * 2 : 512;
+		this->CreateLeaf(out, node, current_ids, current_count);
+		arena->Release(marker);
+		return;
+	}
 
-		KdNode* nodes_realloc = (KdNode*)malloc(sizeof(KdNode) * alloc_count);
+	int best_axis = -1;
+	int best_offset = -1;
+	float best_cost = std::numeric_limits<float>::infinity();
+	float old_cost = (float)(this->mSahIsectCost * current_count);
 
-		if (this->mNodes_alloc > 0)
+	// Longest axis first, other axes are swept when it has no split or when all axes are requested
+	int axis = node_bounds->GetLongestAxis();
+	for (int retries = 0; retries < 3 && (best_axis == -1 || this->mSahAllAxes); retries++)
+	{
+		for (unsigned int i = 0; i < current_count; i++)
 		{
-			memcpy(nodes_realloc, this->mNodes, sizeof(KdNode) * this->mNodes_alloc);
-			free(this->mNodes);
+			int prim_number = current_ids[i];
+			const AABB& bbox = clipped_bounds ? clipped_bounds[i] : prims_bounds[prim_number];
+			prims_bound_edges[axis][2 * i] = BoundEdge(bbox.mMin[axis], prim_number, true);
+			prims_bound_edges[axis][2 * i + 1] = BoundEdge(bbox.mMax[axis], prim_number, false);
 		}
+		std::sort(&prims_bound_edges[axis][0], &prims_bound_edges[axis][2 * current_count]);
 
-		this->mNodes = nodes_realloc;
-		this->mNodes_alloc = alloc_count;
+		this->FindSplit(prims_bound_edges[axis], 2 * current_count, axis, node_bounds, current_count, best_axis, best_offset, best_cost);
+
+		axis = (axis + 1) % 3;
 	}
 
-	this->mNodes_next++;
+	if (best_cost > old_cost)
+	{
+		bad_refines++;
+	}
 
-	if (current_count <= this->mMaxPrimsInNode || recursion_depth > this->mMaxRecursionDepth)
+	if ((best_cost > 4.0f * old_cost && current_count < this->mMaxPrimsInNode) || best_axis == -1 || bad_refines == 3 || best_offset == -1)
 	{
-		unsigned int base_index = this->mIndices_next;
+		this->CreateLeaf(out, node, current_ids, current_count);
+		arena->Release(marker);
+		return;
+	}
+
+	axis = best_axis;
+	float split = prims_bound_edges[axis][best_offset].mPosition;
+
+	unsigned int* left = arena->Allocate<unsigned int>(current_count);
+	unsigned int left_count = 0;
+
+	unsigned int* right = arena->Allocate<unsigned int>(current_count);
+	unsigned int right_count = 0;
 
-		int alloc_count = this->mIndices_alloc;
-		while (this->mIndices_next + current_count >= (unsigned int)alloc_count)
+	for (unsigned int i = 0; i < (unsigned int)best_offset; i++)
+	{
+		if (prims_bound_edges[axis][i].type == BoundEdge::START)
 		{
-			alloc_count = alloc_count > 256 ? alloc_count * 2 : 512;
+			left[left_count] = prims_bound_edges[axis][i].mPrimitiveID;
+			left_count++;
 		}
+	}
 
-		unsigned int* indexes_realloc = (unsigned int*)malloc(sizeof(unsigned int) * alloc_count);
-
-		if (this->mIndices_alloc > 0)
+	for (unsigned int i = (unsigned int)best_offset + 1; i < 2 * current_count; i++)
+	{
+		if (prims_bound_edges[axis][i].type == BoundEdge::END)
 		{
-			memcpy(indexes_realloc, this->mIndices, sizeof(unsigned int) * this->mIndices_alloc);
-			free(this->mIndices);
+			right[right_count] = prims_bound_edges[axis][i].mPrimitiveID;
+			right_count++;
 		}
+	}
 
-		this->mIndices = indexes_realloc;
-		this->mIndices_alloc = alloc_count;
+	AABB left_bounds = *node_bounds;
+	AABB right_bounds = *node_bounds;
 
-		for (unsigned int i = 0; i < current_count; i++)
+	left_bounds.mMax[axis] = split;
+	right_bounds.mMin[axis] = split;
+
+	this->BuildChildren(out, node, axis, split, current_count,
+		[&](BuildBuffer* child_out, unsigned int child, bool detached)
 		{
-			this->mIndices[base_index + i] = current_ids[i];
-			this->mIndices_next++;
-		}
+			this->RecursiveBuild(child_out, child, prims, prims_bounds, prims_bound_edges, prims_count,
+				&left_bounds, left, left_count, bad_refines, recursion_depth + 1);
+		},
+		[&](BuildBuffer* child_out, unsigned int child, bool detached)
+		{
+			// Detached task must not share edge scratch with the rest of the build
+			BoundEdge* edges[3] = { prims_bound_edges[0], prims_bound_edges[1], prims_bound_edges[2] };
+			MemoryArena* task_arena = this->mArenas[this->GetWorkerIndex()];
+			MemoryArena::Marker task_marker = task_arena->GetMarker();
 
-		this->mNodes[node].InitLeaf(base_index, current_count);
+			if (detached)
+			{
+				edges[0] = task_arena->Allocate<BoundEdge>(2 * right_count * 3);
+				edges[1] = edges[0] + 2 * right_count;
+				edges[2] = edges[1] + 2 * right_count;
+			}
+
+			this->RecursiveBuild(child_out, child, prims, prims_bounds, edges, prims_count,
+				&right_bounds, right, right_count, bad_refines, recursion_depth + 1);
+
+			task_arena->Release(task_marker);
+		});
 
+	arena->Release(marker);
+}
+
+void KDTree::RecursiveBuildEvents(BuildBuffer* out,
+	unsigned int node,
+	Triangle* prims,
+	BoundEdge* edges[3],
+	AABB* node_bounds,
+	unsigned int current_count,
+	unsigned int bad_refines,
+	unsigned int recursion_depth)
+{
+	if (node != out->mNodes_next)
+	{
+		std::cout << "Error: Something strange happened in KdTree builder" << std::endl;
 		return;
 	}
 
+	this->AllocateNode(out);
+
+	// Each primitive has exactly one START event per axis, so ids can always be recovered from the events
+	bool make_leaf = (current_count <= this->mMaxPrimsInNode || recursion_depth > this->mMaxRecursionDepth);
+
 	int best_axis = -1;
 	int best_offset = -1;
 	float best_cost = std::numeric_limits<float>::infinity();
 	float old_cost = (float)(this->mSahIsectCost * current_count);
-	float4 d = node_bounds->mMax - node_bounds->mMin;
-	float total_sa = (2.0f * (d.x * d.y + d.x * d.z + d.y * d.z));
-	float inv_total_sa = 1.0f / total_sa;
-
-	int axis = node_bounds->GetLongestAxis();
-	int retries = 0;
-
-RetrySplit:
-	for (unsigned int i = 0; i < current_count; i++)
-	{
-		int prim_number = current_ids[i];
-		const AABB& bbox = prims_bounds[prim_number];
-		prims_bound_edges[axis][2 * i] = BoundEdge(bbox.mMin[axis], prim_number, true);
-		prims_bound_edges[axis][2 * i + 1] = BoundEdge(bbox.mMax[axis], prim_number, false);
-	}
-	std::sort(&prims_bound_edges[axis][0], &prims_bound_edges[axis][2 * current_count]);
 
-	int below = 0, above = current_count;
-	for (unsigned int i = 0; i < 2 * current_count; i++)
+	if (!make_leaf)
 	{
-		if (prims_bound_edges[axis][i].type == BoundEdge::END)
+		int axis = node_bounds->GetLongestAxis();
+		for (int retries = 0; retries < 3 && (best_axis == -1 || this->mSahAllAxes); retries++)
 		{
-			above--;
+			this->FindSplit(edges[axis], 2 * current_count, axis, node_bounds, current_count, best_axis, best_offset, best_cost);
+			axis = (axis + 1) % 3;
 		}
 
-		float edge_t = prims_bound_edges[axis][i].mPosition;
-
-		if (edge_t > node_bounds->mMin[axis] && edge_t < node_bounds->mMax[axis])
+		if (best_cost > old_cost)
 		{
-			int other_axis[3][2] = { { 1, 2 }, { 0, 2 }, { 0, 1 } };
-			int other_axis0 = other_axis[axis][0];
-			int other_axis1 = other_axis[axis][1];
+			bad_refines++;
+		}
 
-			float below_sa = 2 * (d[other_axis0] * d[other_axis1] + (edge_t - node_bounds->mMin[axis]) * (d[other_axis0] + d[other_axis1]));
-			float above_sa = 2 * (d[other_axis0] * d[other_axis1] + (node_bounds->mMax[axis] - edge_t) * (d[other_axis0] + d[other_axis1]));
+		make_leaf = ((best_cost > 4.0f * old_cost && current_count < this->mMaxPrimsInNode) || best_axis == -1 || bad_refines == 3 || best_offset == -1);
+	}
 
-			float below_p = below_sa * inv_total_sa;
-			float above_p = above_sa * inv_total_sa;
+	MemoryArena* arena = this->mArenas[this->GetWorkerIndex()];
+	MemoryArena::Marker marker = arena->GetMarker();
 
-			float eb = (above == 0 || below == 0) ? this->mSahEmptyBonus : 0.0f;
-			float cost = this->mSahTraversalCost + this->mSahIsectCost * (1.0f - eb) * (below_p * below + above_p * above);
+	if (make_leaf)
+	{
+		unsigned int* ids = arena->Allocate<unsigned int>(current_count);
+		unsigned int ids_count = 0;
 
-			if (cost < best_cost)
+		for (unsigned int i = 0; i < 2 * current_count; i++)
+		{
+			if (edges[0][i].type == BoundEdge::START)
 			{
-				best_cost = cost;
-				best_axis = axis;
-				best_offset = i;
+				ids[ids_count] = edges[0][i].mPrimitiveID;
+				ids_count++;
 			}
 		}
 
-		if (prims_bound_edges[axis][i].type == BoundEdge::START)
-		{
-			below++;
-		}
+		this->CreateLeaf(out, node, ids, ids_count);
+
+		arena->Release(marker);
+
+		return;
+	}
+
+	int axis = best_axis;
+	float split = edges[axis][best_offset].mPosition;
+
+	// Classify primitives - bit 0 marks below the split, bit 1 marks above the split
+	unsigned char* prims_side = this->mPrimsSide[this->GetWorkerIndex()];
+
+	for (unsigned int i = 0; i < 2 * current_count; i++)
+	{
+		prims_side[edges[axis][i].mPrimitiveID] = 0;
 	}
 
-	if (best_axis == -1 && retries < 2)
+	unsigned int left_count = 0;
+	unsigned int right_count = 0;
+
+	for (unsigned int i = 0; i < (unsigned int)best_offset; i++)
 	{
-		retries++;
-		axis = (axis + 1) % 3;
-		goto RetrySplit;
+		if (edges[axis][i].type == BoundEdge::START)
+		{
+			prims_side[edges[axis][i].mPrimitiveID] |= 1;
+			left_count++;
+		}
 	}
 
-	if (best_cost > old_cost)
+	for (unsigned int i = (unsigned int)best_offset + 1; i < 2 * current_count; i++)
 	{
-		bad_refines++;
+		if (edges[axis][i].type == BoundEdge::END)
+		{
+			prims_side[edges[axis][i].mPrimitiveID] |= 2;
+			right_count++;
+		}
 	}
 
-	if ((best_cost > 4.0f * old_cost && current_count < this->mMaxPrimsInNode) || best_axis == -1 || bad_refines == 3 || best_offset == -1)
+	AABB left_bounds = *node_bounds;
+	AABB right_bounds = *node_bounds;
+
+	left_bounds.mMax[axis] = split;
+	right_bounds.mMin[axis] = split;
+
+	// Straddling primitives get bounds clipped to each child (bit 2 marks them), a primitive whose
+	// clipped part is empty on one side is dropped from that child
+	unsigned int straddle_count = 0;
+	unsigned int* straddle_ids = NULL;
+	AABB* straddle_bounds = NULL;
+
+	if (this->mPerfectSplits)
 	{
-		unsigned int base_index = this->mIndices_next;
+		straddle_ids = arena->Allocate<unsigned int>(current_count);
 
-		int alloc_count = this->mIndices_alloc;
-		while (this->mIndices_next + current_count >= (unsigned int)alloc_count)
+		for (unsigned int i = 0; i < 2 * current_count; i++)
 		{
-			alloc_count = alloc_count > 256 ? alloc_count * 2 : 512;
+			if (edges[axis][i].type == BoundEdge::START && prims_side[edges[axis][i].mPrimitiveID] == 3)
+			{
+				straddle_ids[straddle_count] = edges[axis][i].mPrimitiveID;
+				straddle_count++;
+			}
 		}
 
-		unsigned int* indexes_realloc = (unsigned int*)malloc(sizeof(unsigned int) * alloc_count);
+		straddle_bounds = arena->Allocate<AABB>(2 * straddle_count);
 
-		if (this->mIndices_alloc > 0)
+		for (unsigned int i = 0; i < straddle_count; i++)
 		{
-			memcpy(indexes_realloc, this->mIndices, sizeof(unsigned int) * this->mIndices_alloc);
-			free(this->mIndices);
+			unsigned int prim = straddle_ids[i];
+			prims_side[prim] |= 4;
+
+			straddle_bounds[2 * i] = prims[prim].GetClippedBounds(left_bounds);
+			straddle_bounds[2 * i + 1] = prims[prim].GetClippedBounds(right_bounds);
+
+			if (straddle_bounds[2 * i].IsEmpty())
+			{
+				prims_side[prim] &= ~1;
+				left_count--;
+			}
+
+			if (straddle_bounds[2 * i + 1].IsEmpty())
+			{
+				prims_side[prim] &= ~2;
+				right_count--;
+			}
 		}
+	}
 
-		this->mIndices = indexes_realloc;
-		this->mIndices_alloc = alloc_count;
+	// Split the sorted event lists, a stable partition keeps both children sorted
+	BoundEdge* left_edges[3];
+	BoundEdge* right_edges[3];
 
-		for (unsigned int i = 0; i < current_count; i++)
+	left_edges[0] = arena->Allocate<BoundEdge>(2 * left_count * 3);
+	right_edges[0] = arena->Allocate<BoundEdge>(2 * right_count * 3);
+
+	for (unsigned int a = 0; a < 3; a++)
+	{
+		left_edges[a] = left_edges[0] + 2 * left_count * a;
+		right_edges[a] = right_edges[0] + 2 * right_count * a;
+
+		unsigned int l = 0;
+		unsigned int r = 0;
+
+		for (unsigned int i = 0; i < 2 * current_count; i++)
+		{
+			unsigned char side = prims_side[edges[a][i].mPrimitiveID];
+
+			if (side & 4)
+			{
+				continue;
+			}
+
+			if (side & 1)
+			{
+				left_edges[a][l] = edges[a][i];
+				l++;
+			}
+
+			if (side & 2)
+			{
+				right_edges[a][r] = edges[a][i];
+				r++;
+			}
+		}
+
+		// Only the few clipped events need sorting, they are merged into already sorted lists
+		if (straddle_count > 0)
 		{
-			this->mIndices[base_index + i] = current_ids[i];
-			this->mIndices_next++;
+			this->MergeClippedEdges(arena, left_edges[a], l, a, straddle_ids, straddle_bounds, straddle_count, prims_side, 0);
+			this->MergeClippedEdges(arena, right_edges[a], r, a, straddle_ids, straddle_bounds, straddle_count, prims_side, 1);
 		}
+	}
+
+	this->BuildChildren(out, node, axis, split, current_count,
+		[&](BuildBuffer* child_out, unsigned int child, bool detached)
+		{
+			this->RecursiveBuildEvents(child_out, child, prims, left_edges, &left_bounds, left_count, bad_refines, recursion_depth + 1);
+		},
+		[&](BuildBuffer* child_out, unsigned int child, bool detached)
+		{
+			this->RecursiveBuildEvents(child_out, child, prims, right_edges, &right_bounds, right_count, bad_refines, recursion_depth + 1);
+		});
+
+	arena->Release(marker);
+}
+
+void KDTree::RecursiveBuildBinned(BuildBuffer* out,
+	unsigned int node,
+	Triangle* prims,
+	AABB* prims_bounds,
+	AABB* node_bounds,
+	unsigned int* current_ids,
+	unsigned int current_count,
+	unsigned int bad_refines,
+	unsigned int recursion_depth)
+{
+	if (node != out->mNodes_next)
+	{
+		std::cout << "Error: Something strange happened in KdTree builder" << std::endl;
+		return;
+	}
+
+	this->AllocateNode(out);
+
+	MemoryArena* arena = this->mArenas[this->GetWorkerIndex()];
+	MemoryArena::Marker marker = arena->GetMarker();
+
+	AABB* clipped_bounds = NULL;
+	if (this->mPerfectSplits && recursion_depth > 0)
+	{
+		clipped_bounds = this->ClipPrimitives(arena, prims, node_bounds, current_ids, current_count);
+	}
+
+	if (current_count <= this->mMaxPrimsInNode || recursion_depth > this->mMaxRecursionDepth)
+	{
+		this->CreateLeaf(out, node, current_ids, current_count);
+		arena->Release(marker);
+		return;
+	}
+
+	int best_axis = -1;
+	float best_split = 0.0f;
+	float best_cost = std::numeric_limits<float>::infinity();
+	float old_cost = (float)(this->mSahIsectCost * current_count);
+
+	unsigned int* bins = arena->Allocate<unsigned int>(2 * this->mSahBins);
+
+	int axis = node_bounds->GetLongestAxis();
+	for (int retries = 0; retries < 3 && (best_axis == -1 || this->mSahAllAxes); retries++)
+	{
+		this->FindSplitBinned(prims_bounds, clipped_bounds, current_ids, current_count, axis, node_bounds, bins, best_axis, best_split, best_cost);
+		axis = (axis + 1) % 3;
+	}
 
-		this->mNodes[node].InitLeaf(base_index, current_count);
+	if (best_cost > old_cost)
+	{
+		bad_refines++;
+	}
 
+	if ((best_cost > 4.0f * old_cost && current_count < this->mMaxPrimsInNode) || best_axis == -1 || bad_refines == 3)
+	{
+		this->CreateLeaf(out, node, current_ids, current_count);
+		arena->Release(marker);
 		return;
 	}
 
 	axis = best_axis;
-	float split = prims_bound_edges[axis][best_offset].mPosition;
+	float split = best_split;
 
-	unsigned int* left = (unsigned int*)malloc(sizeof(unsigned int) * current_count);
+	unsigned int* left = arena->Allocate<unsigned int>(current_count);
 	unsigned int left_count = 0;
 
-	unsigned int* right = (unsigned int*)malloc(sizeof(unsigned int) * current_count);
+	unsigned int* right = arena->Allocate<unsigned int>(current_count);
 	unsigned int right_count = 0;
 
-	for (unsigned int i = 0; i < (unsigned int)best_offset; i++)
+	// Primitives lying in the split plane go below
+	for (unsigned int i = 0; i < current_count; i++)
 	{
-		if (prims_bound_edges[axis][i].type == BoundEdge::START)
+		const AABB& bbox = clipped_bounds ? clipped_bounds[i] : prims_bounds[current_ids[i]];
+
+		if (bbox.mMin[axis] < split || bbox.mMax[axis] <= split)
 		{
-			left[left_count] = prims_bound_edges[axis][i].mPrimitiveID;
+			left[left_count] = current_ids[i];
 			left_count++;
 		}
-	}
 
-	for (unsigned int i = (unsigned int)best_offset + 1; i < 2 * current_count; i++)
-	{
-		if (prims_bound_edges[axis][i].type == BoundEdge::END)
+		if (bbox.mMax[axis] > split)
 		{
-			right[right_count] = prims_bound_edges[axis][i].mPrimitiveID;
+			right[right_count] = current_ids[i];
 			right_count++;
 		}
 	}
@@ -291,34 +1342,47 @@ RetrySplit:
 	left_bounds.mMax[axis] = split;
 	right_bounds.mMin[axis] = split;
 
-	this->RecursiveBuild(node + 1,
-		prims,
-		prims_bounds,
-		prims_bound_edges,
-		prims_count,
-		&left_bounds,
-		left,
-		left_count,
-		bad_refines,
-		recursion_depth + 1);
-
-	unsigned int above_child = this->mNodes_next;
-	this->mNodes[node].InitInterior(axis, above_child, split);
-
-	this->RecursiveBuild(above_child,
-		prims,
-		prims_bounds,
-		prims_bound_edges,
-		prims_count,
-		&right_bounds,
-		right,
-		right_count,
-		bad_refines,
-		recursion_depth + 1);
-
-	free(left);
-	left = NULL;
-
-	free(right);
-	right = NULL;
-}
\ No newline at end of file
+	this->BuildChildren(out, node, axis, split, current_count,
+		[&](BuildBuffer* child_out, unsigned int child, bool detached)
+		{
+			this->RecursiveBuildBinned(child_out, child, prims, prims_bounds, &left_bounds, left, left_count, bad_refines, recursion_depth + 1);
+		},
+		[&](BuildBuffer* child_out, unsigned int child, bool detached)
+		{
+			this->RecursiveBuildBinned(child_out, child, prims, prims_bounds, &right_bounds, right, right_count, bad_refines, recursion_depth + 1);
+		});
+
+	arena->Release(marker);
+}
+
+float KDTree::GetSAHCost()
+{
+	if (this->mNodes_next == 0)
+	{
+		return 0.0f;
+	}
+
+	return this->ComputeSAHCost(0, this->mBounds) / this->mBounds.GetSurfaceArea();
+}
+
+float KDTree::ComputeSAHCost(unsigned int node, const AABB& node_bounds)
+{
+	const KdNode& n = this->mNodes[node];
+
+	if (n.IsLeaf())
+	{
+		return node_bounds.GetSurfaceArea() * this->mSahIsectCost * n.GetPrimitivesCount();
+	}
+
+	unsigned int axis = n.GetSplitAxis();
+
+	AABB below_bounds = node_bounds;
+	AABB above_bounds = node_bounds;
+
+	below_bounds.mMax[axis] = n.GetSplitPosition();
+	above_bounds.mMin[axis] = n.GetSplitPosition();
+
+	return node_bounds.GetSurfaceArea() * this->mSahTraversalCost +
+		this->ComputeSAHCost(this->GetBelowChild(node), below_bounds) +
+		this->ComputeSAHCost(this->GetAboveChild(node), above_bounds);
+}
@@ -2,10 +2,16 @@
 #define __KDTREE_H__
 
 #include <string>
+#include <functional>
+#include <chrono>
 #include "../../Util/Config.h"
+#include "../../Util/TaskScheduler.h"
+#include "../../Util/MemoryArena.h"
+#include "../../Util/Hash.h"
 #include "../../Math/Shapes/AABB.h"
 #include "../../Math/Shapes/Triangle.h"
 #include "../../Scene.h"
+#include "TreeStatistics.h"
 
 namespace OpenTracerCore
 {
@@ -31,6 +37,12 @@ namespace OpenTracerCore
 			{
 				if (this->mPosition == edge.mPosition)
 				{
+					if (this->type == edge.type)
+					{
+						// Tie-break on primitive keeps the order (and therefore the tree) deterministic
+						return this->mPrimitiveID < edge.mPrimitiveID;
+					}
+
 					return (int)this->type < (int)edge.type;
 				}
 				else
@@ -98,12 +110,76 @@ namespace OpenTracerCore
 				return (this->mFlags & 3) == 3;
 			}
 
+			// In treelet layout this is the first node of the children pair
 			unsigned int GetAboveChild() const
 			{
 				return (this->mAboveChild >> 2);
 			}
+
+			void SetAboveChild(unsigned int above_node)
+			{
+				this->mAboveChild = (this->mAboveChild & 3) | (above_node << 2);
+			}
+		};
+
+		enum BuildMethod
+		{
+			BUILD_SORT = 0,		// Sorts bound edges in every node - O(N log^2 N)
+			BUILD_EVENTS,		// Sorts bound edges once and splits sorted lists (Wald & Havran) - O(N log N)
+			BUILD_BINNED		// Evaluates SAH only on bin boundaries, approximate but fastest - O(N log N)
 		};
 
+		class BuildBuffer
+		{
+		public:
+			KdNode* mNodes;
+			size_t mNodes_alloc;
+			size_t mNodes_next;
+
+			unsigned int* mIndices;
+			size_t mIndices_alloc;
+			size_t mIndices_next;
+
+			BuildBuffer()
+			{
+				this->mNodes = NULL;
+				this->mNodes_alloc = 0;
+				this->mNodes_next = 0;
+
+				this->mIndices = NULL;
+				this->mIndices_alloc = 0;
+				this->mIndices_next = 0;
+			}
+
+			void Release()
+			{
+				if (this->mNodes)
+				{
+					free(this->mNodes);
+					this->mNodes = NULL;
+				}
+				this->mNodes_alloc = 0;
+				this->mNodes_next = 0;
+
+				if (this->mIndices)
+				{
+					free(this->mIndices);
+					this->mIndices = NULL;
+				}
+				this->mIndices_alloc = 0;
+				this->mIndices_next = 0;
+			}
+		};
+
+		enum NodeLayout
+		{
+			LAYOUT_DEPTH_FIRST = 0,	// Below child follows its parent, above child is referenced
+			LAYOUT_TREELET			// Children are stored as a referenced pair, pairs are clustered into blocks
+		};
+
+		// Nodes with fewer primitives are never built as separate tasks
+		enum { PARALLEL_MIN_PRIMS = 4096 };
+
 		AABB mBounds;
 
 		KdNode* mNodes;
@@ -114,11 +190,31 @@ namespace OpenTracerCore
 		size_t mIndices_alloc;
 		size_t mIndices_next;
 
+		size_t mPrimsCount;
+		TreeStatistics mStatistics;
+
 		unsigned int mMaxPrimsInNode;
 		unsigned int mMaxRecursionDepth;
 		unsigned int mSahTraversalCost;
 		unsigned int mSahIsectCost;
 		float mSahEmptyBonus;
+		unsigned int mSahBins;
+		bool mSahAllAxes;
+		bool mPerfectSplits;
+		BuildMethod mBuildMethod;
+		NodeLayout mLayout;
+		unsigned int mLayoutBlock;
+		bool mBuildRopes;
+
+		// Neighbour links of leaf faces (-x, +x, -y, +y, -z, +z) and leaf bounds, both indexed by
+		// node and valid for leaves only, NULL when ropes are not built
+		unsigned int* mRopes;
+		AABB* mLeafBounds;
+		unsigned int mThreads;
+
+		TaskScheduler* mScheduler;
+		unsigned char** mPrimsSide;
+		MemoryArena** mArenas;
 
 		unsigned int EstimateRecursionDepth(unsigned int prims_count)
 		{
@@ -127,7 +223,71 @@ namespace OpenTracerCore
 
 		void BuildTree(Triangle* prims, unsigned int prims_count);
 
-		void RecursiveBuild(unsigned int node,
+		unsigned int GetWorkerIndex()
+		{
+			return this->mScheduler ? this->mScheduler->GetWorkerIndex() : 0;
+		}
+
+		void ReserveNodes(BuildBuffer* out, size_t count);
+
+		void ReserveIndices(BuildBuffer* out, size_t count);
+
+		unsigned int AllocateNode(BuildBuffer* out);
+
+		unsigned int AllocateIndices(BuildBuffer* out, unsigned int count);
+
+		void CreateLeaf(BuildBuffer* out, unsigned int node, unsigned int* current_ids, unsigned int current_count);
+
+		void AppendBuffer(BuildBuffer* out, BuildBuffer* in);
+
+		void BuildChildren(BuildBuffer* out,
+			unsigned int node,
+			unsigned int axis,
+			float split,
+			unsigned int current_count,
+			const std::function<void(BuildBuffer*, unsigned int, bool)>& build_below,
+			const std::function<void(BuildBuffer*, unsigned int, bool)>& build_above);
+
+		float EvaluateSAH(AABB* node_bounds, int axis, float split, unsigned int below, unsigned int above);
+
+		void FindSplit(BoundEdge* edges,
+			unsigned int edges_count,
+			int axis,
+			AABB* node_bounds,
+			unsigned int current_count,
+			int& best_axis,
+			int& best_offset,
+			float& best_cost);
+
+		void FindSplitBinned(AABB* prims_bounds,
+			AABB* clipped_bounds,
+			unsigned int* current_ids,
+			unsigned int current_count,
+			int axis,
+			AABB* node_bounds,
+			unsigned int* bins,
+			int& best_axis,
+			float& best_split,
+			float& best_cost);
+
+		AABB* ClipPrimitives(MemoryArena* arena,
+			Triangle* prims,
+			AABB* node_bounds,
+			unsigned int* current_ids,
+			unsigned int& current_count);
+
+		unsigned int MergeClippedEdges(MemoryArena* arena,
+			BoundEdge* edges,
+			unsigned int edges_count,
+			int axis,
+			unsigned int* straddle_ids,
+			AABB* straddle_bounds,
+			unsigned int straddle_count,
+			unsigned char* prims_side,
+			unsigned int child);
+
+		void RecursiveBuild(BuildBuffer* out,
+			unsigned int node,
 			Triangle* prims,
 			AABB* prims_bounds,
 			BoundEdge* prims_bound_edges[3],
@@ -138,9 +298,66 @@ namespace OpenTracerCore
 			unsigned int bad_refines,
 			unsigned int recursion_depth);
 
+		void RecursiveBuildEvents(BuildBuffer* out,
+			unsigned int node,
+			Triangle* prims,
+			BoundEdge* edges[3],
+			AABB* node_bounds,
+			unsigned int current_count,
+			unsigned int bad_refines,
+			unsigned int recursion_depth);
+
+		void RecursiveBuildBinned(BuildBuffer* out,
+			unsigned int node,
+			Triangle* prims,
+			AABB* prims_bounds,
+			AABB* node_bounds,
+			unsigned int* current_ids,
+			unsigned int current_count,
+			unsigned int bad_refines,
+			unsigned int recursion_depth);
+
+		float ComputeSAHCost(unsigned int node, const AABB& node_bounds);
+
+		unsigned int GetBelowChild(unsigned int node) const
+		{
+			return this->mLayout == LAYOUT_TREELET ? this->mNodes[node].GetAboveChild() : node + 1;
+		}
+
+		unsigned int GetAboveChild(unsigned int node) const
+		{
+			return this->mLayout == LAYOUT_TREELET ? this->mNodes[node].GetAboveChild() + 1 : this->mNodes[node].GetAboveChild();
+		}
+
+		void RelayoutTreelets();
+
+		void BuildRopes();
+
+		unsigned int OptimizeRope(unsigned int rope, unsigned int face, const AABB& node_bounds);
+
+		void RecursiveBuildRopes(unsigned int node, unsigned int ropes[6], const AABB& node_bounds);
+
+		void RecordPhase(const std::string& phase, std::chrono::high_resolution_clock::time_point& start);
+
+		void UpdateStatistics();
+
+		void CollectStatistics(unsigned int node, unsigned int depth);
+
 	public:
+		// Reads build settings only, tree is empty until Build or SetTree is called
+		KDTree(const std::string& config);
+
 		KDTree(const std::string& config, Scene* scene);
 
+		// Builds the tree, previously built one is released first (geometry may have changed)
+		void Build(Scene* scene);
+
+		// Replaces the tree with a copy of previously built one (e.g. loaded from cache)
+		void SetTree(const void* nodes, size_t nodes_count, const unsigned int* indices, size_t indices_count, const AABB& bounds, size_t prims_count);
+
+		// Hash of all settings that affect the built tree
+		unsigned long long GetBuildHash();
+
 		~KDTree();
 
 		AABB& GetAABB() { return mBounds; }
@@ -151,6 +368,24 @@ namespace OpenTracerCore
 		unsigned int* GetIndices() { return mIndices; }
 		size_t GetIndexCount() { return mIndices_next; }
 
+		// Expected cost of tracing a random ray through the tree, relative to the root surface area
+		float GetSAHCost();
+
+		const TreeStatistics& GetStatistics() { return mStatistics; }
+
+		// Node layout as understood by traversal kernels (0 - depth first, 1 - treelet)
+		int GetLayout() { return (int)mLayout; }
+
+		// Rope pointing out of the scene
+		static const unsigned int ROPE_NONE = 0xFFFFFFFF;
+
+		bool HasRopes() { return mRopes != NULL; }
+		unsigned int* GetRopes() { return mRopes; }
+		float* GetLeafBounds() { return (float*)mLeafBounds; }
+
+		// Appends time of phase run outside of the tree (e.g. upload, cache load) to statistics
+		void AddPhaseTime(const std::string& phase, double milliseconds);
+
 		void* operator new(size_t size)
 		{
 			return _aligned_malloc(size, 16);
@@ -0,0 +1,143 @@
+#ifndef __TREE_STATISTICS_H__
+#define __TREE_STATISTICS_H__
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <sstream>
+
+namespace OpenTracerCore
+{
+	// Quality and build time report of an acceleration structure
+	class TreeStatistics
+	{
+	public:
+		// Leaves with more primitives than this all fall into the last leaf-size bucket
+		enum { MAX_LEAF_SIZE_BUCKET = 64 };
+
+		float mSAHCost;
+		size_t mPrimitives;
+		size_t mNodes;
+		size_t mLeaves;
+		size_t mEmptyLeaves;
+		size_t mReferences;
+		unsigned int mMaxDepth;
+
+		// Number of leaves at given depth / with given number of primitives (last bucket is open)
+		std::vector<unsigned int> mDepthHistogram;
+		std::vector<unsigned int> mLeafSizeHistogram;
+
+		// Duration of build phases in milliseconds, in order they were run
+		std::vector<std::pair<std::string, double> > mPhaseTimes;
+
+		TreeStatistics()
+		{
+			Clear();
+		}
+
+		void Clear()
+		{
+			mSAHCost = 0.0f;
+			mPrimitives = 0;
+			mNodes = 0;
+			mLeaves = 0;
+			mEmptyLeaves = 0;
+			mReferences = 0;
+			mMaxDepth = 0;
+			mDepthHistogram.clear();
+			mLeafSizeHistogram.clear();
+			mPhaseTimes.clear();
+		}
+
+		void AddLeaf(unsigned int depth, unsigned int count)
+		{
+			if (mDepthHistogram.size() <= depth)
+			{
+				mDepthHistogram.resize(depth + 1, 0);
+			}
+			mDepthHistogram[depth]++;
+
+			unsigned int bucket = count < MAX_LEAF_SIZE_BUCKET ? count : MAX_LEAF_SIZE_BUCKET;
+			if (mLeafSizeHistogram.size() <= bucket)
+			{
+				mLeafSizeHistogram.resize(bucket + 1, 0);
+			}
+			mLeafSizeHistogram[bucket]++;
+
+			mLeaves++;
+			mEmptyLeaves += count == 0 ? 1 : 0;
+			mReferences += count;
+			mMaxDepth = depth > mMaxDepth ? depth : mMaxDepth;
+		}
+
+		void AddPhaseTime(const std::string& phase, double milliseconds)
+		{
+			mPhaseTimes.push_back(std::make_pair(phase, milliseconds));
+		}
+
+		float GetEmptyLeafRatio() const
+		{
+			return mLeaves > 0 ? (float)mEmptyLeaves / (float)mLeaves : 0.0f;
+		}
+
+		// Average number of leaves referencing one primitive
+		float GetDuplicationFactor() const
+		{
+			return mPrimitives > 0 ? (float)mReferences / (float)mPrimitives : 0.0f;
+		}
+
+		double GetTotalTime() const
+		{
+			double total = 0.0;
+			for (size_t i = 0; i < mPhaseTimes.size(); i++)
+			{
+				total += mPhaseTimes[i].second;
+			}
+			return total;
+		}
+
+		std::string ToJSON() const
+		{
+			std::ostringstream s;
+			s << "{";
+			s << "\"sah_cost\":" << mSAHCost << ",";
+			s << "\"primitives\":" << mPrimitives << ",";
+			s << "\"nodes\":" << mNodes << ",";
+			s << "\"leaves\":" << mLeaves << ",";
+			s << "\"empty_leaves\":" << mEmptyLeaves << ",";
+			s << "\"empty_leaf_ratio\":" << GetEmptyLeafRatio() << ",";
+			s << "\"references\":" << mReferences << ",";
+			s << "\"duplication_factor\":" << GetDuplicationFactor() << ",";
+			s << "\"max_depth\":" << mMaxDepth << ",";
+
+			s << "\"depth_histogram\":[";
+			for (size_t i = 0; i < mDepthHistogram.size(); i++)
+			{
+				s << (i > 0 ? "," : "") << mDepthHistogram[i];
+			}
+			s << "],";
+
+			s << "\"leaf_size_histogram\":[";
+			for (size_t i = 0; i < mLeafSizeHistogram.size(); i++)
+			{
+				s << (i > 0 ? "," : "") << mLeafSizeHistogram[i];
+			}
+			s << "],";
+
+			// Phase names are fixed identifiers, they never need escaping
+			s << "\"phase_times_ms\":{";
+			for (size_t i = 0; i < mPhaseTimes.size(); i++)
+			{
+				s << (i > 0 ? "," : "") << "\"" << mPhaseTimes[i].first << "\":" << mPhaseTimes[i].second;
+			}
+			s << "},";
+
+			s << "\"total_time_ms\":" << GetTotalTime();
+			s << "}";
+
+			return s.str();
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,354 @@
+#ifndef __WIDE_BVH_H__
+#define __WIDE_BVH_H__
+
+#include <iostream>
+#include "../../Math/Numeric/Lanes.h"
+#include "../../Math/Shapes/AABB.h"
+#include "../../Math/Shapes/Ray.h"
+#include "../../Math/Shapes/Triangle.h"
+#include "../../Math/Shapes/TriangleBlock.h"
+#include "../../Math/Intersection/Intersection.h"
+#include "BVH.h"
+
+namespace OpenTracerCore
+{
+	// N-wide BVH collapsed from binary one for CPU traversal. Child bounds are stored per axis
+	// (SoA), so one pass of SIMD instructions tests the ray against all children of a node. Leaf
+	// triangles are packed into blocks of N Woop triangles, which are tested the same way.
+	template<unsigned int N>
+	class WideBVH
+	{
+	public:
+		enum { LEAF_FLAG = 0x80000000 };
+		enum { EMPTY_CHILD = 0xFFFFFFFF };
+		enum { STACK_SIZE = 64 * N };
+
+		// Interior child holds node index, leaf child holds first triangle block index flagged with
+		// LEAF_FLAG and the block count. Empty children get AABB() bounds, which min/max slab test
+		// still hits, so they are masked out by the valid bits of the node.
+		class __declspec(align(64)) Node
+		{
+		public:
+			float mMinX[N];
+			float mMaxX[N];
+			float mMinY[N];
+			float mMaxY[N];
+			float mMinZ[N];
+			float mMaxZ[N];
+			unsigned int mChildren[N];
+			unsigned int mCounts[N];
+			unsigned int mValid;		// Bit i is set when child i exists
+		};
+
+	protected:
+		typedef SimdLanes<N> Lanes;
+
+		// Binary node with bounds taken from its parent
+		class __declspec(align(16)) Candidate
+		{
+		public:
+			AABB mBounds;
+			unsigned int mNode;
+		};
+
+		Node* mNodes;
+		unsigned int mNodeCount;
+
+		TriangleBlock<N>* mBlocks;
+		unsigned int mBlockCount;
+
+		const unsigned int* mIndices;
+		const Triangle* mTriangles;
+
+		AABB mBounds;
+
+		// Opens the largest interior child until node is full, builds node and its subtrees
+		unsigned int Collapse(const BVH::LBVHNode* nodes, unsigned int node)
+		{
+			unsigned int index = mNodeCount++;
+
+			Candidate children[N];
+			unsigned int count = 2;
+			GetChildren(nodes, node, children[0], children[1]);
+
+			while (count < N)
+			{
+				int best = -1;
+				float best_area = -1.0f;
+				for (unsigned int i = 0; i < count; i++)
+				{
+					if (!nodes[children[i].mNode].mLeaf && children[i].mBounds.GetSurfaceArea() > best_area)
+					{
+						best = i;
+						best_area = children[i].mBounds.GetSurfaceArea();
+					}
+				}
+
+				if (best < 0)
+				{
+					break;
+				}
+
+				unsigned int opened = children[best].mNode;
+				GetChildren(nodes, opened, children[best], children[count]);
+				count++;
+			}
+
+			Node& n = mNodes[index];
+			for (unsigned int i = 0; i < N; i++)
+			{
+				const AABB b = i < count ? children[i].mBounds : AABB();
+				n.mMinX[i] = b.mMin.x;
+				n.mMaxX[i] = b.mMax.x;
+				n.mMinY[i] = b.mMin.y;
+				n.mMaxY[i] = b.mMax.y;
+				n.mMinZ[i] = b.mMin.z;
+				n.mMaxZ[i] = b.mMax.z;
+				n.mChildren[i] = EMPTY_CHILD;
+				n.mCounts[i] = 0;
+			}
+			n.mValid = (1u << count) - 1;
+
+			for (unsigned int i = 0; i < count; i++)
+			{
+				const BVH::LBVHNode& c = nodes[children[i].mNode];
+				if (c.mLeaf)
+				{
+					unsigned int first = Pack(c.mPrimitiveOffset, c.mPrimitiveCount);
+					mNodes[index].mChildren[i] = first | LEAF_FLAG;
+					mNodes[index].mCounts[i] = mBlockCount - first;
+				}
+				else
+				{
+					unsigned int child = Collapse(nodes, children[i].mNode);
+					mNodes[index].mChildren[i] = child;
+				}
+			}
+
+			return index;
+		}
+
+		// Packs leaf triangles into consecutive blocks, returns index of the first one
+		unsigned int Pack(unsigned int offset, unsigned int count)
+		{
+			unsigned int first = mBlockCount;
+			for (unsigned int k = 0; k < count; k++)
+			{
+				if (k % N == 0)
+				{
+					mBlocks[mBlockCount++] = TriangleBlock<N>();
+				}
+
+				unsigned int prim = mIndices[offset + k];
+				mBlocks[mBlockCount - 1].Set(k % N, mTriangles[prim], prim);
+			}
+
+			return first;
+		}
+
+		static void GetChildren(const BVH::LBVHNode* nodes, unsigned int node, Candidate& left, Candidate& right)
+		{
+			const BVH::LBVHNode& n = nodes[node];
+
+			left.mNode = node + 1;
+			left.mBounds.mMin = float4(n.mLXY.x, n.mLXY.z, n.mLRZ.x, 0.0f);
+			left.mBounds.mMax = float4(n.mLXY.y, n.mLXY.w, n.mLRZ.y, 0.0f);
+
+			right.mNode = n.mPrimitiveOffset;
+			right.mBounds.mMin = float4(n.mRXY.x, n.mRXY.z, n.mLRZ.z, 0.0f);
+			right.mBounds.mMax = float4(n.mRXY.y, n.mRXY.w, n.mLRZ.w, 0.0f);
+		}
+
+	public:
+		WideBVH(BVH* bvh, const Triangle* triangles)
+		{
+			mTriangles = triangles;
+
+			// Every wide node consumes at least one binary interior node, every leaf wastes less
+			// than one block
+			size_t capacity = bvh->GetNodeCount() / 2 + 1;
+			mNodes = (Node*)_aligned_malloc(sizeof(Node) * capacity, 64);
+			mNodeCount = 0;
+
+			size_t blocks = bvh->GetIndexCount() / N + capacity + 1;
+			mBlocks = (TriangleBlock<N>*)_aligned_malloc(sizeof(TriangleBlock<N>) * blocks, 64);
+			mBlockCount = 0;
+
+			Update(bvh);
+
+			std::cout << "\tWide BVH" << N << " nodes: " << mNodeCount << ", triangle blocks: " << mBlockCount << std::endl;
+		}
+
+		~WideBVH()
+		{
+			_aligned_free(mNodes);
+			_aligned_free(mBlocks);
+		}
+
+		// Collapses refitted binary tree again and repacks moved triangles, its topology must be the
+		// one wide tree was built from
+		void Update(BVH* bvh)
+		{
+			const BVH::LBVHNode* nodes = (const BVH::LBVHNode*)bvh->GetNodes();
+			mIndices = bvh->GetIndices();
+			mBounds = bvh->GetAABB();
+			mNodeCount = 0;
+			mBlockCount = 0;
+
+			if (bvh->GetNodeCount() == 0)
+			{
+				return;
+			}
+
+			if (nodes[0].mLeaf)
+			{
+				// Single leaf tree still gets root node, so that traversal starts the same way
+				Node& n = mNodes[mNodeCount++];
+				for (unsigned int i = 0; i < N; i++)
+				{
+					const AABB b = i == 0 ? mBounds : AABB();
+					n.mMinX[i] = b.mMin.x;
+					n.mMaxX[i] = b.mMax.x;
+					n.mMinY[i] = b.mMin.y;
+					n.mMaxY[i] = b.mMax.y;
+					n.mMinZ[i] = b.mMin.z;
+					n.mMaxZ[i] = b.mMax.z;
+					n.mChildren[i] = EMPTY_CHILD;
+					n.mCounts[i] = 0;
+				}
+				n.mValid = 1;
+
+				unsigned int first = Pack(nodes[0].mPrimitiveOffset, nodes[0].mPrimitiveCount);
+				n.mChildren[0] = first | LEAF_FLAG;
+				n.mCounts[0] = mBlockCount - first;
+			}
+			else
+			{
+				Collapse(nodes, 0);
+			}
+		}
+
+		// Closest hit along the ray, barycentric coordinates and distance are in Intersection terms
+		bool Intersect(const Ray& r, float& distance, float4& barycentric, int& id) const
+		{
+			if (mNodeCount == 0)
+			{
+				return false;
+			}
+
+			const float4& o = r.GetOrigin();
+			const float4& d = r.GetDirection();
+
+			// Exact reciprocal, approximate one lets rays slip between adjacent boxes
+			const typename Lanes::Type ox = Lanes::Set(o.x);
+			const typename Lanes::Type oy = Lanes::Set(o.y);
+			const typename Lanes::Type oz = Lanes::Set(o.z);
+			const typename Lanes::Type ix = Lanes::Set(1.0f / d.x);
+			const typename Lanes::Type iy = Lanes::Set(1.0f / d.y);
+			const typename Lanes::Type iz = Lanes::Set(1.0f / d.z);
+
+			Intersection isect;
+			float best = distance;
+			id = -1;
+
+			unsigned int stack[STACK_SIZE];
+			float stack_near[STACK_SIZE];
+			unsigned int stack_ptr = 0;
+			stack[stack_ptr] = 0;
+			stack_near[stack_ptr] = 0.0f;
+			stack_ptr++;
+
+			__declspec(align(64)) float near[N];
+
+			while (stack_ptr != 0)
+			{
+				stack_ptr--;
+				if (stack_near[stack_ptr] > best)
+				{
+					continue;
+				}
+
+				const Node& n = mNodes[stack[stack_ptr]];
+
+				typename Lanes::Type x0 = Lanes::Mul(Lanes::Sub(Lanes::Load(n.mMinX), ox), ix);
+				typename Lanes::Type x1 = Lanes::Mul(Lanes::Sub(Lanes::Load(n.mMaxX), ox), ix);
+				typename Lanes::Type y0 = Lanes::Mul(Lanes::Sub(Lanes::Load(n.mMinY), oy), iy);
+				typename Lanes::Type y1 = Lanes::Mul(Lanes::Sub(Lanes::Load(n.mMaxY), oy), iy);
+				typename Lanes::Type z0 = Lanes::Mul(Lanes::Sub(Lanes::Load(n.mMinZ), oz), iz);
+				typename Lanes::Type z1 = Lanes::Mul(Lanes::Sub(Lanes::Load(n.mMaxZ), oz), iz);
+
+				typename Lanes::Type enter = Lanes::Max(Lanes::Max(Lanes::Min(x0, x1), Lanes::Min(y0, y1)), Lanes::Max(Lanes::Min(z0, z1), Lanes::Set(0.0f)));
+				typename Lanes::Type exit = Lanes::Min(Lanes::Min(Lanes::Max(x0, x1), Lanes::Max(y0, y1)), Lanes::Min(Lanes::Max(z0, z1), Lanes::Set(best)));
+				int mask = Lanes::LessEqual(enter, exit) & n.mValid;
+
+				if (mask == 0)
+				{
+					continue;
+				}
+
+				Lanes::Store(near, enter);
+
+				// Hit children are pushed far to near, so that the nearest one is popped first
+				unsigned int first = stack_ptr;
+				for (unsigned int i = 0; i < N; i++)
+				{
+					if (!(mask & (1 << i)))
+					{
+						continue;
+					}
+
+					unsigned int child = n.mChildren[i];
+					if (child & LEAF_FLAG)
+					{
+						unsigned int offset = child & ~LEAF_FLAG;
+						for (unsigned int k = 0; k < n.mCounts[i]; k++)
+						{
+							isect.Intersect(mBlocks[offset + k], r, best, barycentric, id);
+						}
+						continue;
+					}
+
+					unsigned int slot = stack_ptr++;
+					while (slot > first && stack_near[slot - 1] < near[i])
+					{
+						stack[slot] = stack[slot - 1];
+						stack_near[slot] = stack_near[slot - 1];
+						slot--;
+					}
+					stack[slot] = child;
+					stack_near[slot] = near[i];
+				}
+			}
+
+			if (id < 0)
+			{
+				return false;
+			}
+
+			distance = best;
+			return true;
+		}
+
+		size_t GetNodeCount() { return mNodeCount; }
+
+		size_t GetBlockCount() { return mBlockCount; }
+
+		AABB& GetAABB() { return mBounds; }
+
+		void* operator new(size_t size)
+		{
+			return _aligned_malloc(size, 64);
+		}
+
+		void operator delete(void* ptr)
+		{
+			_aligned_free(ptr);
+		}
+	};
+
+	typedef WideBVH<4> BVH4;
+	typedef WideBVH<8> BVH8;
+	typedef WideBVH<16> BVH16;
+}
+
+#endif
@@ -2,6 +2,8 @@
 #define __INTERSECTION_H__
 
 #include "../Shapes/Ray.h"
+#include "../Shapes/RayPacket.h"
+#include "../Shapes/TriangleBlock.h"
 #include "../Shapes/AABB.h"
 #include "../Shapes/Triangle.h"
 
@@ -9,6 +11,7 @@ namespace OpenTracerCore
 {
 	class Intersection
 	{
+	public:
 		bool Intersect(const Triangle& t, const Ray& r, float4 &b, float &d) const
 		{
 			const float4 e1 = t.b - t.a;
@@ -70,6 +73,132 @@ namespace OpenTracerCore
 
 			return (exit > 0.0f && enter < exit);
 		}
+
+		// Ray against all triangles of the block at once (Woop test, same as trace kernels do it).
+		// Closest hit in (0, d) updates d, barycentric coordinates in Intersection terms and id.
+		template<unsigned int N>
+		bool Intersect(const TriangleBlock<N>& t, const Ray& r, float& d, float4& b, int& id) const
+		{
+			typedef typename TriangleBlock<N>::Lanes Lanes;
+			typedef typename TriangleBlock<N>::Vector Vector;
+
+			const Vector ox = Lanes::Set(r.mOrigin.x);
+			const Vector oy = Lanes::Set(r.mOrigin.y);
+			const Vector oz = Lanes::Set(r.mOrigin.z);
+			const Vector dx = Lanes::Set(r.mDirection.x);
+			const Vector dy = Lanes::Set(r.mDirection.y);
+			const Vector dz = Lanes::Set(r.mDirection.z);
+
+			const Vector* w = t.mRows[0];
+			const Vector* p = t.mRows[1];
+			const Vector* q = t.mRows[2];
+
+			const Vector o_z = w[3] - ox * w[0] - oy * w[1] - oz * w[2];
+			const Vector i_z = Lanes::Set(1.0f) / (dx * w[0] + dy * w[1] + dz * w[2]);
+			const Vector dist = o_z * i_z;
+
+			const Vector u = p[3] + ox * p[0] + oy * p[1] + oz * p[2] + dist * (dx * p[0] + dy * p[1] + dz * p[2]);
+			const Vector v = q[3] + ox * q[0] + oy * q[1] + oz * q[2] + dist * (dx * q[0] + dy * q[1] + dz * q[2]);
+
+			const Vector zero = Lanes::Set(0.0f);
+			const Vector one = Lanes::Set(1.0f);
+			int hits = Lanes::Less(zero, dist) & Lanes::Less(dist, Lanes::Set(d));
+			hits &= Lanes::LessEqual(zero, u) & Lanes::LessEqual(u, one);
+			hits &= Lanes::LessEqual(zero, v) & Lanes::LessEqual(u + v, one);
+			if (hits == 0)
+			{
+				return false;
+			}
+
+			int best = -1;
+			for (int i = 0; hits != 0; i++, hits >>= 1)
+			{
+				if ((hits & 1) && (best < 0 || dist[i] < dist[best]))
+				{
+					best = i;
+				}
+			}
+
+			// Woop weights belong to the first two vertices, Intersection ones to the last two
+			d = dist[best];
+			b = float4(v[best], 1.0f - u[best] - v[best], u[best], 0.0f);
+			id = (int)t.mIds[best];
+
+			return true;
+		}
+
+		// Packet variant of the triangle test, only lanes in mask with hit in (near, d) are updated.
+		// Barycentric rows b[0], b[1] hold per lane coordinates as above, returns updated lanes.
+		template<unsigned int N>
+		int Intersect(const Triangle& t, const RayPacket<N>& r, int mask, typename RayPacket<N>::Vector* b, typename RayPacket<N>::Vector& d) const
+		{
+			typedef typename RayPacket<N>::Lanes Lanes;
+			typedef typename RayPacket<N>::Vector Vector;
+
+			const float4 e1 = t.b - t.a;
+			const float4 e2 = t.c - t.a;
+
+			const Vector px = r.mDirection[1] * e2.z - r.mDirection[2] * e2.y;
+			const Vector py = r.mDirection[2] * e2.x - r.mDirection[0] * e2.z;
+			const Vector pz = r.mDirection[0] * e2.y - r.mDirection[1] * e2.x;
+
+			const Vector det = px * e1.x + py * e1.y + pz * e1.z;
+			const Vector inv_det = Lanes::Set(1.0f) / det;
+
+			const Vector tx = r.mOrigin[0] - t.a.x;
+			const Vector ty = r.mOrigin[1] - t.a.y;
+			const Vector tz = r.mOrigin[2] - t.a.z;
+
+			const Vector u = (tx * px + ty * py + tz * pz) * inv_det;
+
+			const Vector qx = ty * e1.z - tz * e1.y;
+			const Vector qy = tz * e1.x - tx * e1.z;
+			const Vector qz = tx * e1.y - ty * e1.x;
+
+			const Vector v = (r.mDirection[0] * qx + r.mDirection[1] * qy + r.mDirection[2] * qz) * inv_det;
+			const Vector dist = (qx * e2.x + qy * e2.y + qz * e2.z) * inv_det;
+
+			const Vector zero = Lanes::Set(0.0f);
+			const Vector one = Lanes::Set(1.0f);
+			// Only parallel rays are rejected, det scales with triangle area so any absolute cut-off
+			// would miss small triangles the Woop kernels hit
+			int hits = Lanes::Less(zero, abs(det)) & mask;
+			hits &= Lanes::LessEqual(zero, u) & Lanes::LessEqual(u, one);
+			hits &= Lanes::LessEqual(zero, v) & Lanes::LessEqual(u + v, one);
+			hits &= Lanes::Less(r.mNear, dist) & Lanes::Less(dist, d);
+			if (hits == 0)
+			{
+				return 0;
+			}
+
+			b[0] = Lanes::Select(hits, u, b[0]);
+			b[1] = Lanes::Select(hits, v, b[1]);
+			d = Lanes::Select(hits, dist, d);
+
+			return hits;
+		}
+
+		// Packet variant of the box test, returns lanes in mask whose [near, far] interval overlaps
+		// the box, the overlap is written to enter and exit
+		template<unsigned int N>
+		int Intersect(const AABB& b, const RayPacket<N>& r, int mask, const typename RayPacket<N>::Vector& near, const typename RayPacket<N>::Vector& far,
+			typename RayPacket<N>::Vector& enter, typename RayPacket<N>::Vector& exit) const
+		{
+			typedef typename RayPacket<N>::Lanes Lanes;
+			typedef typename RayPacket<N>::Vector Vector;
+
+			const Vector x0 = (Lanes::Set(b.mMin.x) - r.mOrigin[0]) * r.mInverse[0];
+			const Vector x1 = (Lanes::Set(b.mMax.x) - r.mOrigin[0]) * r.mInverse[0];
+			const Vector y0 = (Lanes::Set(b.mMin.y) - r.mOrigin[1]) * r.mInverse[1];
+			const Vector y1 = (Lanes::Set(b.mMax.y) - r.mOrigin[1]) * r.mInverse[1];
+			const Vector z0 = (Lanes::Set(b.mMin.z) - r.mOrigin[2]) * r.mInverse[2];
+			const Vector z1 = (Lanes::Set(b.mMax.z) - r.mOrigin[2]) * r.mInverse[2];
+
+			enter = Lanes::Max(Lanes::Max(Lanes::Min(x0, x1), Lanes::Min(y0, y1)), Lanes::Max(Lanes::Min(z0, z1), near));
+			exit = Lanes::Min(Lanes::Min(Lanes::Max(x0, x1), Lanes::Max(y0, y1)), Lanes::Min(Lanes::Max(z0, z1), far));
+
+			return Lanes::LessEqual(enter, exit) & mask;
+		}
 	};
 }
 
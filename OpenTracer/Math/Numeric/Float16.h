@@ -0,0 +1,300 @@
+#pragma once
+
+#include <immintrin.h>
+
+// AVX-512 intrinsics need VS 2017 or compiler targeting AVX-512, otherwise float16 is a pair of
+// AVX registers - same results, half of the throughput
+#if (defined(_MSC_VER) && _MSC_VER >= 1911) || defined(__AVX512F__)
+#define FLOAT16_USE_AVX512
+#endif
+
+namespace OpenTracerCore
+{
+	// Sixteen floats in one AVX-512 register (two AVX registers when AVX-512 is not available to
+	// the compiler). Code using it is selected at runtime only on CPUs supporting AVX-512.
+	struct __declspec(align(64)) float16
+	{
+#ifdef FLOAT16_USE_AVX512
+		union
+		{
+			float f[16];
+			__m512 zmm;
+		};
+#else
+		union
+		{
+			float f[16];
+			struct
+			{
+				__m256 lo, hi;
+			};
+		};
+#endif
+
+		///////////////////////////////////////////////////////////////////////////////////////////////////
+		/** Constructors                                                                                **/
+
+		/* Default constructor */
+		inline float16()
+		{
+#ifdef FLOAT16_USE_AVX512
+			zmm = _mm512_setzero_ps();
+#else
+			lo = hi = _mm256_setzero_ps();
+#endif
+		}
+
+		/* Float constructor */
+		explicit inline float16(float v)
+		{
+#ifdef FLOAT16_USE_AVX512
+			zmm = _mm512_set1_ps(v);
+#else
+			lo = hi = _mm256_set1_ps(v);
+#endif
+		}
+
+		/* Array constructor (unaligned!!!) */
+		inline float16(const float* fv)
+		{
+#ifdef FLOAT16_USE_AVX512
+			zmm = _mm512_loadu_ps(fv);
+#else
+			lo = _mm256_loadu_ps(fv);
+			hi = _mm256_loadu_ps(fv + 8);
+#endif
+		}
+
+		/* Copy constructor */
+		inline float16(const float16& v)
+		{
+#ifdef FLOAT16_USE_AVX512
+			zmm = v.zmm;
+#else
+			lo = v.lo;
+			hi = v.hi;
+#endif
+		}
+
+#ifdef FLOAT16_USE_AVX512
+		/* AVX-512 constructor */
+		inline float16(const __m512& _m)
+		{
+			zmm = _m;
+		}
+#else
+		/* Halves constructor */
+		inline float16(const __m256& _lo, const __m256& _hi)
+		{
+			lo = _lo;
+			hi = _hi;
+		}
+#endif
+
+		///////////////////////////////////////////////////////////////////////////////////////////////////
+		/** Accessing                                                                                   **/
+
+		/* Direct access write */
+		inline float& operator[](int index)
+		{
+			return f[index];
+		}
+
+		/* Direct access read */
+		inline const float& operator[](int index) const
+		{
+			return f[index];
+		}
+
+		///////////////////////////////////////////////////////////////////////////////////////////////////
+		/** Unary arithmetics                                                                           **/
+
+		friend inline float16& operator += (float16& v0, const float16& v1)
+		{
+#ifdef FLOAT16_USE_AVX512
+			v0.zmm = _mm512_add_ps(v0.zmm, v1.zmm);
+#else
+			v0.lo = _mm256_add_ps(v0.lo, v1.lo);
+			v0.hi = _mm256_add_ps(v0.hi, v1.hi);
+#endif
+			return v0;
+		}
+
+		friend inline float16& operator -= (float16& v0, const float16& v1)
+		{
+#ifdef FLOAT16_USE_AVX512
+			v0.zmm = _mm512_sub_ps(v0.zmm, v1.zmm);
+#else
+			v0.lo = _mm256_sub_ps(v0.lo, v1.lo);
+			v0.hi = _mm256_sub_ps(v0.hi, v1.hi);
+#endif
+			return v0;
+		}
+
+		friend inline float16& operator *= (float16& v0, const float16& v1)
+		{
+#ifdef FLOAT16_USE_AVX512
+			v0.zmm = _mm512_mul_ps(v0.zmm, v1.zmm);
+#else
+			v0.lo = _mm256_mul_ps(v0.lo, v1.lo);
+			v0.hi = _mm256_mul_ps(v0.hi, v1.hi);
+#endif
+			return v0;
+		}
+
+		friend inline const float16 operator - (const float16& v)
+		{
+#ifdef FLOAT16_USE_AVX512
+			return _mm512_sub_ps(_mm512_setzero_ps(), v.zmm);
+#else
+			return float16(_mm256_xor_ps(v.lo, _mm256_set1_ps(-0.0f)), _mm256_xor_ps(v.hi, _mm256_set1_ps(-0.0f)));
+#endif
+		}
+
+		///////////////////////////////////////////////////////////////////////////////////////////////////
+		/** Binary arithmetics                                                                          **/
+
+		/* Addition */
+		friend inline const float16 operator + (float f, const float16& v)
+		{
+			return float16(f) + v;
+		}
+
+		friend inline const float16 operator + (const float16& v, float f)
+		{
+			return v + float16(f);
+		}
+
+		friend inline const float16 operator + (const float16& v0, const float16& v1)
+		{
+#ifdef FLOAT16_USE_AVX512
+			return _mm512_add_ps(v0.zmm, v1.zmm);
+#else
+			return float16(_mm256_add_ps(v0.lo, v1.lo), _mm256_add_ps(v0.hi, v1.hi));
+#endif
+		}
+
+		/* Substraction */
+		friend inline const float16 operator - (float f, const float16& v)
+		{
+			return float16(f) - v;
+		}
+
+		friend inline const float16 operator - (const float16& v, float f)
+		{
+			return v - float16(f);
+		}
+
+		friend inline const float16 operator - (const float16& v0, const float16& v1)
+		{
+#ifdef FLOAT16_USE_AVX512
+			return _mm512_sub_ps(v0.zmm, v1.zmm);
+#else
+			return float16(_mm256_sub_ps(v0.lo, v1.lo), _mm256_sub_ps(v0.hi, v1.hi));
+#endif
+		}
+
+		/* Multiplication */
+		friend inline const float16 operator * (float f, const float16& v)
+		{
+			return float16(f) * v;
+		}
+
+		friend inline const float16 operator * (const float16& v, float f)
+		{
+			return v * float16(f);
+		}
+
+		friend inline const float16 operator * (const float16& v0, const float16& v1)
+		{
+#ifdef FLOAT16_USE_AVX512
+			return _mm512_mul_ps(v0.zmm, v1.zmm);
+#else
+			return float16(_mm256_mul_ps(v0.lo, v1.lo), _mm256_mul_ps(v0.hi, v1.hi));
+#endif
+		}
+
+		/* Division */
+		friend inline const float16 operator / (float f, const float16& v)
+		{
+			return float16(f) / v;
+		}
+
+		friend inline const float16 operator / (const float16& v, float f)
+		{
+			return v / float16(f);
+		}
+
+		friend inline const float16 operator / (const float16& v0, const float16& v1)
+		{
+#ifdef FLOAT16_USE_AVX512
+			return _mm512_div_ps(v0.zmm, v1.zmm);
+#else
+			return float16(_mm256_div_ps(v0.lo, v1.lo), _mm256_div_ps(v0.hi, v1.hi));
+#endif
+		}
+
+		///////////////////////////////////////////////////////////////////////////////////////////////////
+		/** Additional arithmetics                                                                      **/
+
+		/* Reciprocal */
+		inline friend float16 rcp(const float16& a)
+		{
+#ifdef FLOAT16_USE_AVX512
+			return _mm512_rcp14_ps(a.zmm);
+#else
+			return float16(_mm256_rcp_ps(a.lo), _mm256_rcp_ps(a.hi));
+#endif
+		}
+
+		/* Absolute value */
+		friend inline const float16 abs(const float16& v)
+		{
+#ifdef FLOAT16_USE_AVX512
+			return _mm512_max_ps(v.zmm, _mm512_sub_ps(_mm512_setzero_ps(), v.zmm));
+#else
+			return float16(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), v.lo), _mm256_andnot_ps(_mm256_set1_ps(-0.0f), v.hi));
+#endif
+		}
+
+		/* Minimum */
+		friend inline const float16 f16min(const float16& v0, const float16& v1)
+		{
+#ifdef FLOAT16_USE_AVX512
+			return _mm512_min_ps(v0.zmm, v1.zmm);
+#else
+			return float16(_mm256_min_ps(v0.lo, v1.lo), _mm256_min_ps(v0.hi, v1.hi));
+#endif
+		}
+
+		/* Maximum */
+		friend inline const float16 f16max(const float16& v0, const float16& v1)
+		{
+#ifdef FLOAT16_USE_AVX512
+			return _mm512_max_ps(v0.zmm, v1.zmm);
+#else
+			return float16(_mm256_max_ps(v0.lo, v1.lo), _mm256_max_ps(v0.hi, v1.hi));
+#endif
+		}
+
+		void* operator new(size_t size)
+		{
+			return _aligned_malloc(size, 64);
+		}
+
+		void* operator new[](size_t size)
+		{
+			return _aligned_malloc(size, 64);
+		}
+
+		void operator delete(void* ptr)
+		{
+			_aligned_free(ptr);
+		}
+
+		void operator delete[](void* ptr)
+		{
+			_aligned_free(ptr);
+		}
+	};
+}
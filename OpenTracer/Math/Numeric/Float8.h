@@ -0,0 +1,206 @@
+#pragma once
+
+#include <math.h>
+#include <immintrin.h>
+
+namespace OpenTracerCore
+{
+	// Eight floats in one AVX register. Unlike float4 there is no scalar fallback, code using it is
+	// selected at runtime only on CPUs supporting AVX2 (see Util/CPU.h).
+	struct __declspec(align(32)) float8
+	{
+		union
+		{
+			float f[8];
+			__m256 ymm;
+		};
+
+		///////////////////////////////////////////////////////////////////////////////////////////////////
+		/** Constructors                                                                                **/
+
+		/* Default constructor */
+		inline float8()
+		{
+			ymm = _mm256_setzero_ps();
+		}
+
+		/* Float constructor */
+		explicit inline float8(float v)
+		{
+			ymm = _mm256_set1_ps(v);
+		}
+
+		/* Array constructor (unaligned!!!) */
+		inline float8(const float* fv)
+		{
+			ymm = _mm256_loadu_ps(fv);
+		}
+
+		/* Copy constructor */
+		inline float8(const float8& v)
+		{
+			ymm = v.ymm;
+		}
+
+		/* AVX constructor */
+		inline float8(const __m256& _m)
+		{
+			ymm = _m;
+		}
+
+		///////////////////////////////////////////////////////////////////////////////////////////////////
+		/** Accessing                                                                                   **/
+
+		/* Direct access write */
+		inline float& operator[](int index)
+		{
+			return f[index];
+		}
+
+		/* Direct access read */
+		inline const float& operator[](int index) const
+		{
+			return f[index];
+		}
+
+		///////////////////////////////////////////////////////////////////////////////////////////////////
+		/** Unary arithmetics                                                                           **/
+
+		friend inline float8& operator += (float8& v0, const float8& v1)
+		{
+			v0.ymm = _mm256_add_ps(v0.ymm, v1.ymm);
+			return v0;
+		}
+
+		friend inline float8& operator -= (float8& v0, const float8& v1)
+		{
+			v0.ymm = _mm256_sub_ps(v0.ymm, v1.ymm);
+			return v0;
+		}
+
+		friend inline float8& operator *= (float8& v0, const float8& v1)
+		{
+			v0.ymm = _mm256_mul_ps(v0.ymm, v1.ymm);
+			return v0;
+		}
+
+		friend inline const float8 operator - (const float8& v)
+		{
+			return _mm256_xor_ps(v.ymm, _mm256_set1_ps(-0.0f));
+		}
+
+		///////////////////////////////////////////////////////////////////////////////////////////////////
+		/** Binary arithmetics                                                                          **/
+
+		/* Addition */
+		friend inline const float8 operator + (float f, const float8& v)
+		{
+			return _mm256_add_ps(_mm256_set1_ps(f), v.ymm);
+		}
+
+		friend inline const float8 operator + (const float8& v, float f)
+		{
+			return _mm256_add_ps(v.ymm, _mm256_set1_ps(f));
+		}
+
+		friend inline const float8 operator + (const float8& v0, const float8& v1)
+		{
+			return _mm256_add_ps(v0.ymm, v1.ymm);
+		}
+
+		/* Substraction */
+		friend inline const float8 operator - (float f, const float8& v)
+		{
+			return _mm256_sub_ps(_mm256_set1_ps(f), v.ymm);
+		}
+
+		friend inline const float8 operator - (const float8& v, float f)
+		{
+			return _mm256_sub_ps(v.ymm, _mm256_set1_ps(f));
+		}
+
+		friend inline const float8 operator - (const float8& v0, const float8& v1)
+		{
+			return _mm256_sub_ps(v0.ymm, v1.ymm);
+		}
+
+		/* Multiplication */
+		friend inline const float8 operator * (float f, const float8& v)
+		{
+			return _mm256_mul_ps(_mm256_set1_ps(f), v.ymm);
+		}
+
+		friend inline const float8 operator * (const float8& v, float f)
+		{
+			return _mm256_mul_ps(v.ymm, _mm256_set1_ps(f));
+		}
+
+		friend inline const float8 operator * (const float8& v0, const float8& v1)
+		{
+			return _mm256_mul_ps(v0.ymm, v1.ymm);
+		}
+
+		/* Division */
+		friend inline const float8 operator / (float f, const float8& v)
+		{
+			return _mm256_div_ps(_mm256_set1_ps(f), v.ymm);
+		}
+
+		friend inline const float8 operator / (const float8& v, float f)
+		{
+			return _mm256_div_ps(v.ymm, _mm256_set1_ps(f));
+		}
+
+		friend inline const float8 operator / (const float8& v0, const float8& v1)
+		{
+			return _mm256_div_ps(v0.ymm, v1.ymm);
+		}
+
+		///////////////////////////////////////////////////////////////////////////////////////////////////
+		/** Additional arithmetics                                                                      **/
+
+		/* Reciprocal */
+		inline friend float8 rcp(const float8& a)
+		{
+			return _mm256_rcp_ps(a.ymm);
+		}
+
+		/* Absolute value */
+		friend inline const float8 abs(const float8& v)
+		{
+			return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), v.ymm);
+		}
+
+		/* Minimum */
+		friend inline const float8 f8min(const float8& v0, const float8& v1)
+		{
+			return _mm256_min_ps(v0.ymm, v1.ymm);
+		}
+
+		/* Maximum */
+		friend inline const float8 f8max(const float8& v0, const float8& v1)
+		{
+			return _mm256_max_ps(v0.ymm, v1.ymm);
+		}
+
+		void* operator new(size_t size)
+		{
+			return _aligned_malloc(size, 32);
+		}
+
+		void* operator new[](size_t size)
+		{
+			return _aligned_malloc(size, 32);
+		}
+
+		void operator delete(void* ptr)
+		{
+			_aligned_free(ptr);
+		}
+
+		void operator delete[](void* ptr)
+		{
+			_aligned_free(ptr);
+		}
+	};
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "Float4.h"
+#include "Float8.h"
+#include "Float16.h"
+
+namespace OpenTracerCore
+{
+	// SIMD operations over N lanes shared by wide trees and ray packets. Comparisons return lane
+	// bitmasks (bit i belongs to lane i), so that code built on top is the same for every width.
+	template<unsigned int N>
+	struct SimdLanes;
+
+	template<>
+	struct SimdLanes<4>
+	{
+		typedef float4 Type;
+
+		static Type Load(const float* p) { return _mm_load_ps(p); }
+		static Type Set(float f) { return float4(f); }
+		static Type Sub(const Type& a, const Type& b) { return a - b; }
+		static Type Mul(const Type& a, const Type& b) { return a * b; }
+		static Type Min(const Type& a, const Type& b) { return f4min(a, b); }
+		static Type Max(const Type& a, const Type& b) { return f4max(a, b); }
+		static int Less(const Type& a, const Type& b) { return _mm_movemask_ps(_mm_cmplt_ps(a.xmm, b.xmm)); }
+		static int LessEqual(const Type& a, const Type& b) { return _mm_movemask_ps(_mm_cmple_ps(a.xmm, b.xmm)); }
+		static void Store(float* p, const Type& a) { _mm_store_ps(p, a.xmm); }
+
+		// Lanes of a where mask is set, lanes of b elsewhere
+		static Type Select(int mask, const Type& a, const Type& b)
+		{
+			const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+			__m128 m = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(mask), bits), bits));
+			return _mm_blendv_ps(b.xmm, a.xmm, m);
+		}
+	};
+
+	template<>
+	struct SimdLanes<8>
+	{
+		typedef float8 Type;
+
+		static Type Load(const float* p) { return _mm256_load_ps(p); }
+		static Type Set(float f) { return float8(f); }
+		static Type Sub(const Type& a, const Type& b) { return a - b; }
+		static Type Mul(const Type& a, const Type& b) { return a * b; }
+		static Type Min(const Type& a, const Type& b) { return f8min(a, b); }
+		static Type Max(const Type& a, const Type& b) { return f8max(a, b); }
+		static int Less(const Type& a, const Type& b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.ymm, b.ymm, _CMP_LT_OQ)); }
+		static int LessEqual(const Type& a, const Type& b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.ymm, b.ymm, _CMP_LE_OQ)); }
+		static void Store(float* p, const Type& a) { _mm256_store_ps(p, a.ymm); }
+
+		static Type Select(int mask, const Type& a, const Type& b)
+		{
+			const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+			__m256 m = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), bits), bits));
+			return _mm256_blendv_ps(b.ymm, a.ymm, m);
+		}
+	};
+
+	template<>
+	struct SimdLanes<16>
+	{
+		typedef float16 Type;
+
+#ifdef FLOAT16_USE_AVX512
+		static Type Load(const float* p) { return _mm512_load_ps(p); }
+		static int Less(const Type& a, const Type& b) { return (int)_mm512_cmp_ps_mask(a.zmm, b.zmm, _CMP_LT_OQ); }
+		static int LessEqual(const Type& a, const Type& b) { return (int)_mm512_cmp_ps_mask(a.zmm, b.zmm, _CMP_LE_OQ); }
+		static void Store(float* p, const Type& a) { _mm512_store_ps(p, a.zmm); }
+		static Type Select(int mask, const Type& a, const Type& b) { return _mm512_mask_blend_ps((__mmask16)mask, b.zmm, a.zmm); }
+#else
+		static Type Load(const float* p) { return float16(_mm256_load_ps(p), _mm256_load_ps(p + 8)); }
+
+		static int Less(const Type& a, const Type& b)
+		{
+			return SimdLanes<8>::Less(a.lo, b.lo) | (SimdLanes<8>::Less(a.hi, b.hi) << 8);
+		}
+
+		static int LessEqual(const Type& a, const Type& b)
+		{
+			return SimdLanes<8>::LessEqual(a.lo, b.lo) | (SimdLanes<8>::LessEqual(a.hi, b.hi) << 8);
+		}
+
+		static void Store(float* p, const Type& a)
+		{
+			_mm256_store_ps(p, a.lo);
+			_mm256_store_ps(p + 8, a.hi);
+		}
+
+		static Type Select(int mask, const Type& a, const Type& b)
+		{
+			return float16(SimdLanes<8>::Select(mask & 0xFF, a.lo, b.lo).ymm, SimdLanes<8>::Select(mask >> 8, a.hi, b.hi).ymm);
+		}
+#endif
+
+		static Type Set(float f) { return float16(f); }
+		static Type Sub(const Type& a, const Type& b) { return a - b; }
+		static Type Mul(const Type& a, const Type& b) { return a * b; }
+		static Type Min(const Type& a, const Type& b) { return f16min(a, b); }
+		static Type Max(const Type& a, const Type& b) { return f16max(a, b); }
+	};
+}
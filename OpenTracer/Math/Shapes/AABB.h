@@ -46,10 +46,15 @@ namespace OpenTracerCore
 		float GetSurfaceArea() const
 		{
 			float4 d = this->mMax - this->mMin;
-			const float4 d_s = hadd(float4(d.x, d.x, d.y, d.w) * float4(d.y, d.z, d.z, d.w));
+			const float4 d_s = hadd(float4(d.x, d.x, d.y, 0.0f) * float4(d.y, d.z, d.z, 0.0f));
 			return d_s.x;
 		}
 
+		bool IsEmpty() const
+		{
+			return (this->mMin.x > this->mMax.x || this->mMin.y > this->mMax.y || this->mMin.z > this->mMax.z);
+		}
+
 		void Expand(float f)
 		{
 			this->mMin -= float4(f, f, f, 0.0f);
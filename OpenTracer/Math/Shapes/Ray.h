@@ -22,6 +22,9 @@ namespace OpenTracerCore
 			this->mInverse = rcp(this->mDirection);
 		}
 
+		const float4& GetOrigin() const { return this->mOrigin; }
+		const float4& GetDirection() const { return this->mDirection; }
+
 		void* operator new(size_t size)
 		{
 			return _aligned_malloc(size, 16);
@@ -0,0 +1,89 @@
+#ifndef _RAY_PACKET_H
+#define _RAY_PACKET_H
+
+#include "../Numeric/Lanes.h"
+
+namespace OpenTracerCore
+{
+	class Intersection;
+
+	// N rays stored per component (SoA), lane i of every vector belongs to ray i. Rays of one
+	// packet are expected to be coherent (e.g. block of pixels), traversal visits union of their
+	// nodes. N is 4 (SSE), 8 (AVX2) or 16 (AVX-512), see SimdLanes.
+	template<unsigned int N>
+	class __declspec(align(64)) RayPacket
+	{
+	public:
+		typedef SimdLanes<N> Lanes;
+		typedef typename Lanes::Type Vector;
+
+		enum { SIZE = N };
+		enum { ALL_LANES = (1 << N) - 1 };
+
+		// Pixel footprint of the packet - 2x2, 4x2 or 4x4, lane index is x + y * WIDTH
+		enum { WIDTH = N == 4 ? 2 : 4 };
+		enum { HEIGHT = N / WIDTH };
+
+	private:
+		Vector mOrigin[3];
+		Vector mDirection[3];
+		Vector mInverse[3];
+		Vector mNear;
+		Vector mFar;
+
+	public:
+		RayPacket()
+		{
+		}
+
+		// Direction is normalized, inverse is exact - approximate one lets rays slip between boxes
+		void Set(int lane, const float4& origin, const float4& direction, float near, float far)
+		{
+			float4 d = normalize(direction);
+			for (int i = 0; i < 3; i++)
+			{
+				this->mOrigin[i][lane] = origin[i];
+				this->mDirection[i][lane] = d[i];
+				this->mInverse[i][lane] = 1.0f / d[i];
+			}
+			this->mNear[lane] = near;
+			this->mFar[lane] = far;
+		}
+
+		const Vector& GetOrigin(unsigned int axis) const { return this->mOrigin[axis]; }
+		const Vector& GetDirection(unsigned int axis) const { return this->mDirection[axis]; }
+		const Vector& GetInverse(unsigned int axis) const { return this->mInverse[axis]; }
+		const Vector& GetNear() const { return this->mNear; }
+		const Vector& GetFar() const { return this->mFar; }
+
+		// Lanes in mask with negative direction along given axis
+		int GetNegativeMask(unsigned int axis, int mask) const
+		{
+			return Lanes::Less(this->mDirection[axis], Lanes::Set(0.0f)) & mask;
+		}
+
+		void* operator new(size_t size)
+		{
+			return _aligned_malloc(size, 64);
+		}
+
+		void* operator new[](size_t size)
+		{
+			return _aligned_malloc(size, 64);
+		}
+
+		void operator delete(void* ptr)
+		{
+			_aligned_free(ptr);
+		}
+
+		void operator delete[](void* ptr)
+		{
+			_aligned_free(ptr);
+		}
+
+		friend class Intersection;
+	};
+}
+
+#endif
@@ -35,6 +35,131 @@ namespace OpenTracerCore
 			return r;
 		}
 
+		// Bounds of the part of triangle inside the box, clipped with Sutherland-Hodgman against
+		// all six box planes. Empty box is returned when triangle does not overlap the box.
+		AABB GetClippedBounds(const AABB& box) const
+		{
+			// Every plane adds at most one vertex
+			float4 poly[2][9];
+			int count = 3;
+			int src = 0;
+
+			poly[0][0] = this->a;
+			poly[0][1] = this->b;
+			poly[0][2] = this->c;
+
+			for (int axis = 0; axis < 3; axis++)
+			{
+				for (int side = 0; side < 2; side++)
+				{
+					float plane = side == 0 ? box.mMin[axis] : box.mMax[axis];
+					float sign = side == 0 ? 1.0f : -1.0f;
+					int dst = 1 - src;
+					int clipped = 0;
+
+					for (int i = 0; i < count; i++)
+					{
+						const float4& p = poly[src][i];
+						const float4& q = poly[src][(i + 1) % count];
+						float dp = sign * (p[axis] - plane);
+						float dq = sign * (q[axis] - plane);
+
+						if (dp >= 0.0f)
+						{
+							poly[dst][clipped++] = p;
+						}
+
+						if ((dp >= 0.0f) != (dq >= 0.0f))
+						{
+							float4 r = p + (q - p) * (dp / (dp - dq));
+							r[axis] = plane;
+							poly[dst][clipped++] = r;
+						}
+					}
+
+					count = clipped;
+					src = dst;
+
+					if (count == 0)
+					{
+						return AABB();
+					}
+				}
+			}
+
+			AABB r = AABB(poly[src][0]);
+			for (int i = 1; i < count; i++)
+			{
+				r.Union(poly[src][i]);
+			}
+
+			// Guard against interpolation round-off leaving the box
+			r.mMin = f4max(r.mMin, box.mMin);
+			r.mMax = f4min(r.mMax, box.mMax);
+
+			return r;
+		}
+
+		// Splits bounds of a part of triangle by axis aligned plane - vertices go to their side, edges
+		// crossing the plane add the crossing point to both. Results are clamped to the given bounds,
+		// so repeated splits only ever walk the three edges.
+		void SplitBounds(const AABB& bounds, unsigned int axis, float plane, AABB* left, AABB* right) const
+		{
+			*left = AABB();
+			*right = AABB();
+
+			const float4* v[3] = { &this->a, &this->b, &this->c };
+			for (int i = 0; i < 3; i++)
+			{
+				const float4& p = *v[i];
+				const float4& q = *v[(i + 1) % 3];
+				float pa = p[axis];
+				float qa = q[axis];
+
+				if (pa <= plane)
+				{
+					left->Union(p);
+				}
+
+				if (pa >= plane)
+				{
+					right->Union(p);
+				}
+
+				if ((pa < plane && qa > plane) || (pa > plane && qa < plane))
+				{
+					float4 t = p + (q - p) * ((plane - pa) / (qa - pa));
+					left->Union(t);
+					right->Union(t);
+				}
+			}
+
+			left->mMax[axis] = plane;
+			right->mMin[axis] = plane;
+			left->mMin = f4max(left->mMin, bounds.mMin);
+			left->mMax = f4min(left->mMax, bounds.mMax);
+			right->mMin = f4max(right->mMin, bounds.mMin);
+			right->mMax = f4min(right->mMax, bounds.mMax);
+		}
+
+		// Rows of the affine transform mapping triangle to unit one (Woop), as trace kernels read
+		// them - out[0] gives distance, out[1] and out[2] weights of the first two vertices
+		void Woopify(float4* out) const
+		{
+			float4 e0 = this->a - this->c;
+			float4 e1 = this->b - this->c;
+			float4 n = cross(e0, e1);
+
+			mat4 m = inverse(mat4(e0.x, e1.x, n.x, this->c.x,
+				e0.y, e1.y, n.y, this->c.y,
+				e0.z, e1.z, n.z, this->c.z,
+				0.0f, 0.0f, 0.0f, 1.0f));
+
+			out[0] = m[2] * float4(1.0f, 1.0f, 1.0f, -1.0f);
+			out[1] = m[0];
+			out[2] = m[1];
+		}
+
 		void* operator new(size_t size)
 		{
 			return _aligned_malloc(size, 16);
@@ -0,0 +1,89 @@
+#ifndef __TRIANGLE_BLOCK_H__
+#define __TRIANGLE_BLOCK_H__
+
+#include "../Numeric/Lanes.h"
+#include "Triangle.h"
+
+namespace OpenTracerCore
+{
+	class Intersection;
+
+	// N triangles in Woop form stored per component (SoA), so that one ray is tested against all
+	// of them at once. Rows are the ones uploaded for trace kernels (see Triangle::Woopify). Unused
+	// lanes have zero rows, which give NaN distance and never hit.
+	template<unsigned int N>
+	class __declspec(align(64)) TriangleBlock
+	{
+	public:
+		typedef SimdLanes<N> Lanes;
+		typedef typename Lanes::Type Vector;
+
+		enum { SIZE = N };
+		enum { EMPTY_LANE = 0xFFFFFFFF };
+
+	private:
+		Vector mRows[3][4];
+		unsigned int mIds[N];
+
+	public:
+		TriangleBlock()
+		{
+			for (unsigned int i = 0; i < N; i++)
+			{
+				this->mIds[i] = EMPTY_LANE;
+			}
+		}
+
+		void Set(unsigned int lane, const Triangle& t, unsigned int id)
+		{
+			float4 rows[3];
+			t.Woopify(rows);
+			for (int i = 0; i < 3; i++)
+			{
+				for (int j = 0; j < 4; j++)
+				{
+					this->mRows[i][j][lane] = rows[i][j];
+				}
+			}
+			this->mIds[lane] = id;
+		}
+
+		void Clear(unsigned int lane)
+		{
+			for (int i = 0; i < 3; i++)
+			{
+				for (int j = 0; j < 4; j++)
+				{
+					this->mRows[i][j][lane] = 0.0f;
+				}
+			}
+			this->mIds[lane] = EMPTY_LANE;
+		}
+
+		unsigned int GetId(unsigned int lane) const { return this->mIds[lane]; }
+
+		void* operator new(size_t size)
+		{
+			return _aligned_malloc(size, 64);
+		}
+
+		void* operator new[](size_t size)
+		{
+			return _aligned_malloc(size, 64);
+		}
+
+		void operator delete(void* ptr)
+		{
+			_aligned_free(ptr);
+		}
+
+		void operator delete[](void* ptr)
+		{
+			_aligned_free(ptr);
+		}
+
+		friend class Intersection;
+	};
+}
+
+#endif
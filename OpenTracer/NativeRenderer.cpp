@@ -0,0 +1,652 @@
+#include "NativeRenderer.h"
+#include "Math/Shapes/RayPacket.h"
+#include "Math/Intersection/Intersection.h"
+#include "Util/CPU.h"
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <algorithm>
+#include <memory>
+
+using namespace OpenTracerCore;
+
+// Same bound as BVH_STACK_SIZE in Renderer.cl, see BVH::MAX_DEPTH
+#define NATIVE_STACK_SIZE 64
+
+// Node layout of KD-tree as seen by traversal (see KDNode in Renderer.cl)
+struct NativeKDNode
+{
+	union
+	{
+		float mSplit;
+		unsigned int mPrimitiveOffset;
+	};
+
+	unsigned int mFlags;
+};
+
+// See KDTree::NodeLayout
+#define NATIVE_KD_LAYOUT_TREELET 1
+
+// Spreads lowest 16 bits so that there is a zero bit between each of them
+static inline unsigned int ExpandBits16(unsigned int x)
+{
+	x &= 0xFFFF;
+	x = (x | x << 8) & 0x00FF00FFu;
+	x = (x | x << 4) & 0x0F0F0F0Fu;
+	x = (x | x << 2) & 0x33333333u;
+	x = (x | x << 1) & 0x55555555u;
+	return x;
+}
+
+namespace OpenTracerCore
+{
+	// Packet kernels for N rays, N is 4, 8 or 16 (see SimdLanes)
+	template<unsigned int N>
+	class PacketTracer
+	{
+	private:
+		typedef RayPacket<N> Packet;
+		typedef typename Packet::Lanes Lanes;
+		typedef typename Packet::Vector Vector;
+
+		// Closest hits of one packet - barycentric rows (Intersection terms), distances and ids.
+		// Any-hit queries collect lanes with a hit in mOccluded, which drops them from traversal.
+		class __declspec(align(64)) PacketHit
+		{
+		public:
+			Vector mBarycentric[2];
+			Vector mDistance;
+			int mId[N];
+			int mOccluded;
+			bool mAnyHit;
+		};
+
+		typedef std::function<void(const Packet&, int, PacketHit&)> TraceFunction;
+
+		// Writes hit records to output, or one byte per ray to occlusion when it is not NULL
+		static void RenderTile(RayBuffer* rayBuffer, Texture* output, unsigned char* occlusion, const TraceFunction& trace, int x0, int y0, int x1, int y1)
+		{
+			int width = rayBuffer->GetWidth();
+			float4* results = occlusion ? NULL : output->GetHostData();
+
+			Packet packet;
+			PacketHit hit;
+			hit.mAnyHit = occlusion != NULL;
+
+			for (int y = y0; y < y1; y += Packet::HEIGHT)
+			{
+				for (int x = x0; x < x1; x += Packet::WIDTH)
+				{
+					int mask = rayBuffer->GeneratePacket(x, y, packet);
+
+					hit.mBarycentric[0] = Lanes::Set(0.0f);
+					hit.mBarycentric[1] = Lanes::Set(0.0f);
+					hit.mDistance = packet.GetFar();
+					for (int k = 0; k < Packet::SIZE; k++)
+					{
+						hit.mId[k] = -1;
+					}
+					hit.mOccluded = 0;
+
+					trace(packet, mask, hit);
+
+					for (int k = 0; k < Packet::SIZE; k++)
+					{
+						if (!(mask & (1 << k)))
+						{
+							continue;
+						}
+
+						if (occlusion)
+						{
+							occlusion[(x + k % Packet::WIDTH) + (y + k / Packet::WIDTH) * width] = (hit.mOccluded >> k) & 1;
+							continue;
+						}
+
+						// Kernels report weights of the first two vertices, Intersection those of the last two
+						float bu = 0.0f, bv = 0.0f;
+						if (hit.mId[k] >= 0)
+						{
+							bu = 1.0f - hit.mBarycentric[0][k] - hit.mBarycentric[1][k];
+							bv = hit.mBarycentric[0][k];
+						}
+
+						float id;
+						memcpy(&id, &hit.mId[k], sizeof(float));
+						results[(x + k % Packet::WIDTH) + (y + k / Packet::WIDTH) * width] = float4(bu, bv, hit.mDistance[k], id);
+					}
+				}
+			}
+		}
+
+		static void RenderPackets(NativeRenderer* renderer, RayBuffer* rayBuffer, Texture* output, unsigned char* occlusion, const TraceFunction& trace)
+		{
+			renderer->RenderTiles(rayBuffer->GetWidth(), rayBuffer->GetHeight(), [&](int x0, int y0, int x1, int y1)
+			{
+				RenderTile(rayBuffer, output, occlusion, trace, x0, y0, x1, y1);
+			});
+		}
+
+		static void IntersectLeaf(const Triangle* triangles, const unsigned int* indices, unsigned int count, const Packet& r, int mask, PacketHit& hit)
+		{
+			Intersection isect;
+			for (unsigned int i = 0; i < count && mask != 0; i++)
+			{
+				unsigned int prim = indices[i];
+				int hits = isect.Intersect(triangles[prim], r, mask, hit.mBarycentric, hit.mDistance);
+				if (hit.mAnyHit)
+				{
+					hit.mOccluded |= hits;
+					mask &= ~hits;
+				}
+
+				for (int k = 0; hits != 0; k++, hits >>= 1)
+				{
+					if (hits & 1)
+					{
+						hit.mId[k] = (int)prim;
+					}
+				}
+			}
+		}
+
+		static void TraceBVH(BVH* tree, const Triangle* triangles, const Packet& r, int mask, PacketHit& hit)
+		{
+			if (tree->GetNodeCount() == 0)
+			{
+				return;
+			}
+
+			const BVH::LBVHNode* nodes = (const BVH::LBVHNode*)tree->GetNodes();
+			const unsigned int* indices = tree->GetIndices();
+			Intersection isect;
+
+			unsigned int stack[NATIVE_STACK_SIZE];
+			int stack_mask[NATIVE_STACK_SIZE];
+			unsigned int stack_ptr = 0;
+			stack[stack_ptr] = 0;
+			stack_mask[stack_ptr] = mask;
+			stack_ptr++;
+
+			while (stack_ptr != 0)
+			{
+				stack_ptr--;
+				unsigned int node = stack[stack_ptr];
+				int m = stack_mask[stack_ptr] & ~hit.mOccluded;
+				if (m == 0)
+				{
+					continue;
+				}
+
+				const BVH::LBVHNode& n = nodes[node];
+
+				if (n.mLeaf)
+				{
+					IntersectLeaf(triangles, indices + n.mPrimitiveOffset, n.mPrimitiveCount, r, m, hit);
+					continue;
+				}
+
+				// Children are tested against current closest hits, so that finished lanes drop out
+				AABB left(float4(n.mLXY.x, n.mLXY.z, n.mLRZ.x, 0.0f), float4(n.mLXY.y, n.mLXY.w, n.mLRZ.y, 0.0f));
+				AABB right(float4(n.mRXY.x, n.mRXY.z, n.mLRZ.z, 0.0f), float4(n.mRXY.y, n.mRXY.w, n.mLRZ.w, 0.0f));
+				Vector l_enter, l_exit, r_enter, r_exit;
+				int l_mask = isect.Intersect(left, r, m, r.GetNear(), hit.mDistance, l_enter, l_exit);
+				int r_mask = isect.Intersect(right, r, m, r.GetNear(), hit.mDistance, r_enter, r_exit);
+
+				// Nearer child for the first ray hitting both is pushed last, so that it is popped first
+				int both = l_mask & r_mask;
+				int lane = 0;
+				while (both && !(both & (1 << lane)))
+				{
+					lane++;
+				}
+				bool left_first = !both || l_enter[lane] <= r_enter[lane];
+
+				unsigned int children[2] = { node + 1, n.mPrimitiveOffset };
+				int masks[2] = { l_mask, r_mask };
+				for (int i = 0; i < 2; i++)
+				{
+					int c = left_first ? 1 - i : i;
+					if (masks[c])
+					{
+						stack[stack_ptr] = children[c];
+						stack_mask[stack_ptr] = masks[c];
+						stack_ptr++;
+					}
+				}
+			}
+		}
+
+		static void TraceSpatial(KDTree* tree, const Triangle* triangles, const Packet& r, int mask, PacketHit& hit)
+		{
+			if (tree->GetNodeCount() == 0)
+			{
+				return;
+			}
+
+			// Near and far children are chosen once per node for the whole packet, which needs common
+			// direction signs - incoherent packets are traced ray by ray
+			for (unsigned int axis = 0; axis < 3; axis++)
+			{
+				int negative = r.GetNegativeMask(axis, mask);
+				if (negative != 0 && negative != mask)
+				{
+					for (int k = 0; k < Packet::SIZE; k++)
+					{
+						if (mask & (1 << k))
+						{
+							TraceSpatial(tree, triangles, r, 1 << k, hit);
+						}
+					}
+					return;
+				}
+			}
+
+			const NativeKDNode* nodes = (const NativeKDNode*)tree->GetNodes();
+			const unsigned int* indices = tree->GetIndices();
+			bool treelet = tree->GetLayout() == NATIVE_KD_LAYOUT_TREELET;
+			Intersection isect;
+
+			unsigned int stack[NATIVE_STACK_SIZE];
+			int stack_mask[NATIVE_STACK_SIZE];
+			Vector stack_near[NATIVE_STACK_SIZE];
+			Vector stack_far[NATIVE_STACK_SIZE];
+			unsigned int stack_ptr = 0;
+
+			stack_mask[stack_ptr] = isect.Intersect(tree->GetAABB(), r, mask, r.GetNear(), r.GetFar(), stack_near[stack_ptr], stack_far[stack_ptr]);
+			stack[stack_ptr] = 0;
+			if (stack_mask[stack_ptr])
+			{
+				stack_ptr++;
+			}
+
+			while (stack_ptr != 0)
+			{
+				stack_ptr--;
+				unsigned int node = stack[stack_ptr];
+				Vector near = stack_near[stack_ptr];
+				Vector far = stack_far[stack_ptr];
+
+				// Lanes with closest hit in front of the segment or any hit are finished
+				int m = stack_mask[stack_ptr] & Lanes::LessEqual(near, hit.mDistance) & ~hit.mOccluded;
+				if (m == 0)
+				{
+					continue;
+				}
+
+				while ((nodes[node].mFlags & 3) != 3)
+				{
+					unsigned int axis = nodes[node].mFlags & 3;
+					unsigned int above = nodes[node].mFlags >> 2;
+					unsigned int below_child = treelet ? above : node + 1;
+					unsigned int above_child = treelet ? above + 1 : above;
+
+					bool below_first = r.GetNegativeMask(axis, m) == 0;
+					unsigned int first = below_first ? below_child : above_child;
+					unsigned int second = below_first ? above_child : below_child;
+
+					Vector t = (Lanes::Set(nodes[node].mSplit) - r.GetOrigin(axis)) * r.GetInverse(axis);
+					int need_first = Lanes::LessEqual(near, t) & m;
+					int need_second = Lanes::LessEqual(t, far) & m;
+
+					if (!need_second)
+					{
+						node = first;
+					}
+					else if (!need_first)
+					{
+						node = second;
+						near = Lanes::Max(t, near);
+					}
+					else
+					{
+						stack[stack_ptr] = second;
+						stack_mask[stack_ptr] = need_second;
+						stack_near[stack_ptr] = Lanes::Max(t, near);
+						stack_far[stack_ptr] = far;
+						stack_ptr++;
+
+						node = first;
+						far = Lanes::Min(t, far);
+						m = need_first;
+					}
+				}
+
+				IntersectLeaf(triangles, indices + nodes[node].mPrimitiveOffset, nodes[node].mFlags >> 2, r, m, hit);
+			}
+		}
+
+		static TraceFunction GetTrace(Scene* scene, Aggregate* naive)
+		{
+			const Triangle* triangles = scene->GetGeometryCPU();
+			unsigned int count = (unsigned int)scene->GetTriangleCount();
+
+			return [=](const Packet& r, int mask, PacketHit& hit)
+			{
+				Intersection isect;
+				for (unsigned int i = 0; i < count && mask != 0; i++)
+				{
+					int hits = isect.Intersect(triangles[i], r, mask, hit.mBarycentric, hit.mDistance);
+					if (hit.mAnyHit)
+					{
+						hit.mOccluded |= hits;
+						mask &= ~hits;
+					}
+
+					for (int k = 0; hits != 0; k++, hits >>= 1)
+					{
+						if (hits & 1)
+						{
+							hit.mId[k] = (int)i;
+						}
+					}
+				}
+			};
+		}
+
+		static TraceFunction GetTrace(Scene* scene, Spatial* spatial)
+		{
+			KDTree* tree = spatial->GetTree();
+			const Triangle* triangles = scene->GetGeometryCPU();
+
+			return [=](const Packet& r, int mask, PacketHit& hit)
+			{
+				TraceSpatial(tree, triangles, r, mask, hit);
+			};
+		}
+
+		static TraceFunction GetTrace(Scene* scene, Hierarchy* hierarchy)
+		{
+			BVH* tree = hierarchy->GetTree();
+			const Triangle* triangles = scene->GetGeometryCPU();
+
+			return [=](const Packet& r, int mask, PacketHit& hit)
+			{
+				TraceBVH(tree, triangles, r, mask, hit);
+			};
+		}
+
+		// Closest hits of batch rays [first, last), written as 4 floats per ray - caller's array
+		// does not have to be aligned. Occlusion batches get one byte per ray.
+		static void TraceBatchRange(RayBatch* batch, const TraceFunction& trace, unsigned int first, unsigned int last)
+		{
+			float* results = batch->GetHits();
+			unsigned char* occlusion = batch->GetOccluded();
+
+			Packet packet;
+			PacketHit hit;
+			hit.mAnyHit = occlusion != NULL;
+
+			for (unsigned int i = first; i < last; i += Packet::SIZE)
+			{
+				int mask = batch->GeneratePacket(i, packet);
+
+				hit.mBarycentric[0] = Lanes::Set(0.0f);
+				hit.mBarycentric[1] = Lanes::Set(0.0f);
+				hit.mDistance = packet.GetFar();
+				for (int k = 0; k < Packet::SIZE; k++)
+				{
+					hit.mId[k] = -1;
+				}
+				hit.mOccluded = 0;
+
+				trace(packet, mask, hit);
+
+				for (int k = 0; k < Packet::SIZE && (mask & (1 << k)); k++)
+				{
+					if (occlusion)
+					{
+						occlusion[i + k] = (hit.mOccluded >> k) & 1;
+						continue;
+					}
+
+					float bu = 0.0f, bv = 0.0f;
+					if (hit.mId[k] >= 0)
+					{
+						bu = 1.0f - hit.mBarycentric[0][k] - hit.mBarycentric[1][k];
+						bv = hit.mBarycentric[0][k];
+					}
+
+					float* result = results + (i + k) * 4;
+					result[0] = bu;
+					result[1] = bv;
+					result[2] = hit.mDistance[k];
+					memcpy(&result[3], &hit.mId[k], sizeof(float));
+				}
+			}
+		}
+
+	public:
+		template<class T>
+		static void Render(NativeRenderer* renderer, Scene* scene, T* aggregate, RayBuffer* rayBuffer, Texture* output, unsigned char* occlusion)
+		{
+			RenderPackets(renderer, rayBuffer, output, occlusion, GetTrace(scene, aggregate));
+		}
+
+		// Batch tasks outlive the call, trace function is shared by them
+		template<class T>
+		static void Trace(NativeRenderer* renderer, Scene* scene, T* aggregate, RayBatch* batch)
+		{
+			std::shared_ptr<TraceFunction> trace = std::make_shared<TraceFunction>(GetTrace(scene, aggregate));
+			renderer->TraceBatch(batch, Packet::SIZE, [trace, batch](unsigned int first, unsigned int last)
+			{
+				TraceBatchRange(batch, *trace, first, last);
+			});
+		}
+	};
+}
+
+NativeRenderer::NativeRenderer(unsigned int threads, unsigned int width)
+{
+	mScheduler = new TaskScheduler(threads);
+	mLastTraceTime = 0.0f;
+	mTileSize = 32;
+	mTilesX = 0;
+	mTilesY = 0;
+	mThreadStatistics.resize(mScheduler->GetWorkerCount());
+
+	// Packets wider than the CPU supports fall back to the widest supported ones
+	unsigned int simd = GetSimdWidth();
+	mWidth = width == 4 || width == 8 || width == 16 ? width : simd;
+	if (mWidth > simd)
+	{
+		mWidth = simd;
+	}
+
+	std::cout << "Native renderer using " << mScheduler->GetWorkerCount() << " threads, " << GetSimdIsaName(GetSimdIsa()) << " CPU, " << mWidth << "-ray packets" << std::endl;
+}
+
+NativeRenderer::~NativeRenderer()
+{
+	delete mScheduler;
+}
+
+void NativeRenderer::SetTileSize(unsigned int size)
+{
+	size = size < 4 ? 4 : (size + 3) & ~3u;
+	if (size != mTileSize)
+	{
+		mTileSize = size;
+		mTilesX = 0;
+		mTilesY = 0;
+	}
+}
+
+void NativeRenderer::RenderTiles(int width, int height, const TileFunction& tile)
+{
+	unsigned int tiles_x = (width + mTileSize - 1) / mTileSize;
+	unsigned int tiles_y = (height + mTileSize - 1) / mTileSize;
+
+	// Morton order keeps tiles of one range close on screen, so that they share visited nodes
+	if (tiles_x != mTilesX || tiles_y != mTilesY)
+	{
+		mTilesX = tiles_x;
+		mTilesY = tiles_y;
+
+		std::vector<std::pair<unsigned int, unsigned int> > codes(tiles_x * tiles_y);
+		for (unsigned int j = 0; j < tiles_y; j++)
+		{
+			for (unsigned int i = 0; i < tiles_x; i++)
+			{
+				codes[i + j * tiles_x] = std::make_pair(ExpandBits16(i) | (ExpandBits16(j) << 1), i + j * tiles_x);
+			}
+		}
+		std::sort(codes.begin(), codes.end());
+
+		mTiles.resize(codes.size());
+		for (size_t i = 0; i < codes.size(); i++)
+		{
+			mTiles[i] = codes[i].second;
+		}
+	}
+
+	for (auto& stats : mThreadStatistics)
+	{
+		stats.mTiles = 0;
+		stats.mRays = 0;
+		stats.mBusyTime = 0.0f;
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	TaskScheduler::TaskGroup group;
+	RenderRange(group, tile, width, height, 0, (unsigned int)mTiles.size());
+	mScheduler->Wait(group);
+
+	mLastTraceTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void NativeRenderer::RenderRange(TaskScheduler::TaskGroup& group, const TileFunction& tile, int width, int height, unsigned int first, unsigned int last)
+{
+	// Upper half goes to the deque, where thieves take the oldest (largest) range first
+	while (last - first > 1)
+	{
+		unsigned int middle = first + (last - first) / 2;
+		mScheduler->Spawn(group, [this, &group, &tile, width, height, middle, last]()
+		{
+			RenderRange(group, tile, width, height, middle, last);
+		});
+		last = middle;
+	}
+
+	if (first == last)
+	{
+		return;
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	int x0 = (int)(mTiles[first] % mTilesX * mTileSize);
+	int y0 = (int)(mTiles[first] / mTilesX * mTileSize);
+	int x1 = x0 + (int)mTileSize < width ? x0 + (int)mTileSize : width;
+	int y1 = y0 + (int)mTileSize < height ? y0 + (int)mTileSize : height;
+	tile(x0, y0, x1, y1);
+
+	ThreadStatistics& stats = mThreadStatistics[mScheduler->GetWorkerIndex()];
+	stats.mTiles++;
+	stats.mRays += (unsigned int)((x1 - x0) * (y1 - y0));
+	stats.mBusyTime += std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void NativeRenderer::TraceBatch(RayBatch* batch, unsigned int packetSize, const RangeFunction& range)
+{
+	TaskScheduler::TaskGroup& group = batch->GetGroup(mScheduler);
+
+	// Chunks are queued at once and the call returns, idle workers steal them while the caller
+	// goes on. Rays are not coherent in general, so smaller chunks balance better than tiles.
+	unsigned int count = batch->GetCount();
+	unsigned int chunk = packetSize * 16;
+	for (unsigned int first = 0; first < count; first += chunk)
+	{
+		unsigned int last = first + chunk < count ? first + chunk : count;
+		mScheduler->Spawn(group, [range, first, last]()
+		{
+			range(first, last);
+		});
+	}
+}
+
+template<class T>
+void NativeRenderer::Dispatch(Scene* scene, T* aggregate, RayBuffer* rayBuffer, Texture* output, unsigned char* occlusion)
+{
+	switch (mWidth)
+	{
+	case 16:
+		PacketTracer<16>::Render(this, scene, aggregate, rayBuffer, output, occlusion);
+		break;
+
+	case 8:
+		PacketTracer<8>::Render(this, scene, aggregate, rayBuffer, output, occlusion);
+		break;
+
+	default:
+		PacketTracer<4>::Render(this, scene, aggregate, rayBuffer, output, occlusion);
+		break;
+	}
+}
+
+void NativeRenderer::Render(Scene* scene, Aggregate* naive, RayBuffer* rayBuffer, Texture* output)
+{
+	Dispatch(scene, naive, rayBuffer, output, NULL);
+}
+
+void NativeRenderer::Render(Scene* scene, Spatial* spatial, RayBuffer* rayBuffer, Texture* output)
+{
+	Dispatch(scene, spatial, rayBuffer, output, NULL);
+}
+
+void NativeRenderer::Render(Scene* scene, Hierarchy* hierarchy, RayBuffer* rayBuffer, Texture* output)
+{
+	Dispatch(scene, hierarchy, rayBuffer, output, NULL);
+}
+
+void NativeRenderer::TraceOcclusion(Scene* scene, Aggregate* naive, RayBuffer* rayBuffer, unsigned char* output)
+{
+	Dispatch(scene, naive, rayBuffer, NULL, output);
+}
+
+void NativeRenderer::TraceOcclusion(Scene* scene, Spatial* spatial, RayBuffer* rayBuffer, unsigned char* output)
+{
+	Dispatch(scene, spatial, rayBuffer, NULL, output);
+}
+
+void NativeRenderer::TraceOcclusion(Scene* scene, Hierarchy* hierarchy, RayBuffer* rayBuffer, unsigned char* output)
+{
+	Dispatch(scene, hierarchy, rayBuffer, NULL, output);
+}
+
+template<class T>
+void NativeRenderer::DispatchBatch(Scene* scene, T* aggregate, RayBatch* batch)
+{
+	switch (mWidth)
+	{
+	case 16:
+		PacketTracer<16>::Trace(this, scene, aggregate, batch);
+		break;
+
+	case 8:
+		PacketTracer<8>::Trace(this, scene, aggregate, batch);
+		break;
+
+	default:
+		PacketTracer<4>::Trace(this, scene, aggregate, batch);
+		break;
+	}
+}
+
+void NativeRenderer::Trace(Scene* scene, Aggregate* naive, RayBatch* batch)
+{
+	DispatchBatch(scene, naive, batch);
+}
+
+void NativeRenderer::Trace(Scene* scene, Spatial* spatial, RayBatch* batch)
+{
+	DispatchBatch(scene, spatial, batch);
+}
+
+void NativeRenderer::Trace(Scene* scene, Hierarchy* hierarchy, RayBatch* batch)
+{
+	DispatchBatch(scene, hierarchy, batch);
+}
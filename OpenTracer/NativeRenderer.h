@@ -0,0 +1,112 @@
+#ifndef __NATIVE_RENDERER_H__
+#define __NATIVE_RENDERER_H__
+
+#include "Texture.h"
+#include "RayBuffer.h"
+#include "RayBatch.h"
+#include "Aggregate/Aggregate.h"
+#include "Aggregate/Spatial.h"
+#include "Aggregate/Hierarchy.h"
+#include "Util/TaskScheduler.h"
+#include <vector>
+#include <functional>
+
+namespace OpenTracerCore
+{
+	template<unsigned int N>
+	class PacketTracer;
+
+	// Host backend of Renderer used with native context. Primary rays are traced in coherent
+	// packets through CPU copies of the trees, one SIMD lane per ray - 2x2 pixels with SSE, 4x2
+	// with AVX2 and 4x4 with AVX-512, the widest one the CPU supports is picked at runtime.
+	// Image is split into square tiles visited in Morton order, ranges of tiles are split
+	// recursively into tasks, so that idle threads steal the largest remaining contiguous ranges.
+	// Results are written to host data of the output texture in the same format as trace kernels
+	// write them.
+	class NativeRenderer
+	{
+	public:
+		// Work done by one thread during the last render
+		struct ThreadStatistics
+		{
+			unsigned int mTiles;
+			unsigned int mRays;
+			float mBusyTime;		// Milliseconds spent tracing tiles
+		};
+
+	private:
+		// Renders pixels [x0, x1) x [y0, y1), bounds are multiples of the tile size or image size
+		typedef std::function<void(int, int, int, int)> TileFunction;
+
+		// Traces batch rays [first, last)
+		typedef std::function<void(unsigned int, unsigned int)> RangeFunction;
+
+		TaskScheduler* mScheduler;
+		unsigned int mWidth;
+		unsigned int mTileSize;
+		float mLastTraceTime;
+
+		// Tile indices (row-major) sorted by Morton code, rebuilt when resolution changes
+		std::vector<unsigned int> mTiles;
+		unsigned int mTilesX;
+		unsigned int mTilesY;
+
+		std::vector<ThreadStatistics> mThreadStatistics;
+
+		// Traces all tiles of the image using the scheduler
+		void RenderTiles(int width, int height, const TileFunction& tile);
+
+		// Splits range of Morton ordered tiles into tasks until single tiles remain
+		void RenderRange(TaskScheduler::TaskGroup& group, const TileFunction& tile, int width, int height, unsigned int first, unsigned int last);
+
+		// Queues chunks of batch rays as tasks of batch's group without waiting
+		void TraceBatch(RayBatch* batch, unsigned int packetSize, const RangeFunction& range);
+
+		// Calls packet tracer of selected width, occlusion selects any-hit query
+		template<class T>
+		void Dispatch(Scene* scene, T* aggregate, RayBuffer* rayBuffer, Texture* output, unsigned char* occlusion);
+
+		template<class T>
+		void DispatchBatch(Scene* scene, T* aggregate, RayBatch* batch);
+
+	public:
+		// Threads include the calling one, 0 uses all hardware threads. Packet width is 4, 8, 16
+		// or 0 for the widest supported one.
+		NativeRenderer(unsigned int threads = 0, unsigned int width = 0);
+		~NativeRenderer();
+		void Render(Scene* scene, Aggregate* naive, RayBuffer* rayBuffer, Texture* output);
+		void Render(Scene* scene, Spatial* spatial, RayBuffer* rayBuffer, Texture* output);
+		void Render(Scene* scene, Hierarchy* hierarchy, RayBuffer* rayBuffer, Texture* output);
+
+		// Any-hit queries, one byte per ray is written to output - 1 when there is a hit within
+		// ray's (near, far) interval
+		void TraceOcclusion(Scene* scene, Aggregate* naive, RayBuffer* rayBuffer, unsigned char* output);
+		void TraceOcclusion(Scene* scene, Spatial* spatial, RayBuffer* rayBuffer, unsigned char* output);
+		void TraceOcclusion(Scene* scene, Hierarchy* hierarchy, RayBuffer* rayBuffer, unsigned char* output);
+
+		// Closest hits (or any hits for occlusion batch) of arbitrary rays traced by scheduler
+		// threads, returns once the work is queued. Batch must be waited for before the renderer is
+		// destroyed.
+		void Trace(Scene* scene, Aggregate* naive, RayBatch* batch);
+		void Trace(Scene* scene, Spatial* spatial, RayBatch* batch);
+		void Trace(Scene* scene, Hierarchy* hierarchy, RayBatch* batch);
+
+		// Duration of the last trace in milliseconds
+		float GetLastTraceTime() { return mLastTraceTime; }
+
+		// Number of rays in one packet
+		unsigned int GetPacketSize() { return mWidth; }
+
+		// Tile edge in pixels, rounded up to a multiple of 4 so that packets never cross tiles
+		void SetTileSize(unsigned int size);
+		unsigned int GetTileSize() { return mTileSize; }
+
+		// One entry per scheduler thread, index 0 is the thread calling Render
+		const std::vector<ThreadStatistics>& GetThreadStatistics() { return mThreadStatistics; }
+
+		template<unsigned int N>
+		friend class PacketTracer;
+	};
+}
+
+#endif
@@ -3,10 +3,12 @@
 #include "Context.h"
 #include "Texture.h"
 #include "RayBuffer.h"
+#include "RayBatch.h"
 #include "Math/Numeric/Float4.h"
 #include "Scene.h"
 #include "Aggregate/Aggregate.h"
 #include "Renderer.h"
+#include "PathTracer.h"
 
 using namespace OpenTracer;
 
@@ -88,6 +90,11 @@ Scene::~Scene()
 	delete ((OpenTracerCore::Scene*)mData);
 }
 
+void Scene::Update(float* vertices)
+{
+	((OpenTracerCore::Scene*)mData)->Update(g_mContext, vertices);
+}
+
 Aggregate::Aggregate(Aggregate::Type type, Scene* scene, const char* config)
 {
 	mType = type;
@@ -101,11 +108,28 @@ Aggregate::Aggregate(Aggregate::Type type, Scene* scene, const char* config)
 		mData = (void*)(new OpenTracerCore::Spatial(g_mContext, (OpenTracerCore::Scene*)scene->mData, std::string(config)));
 		break;
 
+	case Aggregate::AGGREGATE_BVH:
+		mData = (void*)(new OpenTracerCore::Hierarchy(g_mContext, (OpenTracerCore::Scene*)scene->mData, std::string(config)));
+		break;
+
 	default:
 		break;
 	}
 }
 
+Aggregate::Aggregate(Scene** meshes, int meshCount, const unsigned int* instanceMeshes, const float* transforms, int instanceCount, const char* config)
+{
+	mType = Aggregate::AGGREGATE_INSTANCED;
+
+	OpenTracerCore::Scene** scenes = new OpenTracerCore::Scene*[meshCount];
+	for (int i = 0; i < meshCount; i++)
+	{
+		scenes[i] = (OpenTracerCore::Scene*)meshes[i]->mData;
+	}
+	mData = (void*)(new OpenTracerCore::Instanced(g_mContext, scenes, meshCount, instanceMeshes, transforms, instanceCount, std::string(config)));
+	delete[] scenes;
+}
+
 Aggregate::~Aggregate()
 {
 	switch (mType)
@@ -118,11 +142,117 @@ Aggregate::~Aggregate()
 		delete ((OpenTracerCore::Spatial*)mData);
 		break;
 
+	case Aggregate::AGGREGATE_BVH:
+		delete ((OpenTracerCore::Hierarchy*)mData);
+		break;
+
+	case Aggregate::AGGREGATE_INSTANCED:
+		delete ((OpenTracerCore::Instanced*)mData);
+		break;
+
 	default:
 		break;
 	}
 }
 
+// Statistics of the acceleration structure, NULL for aggregates without one
+static const OpenTracerCore::TreeStatistics* GetTreeStatistics(Aggregate::Type type, void* data)
+{
+	switch (type)
+	{
+	case Aggregate::AGGREGATE_KDTREE:
+		return &((OpenTracerCore::Spatial*)data)->GetStatistics();
+
+	case Aggregate::AGGREGATE_BVH:
+		return &((OpenTracerCore::Hierarchy*)data)->GetStatistics();
+
+	case Aggregate::AGGREGATE_INSTANCED:
+		return &((OpenTracerCore::Instanced*)data)->GetStatistics();
+
+	default:
+		return NULL;
+	}
+}
+
+bool Aggregate::GetStatistics(AggregateStatistics* stats)
+{
+	const OpenTracerCore::TreeStatistics* tree = GetTreeStatistics(mType, mData);
+	if (!tree)
+	{
+		return false;
+	}
+
+	const OpenTracerCore::TreeStatistics& s = *tree;
+	stats->mSAHCost = s.mSAHCost;
+	stats->mPrimitives = (unsigned int)s.mPrimitives;
+	stats->mNodes = (unsigned int)s.mNodes;
+	stats->mLeaves = (unsigned int)s.mLeaves;
+	stats->mEmptyLeaves = (unsigned int)s.mEmptyLeaves;
+	stats->mReferences = (unsigned int)s.mReferences;
+	stats->mMaxDepth = s.mMaxDepth;
+	stats->mEmptyLeafRatio = s.GetEmptyLeafRatio();
+	stats->mDuplicationFactor = s.GetDuplicationFactor();
+	stats->mBuildTime = (float)s.GetTotalTime();
+
+	return true;
+}
+
+unsigned int Aggregate::GetStatisticsJSON(char* buffer, unsigned int size)
+{
+	const OpenTracerCore::TreeStatistics* tree = GetTreeStatistics(mType, mData);
+	std::string json = tree ? tree->ToJSON() : "{}";
+
+	unsigned int required = (unsigned int)json.length() + 1;
+	if (buffer && size >= required)
+	{
+		memcpy(buffer, json.c_str(), required);
+	}
+
+	return required;
+}
+
+bool Aggregate::Intersect(const float* origin, const float* direction, float* distance, int* id)
+{
+	if (mType != Aggregate::AGGREGATE_BVH)
+	{
+		return false;
+	}
+
+	OpenTracerCore::Ray r(OpenTracerCore::float4(origin[0], origin[1], origin[2], 0.0f), OpenTracerCore::float4(direction[0], direction[1], direction[2], 0.0f));
+	OpenTracerCore::float4 barycentric;
+	return ((OpenTracerCore::Hierarchy*)mData)->Intersect(r, *distance, barycentric, *id);
+}
+
+void Aggregate::Update(Scene* scene)
+{
+	OpenTracerCore::Scene* s = (OpenTracerCore::Scene*)scene->mData;
+	switch (mType)
+	{
+	case Aggregate::AGGREGATE_NAIVE:
+		((OpenTracerCore::Aggregate*)mData)->Update(g_mContext, s);
+		break;
+
+	case Aggregate::AGGREGATE_KDTREE:
+		((OpenTracerCore::Spatial*)mData)->Update(g_mContext, s);
+		break;
+
+	case Aggregate::AGGREGATE_BVH:
+		((OpenTracerCore::Hierarchy*)mData)->Update(g_mContext, s);
+		break;
+
+	default:
+		break;
+	}
+}
+
+void Aggregate::SetTransforms(const float* transforms)
+{
+	if (mType == Aggregate::AGGREGATE_INSTANCED)
+	{
+		((OpenTracerCore::Instanced*)mData)->SetTransforms(g_mContext, transforms);
+	}
+}
+
 Renderer::Renderer()
 {
 	OpenTracerCore::Renderer* r = new OpenTracerCore::Renderer(g_mContext);
@@ -147,7 +277,230 @@ void Renderer::Render(Scene* scene, Aggregate* aggregate, RayGenerator* raygen,
 		r->Render((OpenTracerCore::Scene*)scene->mData, (OpenTracerCore::Spatial*)aggregate->mData, (OpenTracerCore::RayBuffer*)raygen->mData, (OpenTracerCore::Texture*)output->mData);
 		break;
 
+	case Aggregate::AGGREGATE_BVH:
+		r->Render((OpenTracerCore::Scene*)scene->mData, (OpenTracerCore::Hierarchy*)aggregate->mData, (OpenTracerCore::RayBuffer*)raygen->mData, (OpenTracerCore::Texture*)output->mData);
+		break;
+
+	case Aggregate::AGGREGATE_INSTANCED:
+		r->Render(scene ? (OpenTracerCore::Scene*)scene->mData : NULL, (OpenTracerCore::Instanced*)aggregate->mData, (OpenTracerCore::RayBuffer*)raygen->mData, (OpenTracerCore::Texture*)output->mData);
+		break;
+
 	default:
 		break;
 	}
-}
\ No newline at end of file
+}
+
+void Renderer::TraceOcclusion(Scene* scene, Aggregate* aggregate, RayGenerator* raygen, unsigned char* output)
+{
+	OpenTracerCore::Renderer* r = (OpenTracerCore::Renderer*)mData;
+	switch (aggregate->mType)
+	{
+	case Aggregate::AGGREGATE_NAIVE:
+		r->TraceOcclusion((OpenTracerCore::Scene*)scene->mData, (OpenTracerCore::Aggregate*)aggregate->mData, (OpenTracerCore::RayBuffer*)raygen->mData, output);
+		break;
+
+	case Aggregate::AGGREGATE_KDTREE:
+		r->TraceOcclusion((OpenTracerCore::Scene*)scene->mData, (OpenTracerCore::Spatial*)aggregate->mData, (OpenTracerCore::RayBuffer*)raygen->mData, output);
+		break;
+
+	case Aggregate::AGGREGATE_BVH:
+		r->TraceOcclusion((OpenTracerCore::Scene*)scene->mData, (OpenTracerCore::Hierarchy*)aggregate->mData, (OpenTracerCore::RayBuffer*)raygen->mData, output);
+		break;
+
+	case Aggregate::AGGREGATE_INSTANCED:
+		r->TraceOcclusion(scene ? (OpenTracerCore::Scene*)scene->mData : NULL, (OpenTracerCore::Instanced*)aggregate->mData, (OpenTracerCore::RayBuffer*)raygen->mData, output);
+		break;
+
+	default:
+		break;
+	}
+}
+
+RayBatch* Renderer::Trace(Scene* scene, Aggregate* aggregate, const BatchRay* rays, unsigned int count, BatchHit* hits)
+{
+	OpenTracerCore::Renderer* r = (OpenTracerCore::Renderer*)mData;
+	OpenTracerCore::RayBatch* batch = new OpenTracerCore::RayBatch(g_mContext, (const float*)rays, count, (float*)hits);
+	switch (aggregate->mType)
+	{
+	case Aggregate::AGGREGATE_NAIVE:
+		r->Trace((OpenTracerCore::Scene*)scene->mData, (OpenTracerCore::Aggregate*)aggregate->mData, batch);
+		break;
+
+	case Aggregate::AGGREGATE_KDTREE:
+		r->Trace((OpenTracerCore::Scene*)scene->mData, (OpenTracerCore::Spatial*)aggregate->mData, batch);
+		break;
+
+	case Aggregate::AGGREGATE_BVH:
+		r->Trace((OpenTracerCore::Scene*)scene->mData, (OpenTracerCore::Hierarchy*)aggregate->mData, batch);
+		break;
+
+	case Aggregate::AGGREGATE_INSTANCED:
+		r->Trace(scene ? (OpenTracerCore::Scene*)scene->mData : NULL, (OpenTracerCore::Instanced*)aggregate->mData, batch);
+		break;
+
+	default:
+		batch->WriteMisses();
+		break;
+	}
+
+	return new RayBatch((void*)batch);
+}
+
+RayBatch* Renderer::TraceOcclusion(Scene* scene, Aggregate* aggregate, const BatchRay* rays, unsigned int count, unsigned char* occluded)
+{
+	OpenTracerCore::Renderer* r = (OpenTracerCore::Renderer*)mData;
+	OpenTracerCore::RayBatch* batch = new OpenTracerCore::RayBatch(g_mContext, (const float*)rays, count, occluded);
+	switch (aggregate->mType)
+	{
+	case Aggregate::AGGREGATE_NAIVE:
+		r->Trace((OpenTracerCore::Scene*)scene->mData, (OpenTracerCore::Aggregate*)aggregate->mData, batch);
+		break;
+
+	case Aggregate::AGGREGATE_KDTREE:
+		r->Trace((OpenTracerCore::Scene*)scene->mData, (OpenTracerCore::Spatial*)aggregate->mData, batch);
+		break;
+
+	case Aggregate::AGGREGATE_BVH:
+		r->Trace((OpenTracerCore::Scene*)scene->mData, (OpenTracerCore::Hierarchy*)aggregate->mData, batch);
+		break;
+
+	case Aggregate::AGGREGATE_INSTANCED:
+		r->Trace(scene ? (OpenTracerCore::Scene*)scene->mData : NULL, (OpenTracerCore::Instanced*)aggregate->mData, batch);
+		break;
+
+	default:
+		batch->WriteMisses();
+		break;
+	}
+
+	return new RayBatch((void*)batch);
+}
+
+void Renderer::SetStacklessTraversal(bool enable)
+{
+	((OpenTracerCore::Renderer*)mData)->SetStacklessTraversal(enable);
+}
+
+void Renderer::SetPersistentThreads(bool enable)
+{
+	((OpenTracerCore::Renderer*)mData)->SetPersistentThreads(enable);
+}
+
+float Renderer::GetLastTraceTime()
+{
+	return ((OpenTracerCore::Renderer*)mData)->GetLastTraceTime();
+}
+
+void Renderer::SetTileSize(unsigned int size)
+{
+	OpenTracerCore::NativeRenderer* native = ((OpenTracerCore::Renderer*)mData)->GetNative();
+	if (native)
+	{
+		native->SetTileSize(size);
+	}
+}
+
+unsigned int Renderer::GetThreadStatistics(ThreadStatistics* stats, unsigned int count)
+{
+	OpenTracerCore::NativeRenderer* native = ((OpenTracerCore::Renderer*)mData)->GetNative();
+	if (!native)
+	{
+		return 0;
+	}
+
+	const std::vector<OpenTracerCore::NativeRenderer::ThreadStatistics>& threads = native->GetThreadStatistics();
+	for (unsigned int i = 0; i < count && i < threads.size(); i++)
+	{
+		stats[i].mTiles = threads[i].mTiles;
+		stats[i].mRays = threads[i].mRays;
+		stats[i].mBusyTime = threads[i].mBusyTime;
+		stats[i].mRaysPerSecond = threads[i].mBusyTime > 0.0f ? threads[i].mRays * 1000.0f / threads[i].mBusyTime : 0.0f;
+	}
+
+	return (unsigned int)threads.size();
+}
+
+RayBatch::RayBatch(void* data)
+{
+	mData = data;
+}
+
+RayBatch::~RayBatch()
+{
+	delete ((OpenTracerCore::RayBatch*)mData);
+}
+
+bool RayBatch::IsDone()
+{
+	return ((OpenTracerCore::RayBatch*)mData)->IsDone();
+}
+
+void RayBatch::Wait()
+{
+	((OpenTracerCore::RayBatch*)mData)->Wait();
+}
+
+PathTracer::PathTracer()
+{
+	OpenTracerCore::PathTracer* p = new OpenTracerCore::PathTracer(g_mContext);
+	mData = (void*)p;
+}
+
+PathTracer::~PathTracer()
+{
+	delete ((OpenTracerCore::PathTracer*)mData);
+}
+
+void PathTracer::Render(Scene* scene, Aggregate* aggregate, RayGenerator* raygen, Texture* output)
+{
+	OpenTracerCore::PathTracer* p = (OpenTracerCore::PathTracer*)mData;
+	switch (aggregate->mType)
+	{
+	case Aggregate::AGGREGATE_KDTREE:
+		p->Render((OpenTracerCore::Scene*)scene->mData, (OpenTracerCore::Spatial*)aggregate->mData, (OpenTracerCore::RayBuffer*)raygen->mData, (OpenTracerCore::Texture*)output->mData);
+		break;
+
+	case Aggregate::AGGREGATE_BVH:
+		p->Render((OpenTracerCore::Scene*)scene->mData, (OpenTracerCore::Hierarchy*)aggregate->mData, (OpenTracerCore::RayBuffer*)raygen->mData, (OpenTracerCore::Texture*)output->mData);
+		break;
+
+	// Naive and instanced aggregates have no single-ray traversal in PathTracer.cl
+	default:
+		break;
+	}
+}
+
+void PathTracer::Reset()
+{
+	((OpenTracerCore::PathTracer*)mData)->Reset();
+}
+
+unsigned int PathTracer::GetSampleCount()
+{
+	return ((OpenTracerCore::PathTracer*)mData)->GetSampleCount();
+}
+
+void PathTracer::SetMaxDepth(unsigned int depth)
+{
+	((OpenTracerCore::PathTracer*)mData)->SetMaxDepth(depth);
+}
+
+void PathTracer::SetSky(float red, float green, float blue)
+{
+	((OpenTracerCore::PathTracer*)mData)->SetSky(OpenTracerCore::float4(red, green, blue, 0.0f));
+}
+
+void PathTracer::SetSun(float dirX, float dirY, float dirZ, float red, float green, float blue)
+{
+	((OpenTracerCore::PathTracer*)mData)->SetSun(OpenTracerCore::float4(dirX, dirY, dirZ, 0.0f), OpenTracerCore::float4(red, green, blue, 0.0f));
+}
+
+void PathTracer::SetAlbedo(float albedo)
+{
+	((OpenTracerCore::PathTracer*)mData)->SetAlbedo(albedo);
+}
+
+float PathTracer::GetLastTraceTime()
+{
+	return ((OpenTracerCore::PathTracer*)mData)->GetLastTraceTime();
+}
@@ -10,7 +10,11 @@ namespace OpenTracer
 		enum ContextType
 		{
 			CONTEXT_TYPE_CPU = 0,
-			CONTEXT_TYPE_GPU
+			CONTEXT_TYPE_GPU,
+
+			// Renders on host with SSE, AVX2 or AVX-512 ray packets (widest the CPU supports), no
+			// OpenCL runtime is needed. Supports naive, KD-tree and BVH aggregates.
+			CONTEXT_TYPE_NATIVE
 		};
 
 		static Context& GetInstance()
@@ -29,6 +33,7 @@ namespace OpenTracer
 	};
 
 	class Renderer;
+	class PathTracer;
 
 	class Texture
 	{
@@ -45,6 +50,7 @@ namespace OpenTracer
 		OPENTRACER_API void Clear(float red, float green, float blue, float alpha);
 
 		friend class Renderer;
+		friend class PathTracer;
 	};
 
 	class RayGenerator
@@ -58,6 +64,7 @@ namespace OpenTracer
 		OPENTRACER_API void GeneratePrimary(float posX, float posY, float posZ, float targetX, float targetY, float targetZ, float upX, float upY, float upZ, float aspect, float fov, int width, int height, float nearPlane, float farPlane);
 
 		friend class Renderer;
+		friend class PathTracer;
 	};
 
 	class Aggregate;
@@ -71,17 +78,38 @@ namespace OpenTracer
 		OPENTRACER_API Scene(float* vertices, int count);
 		OPENTRACER_API ~Scene();
 
+		// Replaces vertex positions of animated geometry, count and topology stay the same.
+		// Aggregates built over the scene follow after their Update is called.
+		OPENTRACER_API void Update(float* vertices);
+
 		friend class Renderer;
+		friend class PathTracer;
 		friend class Aggregate;
 	};
 
+	struct AggregateStatistics
+	{
+		float mSAHCost;
+		unsigned int mPrimitives;
+		unsigned int mNodes;
+		unsigned int mLeaves;
+		unsigned int mEmptyLeaves;
+		unsigned int mReferences;
+		unsigned int mMaxDepth;
+		float mEmptyLeafRatio;
+		float mDuplicationFactor;
+		float mBuildTime;
+	};
+
 	class Aggregate
 	{
 	public:
 		enum Type
 		{
 			AGGREGATE_NAIVE,
-			AGGREGATE_KDTREE
+			AGGREGATE_KDTREE,
+			AGGREGATE_BVH,
+			AGGREGATE_INSTANCED
 		};
 		Type mType;
 
@@ -90,8 +118,83 @@ namespace OpenTracer
 
 	public:
 		OPENTRACER_API Aggregate(Type type, Scene* scene, const char* config = "");
+
+		// Two level aggregate over instances of shared meshes, each mesh gets one BVH. Instance i
+		// references meshes[instanceMeshes[i]], transforms hold 12 floats per instance - 3x4
+		// row-major object to world matrix. Rendered with NULL scene.
+		OPENTRACER_API Aggregate(Scene** meshes, int meshCount, const unsigned int* instanceMeshes, const float* transforms, int instanceCount, const char* config = "");
+
 		OPENTRACER_API ~Aggregate();
 
+		// Returns false for aggregates without acceleration structure
+		OPENTRACER_API bool GetStatistics(AggregateStatistics* stats);
+
+		// Full statistics including histograms and phase times as JSON, returns required buffer
+		// size (with terminating zero), buffer is filled only when it is large enough
+		OPENTRACER_API unsigned int GetStatisticsJSON(char* buffer, unsigned int size);
+
+		// Closest hit of a single ray traced on CPU, needs BVH aggregate with BVH.Wide.Width set
+		// to 4, 8, 16 or 0 (widest the CPU supports). Direction is normalized, distance holds
+		// maximal ray length on input and hit distance on output.
+		OPENTRACER_API bool Intersect(const float* origin, const float* direction, float* distance, int* id);
+
+		// Follows geometry changed by Scene::Update - BVH is refitted, KD-tree is rebuilt
+		OPENTRACER_API void Update(Scene* scene);
+
+		// Moves instances of instanced aggregate, only the top level is rebuilt
+		OPENTRACER_API void SetTransforms(const float* transforms);
+
+		friend class Renderer;
+		friend class PathTracer;
+	};
+
+	// Work done by one thread of native renderer during the last render
+	struct ThreadStatistics
+	{
+		unsigned int mTiles;
+		unsigned int mRays;
+		float mBusyTime;
+		float mRaysPerSecond;
+	};
+
+	// Ray of a batch, direction does not have to be normalized - near, far and hit distance are
+	// measured along the normalized direction
+	struct BatchRay
+	{
+		float mOrigin[3];
+		float mNear;
+		float mDirection[3];
+		float mFar;
+	};
+
+	// Closest hit of a batch ray with the same barycentrics as Render writes, id is -1 on miss
+	struct BatchHit
+	{
+		float mU;
+		float mV;
+		float mDistance;
+		int mId;
+	};
+
+	// Completion handle of a batch traced by Renderer::Trace or TraceOcclusion, must be deleted before
+	// the renderer
+	class RayBatch
+	{
+	private:
+		void* mData;
+
+		RayBatch(void* data);
+
+	public:
+		// Waits for the batch when it is still being traced
+		OPENTRACER_API ~RayBatch();
+
+		// True once all hits are written
+		OPENTRACER_API bool IsDone();
+
+		// Blocks until all hits are written, with native context the calling thread helps tracing
+		OPENTRACER_API void Wait();
+
 		friend class Renderer;
 	};
 
@@ -104,5 +207,68 @@ namespace OpenTracer
 		OPENTRACER_API Renderer();
 		OPENTRACER_API ~Renderer();
 		OPENTRACER_API void Render(Scene* scene, Aggregate* aggregate, RayGenerator* raygen, Texture* output);
+
+		// Any-hit query for primary rays of raygen - traversal stops at the first hit within ray's
+		// (near, far) interval. Output holds one byte per ray (width * height), 1 when the ray is
+		// occluded. Instanced aggregates are not supported, output is cleared (no ray occluded).
+		OPENTRACER_API void TraceOcclusion(Scene* scene, Aggregate* aggregate, RayGenerator* raygen, unsigned char* output);
+
+		// Any-hit queries of count arbitrary rays, e.g. shadow or visibility rays with their own
+		// (near, far) interval. Queued like Trace - rays are copied, occluded receives one byte per
+		// ray (1 when occluded) and must stay valid until the returned handle is done. Caller deletes
+		// the handle. Rays of instanced aggregates are reported as unoccluded.
+		OPENTRACER_API RayBatch* TraceOcclusion(Scene* scene, Aggregate* aggregate, const BatchRay* rays, unsigned int count, unsigned char* occluded);
+
+		// Queues closest hit queries of count arbitrary rays and returns right away. Rays are copied,
+		// hits receive one record per ray and must stay valid until the returned handle is done.
+		// Caller deletes the handle. Several batches may be in flight at once. Instanced aggregates
+		// with native context are not supported, every ray of such batch is reported as a miss.
+		OPENTRACER_API RayBatch* Trace(Scene* scene, Aggregate* aggregate, const BatchRay* rays, unsigned int count, BatchHit* hits);
+
+		// Selects rope (stackless) or stack traversal for KD-trees built with ropes (KDTree.Ropes = 1).
+		// Stack traversal by default.
+		OPENTRACER_API void SetStacklessTraversal(bool enable);
+
+		// Traces KD-trees (stack traversal) and uncompressed BVHs with persistent threads - device is
+		// filled with work items fetching rays from a global queue until it drains. Off by default.
+		OPENTRACER_API void SetPersistentThreads(bool enable);
+
+		// Duration of the last trace kernel in milliseconds
+		OPENTRACER_API float GetLastTraceTime();
+
+		// Tile edge in pixels used by native context (32 by default), rounded up to a multiple of 4
+		OPENTRACER_API void SetTileSize(unsigned int size);
+
+		// Per thread work of the last render with native context, returns number of threads (0 for
+		// OpenCL contexts), at most count entries are written to stats
+		OPENTRACER_API unsigned int GetThreadStatistics(ThreadStatistics* stats, unsigned int count);
+	};
+
+	// Progressive path tracer for diffuse scenes lit by sky and sun - every Render traces one more
+	// sample per pixel and writes the average of all samples to output. Runs as a wavefront of
+	// kernels over queues of live paths on OpenCL device, supports KD-tree and uncompressed BVH
+	// aggregates.
+	class PathTracer
+	{
+	private:
+		void* mData;
+
+	public:
+		OPENTRACER_API PathTracer();
+		OPENTRACER_API ~PathTracer();
+		OPENTRACER_API void Render(Scene* scene, Aggregate* aggregate, RayGenerator* raygen, Texture* output);
+
+		// Restarts accumulation, call after camera or scene changes
+		OPENTRACER_API void Reset();
+		OPENTRACER_API unsigned int GetSampleCount();
+
+		// Number of path vertices (4 by default), 1 gives direct light only
+		OPENTRACER_API void SetMaxDepth(unsigned int depth);
+		OPENTRACER_API void SetSky(float red, float green, float blue);
+		OPENTRACER_API void SetSun(float dirX, float dirY, float dirZ, float red, float green, float blue);
+		OPENTRACER_API void SetAlbedo(float albedo);
+
+		// Duration of the last sample in milliseconds
+		OPENTRACER_API float GetLastTraceTime();
 	};
 }
\ No newline at end of file
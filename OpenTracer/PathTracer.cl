@@ -0,0 +1,372 @@
+// Wavefront path tracer, built together with Renderer.cl. Paths advance one bounce per round of
+// small kernels that pass work through device queues of path indices:
+//   Generate - jittered camera ray for every pixel, path state is reset
+//   Extend   - closest hit of every queued path
+//   Shade    - light sample and diffuse bounce, flags paths that continue and shadow rays
+//   Connect  - any-hit test of shadow rays, unoccluded samples add to path radiance
+// Flags are compacted with prefix sums (ScanGroups, AddGroupOffsets, Compact) between kernels,
+// so that every launch covers live paths only. Path state is stored per component, ray i holds
+// origin (near in w) and direction (far in w) at 2 * i and 2 * i + 1.
+
+// Must match SCAN_GROUP_SIZE in PathTracer.cpp
+#define SCAN_GROUP_SIZE 256
+
+#define PATH_EPSILON 1e-4f
+#define PATH_FAR 1e30f
+#define PATH_PI 3.14159265f
+
+// Integer hash (lowbias32), random numbers are stateless functions of path, sample, bounce and
+// dimension
+uint Hash(uint x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+float Random(uint path, uint sample, uint bounce, uint dimension)
+{
+	uint h = Hash(path ^ Hash(sample * 0x9e3779b9u ^ Hash(bounce * 8 + dimension)));
+	return (float)(h >> 8) * (1.0f / 16777216.0f);
+}
+
+__kernel void Generate(__global float4* rays,
+	__global float4* throughput,
+	__global float4* radiance,
+	__global uint* queue,
+	float4 origin,
+	float4 forward,
+	float4 right,
+	float4 up,
+	float aspect,
+	float near,
+	int2 dimensions,
+	uint sample)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+
+	if (i >= dimensions.x || j >= dimensions.y)
+	{
+		return;
+	}
+
+	uint path = j * dimensions.x + i;
+
+	// Jitter inside the pixel antialiases the accumulated image
+	float u = (float)i + Random(path, sample, 0, 6) - 0.5f - dimensions.x * 0.5f;
+	float v = ((float)j + Random(path, sample, 0, 7) - 0.5f - dimensions.y * 0.5f) * aspect;
+	float4 d = normalize((float4)(forward.xyz + right.xyz * u + up.xyz * v, 0.0f));
+
+	rays[path * 2 + 0] = (float4)(origin.xyz, near);
+	rays[path * 2 + 1] = (float4)(d.xyz, PATH_FAR);
+	throughput[path] = (float4)(1.0f, 1.0f, 1.0f, 0.0f);
+	radiance[path] = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+	queue[path] = path;
+}
+
+__kernel void ExtendBVH(__global uint* queue,
+	uint count,
+	__global float4* triangles,
+	__global struct BVHNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	__global float4* rays,
+	__global float4* hits)
+{
+	uint k = get_global_id(0);
+
+	if (k >= count)
+	{
+		return;
+	}
+
+	uint path = queue[k];
+	hits[path] = TraceBVHRay(triangles, nodes, indices, boundsMin, boundsMax, rays[path * 2 + 0], rays[path * 2 + 1]);
+}
+
+__kernel void ExtendSpatial(__global uint* queue,
+	uint count,
+	__global float4* triangles,
+	__global struct KDNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	int layout,
+	__global float4* rays,
+	__global float4* hits)
+{
+	uint k = get_global_id(0);
+
+	if (k >= count)
+	{
+		return;
+	}
+
+	uint path = queue[k];
+	hits[path] = TraceSpatialRay(triangles, nodes, indices, boundsMin, boundsMax, layout, rays[path * 2 + 0], rays[path * 2 + 1]);
+}
+
+// Misses add sky and terminate. Hits are diffuse with constant albedo - sun is sampled with a
+// shadow ray, the path continues in cosine distributed direction (BRDF * cos / pdf = albedo)
+// and is cut by russian roulette from the third bounce or at maximal depth.
+__kernel void Shade(__global uint* queue,
+	uint count,
+	__global float4* triangles,
+	__global float4* rays,
+	__global float4* hits,
+	__global float4* throughput,
+	__global float4* radiance,
+	__global float4* shadowRays,
+	__global float4* shadowRadiance,
+	__global uint* alive,
+	__global uint* shadow,
+	float4 sky,
+	float4 sunDirection,
+	float4 sunRadiance,
+	float albedo,
+	uint sample,
+	uint bounce,
+	uint maxDepth)
+{
+	uint k = get_global_id(0);
+
+	if (k >= count)
+	{
+		return;
+	}
+
+	uint path = queue[k];
+	float4 hit = hits[path];
+	float4 beta = throughput[path];
+	alive[k] = 0;
+	shadow[k] = 0;
+
+	if (as_int(hit.w) < 0)
+	{
+		radiance[path] += beta * sky;
+		return;
+	}
+
+	// First row of Woop matrix is parallel to geometric normal, it faces the incoming ray
+	float4 o = rays[path * 2 + 0];
+	float4 d = rays[path * 2 + 1];
+	float4 n = triangles[as_int(hit.w) * 3];
+	n = normalize((float4)(n.xyz, 0.0f));
+	if (dot(n.xyz, d.xyz) > 0.0f)
+	{
+		n = -n;
+	}
+
+	// Offset along the normal scales with position, so that new rays never hit the same surface
+	float4 p = (float4)(o.xyz + d.xyz * hit.z, 0.0f);
+	float scale = max(1.0f, max(fabs(p.x), max(fabs(p.y), fabs(p.z))));
+	p = (float4)(p.xyz + n.xyz * (PATH_EPSILON * scale), 0.0f);
+
+	float cosLight = dot(n.xyz, sunDirection.xyz);
+	if (cosLight > 0.0f)
+	{
+		shadowRays[path * 2 + 0] = p;
+		shadowRays[path * 2 + 1] = (float4)(sunDirection.xyz, PATH_FAR);
+		shadowRadiance[path] = beta * sunRadiance * (albedo * cosLight / PATH_PI);
+		shadow[k] = 1;
+	}
+
+	if (bounce + 1 >= maxDepth)
+	{
+		return;
+	}
+
+	beta *= albedo;
+	if (bounce >= 2)
+	{
+		float q = min(max(beta.x, max(beta.y, beta.z)), 1.0f);
+		if (Random(path, sample, bounce, 2) >= q)
+		{
+			return;
+		}
+		beta /= q;
+	}
+
+	// Cosine distributed direction in tangent frame of the normal
+	float r1 = Random(path, sample, bounce, 0);
+	float r2 = Random(path, sample, bounce, 1);
+	float phi = 2.0f * PATH_PI * r1;
+	float r = sqrt(r2);
+	float4 t = fabs(n.x) > 0.5f ? (float4)(n.y, -n.x, 0.0f, 0.0f) : (float4)(0.0f, n.z, -n.y, 0.0f);
+	t = normalize(t);
+	float4 b = cross(n, t);
+	float4 w = normalize(t * (r * cos(phi)) + b * (r * sin(phi)) + n * sqrt(max(0.0f, 1.0f - r2)));
+
+	rays[path * 2 + 0] = p;
+	rays[path * 2 + 1] = (float4)(w.xyz, PATH_FAR);
+	throughput[path] = beta;
+	alive[k] = 1;
+}
+
+__kernel void ConnectBVH(__global uint* queue,
+	uint count,
+	__global float4* triangles,
+	__global struct BVHNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	__global float4* shadowRays,
+	__global float4* shadowRadiance,
+	__global float4* radiance)
+{
+	uint k = get_global_id(0);
+
+	if (k >= count)
+	{
+		return;
+	}
+
+	uint path = queue[k];
+	if (!OccludedBVHRay(triangles, nodes, indices, boundsMin, boundsMax, shadowRays[path * 2 + 0], shadowRays[path * 2 + 1]))
+	{
+		radiance[path] += shadowRadiance[path];
+	}
+}
+
+__kernel void ConnectSpatial(__global uint* queue,
+	uint count,
+	__global float4* triangles,
+	__global struct KDNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	int layout,
+	__global float4* shadowRays,
+	__global float4* shadowRadiance,
+	__global float4* radiance)
+{
+	uint k = get_global_id(0);
+
+	if (k >= count)
+	{
+		return;
+	}
+
+	uint path = queue[k];
+	if (!OccludedSpatialRay(triangles, nodes, indices, boundsMin, boundsMax, layout, shadowRays[path * 2 + 0], shadowRays[path * 2 + 1]))
+	{
+		radiance[path] += shadowRadiance[path];
+	}
+}
+
+// Exclusive prefix sum of every SCAN_GROUP_SIZE elements (Hillis-Steele, double buffered in
+// local memory), totals of the groups go to sums. Input and output may be the same buffer.
+__kernel void ScanGroups(__global uint* input,
+	__global uint* output,
+	__global uint* sums,
+	uint count)
+{
+	__local uint scan[2 * SCAN_GROUP_SIZE];
+
+	uint i = get_global_id(0);
+	uint l = get_local_id(0);
+	uint value = i < count ? input[i] : 0;
+
+	uint current = 0;
+	scan[l] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint offset = 1; offset < SCAN_GROUP_SIZE; offset <<= 1)
+	{
+		uint previous = current;
+		current = 1 - current;
+
+		uint sum = scan[previous * SCAN_GROUP_SIZE + l];
+		if (l >= offset)
+		{
+			sum += scan[previous * SCAN_GROUP_SIZE + l - offset];
+		}
+		scan[current * SCAN_GROUP_SIZE + l] = sum;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	uint inclusive = scan[current * SCAN_GROUP_SIZE + l];
+	if (i < count)
+	{
+		output[i] = inclusive - value;
+	}
+
+	if (l == SCAN_GROUP_SIZE - 1)
+	{
+		sums[get_group_id(0)] = inclusive;
+	}
+}
+
+// Adds scanned group totals to group-local prefix sums, launched with the same groups as
+// ScanGroups
+__kernel void AddGroupOffsets(__global uint* data,
+	__global uint* sums,
+	uint count)
+{
+	uint i = get_global_id(0);
+
+	if (i < count)
+	{
+		data[i] += sums[get_group_id(0)];
+	}
+}
+
+// Moves flagged queue entries to their prefix sum offsets, the last item writes the new count
+__kernel void Compact(__global uint* flags,
+	__global uint* offsets,
+	__global uint* input,
+	__global uint* output,
+	__global uint* total,
+	uint count)
+{
+	uint i = get_global_id(0);
+
+	if (i >= count)
+	{
+		return;
+	}
+
+	uint flag = flags[i];
+	uint offset = offsets[i];
+	if (flag)
+	{
+		output[offset] = input[i];
+	}
+
+	if (i == count - 1)
+	{
+		total[0] = offset + flag;
+	}
+}
+
+// Adds radiance of finished paths to the running sum, output gets the average (first sample
+// overwrites the sum)
+__kernel void Accumulate(__global float4* radiance,
+	__global float4* accumulation,
+	__global float4* output,
+	int2 dimensions,
+	uint sample)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+
+	if (i >= dimensions.x || j >= dimensions.y)
+	{
+		return;
+	}
+
+	uint path = j * dimensions.x + i;
+	float4 sum = radiance[path];
+	if (sample > 0)
+	{
+		sum += accumulation[path];
+	}
+
+	accumulation[path] = sum;
+	output[path] = (float4)(sum.xyz / (float)(sample + 1), 1.0f);
+}
@@ -0,0 +1,361 @@
+#include "PathTracer.h"
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <iostream>
+#include <chrono>
+
+using namespace OpenTracerCore;
+
+// Must match SCAN_GROUP_SIZE in PathTracer.cl
+#define SCAN_GROUP_SIZE 256
+
+cl::Program* PathTracer::mProgram = NULL;
+cl::Kernel* PathTracer::mKernelGenerate = NULL;
+cl::Kernel* PathTracer::mKernelExtendBVH = NULL;
+cl::Kernel* PathTracer::mKernelExtendSpatial = NULL;
+cl::Kernel* PathTracer::mKernelShade = NULL;
+cl::Kernel* PathTracer::mKernelConnectBVH = NULL;
+cl::Kernel* PathTracer::mKernelConnectSpatial = NULL;
+cl::Kernel* PathTracer::mKernelScanGroups = NULL;
+cl::Kernel* PathTracer::mKernelAddGroupOffsets = NULL;
+cl::Kernel* PathTracer::mKernelCompact = NULL;
+cl::Kernel* PathTracer::mKernelAccumulate = NULL;
+
+static cl_float4 ToDevice(const float4& v)
+{
+	cl_float4 result;
+	result.s[0] = v.x; result.s[1] = v.y; result.s[2] = v.z; result.s[3] = v.w;
+	return result;
+}
+
+PathTracer::PathTracer(Context* context)
+{
+	mContext = context;
+	mPaths = 0;
+	mRays = NULL;
+	mHits = NULL;
+	mThroughput = NULL;
+	mRadiance = NULL;
+	mAccumulation = NULL;
+	mShadowRays = NULL;
+	mShadowRadiance = NULL;
+	mQueues[0] = NULL;
+	mQueues[1] = NULL;
+	mShadowQueue = NULL;
+	mAlive = NULL;
+	mShadow = NULL;
+	mOffsets = NULL;
+	mCount = NULL;
+	mSample = 0;
+	mMaxDepth = 4;
+	mSky = float4(0.6f, 0.7f, 0.9f, 0.0f);
+	mSunDirection = normalize(float4(0.3f, 1.0f, 0.2f, 0.0f));
+	mSunRadiance = float4(3.0f, 2.8f, 2.5f, 0.0f);
+	mAlbedo = 0.7f;
+	mLastTraceTime = 0.0f;
+
+	// Path tracer needs device queues, native context has no program to build
+	if (mContext->IsNative())
+	{
+		return;
+	}
+
+	if (!mProgram)
+	{
+		// Kernels call ray functions of Renderer.cl, both sources form one program
+		std::ifstream rf("C:\\Programming\\OpenTracer\\OpenTracer\\Renderer.cl");
+		std::string r(std::istreambuf_iterator<char>(rf), (std::istreambuf_iterator<char>()));
+		std::ifstream pf("C:\\Programming\\OpenTracer\\OpenTracer\\PathTracer.cl");
+		std::string p(std::istreambuf_iterator<char>(pf), (std::istreambuf_iterator<char>()));
+		cl::Program::Sources source;
+		source.push_back(std::make_pair(r.c_str(), r.length()));
+		source.push_back(std::make_pair(p.c_str(), p.length() + 1));
+		mProgram = new cl::Program(mContext->GetContext(), source);
+		mProgram->build(mContext->GetDevices(), "-cl-mad-enable -cl-unsafe-math-optimizations -cl-finite-math-only -cl-fast-relaxed-math");
+		std::cout << mProgram->getBuildInfo<CL_PROGRAM_BUILD_LOG>(mContext->GetDevices()[0]) << std::endl;
+		mKernelGenerate = new cl::Kernel(*mProgram, "Generate");
+		mKernelExtendBVH = new cl::Kernel(*mProgram, "ExtendBVH");
+		mKernelExtendSpatial = new cl::Kernel(*mProgram, "ExtendSpatial");
+		mKernelShade = new cl::Kernel(*mProgram, "Shade");
+		mKernelConnectBVH = new cl::Kernel(*mProgram, "ConnectBVH");
+		mKernelConnectSpatial = new cl::Kernel(*mProgram, "ConnectSpatial");
+		mKernelScanGroups = new cl::Kernel(*mProgram, "ScanGroups");
+		mKernelAddGroupOffsets = new cl::Kernel(*mProgram, "AddGroupOffsets");
+		mKernelCompact = new cl::Kernel(*mProgram, "Compact");
+		mKernelAccumulate = new cl::Kernel(*mProgram, "Accumulate");
+	}
+
+	mCount = new cl::Buffer(mContext->GetContext(), CL_MEM_READ_WRITE, sizeof(cl_uint));
+}
+
+PathTracer::~PathTracer()
+{
+	Release();
+	delete mCount;
+}
+
+void PathTracer::Release()
+{
+	delete mRays;
+	delete mHits;
+	delete mThroughput;
+	delete mRadiance;
+	delete mAccumulation;
+	delete mShadowRays;
+	delete mShadowRadiance;
+	delete mQueues[0];
+	delete mQueues[1];
+	delete mShadowQueue;
+	delete mAlive;
+	delete mShadow;
+	delete mOffsets;
+	for (size_t i = 0; i < mGroupSums.size(); i++)
+	{
+		delete mGroupSums[i];
+	}
+	mGroupSums.clear();
+	mPaths = 0;
+}
+
+void PathTracer::Resize(unsigned int paths)
+{
+	Release();
+
+	const cl::Context& context = mContext->GetContext();
+	mRays = new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float4) * 2 * paths);
+	mHits = new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float4) * paths);
+	mThroughput = new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float4) * paths);
+	mRadiance = new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float4) * paths);
+	mAccumulation = new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float4) * paths);
+	mShadowRays = new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float4) * 2 * paths);
+	mShadowRadiance = new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float4) * paths);
+	mQueues[0] = new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * paths);
+	mQueues[1] = new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * paths);
+	mShadowQueue = new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * paths);
+	mAlive = new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * paths);
+	mShadow = new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * paths);
+	mOffsets = new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * paths);
+
+	// Every level holds one total per group of the level below, down to a single group
+	unsigned int count = paths;
+	do
+	{
+		count = (count + SCAN_GROUP_SIZE - 1) / SCAN_GROUP_SIZE;
+		mGroupSums.push_back(new cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * count));
+	} while (count > 1);
+
+	mPaths = paths;
+}
+
+void PathTracer::SetSun(const float4& direction, const float4& radiance)
+{
+	mSunDirection = normalize(float4(direction.x, direction.y, direction.z, 0.0f));
+	mSunRadiance = radiance;
+	mSample = 0;
+}
+
+void PathTracer::Scan(cl::Buffer* input, cl::Buffer* output, unsigned int count, unsigned int level)
+{
+	cl::CommandQueue& queue = mContext->GetCommandQueue();
+	unsigned int groups = (count + SCAN_GROUP_SIZE - 1) / SCAN_GROUP_SIZE;
+	cl::Buffer* sums = mGroupSums[level];
+
+	mKernelScanGroups->setArg(0, *input);
+	mKernelScanGroups->setArg(1, *output);
+	mKernelScanGroups->setArg(2, *sums);
+	mKernelScanGroups->setArg(3, count);
+	queue.enqueueNDRangeKernel(*mKernelScanGroups, cl::NullRange, cl::NDRange(groups * SCAN_GROUP_SIZE), cl::NDRange(SCAN_GROUP_SIZE));
+
+	// Group totals are scanned in place, then added to every element of their group
+	if (groups > 1)
+	{
+		Scan(sums, sums, groups, level + 1);
+
+		mKernelAddGroupOffsets->setArg(0, *output);
+		mKernelAddGroupOffsets->setArg(1, *sums);
+		mKernelAddGroupOffsets->setArg(2, count);
+		queue.enqueueNDRangeKernel(*mKernelAddGroupOffsets, cl::NullRange, cl::NDRange(groups * SCAN_GROUP_SIZE), cl::NDRange(SCAN_GROUP_SIZE));
+	}
+}
+
+unsigned int PathTracer::Compact(cl::Buffer* flags, cl::Buffer* input, cl::Buffer* output, unsigned int count)
+{
+	Scan(flags, mOffsets, count, 0);
+
+	mKernelCompact->setArg(0, *flags);
+	mKernelCompact->setArg(1, *mOffsets);
+	mKernelCompact->setArg(2, *input);
+	mKernelCompact->setArg(3, *output);
+	mKernelCompact->setArg(4, *mCount);
+	mKernelCompact->setArg(5, count);
+	mContext->GetCommandQueue().enqueueNDRangeKernel(*mKernelCompact, cl::NullRange, cl::NDRange(count));
+
+	// Launch sizes of the next kernels depend on the count, it is the only read back per step
+	cl_uint total = 0;
+	mContext->GetCommandQueue().enqueueReadBuffer(*mCount, CL_TRUE, 0, sizeof(cl_uint), &total);
+	return total;
+}
+
+void PathTracer::Render(RayBuffer* rayBuffer, Texture* output, cl::Kernel* extend, cl::Kernel* connect)
+{
+	cl::CommandQueue& queue = mContext->GetCommandQueue();
+	unsigned int width = (unsigned int)output->GetWidth();
+	unsigned int height = (unsigned int)output->GetHeight();
+	unsigned int paths = width * height;
+	if (paths == 0)
+	{
+		return;
+	}
+
+	if (paths != mPaths)
+	{
+		Resize(paths);
+		mSample = 0;
+	}
+
+	cl_int2 dimensions;
+	dimensions.s[0] = width;
+	dimensions.s[1] = height;
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	mKernelGenerate->setArg(0, *mRays);
+	mKernelGenerate->setArg(1, *mThroughput);
+	mKernelGenerate->setArg(2, *mRadiance);
+	mKernelGenerate->setArg(3, *mQueues[0]);
+	mKernelGenerate->setArg(4, ToDevice(rayBuffer->GetOrigin()));
+	mKernelGenerate->setArg(5, ToDevice(rayBuffer->GetForward()));
+	mKernelGenerate->setArg(6, ToDevice(rayBuffer->GetRight()));
+	mKernelGenerate->setArg(7, ToDevice(rayBuffer->GetUp()));
+	mKernelGenerate->setArg(8, rayBuffer->GetAspect());
+	mKernelGenerate->setArg(9, rayBuffer->GetNear());
+	mKernelGenerate->setArg(10, dimensions);
+	mKernelGenerate->setArg(11, mSample);
+	queue.enqueueNDRangeKernel(*mKernelGenerate, cl::NullRange, cl::NDRange(width, height));
+
+	// Queue and count are the first two arguments of every queue kernel
+	extend->setArg(extend == mKernelExtendBVH ? 7 : 8, *mRays);
+	extend->setArg(extend == mKernelExtendBVH ? 8 : 9, *mHits);
+	connect->setArg(connect == mKernelConnectBVH ? 7 : 8, *mShadowRays);
+	connect->setArg(connect == mKernelConnectBVH ? 8 : 9, *mShadowRadiance);
+	connect->setArg(connect == mKernelConnectBVH ? 9 : 10, *mRadiance);
+
+	mKernelShade->setArg(3, *mRays);
+	mKernelShade->setArg(4, *mHits);
+	mKernelShade->setArg(5, *mThroughput);
+	mKernelShade->setArg(6, *mRadiance);
+	mKernelShade->setArg(7, *mShadowRays);
+	mKernelShade->setArg(8, *mShadowRadiance);
+	mKernelShade->setArg(9, *mAlive);
+	mKernelShade->setArg(10, *mShadow);
+	mKernelShade->setArg(11, ToDevice(mSky));
+	mKernelShade->setArg(12, ToDevice(mSunDirection));
+	mKernelShade->setArg(13, ToDevice(mSunRadiance));
+	mKernelShade->setArg(14, mAlbedo);
+	mKernelShade->setArg(15, mSample);
+	mKernelShade->setArg(17, mMaxDepth);
+
+	unsigned int count = paths;
+	unsigned int current = 0;
+	for (unsigned int bounce = 0; bounce < mMaxDepth && count > 0; bounce++)
+	{
+		extend->setArg(0, *mQueues[current]);
+		extend->setArg(1, count);
+		queue.enqueueNDRangeKernel(*extend, cl::NullRange, cl::NDRange(count));
+
+		mKernelShade->setArg(0, *mQueues[current]);
+		mKernelShade->setArg(1, count);
+		mKernelShade->setArg(16, bounce);
+		queue.enqueueNDRangeKernel(*mKernelShade, cl::NullRange, cl::NDRange(count));
+
+		unsigned int shadows = Compact(mShadow, mQueues[current], mShadowQueue, count);
+		if (shadows > 0)
+		{
+			connect->setArg(0, *mShadowQueue);
+			connect->setArg(1, shadows);
+			queue.enqueueNDRangeKernel(*connect, cl::NullRange, cl::NDRange(shadows));
+		}
+
+		count = Compact(mAlive, mQueues[current], mQueues[1 - current], count);
+		current = 1 - current;
+	}
+
+	mKernelAccumulate->setArg(0, *mRadiance);
+	mKernelAccumulate->setArg(1, *mAccumulation);
+	mKernelAccumulate->setArg(2, *output->GetDeviceData());
+	mKernelAccumulate->setArg(3, dimensions);
+	mKernelAccumulate->setArg(4, mSample);
+	queue.enqueueNDRangeKernel(*mKernelAccumulate, cl::NullRange, cl::NDRange(width, height));
+	queue.finish();
+
+	mSample++;
+	mLastTraceTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void PathTracer::Render(Scene* scene, Spatial* spatial, RayBuffer* rayBuffer, Texture* output)
+{
+	if (mContext->IsNative())
+	{
+		std::cout << "Path tracer is not supported by native context" << std::endl;
+		return;
+	}
+
+	cl_float4 pmin, pmax;
+	pmin.s[0] = spatial->GetBounds().mMin.x; pmin.s[1] = spatial->GetBounds().mMin.y; pmin.s[2] = spatial->GetBounds().mMin.z; pmin.s[3] = spatial->GetBounds().mMin.w;
+	pmax.s[0] = spatial->GetBounds().mMax.x; pmax.s[1] = spatial->GetBounds().mMax.y; pmax.s[2] = spatial->GetBounds().mMax.z; pmax.s[3] = spatial->GetBounds().mMax.w;
+
+	mKernelShade->setArg(2, *spatial->GetTriangles());
+
+	mKernelExtendSpatial->setArg(2, *spatial->GetTriangles());
+	mKernelExtendSpatial->setArg(3, *spatial->GetNodes());
+	mKernelExtendSpatial->setArg(4, *spatial->GetIndices());
+	mKernelExtendSpatial->setArg(5, pmin);
+	mKernelExtendSpatial->setArg(6, pmax);
+	mKernelExtendSpatial->setArg(7, spatial->GetLayout());
+
+	mKernelConnectSpatial->setArg(2, *spatial->GetTriangles());
+	mKernelConnectSpatial->setArg(3, *spatial->GetNodes());
+	mKernelConnectSpatial->setArg(4, *spatial->GetIndices());
+	mKernelConnectSpatial->setArg(5, pmin);
+	mKernelConnectSpatial->setArg(6, pmax);
+	mKernelConnectSpatial->setArg(7, spatial->GetLayout());
+
+	Render(rayBuffer, output, mKernelExtendSpatial, mKernelConnectSpatial);
+}
+
+void PathTracer::Render(Scene* scene, Hierarchy* hierarchy, RayBuffer* rayBuffer, Texture* output)
+{
+	if (mContext->IsNative())
+	{
+		std::cout << "Path tracer is not supported by native context" << std::endl;
+		return;
+	}
+
+	if (hierarchy->IsCompressed())
+	{
+		std::cout << "Compressed BVH is not supported by path tracer" << std::endl;
+		return;
+	}
+
+	cl_float4 pmin, pmax;
+	pmin.s[0] = hierarchy->GetBounds().mMin.x; pmin.s[1] = hierarchy->GetBounds().mMin.y; pmin.s[2] = hierarchy->GetBounds().mMin.z; pmin.s[3] = hierarchy->GetBounds().mMin.w;
+	pmax.s[0] = hierarchy->GetBounds().mMax.x; pmax.s[1] = hierarchy->GetBounds().mMax.y; pmax.s[2] = hierarchy->GetBounds().mMax.z; pmax.s[3] = hierarchy->GetBounds().mMax.w;
+
+	mKernelShade->setArg(2, *hierarchy->GetTriangles());
+
+	mKernelExtendBVH->setArg(2, *hierarchy->GetTriangles());
+	mKernelExtendBVH->setArg(3, *hierarchy->GetNodes());
+	mKernelExtendBVH->setArg(4, *hierarchy->GetIndices());
+	mKernelExtendBVH->setArg(5, pmin);
+	mKernelExtendBVH->setArg(6, pmax);
+
+	mKernelConnectBVH->setArg(2, *hierarchy->GetTriangles());
+	mKernelConnectBVH->setArg(3, *hierarchy->GetNodes());
+	mKernelConnectBVH->setArg(4, *hierarchy->GetIndices());
+	mKernelConnectBVH->setArg(5, pmin);
+	mKernelConnectBVH->setArg(6, pmax);
+
+	Render(rayBuffer, output, mKernelExtendBVH, mKernelConnectBVH);
+}
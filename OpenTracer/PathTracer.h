@@ -0,0 +1,96 @@
+#ifndef __PATH_TRACER_H__
+#define __PATH_TRACER_H__
+
+#include "Texture.h"
+#include "RayBuffer.h"
+#include "Scene.h"
+#include "Aggregate/Spatial.h"
+#include "Aggregate/Hierarchy.h"
+#include <vector>
+
+namespace OpenTracerCore
+{
+	// Progressive wavefront path tracer on OpenCL device, see PathTracer.cl. Each Render traces
+	// one sample per pixel - generate, then extend, shade and connect rounds until the path queue
+	// drains or maximal depth is reached, between the kernels flagged entries are compacted into
+	// queues of live paths by prefix sums. Output texture gets the average of all samples since
+	// the last Reset. Surfaces are grey diffuse, lit by constant sky and directional sun.
+	class PathTracer
+	{
+	private:
+		static cl::Program* mProgram;
+		static cl::Kernel* mKernelGenerate;
+		static cl::Kernel* mKernelExtendBVH;
+		static cl::Kernel* mKernelExtendSpatial;
+		static cl::Kernel* mKernelShade;
+		static cl::Kernel* mKernelConnectBVH;
+		static cl::Kernel* mKernelConnectSpatial;
+		static cl::Kernel* mKernelScanGroups;
+		static cl::Kernel* mKernelAddGroupOffsets;
+		static cl::Kernel* mKernelCompact;
+		static cl::Kernel* mKernelAccumulate;
+		Context* mContext;
+
+		// Path state for every pixel, buffers are reallocated when resolution changes
+		unsigned int mPaths;
+		cl::Buffer* mRays;
+		cl::Buffer* mHits;
+		cl::Buffer* mThroughput;
+		cl::Buffer* mRadiance;
+		cl::Buffer* mAccumulation;
+		cl::Buffer* mShadowRays;
+		cl::Buffer* mShadowRadiance;
+
+		// Ping-pong queues of live paths, queue of shadow rays, flags and their prefix sums
+		cl::Buffer* mQueues[2];
+		cl::Buffer* mShadowQueue;
+		cl::Buffer* mAlive;
+		cl::Buffer* mShadow;
+		cl::Buffer* mOffsets;
+		cl::Buffer* mCount;
+
+		// Group totals of every level of the scan
+		std::vector<cl::Buffer*> mGroupSums;
+
+		unsigned int mSample;
+		unsigned int mMaxDepth;
+		float4 mSky;
+		float4 mSunDirection;
+		float4 mSunRadiance;
+		float mAlbedo;
+		float mLastTraceTime;
+
+		void Resize(unsigned int paths);
+		void Release();
+
+		// Exclusive prefix sum of count values, level selects buffer of group totals
+		void Scan(cl::Buffer* input, cl::Buffer* output, unsigned int count, unsigned int level);
+
+		// Copies entries of input queue with nonzero flag to output, returns their number
+		unsigned int Compact(cl::Buffer* flags, cl::Buffer* input, cl::Buffer* output, unsigned int count);
+
+		// Runs one sample, extend and connect kernels have aggregate arguments set
+		void Render(RayBuffer* rayBuffer, Texture* output, cl::Kernel* extend, cl::Kernel* connect);
+
+	public:
+		PathTracer(Context* context);
+		~PathTracer();
+		void Render(Scene* scene, Spatial* spatial, RayBuffer* rayBuffer, Texture* output);
+		void Render(Scene* scene, Hierarchy* hierarchy, RayBuffer* rayBuffer, Texture* output);
+
+		// Restarts accumulation, call after camera or scene changes
+		void Reset() { mSample = 0; }
+		unsigned int GetSampleCount() { return mSample; }
+
+		// Number of path vertices, 1 gives direct light only
+		void SetMaxDepth(unsigned int depth) { mMaxDepth = depth > 0 ? depth : 1; mSample = 0; }
+		void SetSky(const float4& radiance) { mSky = radiance; mSample = 0; }
+		void SetSun(const float4& direction, const float4& radiance);
+		void SetAlbedo(float albedo) { mAlbedo = albedo; mSample = 0; }
+
+		// Duration of the last sample in milliseconds
+		float GetLastTraceTime() { return mLastTraceTime; }
+	};
+}
+
+#endif
@@ -0,0 +1,116 @@
+#include "RayBatch.h"
+#include <cstring>
+
+using namespace OpenTracerCore;
+
+RayBatch::RayBatch(Context* context, const float* rays, unsigned int count, float* hits)
+{
+	mHits = hits;
+	mOccluded = NULL;
+	Init(context, rays, count, sizeof(float4));
+}
+
+RayBatch::RayBatch(Context* context, const float* rays, unsigned int count, unsigned char* occluded)
+{
+	mHits = NULL;
+	mOccluded = occluded;
+	Init(context, rays, count, sizeof(unsigned char));
+}
+
+void RayBatch::Init(Context* context, const float* rays, unsigned int count, size_t resultSize)
+{
+	mContext = context;
+	mCount = count;
+	mDeviceRays = NULL;
+	mDeviceHits = NULL;
+	mQueued = false;
+	mScheduler = NULL;
+
+	mRays = (float4*)_aligned_malloc((count > 0 ? count : 1) * sizeof(float4) * 4, 16);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		const float* r = rays + i * 8;
+		float4 d = normalize(float4(r[4], r[5], r[6], 0.0f));
+		mRays[i * 4 + 0] = float4(r[0], r[1], r[2], r[3]);
+		mRays[i * 4 + 1] = float4(d.x, d.y, d.z, r[7]);
+		mRays[i * 4 + 2] = float4(0.0f, 0.0f, 0.0f, 0.0f);
+		mRays[i * 4 + 3] = float4(0.0f, 0.0f, 0.0f, 0.0f);
+	}
+
+	// Upload is queued before the trace kernel, in-order queue needs no wait here
+	if (!mContext->IsNative() && count > 0)
+	{
+		mDeviceRays = new cl::Buffer(mContext->GetContext(), CL_MEM_READ_ONLY, count * sizeof(float4) * 4);
+		mDeviceHits = new cl::Buffer(mContext->GetContext(), CL_MEM_WRITE_ONLY, count * resultSize);
+		mContext->GetCommandQueue().enqueueWriteBuffer(*mDeviceRays, CL_FALSE, 0, count * sizeof(float4) * 4, mRays);
+	}
+}
+
+RayBatch::~RayBatch()
+{
+	Wait();
+
+	// Upload may still be pending when the batch was never traced
+	if (mDeviceRays)
+	{
+		mContext->GetCommandQueue().finish();
+	}
+
+	delete mDeviceRays;
+	delete mDeviceHits;
+	_aligned_free(mRays);
+}
+
+bool RayBatch::IsDone()
+{
+	if (mScheduler)
+	{
+		return mGroup.mPending == 0;
+	}
+
+	return !mQueued || mEvent.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE;
+}
+
+void RayBatch::Wait()
+{
+	// Waiting thread executes remaining tasks, batch completes even with a single worker
+	if (mScheduler)
+	{
+		mScheduler->Wait(mGroup);
+	}
+	else if (mQueued)
+	{
+		mEvent.wait();
+	}
+}
+
+void RayBatch::WriteMisses()
+{
+	if (mOccluded)
+	{
+		memset(mOccluded, 0, mCount);
+		return;
+	}
+
+	const int miss = -1;
+	for (unsigned int i = 0; i < mCount; i++)
+	{
+		float* hit = mHits + i * 4;
+		hit[0] = 0.0f;
+		hit[1] = 0.0f;
+		hit[2] = mRays[i * 4 + 1].w;
+		memcpy(&hit[3], &miss, sizeof(int));
+	}
+}
+
+void RayBatch::SetEvent(const cl::Event& evt)
+{
+	mEvent = evt;
+	mQueued = true;
+}
+
+TaskScheduler::TaskGroup& RayBatch::GetGroup(TaskScheduler* scheduler)
+{
+	mScheduler = scheduler;
+	return mGroup;
+}
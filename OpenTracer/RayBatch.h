@@ -0,0 +1,118 @@
+#ifndef __RAY_BATCH_H__
+#define __RAY_BATCH_H__
+
+#include "Context.h"
+#include "Math/Numeric/Float4.h"
+#include "Math/Shapes/RayPacket.h"
+#include "Util/TaskScheduler.h"
+
+namespace OpenTracerCore
+{
+	// Arbitrary rays traced as one asynchronous job. Rays are copied on creation in the layout of
+	// ray buffer (origin with near in w, normalized direction with far in w and two unused
+	// differentials), so that trace kernels read them as a width x 1 image. Hits are written to
+	// the caller's array in the layout of kernel results - barycentrics, distance and id (-1 on
+	// miss). Occlusion batches write one byte per ray instead, 1 when any hit lies within the
+	// ray's (near, far) interval. Completion is tracked by event of the read back (OpenCL) or by
+	// task group of the native scheduler.
+	class RayBatch
+	{
+	private:
+		Context* mContext;
+		unsigned int mCount;
+		float4* mRays;
+		float* mHits;
+		unsigned char* mOccluded;
+
+		cl::Buffer* mDeviceRays;
+		cl::Buffer* mDeviceHits;
+		cl::Event mEvent;
+		bool mQueued;
+
+		TaskScheduler* mScheduler;
+		TaskScheduler::TaskGroup mGroup;
+
+		// Copies rays and uploads them, results take given number of bytes per ray
+		void Init(Context* context, const float* rays, unsigned int count, size_t resultSize);
+
+	public:
+		// Rays hold 8 floats each - origin, near, direction and far. Hits receive 4 floats per ray.
+		RayBatch(Context* context, const float* rays, unsigned int count, float* hits);
+
+		// Any-hit batch, occluded receives one byte per ray
+		RayBatch(Context* context, const float* rays, unsigned int count, unsigned char* occluded);
+
+		// Waits for the batch, so that no queued work writes to freed memory
+		~RayBatch();
+
+		bool IsDone();
+		void Wait();
+
+		unsigned int GetCount() const { return mCount; }
+		float* GetHits() { return mHits; }
+
+		// Output of occlusion batch, NULL for closest hit batch
+		unsigned char* GetOccluded() { return mOccluded; }
+		cl::Buffer* GetRayBuffer() { return mDeviceRays; }
+		cl::Buffer* GetHitBuffer() { return mDeviceHits; }
+
+		// Writes miss record (id -1, distance far, or 0 for occlusion) for every ray, used when
+		// aggregate cannot be traced so that caller never reads uninitialized hits
+		void WriteMisses();
+
+		// Event of the last command writing hits
+		void SetEvent(const cl::Event& evt);
+
+		// Group of native tasks tracing the batch on given scheduler
+		TaskScheduler::TaskGroup& GetGroup(TaskScheduler* scheduler);
+
+		// Rays first .. first + N - 1, lanes past the end repeat the first ray. Returns mask of
+		// lanes inside the batch.
+		template<unsigned int N>
+		int GeneratePacket(unsigned int first, RayPacket<N>& packet) const
+		{
+			int mask = 0;
+			for (int k = 0; k < RayPacket<N>::SIZE; k++)
+			{
+				unsigned int i = first + k;
+				if (i < mCount)
+				{
+					mask |= 1 << k;
+				}
+				else
+				{
+					i = first;
+				}
+
+				// Direction holds far in w, which must stay out of normalization
+				const float4& o = this->mRays[i * 4 + 0];
+				const float4& d = this->mRays[i * 4 + 1];
+				packet.Set(k, o, float4(d.x, d.y, d.z, 0.0f), o.w, d.w);
+			}
+
+			return mask;
+		}
+
+		void* operator new(size_t size)
+		{
+			return _aligned_malloc(size, 16);
+		}
+
+		void* operator new[](size_t size)
+		{
+			return _aligned_malloc(size, 16);
+		}
+
+		void operator delete(void* ptr)
+		{
+			_aligned_free(ptr);
+		}
+
+		void operator delete[](void* ptr)
+		{
+			_aligned_free(ptr);
+		}
+	};
+}
+
+#endif
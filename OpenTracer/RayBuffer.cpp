@@ -13,8 +13,12 @@ cl::Kernel* RayBuffer::mKernel = NULL;
 RayBuffer::RayBuffer(Context* context)
 {
 	mContext = context;
+	mDeviceData = NULL;
+	mWidth = 0.0f;
+	mHeight = 0.0f;
 
-	if (!mProgram)
+	// Native context generates rays on host while tracing, kernel is never needed
+	if (!mProgram && !mContext->IsNative())
 	{
 		std::ifstream sf("C:\\Programming\\OpenTracer\\OpenTracer\\RayBuffer.cl");
 		std::string s(std::istreambuf_iterator<char>(sf), (std::istreambuf_iterator<char>()));
@@ -33,7 +37,7 @@ RayBuffer::~RayBuffer()
 
 void RayBuffer::SetCamera(const float4& position, const float4& target, const float4& up, float aspect, float fov, int width, int height, float nearPlane, float farPlane)
 {
-	if (width != (int)mWidth || height != (int)mHeight)
+	if ((width != (int)mWidth || height != (int)mHeight) && !mContext->IsNative())
 	{
 		if (mDeviceData)
 		{
@@ -52,10 +56,16 @@ void RayBuffer::SetCamera(const float4& position, const float4& target, const fl
 	mHeight = (float)height;
 	mNear = nearPlane;
 	mFar = farPlane;
+	mPlanePos = mHeight * 0.5f / tanf(mFov * 0.5f * 3.141592654f / 180.0f);
 }
 
 void RayBuffer::GeneratePrimary()
 {
+	if (mContext->IsNative())
+	{
+		return;
+	}
+
 	size_t items = (int)mWidth * (int)mHeight;
 	cl_float2 halfDim = { mWidth * 0.5f, mHeight * 0.5f };
 	cl_float2 invHalfDim = { 1.0f / halfDim.s[0], 1.0f / halfDim.s[1] };
@@ -3,6 +3,7 @@
 
 #include "Context.h"
 #include "Math/Numeric/Float4.h"
+#include "Math/Shapes/RayPacket.h"
 
 namespace OpenTracerCore
 {
@@ -19,6 +20,7 @@ namespace OpenTracerCore
 		float mHeight;
 		float mNear;
 		float mFar;
+		float mPlanePos;
 
 		Context* mContext;
 		
@@ -33,6 +35,49 @@ namespace OpenTracerCore
 		void GeneratePrimary();
 		cl::Buffer* GetRayBuffer() { return mDeviceData; }
 
+		// Primary rays of the packet footprint starting at (x, y) generated on host, same as Primary
+		// kernel generates them. Returns mask of lanes inside the image.
+		template<unsigned int N>
+		int GeneratePacket(int x, int y, RayPacket<N>& packet) const
+		{
+			int mask = 0;
+			float4 forward = mForward * mPlanePos;
+			for (int k = 0; k < RayPacket<N>::SIZE; k++)
+			{
+				// Lanes outside of the image repeat the first ray, so that packet stays coherent
+				int i = x + k % RayPacket<N>::WIDTH;
+				int j = y + k / RayPacket<N>::WIDTH;
+				if (i < (int)mWidth && j < (int)mHeight)
+				{
+					mask |= 1 << k;
+				}
+				else
+				{
+					i = x;
+					j = y;
+				}
+
+				float u = (float)i - mWidth * 0.5f;
+				float v = ((float)j - mHeight * 0.5f) * mAspect;
+				packet.Set(k, mOrigin, forward + mRight * u + mUp * v, mNear, mFar);
+			}
+
+			return mask;
+		}
+
+		int GetWidth() const { return (int)mWidth; }
+		int GetHeight() const { return (int)mHeight; }
+
+		// Camera of primary rays - pixel (i, j) looks along forward + right * (i - width / 2) +
+		// up * (j - height / 2) * aspect, forward is scaled to the image plane distance in pixels
+		float4 GetOrigin() const { return mOrigin; }
+		float4 GetForward() const { return mForward * mPlanePos; }
+		float4 GetRight() const { return mRight; }
+		float4 GetUp() const { return mUp; }
+		float GetAspect() const { return mAspect; }
+		float GetNear() const { return mNear; }
+		float GetFar() const { return mFar; }
+
 		void* operator new(size_t size)
 		{
 			return _aligned_malloc(size, 16);
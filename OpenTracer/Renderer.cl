@@ -15,8 +15,8 @@ __kernel void TraceNaive(__global float4* triangles,
 		return;
 	}
 
-	float4 o = rays[i * 2 + 0];
-	float4 d = rays[i * 2 + 1];
+	float4 o = rays[i * 4 + 0];
+	float4 d = rays[i * 4 + 1];
 
 	bool hit = true;
 	int id = -1;
@@ -59,7 +59,8 @@ __kernel void TraceNaive(__global float4* triangles,
 	results[i] = (float4)(bu, bv, dist, as_float(id));
 }
 
-// Uncomment to render statistics
+// Uncomment to render statistics, closest hit kernels then return traversal counters instead of
+// hits (path tracer needs both off)
 //#define RENDER_STATISTICS
 //#define MEMORY_STATISTICS
 
@@ -79,6 +80,10 @@ struct KDNode
 	};
 };
 
+// Node layouts, see KDTree::NodeLayout
+#define KD_LAYOUT_DEPTH_FIRST 0
+#define KD_LAYOUT_TREELET 1
+
 #define SPATIAL_STACK_SIZE 32
 struct KDStackNode
 {
@@ -87,28 +92,58 @@ struct KDStackNode
 	float pad;
 };
 
-__kernel void TraceSpatial(__global float4* triangles,
-	__global float4* rays,
-	__global float4* results,
+// Woop test of one triangle, updates the closest hit when it is nearer
+void IntersectTriangle(__global float4* triangles,
+	unsigned int n,
+	float4 o,
+	float4 d,
+	float* dist,
+	float* bu,
+	float* bv,
+	int* id)
+{
+	float4 r = triangles[n * 3 + 0];
+	float4 p = triangles[n * 3 + 1];
+	float4 q = triangles[n * 3 + 2];
+
+	float o_z = r.w - o.x * r.x - o.y * r.y - o.z * r.z;
+	float i_z = 1.0f / (d.x * r.x + d.y * r.y + d.z * r.z);
+	float t = o_z * i_z;
+
+	if (t > o.w && t < *dist)
+	{
+		float o_x = p.w + o.x * p.x + o.y * p.y + o.z * p.z;
+		float d_x = d.x * p.x + d.y * p.y + d.z * p.z;
+		float u = o_x + t * d_x;
+
+		if (u >= 0.0f && u <= 1.0f)
+		{
+			float o_y = q.w + o.x * q.x + o.y * q.y + o.z * q.z;
+			float d_y = d.x * q.x + d.y * q.y + d.z * q.z;
+			float v = o_y + t * d_y;
+
+			if (v >= 0.0f && u + v <= 1.0f)
+			{
+				*dist = t;
+				*bu = u;
+				*bv = v;
+				*id = n;
+			}
+		}
+	}
+}
+
+// Closest hit of one ray in KD-tree, stack traversal shared by all KD-tree kernels. Returns
+// traversal counters instead when statistics are rendered.
+float4 TraceSpatialRay(__global float4* triangles,
 	__global struct KDNode* nodes,
 	__global unsigned int* indices,
 	float4 boundsMin,
 	float4 boundsMax,
-	int trianglesCount,
-	int raysCount,
-	int2 dimensions)
+	int layout,
+	float4 o,
+	float4 d)
 {
-	int i = get_global_id(0);
-	int j = get_global_id(1);
-	if (i >= dimensions.x || j >= dimensions.y)
-	{
-		return;
-	}
-
-	int k = i + j * dimensions.x;
-
-	float4 o = rays[k * 4 + 0];
-	float4 d = rays[k * 4 + 1];
 	float4 inv = native_recip(d);
 
 	struct KDStackNode stack[SPATIAL_STACK_SIZE];
@@ -120,7 +155,7 @@ __kernel void TraceSpatial(__global float4* triangles,
 		float4 near = min(v1, v2);
 		float4 far = max(v1, v2);
 		float enter = max(near.x, max(near.y, near.z));
-		float exit = min(far.x, max(far.y, far.z));
+		float exit = min(far.x, min(far.y, far.z));
 
 		if (exit > 0.0f && enter < exit)
 		{
@@ -144,14 +179,19 @@ __kernel void TraceSpatial(__global float4* triangles,
 	int privateop = 0;
 #endif
 
-	unsigned int node;
 	while (stack_ptr != 0)
 	{
 		stack_ptr--;
-		node = stack[stack_ptr].node;
+		unsigned int node = stack[stack_ptr].node;
 		float near = stack[stack_ptr].near;
 		float far = stack[stack_ptr].far;
 
+		// Segment behind the closest hit can't hold a nearer one
+		if (near > dist)
+		{
+			break;
+		}
+
 		uint axis = (nodes[node].flags & 3);
 		uint above_child = (nodes[node].above_child >> 2);
 		float split = nodes[node].split;
@@ -168,44 +208,18 @@ __kernel void TraceSpatial(__global float4* triangles,
 			interiors++;
 #endif
 
-			float hitpos;	 
-			int below_first;
-			unsigned int first, second;
-
-			float orig_tmp;
-			float idir_tmp;
+			float orig_tmp = axis == 0 ? o.x : (axis == 1 ? o.y : o.z);
+			float idir_tmp = axis == 0 ? inv.x : (axis == 1 ? inv.y : inv.z);
 
-			switch (axis)
-			{
-			case 0:
-				orig_tmp = o.x;
-				idir_tmp = inv.x;
-				break;
-
-			case 1:
-				orig_tmp = o.y;
-				idir_tmp = inv.y;
-				break;
+			float hitpos = (split - orig_tmp) * idir_tmp;
+			int below_first = (orig_tmp < split) || (orig_tmp == split && idir_tmp >= 0.0f);
 
-			case 2:
-				orig_tmp = o.z;
-				idir_tmp = inv.z;
-				break;
-			}
+			// Treelet layout keeps both children as a pair, depth-first keeps below child after its parent
+			unsigned int below_child = layout == KD_LAYOUT_TREELET ? above_child : node + 1;
+			above_child = layout == KD_LAYOUT_TREELET ? above_child + 1 : above_child;
 
-			hitpos = (split - orig_tmp) * idir_tmp;
-			below_first = (orig_tmp < split) || (orig_tmp == split && idir_tmp >= 0.0f);
-			
-			if (below_first)
-			{
-				first = node + 1;
-				second = above_child;
-			}
-			else
-			{
-				first = above_child;
-				second = node + 1;
-			}
+			unsigned int first = below_first ? below_child : above_child;
+			unsigned int second = below_first ? above_child : below_child;
 
 			if (hitpos > far || hitpos < 0.0f)
 			{
@@ -238,87 +252,258 @@ __kernel void TraceSpatial(__global float4* triangles,
 		}
 
 		unsigned int prim_offset = nodes[node].prim_offset;
-#ifdef MEMORY_STATISTICS
-		globalop += 1;
-#endif
 		unsigned int prims_num = above_child;
 
 #ifdef RENDER_STATISTICS
 		visited++;
 		leaves += prims_num;
+#elif defined MEMORY_STATISTICS
+		globalop += 1 + 4 * prims_num;
 #endif
 
-		if (prims_num > 0)
+		for (unsigned int n = 0; n < prims_num; n++)
 		{
-			__global unsigned int *prims_ids = &indices[prim_offset];
+			IntersectTriangle(triangles, indices[prim_offset + n], o, d, &dist, &bu, &bv, &id);
+		}
 
-			for (unsigned int n = 0; n < prims_num; n++)
-			{
-				// Don't trash cache by reading index through it
-				int tri_idx = prims_ids[n] * 3;
+		if (prims_num > 0 && dist < far)
+		{
+			break;
+		}
+	}
 
-				float4 r = triangles[tri_idx + 0];
-				float4 p = triangles[tri_idx + 1];
-				float4 q = triangles[tri_idx + 2];
-#ifdef MEMORY_STATISTICS
-				globalop += 4;
+#ifdef RENDER_STATISTICS
+	return (float4)((float)visited * 0.01f, (float)interiors * 0.01f, (float)leaves * 0.01f, 1.0f);
+#elif defined MEMORY_STATISTICS
+	return (float4)((float)globalop * 0.004f, (float)privateop * 0.004f, 0.0f, 1.0f);
+#else
+	return (float4)(bu, bv, dist, as_float(id));
+#endif
+}
+
+__kernel void TraceSpatial(__global float4* triangles,
+	__global float4* rays,
+	__global float4* results,
+	__global struct KDNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	int trianglesCount,
+	int raysCount,
+	int2 dimensions,
+	int layout)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i >= dimensions.x || j >= dimensions.y)
+	{
+		return;
+	}
+
+	int k = i + j * dimensions.x;
+	results[k] = TraceSpatialRay(triangles, nodes, indices, boundsMin, boundsMax, layout, rays[k * 4 + 0], rays[k * 4 + 1]);
+}
+
+#define ROPE_NONE 0xFFFFFFFF
+
+// Stackless traversal following leaf ropes (Popov et al.), each leaf is left through the face the
+// ray exits, the rope of that face points to the smallest node covering the whole face
+__kernel void TraceSpatialRopes(__global float4* triangles,
+	__global float4* rays,
+	__global float4* results,
+	__global struct KDNode* nodes,
+	__global unsigned int* indices,
+	__global unsigned int* ropes,
+	__global float4* leafBounds,
+	float4 boundsMin,
+	float4 boundsMax,
+	int trianglesCount,
+	int raysCount,
+	int2 dimensions,
+	int layout)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i >= dimensions.x || j >= dimensions.y)
+	{
+		return;
+	}
+
+	int k = i + j * dimensions.x;
+
+	float4 o = rays[k * 4 + 0];
+	float4 d = rays[k * 4 + 1];
+	float4 inv = native_recip(d);
+
+	int id = -1;
+	float bu = 0.0f, bv = 0.0f;
+	float dist = d.w;
+
+#ifdef RENDER_STATISTICS
+	int visited = 0;
+	int interiors = 0;
+	int leaves = 0;
+#endif
+
+	float4 v1 = (boundsMin - o) * inv;
+	float4 v2 = (boundsMax - o) * inv;
+	float4 near = min(v1, v2);
+	float4 far = max(v1, v2);
+	float enter = max(near.x, max(near.y, near.z));
+	float exit = min(far.x, min(far.y, far.z));
+
+	unsigned int node = (exit > 0.0f && enter < exit) ? 0 : ROPE_NONE;
+	float t = max(enter, 0.0f);
+
+	while (node != ROPE_NONE && t < dist)
+	{
+		// Descend from rope target to the leaf containing entry point, points lying on a split
+		// plane belong to the side the ray continues to
+		float4 p = o + d * t;
+
+		uint axis = (nodes[node].flags & 3);
+		while (axis != 3)
+		{
+#ifdef RENDER_STATISTICS
+			visited++;
+			interiors++;
+#endif
+			uint child = (nodes[node].above_child >> 2);
+			float split = nodes[node].split;
+			float p_axis = axis == 0 ? p.x : (axis == 1 ? p.y : p.z);
+			float d_axis = axis == 0 ? d.x : (axis == 1 ? d.y : d.z);
+
+			unsigned int below_child = layout == KD_LAYOUT_TREELET ? child : node + 1;
+			unsigned int above_child = layout == KD_LAYOUT_TREELET ? child + 1 : child;
+
+			node = (p_axis > split || (p_axis == split && d_axis > 0.0f)) ? above_child : below_child;
+			axis = (nodes[node].flags & 3);
+		}
+
+		float4 leaf_min = leafBounds[node * 2 + 0];
+		float4 leaf_max = leafBounds[node * 2 + 1];
+		float exit_x = ((d.x >= 0.0f ? leaf_max.x : leaf_min.x) - o.x) * inv.x;
+		float exit_y = ((d.y >= 0.0f ? leaf_max.y : leaf_min.y) - o.y) * inv.y;
+		float exit_z = ((d.z >= 0.0f ? leaf_max.z : leaf_min.z) - o.z) * inv.z;
+
+		float leaf_exit;
+		uint face;
+		if (exit_x < exit_y && exit_x < exit_z)
+		{
+			leaf_exit = exit_x;
+			face = d.x >= 0.0f ? 1 : 0;
+		}
+		else if (exit_y < exit_z)
+		{
+			leaf_exit = exit_y;
+			face = d.y >= 0.0f ? 3 : 2;
+		}
+		else
+		{
+			leaf_exit = exit_z;
+			face = d.z >= 0.0f ? 5 : 4;
+		}
+
+		unsigned int prim_offset = nodes[node].prim_offset;
+		unsigned int prims_num = (nodes[node].prim_count >> 2);
+
+#ifdef RENDER_STATISTICS
+		visited++;
+		leaves += prims_num;
 #endif
-				float o_z = r.w - o.x * r.x - o.y * r.y - o.z * r.z;
-				float i_z = 1.0f / (d.x * r.x + d.y * r.y + d.z * r.z);
-				float t = o_z * i_z;
 
-				if (t > o.w && t < dist)
+		__global unsigned int *prims_ids = &indices[prim_offset];
+
+		for (unsigned int n = 0; n < prims_num; n++)
+		{
+			int tri_idx = prims_ids[n] * 3;
+
+			float4 r = triangles[tri_idx + 0];
+			float4 p = triangles[tri_idx + 1];
+			float4 q = triangles[tri_idx + 2];
+
+			float o_z = r.w - o.x * r.x - o.y * r.y - o.z * r.z;
+			float i_z = 1.0f / (d.x * r.x + d.y * r.y + d.z * r.z);
+			float t_hit = o_z * i_z;
+
+			if (t_hit > o.w && t_hit < dist)
+			{
+				float o_x = p.w + o.x * p.x + o.y * p.y + o.z * p.z;
+				float d_x = d.x * p.x + d.y * p.y + d.z * p.z;
+				float u = o_x + t_hit * d_x;
+
+				if (u >= 0.0f && u <= 1.0f)
 				{
-					float o_x = p.w + o.x * p.x + o.y * p.y + o.z * p.z;
-					float d_x = d.x * p.x + d.y * p.y + d.z * p.z;
-					float u = o_x + t * d_x;
+					float o_y = q.w + o.x * q.x + o.y * q.y + o.z * q.z;
+					float d_y = d.x * q.x + d.y * q.y + d.z * q.z;
+					float v = o_y + t_hit * d_y;
 
-					if (u >= 0.0f && u <= 1.0f)
+					if (v >= 0.0f && u + v <= 1.0f)
 					{
-						float o_y = q.w + o.x * q.x + o.y * q.y + o.z * q.z;
-						float d_y = d.x * q.x + d.y * q.y + d.z * q.z;
-						float v = o_y + t * d_y;
-
-						if (v >= 0.0f && u + v <= 1.0f)
-						{
-							dist = t;
-							bu = u;
-							bv = v;
-							id = i;
-						}
+						dist = t_hit;
+						bu = u;
+						bv = v;
+						id = prims_ids[n];
 					}
 				}
 			}
+		}
 
-			if (dist < far)
-			{
-				break;
-			}
+		// Hit inside this leaf cannot be beaten by any leaf further along the ray
+		if (dist <= leaf_exit)
+		{
+			break;
 		}
+
+		node = ropes[node * 6 + face];
+		t = leaf_exit;
 	}
 
 #ifdef RENDER_STATISTICS
 	results[k] = (float4)((float)visited * 0.01f, (float)interiors * 0.01f, (float)leaves * 0.01f, 1.0f);
-#elif defined MEMORY_STATISTICS
-	results[k] = (float4)((float)globalop * 0.004f, (float)privateop * 0.004f, 0.0f, 1.0f);
 #else
 	results[k] = (float4)(bu, bv, dist, as_float(id));
 #endif
+}
 
-/*	int i = get_global_id(0);
-	int j = get_global_id(1);
-	if (i >= dimensions.x || j >= dimensions.y)
-	{
-		return;
-	}
-	
-	int k = i + j * dimensions.x;
+// Builders collapse subtrees below depth 63 (BVH::MAX_DEPTH), one entry per level fits
+#define BVH_STACK_SIZE 64
+
+struct BVHNode
+{
+	unsigned int prim_offset;
+	unsigned int prim_count;
+	unsigned int axis;
+	unsigned int leaf;
+	float4 lxy;
+	float4 rxy;
+	float4 lrz;
+};
 
-	float4 o = rays[k * 2 + 0];
-	float4 d = rays[k * 2 + 1];
+// Closest hit of one ray in binary BVH, stack traversal shared by all BVH kernels. Returns
+// traversal counters instead when statistics are rendered.
+float4 TraceBVHRay(__global float4* triangles,
+	__global struct BVHNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	float4 o,
+	float4 d)
+{
 	float4 inv = native_recip(d);
+	float4 oinv = o * inv;
 
-	struct KDStackNode stack[SPATIAL_STACK_SIZE];
+	int id = -1;
+	float bu = 0.0f, bv = 0.0f;
+	float dist = d.w;
+
+#ifdef RENDER_STATISTICS
+	int visited = 0;
+	int interiors = 0;
+	int leaves = 0;
+#endif
+
+	unsigned int stack[BVH_STACK_SIZE];
 	unsigned int stack_ptr = 0;
 
 	{
@@ -327,159 +512,1013 @@ __kernel void TraceSpatial(__global float4* triangles,
 		float4 near = min(v1, v2);
 		float4 far = max(v1, v2);
 		float enter = max(near.x, max(near.y, near.z));
-		float exit = min(far.x, max(far.y, far.z));
+		float exit = min(far.x, min(far.y, far.z));
 
 		if (exit > 0.0f && enter < exit)
 		{
-			stack[stack_ptr].node = 0;
-			stack[stack_ptr].near = enter;
-			stack[stack_ptr].far = exit;
-			stack_ptr++;
+			stack[stack_ptr++] = 0;
 		}
 	}
 
-	int id = -1;
-	float bu = 0.0f, bv = 0.0f;
-	float dist = d.w;
-	
-#ifdef RENDER_STATISTICS
-	int visited = 0;
-	int interiors = 0;
-	int leaves = 0;
-#endif
-
-	unsigned int node;
 	while (stack_ptr != 0)
 	{
-		stack_ptr--;
-		node = stack[stack_ptr].node;
-		float near = stack[stack_ptr].near;
-		float far = stack[stack_ptr].far;
-		
-		uint axis = (nodes[node].flags & 3);
-		uint above_child = (nodes[node].above_child >> 2);
-		float split = nodes[node].split;
-		unsigned int prim_offset = nodes[node].prim_offset;
+		unsigned int node = stack[--stack_ptr];
 
-		while (axis != 3)
+		while (nodes[node].leaf == 0)
 		{
 #ifdef RENDER_STATISTICS
 			visited++;
 			interiors++;
 #endif
 
-			float hitpos;
-			int below_first;
-			unsigned int first, second;
+			float4 lxy = nodes[node].lxy;
+			float4 rxy = nodes[node].rxy;
+			float4 lrz = nodes[node].lrz;
 
-			switch (axis)
-			{
-			case 0:
-				hitpos = (split - o.x) * inv.x;
-				below_first = (o.x < split) || (o.x == split && d.x >= 0.0f);
-				break;
+			// Slabs of both children as (left min, left max, right min, right max)
+			float4 tx = (float4)(lxy.x, lxy.y, rxy.x, rxy.y) * inv.x - oinv.x;
+			float4 ty = (float4)(lxy.z, lxy.w, rxy.z, rxy.w) * inv.y - oinv.y;
+			float4 tz = lrz * inv.z - oinv.z;
 
-			case 1:
-				hitpos = (split - o.y) * inv.y;
-				below_first = (o.y < split) || (o.y == split && d.y >= 0.0f);
-				break;
+			float l_enter = max(max(min(tx.x, tx.y), min(ty.x, ty.y)), max(min(tz.x, tz.y), 0.0f));
+			float l_exit = min(min(max(tx.x, tx.y), max(ty.x, ty.y)), min(max(tz.x, tz.y), dist));
+			float r_enter = max(max(min(tx.z, tx.w), min(ty.z, ty.w)), max(min(tz.z, tz.w), 0.0f));
+			float r_exit = min(min(max(tx.z, tx.w), max(ty.z, ty.w)), min(max(tz.z, tz.w), dist));
 
-			case 2:
-				hitpos = (split - o.z) * inv.z;
-				below_first = (o.z < split) || (o.z == split && d.z >= 0.0f);
-				break;
-			}
+			bool l_hit = l_enter <= l_exit;
+			bool r_hit = r_enter <= r_exit;
 
-			if (below_first)
-			{
-				first = node + 1;
-				second = above_child;
-			}
-			else
+			unsigned int left = node + 1;
+			unsigned int right = nodes[node].prim_offset;
+
+			if (l_hit && r_hit)
 			{
-				first = above_child;
-				second = node + 1;
+				node = l_enter <= r_enter ? left : right;
+				stack[stack_ptr++] = l_enter <= r_enter ? right : left;
 			}
-			
-			if (hitpos > far || hitpos < 0.0f)
+			else if (l_hit)
 			{
-				node = first;
+				node = left;
 			}
-			else if (hitpos < near)
+			else if (r_hit)
 			{
-				node = second;
+				node = right;
 			}
 			else
 			{
-				stack[stack_ptr].node = second;
-				stack[stack_ptr].near = hitpos;
-				stack[stack_ptr].far = far;
-				stack_ptr++;
-
-				node = first;
-				far = hitpos;
+				break;
 			}
+		}
 
-			axis = (nodes[node].flags & 3);
-			above_child = (nodes[node].above_child >> 2);
-			split = nodes[node].split;
-			prim_offset = nodes[node].prim_offset;
+		if (nodes[node].leaf == 0)
+		{
+			continue;
 		}
 
-		unsigned int prims_num = above_child;
+		unsigned int prim_offset = nodes[node].prim_offset;
+		unsigned int prims_num = nodes[node].prim_count;
 
 #ifdef RENDER_STATISTICS
 		visited++;
 		leaves += prims_num;
 #endif
 
-		if (prims_num > 0)
+		for (unsigned int n = 0; n < prims_num; n++)
 		{
-			__global unsigned int *prims_ids = &indices[prim_offset];
-
-			for (unsigned int n = 0; n < prims_num; n++)
-			{
-				float4 v = triangles[prims_ids[n] * 3 + 0];
-				float4 p = triangles[prims_ids[n] * 3 + 1];
-				float4 q = triangles[prims_ids[n] * 3 + 2];
-
-				float o_z = v.w - o.x * v.x - o.y * v.y - o.z * v.z;
-				float i_z = 1.0f / (d.x * v.x + d.y * v.y + d.z * v.z);
-				float t = o_z * i_z;
-
-				if (t > o.w && t < dist)
-				{
-					float o_x = p.w + o.x * p.x + o.y * p.y + o.z * p.z;
-					float d_x = d.x * p.x + d.y * p.y + d.z * p.z;
-					float u = o_x + t * d_x;
-
-					if (u >= 0.0f && u <= 1.0f)
-					{
-						float o_y = q.w + o.x * q.x + o.y * q.y + o.z * q.z;
-						float d_y = d.x * q.x + d.y * q.y + d.z * q.z;
-						float v = o_y + t * d_y;
-
-						if (v >= 0.0f && u + v <= 1.0f)
-						{
-							dist = t;
-							bu = u;
-							bv = v;
-							id = i;
-						}
-					}
-				}
-			}
-
-			if (dist < far)
-			{
-				break;
-			}
+			IntersectTriangle(triangles, indices[prim_offset + n], o, d, &dist, &bu, &bv, &id);
 		}
 	}
 
 #ifdef RENDER_STATISTICS
-	results[k] = (float4)((float)visited * 0.01f, (float)interiors * 0.01f, (float)leaves * 0.01f, 1.0f);
+	return (float4)((float)visited * 0.01f, (float)interiors * 0.01f, (float)leaves * 0.01f, 1.0f);
 #else
-	results[k] = (float4)(bu, bv, dist, as_float(id));
-#endif*/
-}
\ No newline at end of file
+	return (float4)(bu, bv, dist, as_float(id));
+#endif
+}
+
+// Stack traversal of binary BVH, both children are tested against the ray at once from bounds
+// stored in parent, nearer one is visited first and the farther one is pushed
+__kernel void TraceBVH(__global float4* triangles,
+	__global float4* rays,
+	__global float4* results,
+	__global struct BVHNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	int trianglesCount,
+	int raysCount,
+	int2 dimensions)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i >= dimensions.x || j >= dimensions.y)
+	{
+		return;
+	}
+
+	int k = i + j * dimensions.x;
+	results[k] = TraceBVHRay(triangles, nodes, indices, boundsMin, boundsMax, rays[k * 4 + 0], rays[k * 4 + 1]);
+}
+
+struct Instance
+{
+	float4 row0;		// World to object transform rows
+	float4 row1;
+	float4 row2;
+	unsigned int node_offset;		// Offsets of referenced mesh in concatenated buffers
+	unsigned int index_offset;
+	unsigned int triangle_offset;
+	unsigned int mesh;
+};
+
+// Closest hit against one bottom level BVH, ray is given in its object space. Node, index and
+// triangle references stored in the mesh are local, offsets relocate them into shared buffers.
+void IntersectMesh(__global float4* triangles,
+	__global struct BVHNode* nodes,
+	__global unsigned int* indices,
+	unsigned int node_offset,
+	unsigned int index_offset,
+	unsigned int triangle_offset,
+	float4 o,
+	float4 d,
+	float* dist,
+	float* bu,
+	float* bv,
+	int* id)
+{
+	float4 inv = native_recip(d);
+	float4 oinv = o * inv;
+
+	unsigned int stack[BVH_STACK_SIZE];
+	unsigned int stack_ptr = 0;
+	stack[stack_ptr++] = 0;
+
+	while (stack_ptr != 0)
+	{
+		unsigned int node = stack[--stack_ptr];
+
+		while (nodes[node_offset + node].leaf == 0)
+		{
+			__global struct BVHNode* n = &nodes[node_offset + node];
+			float4 lxy = n->lxy;
+			float4 rxy = n->rxy;
+			float4 lrz = n->lrz;
+
+			float4 tx = (float4)(lxy.x, lxy.y, rxy.x, rxy.y) * inv.x - oinv.x;
+			float4 ty = (float4)(lxy.z, lxy.w, rxy.z, rxy.w) * inv.y - oinv.y;
+			float4 tz = lrz * inv.z - oinv.z;
+
+			float l_enter = max(max(min(tx.x, tx.y), min(ty.x, ty.y)), max(min(tz.x, tz.y), 0.0f));
+			float l_exit = min(min(max(tx.x, tx.y), max(ty.x, ty.y)), min(max(tz.x, tz.y), *dist));
+			float r_enter = max(max(min(tx.z, tx.w), min(ty.z, ty.w)), max(min(tz.z, tz.w), 0.0f));
+			float r_exit = min(min(max(tx.z, tx.w), max(ty.z, ty.w)), min(max(tz.z, tz.w), *dist));
+
+			bool l_hit = l_enter <= l_exit;
+			bool r_hit = r_enter <= r_exit;
+
+			unsigned int left = node + 1;
+			unsigned int right = n->prim_offset;
+
+			if (l_hit && r_hit)
+			{
+				node = l_enter <= r_enter ? left : right;
+				stack[stack_ptr++] = l_enter <= r_enter ? right : left;
+			}
+			else if (l_hit)
+			{
+				node = left;
+			}
+			else if (r_hit)
+			{
+				node = right;
+			}
+			else
+			{
+				break;
+			}
+		}
+
+		if (nodes[node_offset + node].leaf == 0)
+		{
+			continue;
+		}
+
+		unsigned int prims_num = nodes[node_offset + node].prim_count;
+		__global unsigned int *prims_ids = &indices[index_offset + nodes[node_offset + node].prim_offset];
+
+		for (unsigned int n = 0; n < prims_num; n++)
+		{
+			int tri = triangle_offset + prims_ids[n];
+			int tri_idx = tri * 3;
+
+			float4 r = triangles[tri_idx + 0];
+			float4 p = triangles[tri_idx + 1];
+			float4 q = triangles[tri_idx + 2];
+
+			float o_z = r.w - o.x * r.x - o.y * r.y - o.z * r.z;
+			float i_z = 1.0f / (d.x * r.x + d.y * r.y + d.z * r.z);
+			float t_hit = o_z * i_z;
+
+			if (t_hit > o.w && t_hit < *dist)
+			{
+				float o_x = p.w + o.x * p.x + o.y * p.y + o.z * p.z;
+				float d_x = d.x * p.x + d.y * p.y + d.z * p.z;
+				float u = o_x + t_hit * d_x;
+
+				if (u >= 0.0f && u <= 1.0f)
+				{
+					float o_y = q.w + o.x * q.x + o.y * q.y + o.z * q.z;
+					float d_y = d.x * q.x + d.y * q.y + d.z * q.z;
+					float v = o_y + t_hit * d_y;
+
+					if (v >= 0.0f && u + v <= 1.0f)
+					{
+						*dist = t_hit;
+						*bu = u;
+						*bv = v;
+						*id = tri;
+					}
+				}
+			}
+		}
+	}
+}
+
+// Two level traversal - top level BVH leaves hold instances, the ray is transformed into instance
+// space and traced through the referenced bottom level. Transforms are affine and the direction is
+// not renormalized, so hit distances stay comparable across instances.
+__kernel void TraceInstanced(__global float4* triangles,
+	__global float4* rays,
+	__global float4* results,
+	__global struct BVHNode* topNodes,
+	__global unsigned int* topIndices,
+	__global struct Instance* instances,
+	__global struct BVHNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	int raysCount,
+	int2 dimensions)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i >= dimensions.x || j >= dimensions.y)
+	{
+		return;
+	}
+
+	int k = i + j * dimensions.x;
+
+	float4 o = rays[k * 4 + 0];
+	float4 d = rays[k * 4 + 1];
+	float4 inv = native_recip(d);
+	float4 oinv = o * inv;
+
+	int id = -1;
+	float bu = 0.0f, bv = 0.0f;
+	float dist = d.w;
+
+	unsigned int stack[BVH_STACK_SIZE];
+	unsigned int stack_ptr = 0;
+
+	{
+		float4 v1 = (boundsMin - o) * inv;
+		float4 v2 = (boundsMax - o) * inv;
+		float4 near = min(v1, v2);
+		float4 far = max(v1, v2);
+		float enter = max(near.x, max(near.y, near.z));
+		float exit = min(far.x, min(far.y, far.z));
+
+		if (exit > 0.0f && enter < exit)
+		{
+			stack[stack_ptr++] = 0;
+		}
+	}
+
+	while (stack_ptr != 0)
+	{
+		unsigned int node = stack[--stack_ptr];
+
+		while (topNodes[node].leaf == 0)
+		{
+			float4 lxy = topNodes[node].lxy;
+			float4 rxy = topNodes[node].rxy;
+			float4 lrz = topNodes[node].lrz;
+
+			float4 tx = (float4)(lxy.x, lxy.y, rxy.x, rxy.y) * inv.x - oinv.x;
+			float4 ty = (float4)(lxy.z, lxy.w, rxy.z, rxy.w) * inv.y - oinv.y;
+			float4 tz = lrz * inv.z - oinv.z;
+
+			float l_enter = max(max(min(tx.x, tx.y), min(ty.x, ty.y)), max(min(tz.x, tz.y), 0.0f));
+			float l_exit = min(min(max(tx.x, tx.y), max(ty.x, ty.y)), min(max(tz.x, tz.y), dist));
+			float r_enter = max(max(min(tx.z, tx.w), min(ty.z, ty.w)), max(min(tz.z, tz.w), 0.0f));
+			float r_exit = min(min(max(tx.z, tx.w), max(ty.z, ty.w)), min(max(tz.z, tz.w), dist));
+
+			bool l_hit = l_enter <= l_exit;
+			bool r_hit = r_enter <= r_exit;
+
+			unsigned int left = node + 1;
+			unsigned int right = topNodes[node].prim_offset;
+
+			if (l_hit && r_hit)
+			{
+				node = l_enter <= r_enter ? left : right;
+				stack[stack_ptr++] = l_enter <= r_enter ? right : left;
+			}
+			else if (l_hit)
+			{
+				node = left;
+			}
+			else if (r_hit)
+			{
+				node = right;
+			}
+			else
+			{
+				break;
+			}
+		}
+
+		if (topNodes[node].leaf == 0)
+		{
+			continue;
+		}
+
+		unsigned int prim_offset = topNodes[node].prim_offset;
+		unsigned int prims_num = topNodes[node].prim_count;
+
+		for (unsigned int n = 0; n < prims_num; n++)
+		{
+			__global struct Instance* inst = &instances[topIndices[prim_offset + n]];
+
+			float4 op = (float4)(o.xyz, 1.0f);
+			float4 dv = (float4)(d.xyz, 0.0f);
+			float4 local_o = (float4)(dot(inst->row0, op), dot(inst->row1, op), dot(inst->row2, op), o.w);
+			float4 local_d = (float4)(dot(inst->row0, dv), dot(inst->row1, dv), dot(inst->row2, dv), 0.0f);
+
+			IntersectMesh(triangles, nodes, indices, inst->node_offset, inst->index_offset, inst->triangle_offset, local_o, local_d, &dist, &bu, &bv, &id);
+		}
+	}
+
+	results[k] = (float4)(bu, bv, dist, as_float(id));
+}
+
+#define BVH_COMPRESSED_LEAF 0x80000000
+#define BVH_COMPRESSED_COUNT_SHIFT 27
+#define BVH_COMPRESSED_OFFSET_MASK 0x07FFFFFF
+#define BVH_COMPRESSED_SCALE (1.0f / 254.0f)
+
+// Stack traversal of compressed BVH - nodes are 16 bytes, child boxes are 8-bit offsets within the
+// parent box which the traversal decodes on the way down and keeps on the stack as frame (min, step)
+__kernel void TraceBVHCompressed(__global float4* triangles,
+	__global float4* rays,
+	__global float4* results,
+	__global uint4* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	int trianglesCount,
+	int raysCount,
+	int2 dimensions)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i >= dimensions.x || j >= dimensions.y)
+	{
+		return;
+	}
+
+	int k = i + j * dimensions.x;
+
+	float4 o = rays[k * 4 + 0];
+	float4 d = rays[k * 4 + 1];
+	float4 inv = native_recip(d);
+	float4 oinv = o * inv;
+
+	int id = -1;
+	float bu = 0.0f, bv = 0.0f;
+	float dist = d.w;
+
+	unsigned int stack[BVH_STACK_SIZE];
+	float4 stack_min[BVH_STACK_SIZE];
+	float4 stack_step[BVH_STACK_SIZE];
+	unsigned int stack_ptr = 0;
+
+	{
+		float4 v1 = (boundsMin - o) * inv;
+		float4 v2 = (boundsMax - o) * inv;
+		float4 near = min(v1, v2);
+		float4 far = max(v1, v2);
+		float enter = max(near.x, max(near.y, near.z));
+		float exit = min(far.x, min(far.y, far.z));
+
+		if (exit > 0.0f && enter < exit)
+		{
+			stack[stack_ptr] = 0;
+			stack_min[stack_ptr] = boundsMin;
+			stack_step[stack_ptr++] = (boundsMax - boundsMin) * BVH_COMPRESSED_SCALE;
+		}
+	}
+
+	while (stack_ptr != 0)
+	{
+		stack_ptr--;
+		unsigned int node = stack[stack_ptr];
+		float4 frame_min = stack_min[stack_ptr];
+		float4 frame_step = stack_step[stack_ptr];
+		uint4 n = nodes[node];
+
+		while ((n.w & BVH_COMPRESSED_LEAF) == 0)
+		{
+			__global uchar* q = (__global uchar*)&nodes[node];
+
+			// Decoded slabs of both children as (left min, left max, right min, right max)
+			float4 bx = frame_min.x + convert_float4(vload4(0, q)) * frame_step.x;
+			float4 by = frame_min.y + convert_float4(vload4(1, q)) * frame_step.y;
+			float4 bz = frame_min.z + convert_float4(vload4(2, q)) * frame_step.z;
+
+			float4 tx = bx * inv.x - oinv.x;
+			float4 ty = by * inv.y - oinv.y;
+			float4 tz = bz * inv.z - oinv.z;
+
+			float l_enter = max(max(min(tx.x, tx.y), min(ty.x, ty.y)), max(min(tz.x, tz.y), 0.0f));
+			float l_exit = min(min(max(tx.x, tx.y), max(ty.x, ty.y)), min(max(tz.x, tz.y), dist));
+			float r_enter = max(max(min(tx.z, tx.w), min(ty.z, ty.w)), max(min(tz.z, tz.w), 0.0f));
+			float r_exit = min(min(max(tx.z, tx.w), max(ty.z, ty.w)), min(max(tz.z, tz.w), dist));
+
+			bool l_hit = l_enter <= l_exit;
+			bool r_hit = r_enter <= r_exit;
+
+			float4 l_min = (float4)(bx.x, by.x, bz.x, 0.0f);
+			float4 r_min = (float4)(bx.z, by.z, bz.z, 0.0f);
+			float4 l_step = ((float4)(bx.y, by.y, bz.y, 0.0f) - l_min) * BVH_COMPRESSED_SCALE;
+			float4 r_step = ((float4)(bx.w, by.w, bz.w, 0.0f) - r_min) * BVH_COMPRESSED_SCALE;
+
+			unsigned int left = node + 1;
+			unsigned int right = n.w;
+
+			if (l_hit && r_hit)
+			{
+				bool l_first = l_enter <= r_enter;
+				stack[stack_ptr] = l_first ? right : left;
+				stack_min[stack_ptr] = l_first ? r_min : l_min;
+				stack_step[stack_ptr++] = l_first ? r_step : l_step;
+				node = l_first ? left : right;
+				frame_min = l_first ? l_min : r_min;
+				frame_step = l_first ? l_step : r_step;
+			}
+			else if (l_hit)
+			{
+				node = left;
+				frame_min = l_min;
+				frame_step = l_step;
+			}
+			else if (r_hit)
+			{
+				node = right;
+				frame_min = r_min;
+				frame_step = r_step;
+			}
+			else
+			{
+				break;
+			}
+
+			n = nodes[node];
+		}
+
+		if ((n.w & BVH_COMPRESSED_LEAF) == 0)
+		{
+			continue;
+		}
+
+		unsigned int prim_offset = n.w & BVH_COMPRESSED_OFFSET_MASK;
+		unsigned int prims_num = ((n.w >> BVH_COMPRESSED_COUNT_SHIFT) & 0xF) + 1;
+		__global unsigned int *prims_ids = &indices[prim_offset];
+
+		for (unsigned int m = 0; m < prims_num; m++)
+		{
+			int tri_idx = prims_ids[m] * 3;
+
+			float4 r = triangles[tri_idx + 0];
+			float4 p = triangles[tri_idx + 1];
+			float4 q = triangles[tri_idx + 2];
+
+			float o_z = r.w - o.x * r.x - o.y * r.y - o.z * r.z;
+			float i_z = 1.0f / (d.x * r.x + d.y * r.y + d.z * r.z);
+			float t_hit = o_z * i_z;
+
+			if (t_hit > o.w && t_hit < dist)
+			{
+				float o_x = p.w + o.x * p.x + o.y * p.y + o.z * p.z;
+				float d_x = d.x * p.x + d.y * p.y + d.z * p.z;
+				float u = o_x + t_hit * d_x;
+
+				if (u >= 0.0f && u <= 1.0f)
+				{
+					float o_y = q.w + o.x * q.x + o.y * q.y + o.z * q.z;
+					float d_y = d.x * q.x + d.y * q.y + d.z * q.z;
+					float v = o_y + t_hit * d_y;
+
+					if (v >= 0.0f && u + v <= 1.0f)
+					{
+						dist = t_hit;
+						bu = u;
+						bv = v;
+						id = prims_ids[m];
+					}
+				}
+			}
+		}
+	}
+
+	results[k] = (float4)(bu, bv, dist, as_float(id));
+}
+
+// Occlusion (any-hit) queries - traversal stops at the first hit within ray's (near, far) interval
+// and one byte per ray is written, 1 when the ray is occluded. Nodes are not visited in distance
+// order and no hit record is kept.
+
+// Woop test of one triangle against ray segment (o.w, d.w)
+bool OccludedBy(__global float4* triangles, unsigned int n, float4 o, float4 d)
+{
+	float4 r = triangles[n * 3 + 0];
+	float4 p = triangles[n * 3 + 1];
+	float4 q = triangles[n * 3 + 2];
+
+	float o_z = r.w - o.x * r.x - o.y * r.y - o.z * r.z;
+	float i_z = 1.0f / (d.x * r.x + d.y * r.y + d.z * r.z);
+	float t = o_z * i_z;
+
+	if (t > o.w && t < d.w)
+	{
+		float o_x = p.w + o.x * p.x + o.y * p.y + o.z * p.z;
+		float d_x = d.x * p.x + d.y * p.y + d.z * p.z;
+		float u = o_x + t * d_x;
+
+		if (u >= 0.0f && u <= 1.0f)
+		{
+			float o_y = q.w + o.x * q.x + o.y * q.y + o.z * q.z;
+			float d_y = d.x * q.x + d.y * q.y + d.z * q.z;
+			float v = o_y + t * d_y;
+
+			return v >= 0.0f && u + v <= 1.0f;
+		}
+	}
+
+	return false;
+}
+
+__kernel void TraceOcclusionNaive(__global float4* triangles,
+	__global float4* rays,
+	__global uchar* results,
+	int trianglesCount,
+	int raysCount)
+{
+	int i = get_global_id(0);
+	if (i >= raysCount)
+	{
+		return;
+	}
+
+	float4 o = rays[i * 4 + 0];
+	float4 d = rays[i * 4 + 1];
+
+	uchar occluded = 0;
+	for (int n = 0; n < trianglesCount && !occluded; n++)
+	{
+		occluded = OccludedBy(triangles, n, o, d) ? 1 : 0;
+	}
+
+	results[i] = occluded;
+}
+
+// Any hit of one ray in KD-tree, stack traversal is also used for trees built with ropes
+bool OccludedSpatialRay(__global float4* triangles,
+	__global struct KDNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	int layout,
+	float4 o,
+	float4 d)
+{
+	float4 inv = native_recip(d);
+
+	struct KDStackNode stack[SPATIAL_STACK_SIZE];
+	unsigned int stack_ptr = 0;
+
+	{
+		float4 v1 = (boundsMin - o) * inv;
+		float4 v2 = (boundsMax - o) * inv;
+		float4 near = min(v1, v2);
+		float4 far = max(v1, v2);
+		float enter = max(near.x, max(near.y, near.z));
+		float exit = min(far.x, min(far.y, far.z));
+
+		if (exit > 0.0f && enter < exit)
+		{
+			stack[stack_ptr].node = 0;
+			stack[stack_ptr].near = enter;
+			stack[stack_ptr].far = exit;
+			stack_ptr++;
+		}
+	}
+
+	uchar occluded = 0;
+	while (stack_ptr != 0 && !occluded)
+	{
+		stack_ptr--;
+		unsigned int node = stack[stack_ptr].node;
+		float near = stack[stack_ptr].near;
+		float far = stack[stack_ptr].far;
+
+		// Segments are popped front to back, the rest lies behind the ray end
+		if (near > d.w)
+		{
+			break;
+		}
+
+		uint axis = (nodes[node].flags & 3);
+		uint above_child = (nodes[node].above_child >> 2);
+		float split = nodes[node].split;
+
+		while (axis != 3)
+		{
+			float orig_tmp = axis == 0 ? o.x : axis == 1 ? o.y : o.z;
+			float idir_tmp = axis == 0 ? inv.x : axis == 1 ? inv.y : inv.z;
+
+			float hitpos = (split - orig_tmp) * idir_tmp;
+			int below_first = (orig_tmp < split) || (orig_tmp == split && idir_tmp >= 0.0f);
+
+			unsigned int below_child = layout == KD_LAYOUT_TREELET ? above_child : node + 1;
+			above_child = layout == KD_LAYOUT_TREELET ? above_child + 1 : above_child;
+
+			unsigned int first = below_first ? below_child : above_child;
+			unsigned int second = below_first ? above_child : below_child;
+
+			if (hitpos > far || hitpos < 0.0f)
+			{
+				node = first;
+			}
+			else if (hitpos < near)
+			{
+				node = second;
+			}
+			else
+			{
+				stack[stack_ptr].node = second;
+				stack[stack_ptr].near = hitpos;
+				stack[stack_ptr].far = far;
+				stack_ptr++;
+
+				node = first;
+				far = hitpos;
+			}
+
+			axis = (nodes[node].flags & 3);
+			above_child = (nodes[node].above_child >> 2);
+			split = nodes[node].split;
+		}
+
+		unsigned int prim_offset = nodes[node].prim_offset;
+		unsigned int prims_num = above_child;
+		__global unsigned int *prims_ids = &indices[prim_offset];
+
+		for (unsigned int n = 0; n < prims_num && !occluded; n++)
+		{
+			occluded = OccludedBy(triangles, prims_ids[n], o, d) ? 1 : 0;
+		}
+	}
+
+	return occluded != 0;
+}
+
+__kernel void TraceOcclusionSpatial(__global float4* triangles,
+	__global float4* rays,
+	__global uchar* results,
+	__global struct KDNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	int trianglesCount,
+	int raysCount,
+	int2 dimensions,
+	int layout)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i >= dimensions.x || j >= dimensions.y)
+	{
+		return;
+	}
+
+	int k = i + j * dimensions.x;
+	results[k] = OccludedSpatialRay(triangles, nodes, indices, boundsMin, boundsMax, layout, rays[k * 4 + 0], rays[k * 4 + 1]) ? 1 : 0;
+}
+
+// Any hit of one ray in binary BVH, children are visited in fixed order
+bool OccludedBVHRay(__global float4* triangles,
+	__global struct BVHNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	float4 o,
+	float4 d)
+{
+	float4 inv = native_recip(d);
+	float4 oinv = o * inv;
+
+	unsigned int stack[BVH_STACK_SIZE];
+	unsigned int stack_ptr = 0;
+
+	{
+		float4 v1 = (boundsMin - o) * inv;
+		float4 v2 = (boundsMax - o) * inv;
+		float4 near = min(v1, v2);
+		float4 far = max(v1, v2);
+		float enter = max(near.x, max(near.y, near.z));
+		float exit = min(far.x, min(far.y, far.z));
+
+		if (exit > 0.0f && enter < exit)
+		{
+			stack[stack_ptr++] = 0;
+		}
+	}
+
+	uchar occluded = 0;
+	while (stack_ptr != 0 && !occluded)
+	{
+		unsigned int node = stack[--stack_ptr];
+
+		while (nodes[node].leaf == 0)
+		{
+			float4 lxy = nodes[node].lxy;
+			float4 rxy = nodes[node].rxy;
+			float4 lrz = nodes[node].lrz;
+
+			float4 tx = (float4)(lxy.x, lxy.y, rxy.x, rxy.y) * inv.x - oinv.x;
+			float4 ty = (float4)(lxy.z, lxy.w, rxy.z, rxy.w) * inv.y - oinv.y;
+			float4 tz = lrz * inv.z - oinv.z;
+
+			float l_enter = max(max(min(tx.x, tx.y), min(ty.x, ty.y)), max(min(tz.x, tz.y), 0.0f));
+			float l_exit = min(min(max(tx.x, tx.y), max(ty.x, ty.y)), min(max(tz.x, tz.y), d.w));
+			float r_enter = max(max(min(tx.z, tx.w), min(ty.z, ty.w)), max(min(tz.z, tz.w), 0.0f));
+			float r_exit = min(min(max(tx.z, tx.w), max(ty.z, ty.w)), min(max(tz.z, tz.w), d.w));
+
+			bool l_hit = l_enter <= l_exit;
+			bool r_hit = r_enter <= r_exit;
+
+			unsigned int left = node + 1;
+			unsigned int right = nodes[node].prim_offset;
+
+			if (l_hit && r_hit)
+			{
+				node = left;
+				stack[stack_ptr++] = right;
+			}
+			else if (l_hit)
+			{
+				node = left;
+			}
+			else if (r_hit)
+			{
+				node = right;
+			}
+			else
+			{
+				break;
+			}
+		}
+
+		if (nodes[node].leaf == 0)
+		{
+			continue;
+		}
+
+		unsigned int prim_offset = nodes[node].prim_offset;
+		unsigned int prims_num = nodes[node].prim_count;
+		__global unsigned int *prims_ids = &indices[prim_offset];
+
+		for (unsigned int n = 0; n < prims_num && !occluded; n++)
+		{
+			occluded = OccludedBy(triangles, prims_ids[n], o, d) ? 1 : 0;
+		}
+	}
+
+	return occluded != 0;
+}
+
+__kernel void TraceOcclusionBVH(__global float4* triangles,
+	__global float4* rays,
+	__global uchar* results,
+	__global struct BVHNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	int trianglesCount,
+	int raysCount,
+	int2 dimensions)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i >= dimensions.x || j >= dimensions.y)
+	{
+		return;
+	}
+
+	int k = i + j * dimensions.x;
+	results[k] = OccludedBVHRay(triangles, nodes, indices, boundsMin, boundsMax, rays[k * 4 + 0], rays[k * 4 + 1]) ? 1 : 0;
+}
+
+__kernel void TraceOcclusionBVHCompressed(__global float4* triangles,
+	__global float4* rays,
+	__global uchar* results,
+	__global uint4* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	int trianglesCount,
+	int raysCount,
+	int2 dimensions)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i >= dimensions.x || j >= dimensions.y)
+	{
+		return;
+	}
+
+	int k = i + j * dimensions.x;
+
+	float4 o = rays[k * 4 + 0];
+	float4 d = rays[k * 4 + 1];
+	float4 inv = native_recip(d);
+	float4 oinv = o * inv;
+
+	unsigned int stack[BVH_STACK_SIZE];
+	float4 stack_min[BVH_STACK_SIZE];
+	float4 stack_step[BVH_STACK_SIZE];
+	unsigned int stack_ptr = 0;
+
+	{
+		float4 v1 = (boundsMin - o) * inv;
+		float4 v2 = (boundsMax - o) * inv;
+		float4 near = min(v1, v2);
+		float4 far = max(v1, v2);
+		float enter = max(near.x, max(near.y, near.z));
+		float exit = min(far.x, min(far.y, far.z));
+
+		if (exit > 0.0f && enter < exit)
+		{
+			stack[stack_ptr] = 0;
+			stack_min[stack_ptr] = boundsMin;
+			stack_step[stack_ptr++] = (boundsMax - boundsMin) * BVH_COMPRESSED_SCALE;
+		}
+	}
+
+	uchar occluded = 0;
+	while (stack_ptr != 0 && !occluded)
+	{
+		stack_ptr--;
+		unsigned int node = stack[stack_ptr];
+		float4 frame_min = stack_min[stack_ptr];
+		float4 frame_step = stack_step[stack_ptr];
+		uint4 n = nodes[node];
+
+		while ((n.w & BVH_COMPRESSED_LEAF) == 0)
+		{
+			__global uchar* q = (__global uchar*)&nodes[node];
+
+			float4 bx = frame_min.x + convert_float4(vload4(0, q)) * frame_step.x;
+			float4 by = frame_min.y + convert_float4(vload4(1, q)) * frame_step.y;
+			float4 bz = frame_min.z + convert_float4(vload4(2, q)) * frame_step.z;
+
+			float4 tx = bx * inv.x - oinv.x;
+			float4 ty = by * inv.y - oinv.y;
+			float4 tz = bz * inv.z - oinv.z;
+
+			float l_enter = max(max(min(tx.x, tx.y), min(ty.x, ty.y)), max(min(tz.x, tz.y), 0.0f));
+			float l_exit = min(min(max(tx.x, tx.y), max(ty.x, ty.y)), min(max(tz.x, tz.y), d.w));
+			float r_enter = max(max(min(tx.z, tx.w), min(ty.z, ty.w)), max(min(tz.z, tz.w), 0.0f));
+			float r_exit = min(min(max(tx.z, tx.w), max(ty.z, ty.w)), min(max(tz.z, tz.w), d.w));
+
+			bool l_hit = l_enter <= l_exit;
+			bool r_hit = r_enter <= r_exit;
+
+			float4 l_min = (float4)(bx.x, by.x, bz.x, 0.0f);
+			float4 r_min = (float4)(bx.z, by.z, bz.z, 0.0f);
+			float4 l_step = ((float4)(bx.y, by.y, bz.y, 0.0f) - l_min) * BVH_COMPRESSED_SCALE;
+			float4 r_step = ((float4)(bx.w, by.w, bz.w, 0.0f) - r_min) * BVH_COMPRESSED_SCALE;
+
+			unsigned int left = node + 1;
+			unsigned int right = n.w;
+
+			if (l_hit && r_hit)
+			{
+				stack[stack_ptr] = right;
+				stack_min[stack_ptr] = r_min;
+				stack_step[stack_ptr++] = r_step;
+				node = left;
+				frame_min = l_min;
+				frame_step = l_step;
+			}
+			else if (l_hit)
+			{
+				node = left;
+				frame_min = l_min;
+				frame_step = l_step;
+			}
+			else if (r_hit)
+			{
+				node = right;
+				frame_min = r_min;
+				frame_step = r_step;
+			}
+			else
+			{
+				break;
+			}
+
+			n = nodes[node];
+		}
+
+		if ((n.w & BVH_COMPRESSED_LEAF) == 0)
+		{
+			continue;
+		}
+
+		unsigned int prim_offset = n.w & BVH_COMPRESSED_OFFSET_MASK;
+		unsigned int prims_num = ((n.w >> BVH_COMPRESSED_COUNT_SHIFT) & 0xF) + 1;
+		__global unsigned int *prims_ids = &indices[prim_offset];
+
+		for (unsigned int m = 0; m < prims_num && !occluded; m++)
+		{
+			occluded = OccludedBy(triangles, prims_ids[m], o, d) ? 1 : 0;
+		}
+	}
+
+	results[k] = occluded;
+}
+
+// Persistent threads (Aila and Laine) - only as many work items are launched as the device keeps
+// resident, each fetches batches of consecutive rays from a global counter until all rays are
+// taken. Work items that finish short traversals fetch new rays instead of idling until the
+// slowest ray of their work-group is done. Counter must be zero at launch.
+
+#define PERSISTENT_BATCH_SIZE 4
+
+__kernel void TraceSpatialPersistent(__global float4* triangles,
+	__global float4* rays,
+	__global float4* results,
+	__global struct KDNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	int trianglesCount,
+	int raysCount,
+	int layout,
+	__global int* rayCounter)
+{
+	while (true)
+	{
+		int first = atom_add(rayCounter, PERSISTENT_BATCH_SIZE);
+		if (first >= raysCount)
+		{
+			break;
+		}
+
+		int last = min(first + PERSISTENT_BATCH_SIZE, raysCount);
+		for (int k = first; k < last; k++)
+		{
+			results[k] = TraceSpatialRay(triangles, nodes, indices, boundsMin, boundsMax, layout, rays[k * 4 + 0], rays[k * 4 + 1]);
+		}
+	}
+}
+
+__kernel void TraceBVHPersistent(__global float4* triangles,
+	__global float4* rays,
+	__global float4* results,
+	__global struct BVHNode* nodes,
+	__global unsigned int* indices,
+	float4 boundsMin,
+	float4 boundsMax,
+	int trianglesCount,
+	int raysCount,
+	__global int* rayCounter)
+{
+	while (true)
+	{
+		int first = atom_add(rayCounter, PERSISTENT_BATCH_SIZE);
+		if (first >= raysCount)
+		{
+			break;
+		}
+
+		int last = min(first + PERSISTENT_BATCH_SIZE, raysCount);
+		for (int k = first; k < last; k++)
+		{
+			results[k] = TraceBVHRay(triangles, nodes, indices, boundsMin, boundsMax, rays[k * 4 + 0], rays[k * 4 + 1]);
+		}
+	}
+}
@@ -5,18 +5,47 @@
 #include <utility>
 #include <iostream>
 #include <chrono>
+#include <cstring>
 
 using namespace OpenTracerCore;
 
+// Work-group size of persistent kernels and work-groups launched per compute unit, enough to
+// keep every unit busy while some of its groups wait for memory
+#define PERSISTENT_GROUP_SIZE 64
+#define PERSISTENT_GROUPS_PER_UNIT 8
+
+// Must match PERSISTENT_BATCH_SIZE in Renderer.cl
+#define PERSISTENT_BATCH_SIZE 4
+
 cl::Program* Renderer::mProgram = NULL;
 cl::Kernel* Renderer::mKernelNaive = NULL;
 cl::Kernel* Renderer::mKernelSpatial = NULL;
+cl::Kernel* Renderer::mKernelSpatialRopes = NULL;
+cl::Kernel* Renderer::mKernelBVH = NULL;
+cl::Kernel* Renderer::mKernelBVHCompressed = NULL;
+cl::Kernel* Renderer::mKernelInstanced = NULL;
+cl::Kernel* Renderer::mKernelSpatialPersistent = NULL;
+cl::Kernel* Renderer::mKernelBVHPersistent = NULL;
+cl::Kernel* Renderer::mKernelOcclusionNaive = NULL;
+cl::Kernel* Renderer::mKernelOcclusionSpatial = NULL;
+cl::Kernel* Renderer::mKernelOcclusionBVH = NULL;
+cl::Kernel* Renderer::mKernelOcclusionBVHCompressed = NULL;
 
 Renderer::Renderer(Context* context)
 {
 	mContext = context;
+	mStackless = false;
+	mLastTraceTime = 0.0f;
+	mOcclusion = NULL;
+	mOcclusionSize = 0;
+	mPersistent = false;
+	mRayCounter = NULL;
+	mPersistentSize = 0;
+
+	// Native context renders on host, OpenCL program is never built
+	mNative = mContext->IsNative() ? new NativeRenderer() : NULL;
 
-	if (!mProgram)
+	if (!mProgram && !mNative)
 	{
 		std::ifstream sf("C:\\Programming\\OpenTracer\\OpenTracer\\Renderer.cl");
 		std::string s(std::istreambuf_iterator<char>(sf), (std::istreambuf_iterator<char>()));
@@ -26,6 +55,16 @@ Renderer::Renderer(Context* context)
 		std::cout << mProgram->getBuildInfo<CL_PROGRAM_BUILD_LOG>(mContext->GetDevices()[0]) << std::endl;
 		mKernelNaive = new cl::Kernel(*mProgram, "TraceNaive");
 		mKernelSpatial = new cl::Kernel(*mProgram, "TraceSpatial");
+		mKernelSpatialRopes = new cl::Kernel(*mProgram, "TraceSpatialRopes");
+		mKernelBVH = new cl::Kernel(*mProgram, "TraceBVH");
+		mKernelBVHCompressed = new cl::Kernel(*mProgram, "TraceBVHCompressed");
+		mKernelInstanced = new cl::Kernel(*mProgram, "TraceInstanced");
+		mKernelSpatialPersistent = new cl::Kernel(*mProgram, "TraceSpatialPersistent");
+		mKernelBVHPersistent = new cl::Kernel(*mProgram, "TraceBVHPersistent");
+		mKernelOcclusionNaive = new cl::Kernel(*mProgram, "TraceOcclusionNaive");
+		mKernelOcclusionSpatial = new cl::Kernel(*mProgram, "TraceOcclusionSpatial");
+		mKernelOcclusionBVH = new cl::Kernel(*mProgram, "TraceOcclusionBVH");
+		mKernelOcclusionBVHCompressed = new cl::Kernel(*mProgram, "TraceOcclusionBVHCompressed");
 
 		size_t binarySize;
 		mProgram->getInfo(CL_PROGRAM_BINARY_SIZES, &binarySize);
@@ -37,52 +76,514 @@ Renderer::Renderer(Context* context)
 		fclose(fp);
 		free(bin);
 	}
+
+	if (!mNative)
+	{
+		mRayCounter = new cl::Buffer(mContext->GetContext(), CL_MEM_READ_WRITE, sizeof(cl_int));
+		unsigned int units = mContext->GetDevices()[0].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+		mPersistentSize = units * PERSISTENT_GROUPS_PER_UNIT * PERSISTENT_GROUP_SIZE;
+	}
 }
 
 Renderer::~Renderer()
 {
-
+	delete mNative;
+	delete mOcclusion;
+	delete mRayCounter;
 }
 
-void Renderer::Render(Scene* scene, Aggregate* naive, RayBuffer* rayBuffer, Texture* output)
+cl::Kernel* Renderer::SetArguments(Aggregate* naive, cl::Buffer* rays, cl::Buffer* results, int width, int height)
 {
-	size_t raysCount = output->GetWidth() * output->GetHeight();
+	size_t raysCount = width * height;
 	size_t trisCount = naive->GetTriangleCount();
 
 	mKernelNaive->setArg(0, *naive->GetTriangles());
-	mKernelNaive->setArg(1, *rayBuffer->GetRayBuffer());
-	mKernelNaive->setArg(2, *output->GetDeviceData());
+	mKernelNaive->setArg(1, *rays);
+	mKernelNaive->setArg(2, *results);
 	mKernelNaive->setArg(3, trisCount);
 	mKernelNaive->setArg(4, raysCount);
 
-	mContext->GetCommandQueue().enqueueNDRangeKernel(*mKernelNaive, cl::NullRange, cl::NDRange(raysCount));
+	return mKernelNaive;
 }
 
-void Renderer::Render(Scene* scene, Spatial* spatial, RayBuffer* rayBuffer, Texture* output)
+cl::Kernel* Renderer::SetArguments(Spatial* spatial, cl::Buffer* rays, cl::Buffer* results, int width, int height)
+{
+	size_t raysCount = width * height;
+	size_t trisCount = spatial->GetTriangleCount();
+	cl_float4 pmin, pmax;
+	pmin.s[0] = spatial->GetBounds().mMin.x; pmin.s[1] = spatial->GetBounds().mMin.y; pmin.s[2] = spatial->GetBounds().mMin.z; pmin.s[3] = spatial->GetBounds().mMin.w;
+	pmax.s[0] = spatial->GetBounds().mMax.x; pmax.s[1] = spatial->GetBounds().mMax.y; pmax.s[2] = spatial->GetBounds().mMax.z; pmax.s[3] = spatial->GetBounds().mMax.w;
+
+	cl_int2 dimensions;
+	dimensions.s[0] = width;
+	dimensions.s[1] = height;
+
+	cl::Kernel* kernel = mKernelSpatial;
+	if (mPersistent && !(mStackless && spatial->GetRopes()))
+	{
+		kernel = mKernelSpatialPersistent;
+		kernel->setArg(0, *spatial->GetTriangles());
+		kernel->setArg(1, *rays);
+		kernel->setArg(2, *results);
+		kernel->setArg(3, *spatial->GetNodes());
+		kernel->setArg(4, *spatial->GetIndices());
+		kernel->setArg(5, pmin);
+		kernel->setArg(6, pmax);
+		kernel->setArg(7, trisCount);
+		kernel->setArg(8, raysCount);
+		kernel->setArg(9, spatial->GetLayout());
+		kernel->setArg(10, *mRayCounter);
+	}
+	else if (mStackless && spatial->GetRopes())
+	{
+		kernel = mKernelSpatialRopes;
+		kernel->setArg(0, *spatial->GetTriangles());
+		kernel->setArg(1, *rays);
+		kernel->setArg(2, *results);
+		kernel->setArg(3, *spatial->GetNodes());
+		kernel->setArg(4, *spatial->GetIndices());
+		kernel->setArg(5, *spatial->GetRopes());
+		kernel->setArg(6, *spatial->GetLeafBounds());
+		kernel->setArg(7, pmin);
+		kernel->setArg(8, pmax);
+		kernel->setArg(9, trisCount);
+		kernel->setArg(10, raysCount);
+		kernel->setArg(11, dimensions);
+		kernel->setArg(12, spatial->GetLayout());
+	}
+	else
+	{
+		kernel->setArg(0, *spatial->GetTriangles());
+		kernel->setArg(1, *rays);
+		kernel->setArg(2, *results);
+		kernel->setArg(3, *spatial->GetNodes());
+		kernel->setArg(4, *spatial->GetIndices());
+		kernel->setArg(5, pmin);
+		kernel->setArg(6, pmax);
+		kernel->setArg(7, trisCount);
+		kernel->setArg(8, raysCount);
+		kernel->setArg(9, dimensions);
+		kernel->setArg(10, spatial->GetLayout());
+	}
+
+	return kernel;
+}
+
+cl::Kernel* Renderer::SetArguments(Hierarchy* hierarchy, cl::Buffer* rays, cl::Buffer* results, int width, int height)
+{
+	size_t raysCount = width * height;
+	size_t trisCount = hierarchy->GetTriangleCount();
+	cl_float4 pmin, pmax;
+	pmin.s[0] = hierarchy->GetBounds().mMin.x; pmin.s[1] = hierarchy->GetBounds().mMin.y; pmin.s[2] = hierarchy->GetBounds().mMin.z; pmin.s[3] = hierarchy->GetBounds().mMin.w;
+	pmax.s[0] = hierarchy->GetBounds().mMax.x; pmax.s[1] = hierarchy->GetBounds().mMax.y; pmax.s[2] = hierarchy->GetBounds().mMax.z; pmax.s[3] = hierarchy->GetBounds().mMax.w;
+
+	cl_int2 dimensions;
+	dimensions.s[0] = width;
+	dimensions.s[1] = height;
+
+	// Compressed nodes are traversed by their own kernel only
+	if (mPersistent && !hierarchy->IsCompressed())
+	{
+		mKernelBVHPersistent->setArg(0, *hierarchy->GetTriangles());
+		mKernelBVHPersistent->setArg(1, *rays);
+		mKernelBVHPersistent->setArg(2, *results);
+		mKernelBVHPersistent->setArg(3, *hierarchy->GetNodes());
+		mKernelBVHPersistent->setArg(4, *hierarchy->GetIndices());
+		mKernelBVHPersistent->setArg(5, pmin);
+		mKernelBVHPersistent->setArg(6, pmax);
+		mKernelBVHPersistent->setArg(7, trisCount);
+		mKernelBVHPersistent->setArg(8, raysCount);
+		mKernelBVHPersistent->setArg(9, *mRayCounter);
+
+		return mKernelBVHPersistent;
+	}
+
+	cl::Kernel* kernel = hierarchy->IsCompressed() ? mKernelBVHCompressed : mKernelBVH;
+	kernel->setArg(0, *hierarchy->GetTriangles());
+	kernel->setArg(1, *rays);
+	kernel->setArg(2, *results);
+	kernel->setArg(3, *hierarchy->GetNodes());
+	kernel->setArg(4, *hierarchy->GetIndices());
+	kernel->setArg(5, pmin);
+	kernel->setArg(6, pmax);
+	kernel->setArg(7, trisCount);
+	kernel->setArg(8, raysCount);
+	kernel->setArg(9, dimensions);
+
+	return kernel;
+}
+
+cl::Kernel* Renderer::SetArguments(Instanced* instanced, cl::Buffer* rays, cl::Buffer* results, int width, int height)
+{
+	size_t raysCount = width * height;
+	cl_float4 pmin, pmax;
+	pmin.s[0] = instanced->GetBounds().mMin.x; pmin.s[1] = instanced->GetBounds().mMin.y; pmin.s[2] = instanced->GetBounds().mMin.z; pmin.s[3] = instanced->GetBounds().mMin.w;
+	pmax.s[0] = instanced->GetBounds().mMax.x; pmax.s[1] = instanced->GetBounds().mMax.y; pmax.s[2] = instanced->GetBounds().mMax.z; pmax.s[3] = instanced->GetBounds().mMax.w;
+
+	cl_int2 dimensions;
+	dimensions.s[0] = width;
+	dimensions.s[1] = height;
+
+	mKernelInstanced->setArg(0, *instanced->GetTriangles());
+	mKernelInstanced->setArg(1, *rays);
+	mKernelInstanced->setArg(2, *results);
+	mKernelInstanced->setArg(3, *instanced->GetTopNodes());
+	mKernelInstanced->setArg(4, *instanced->GetTopIndices());
+	mKernelInstanced->setArg(5, *instanced->GetInstances());
+	mKernelInstanced->setArg(6, *instanced->GetNodes());
+	mKernelInstanced->setArg(7, *instanced->GetIndices());
+	mKernelInstanced->setArg(8, pmin);
+	mKernelInstanced->setArg(9, pmax);
+	mKernelInstanced->setArg(10, raysCount);
+	mKernelInstanced->setArg(11, dimensions);
+
+	return mKernelInstanced;
+}
+
+void Renderer::Enqueue(cl::Kernel* kernel, int width, int height, cl::Event* evt)
 {
+	cl::CommandQueue& queue = mContext->GetCommandQueue();
+
+	// Persistent kernels take rays from the counter, launch only has to fill the device
+	if (kernel == mKernelSpatialPersistent || kernel == mKernelBVHPersistent)
+	{
+		static const cl_int zero = 0;
+		queue.enqueueWriteBuffer(*mRayCounter, CL_FALSE, 0, sizeof(cl_int), &zero);
+
+		size_t batches = ((size_t)width * height + PERSISTENT_BATCH_SIZE - 1) / PERSISTENT_BATCH_SIZE;
+		size_t items = (batches + PERSISTENT_GROUP_SIZE - 1) / PERSISTENT_GROUP_SIZE * PERSISTENT_GROUP_SIZE;
+		queue.enqueueNDRangeKernel(*kernel, cl::NullRange, cl::NDRange(items < mPersistentSize ? items : mPersistentSize), cl::NDRange(PERSISTENT_GROUP_SIZE), 0, evt);
+		return;
+	}
+
+	queue.enqueueNDRangeKernel(*kernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange, 0, evt);
+}
+
+void Renderer::Render(Scene* scene, Aggregate* naive, RayBuffer* rayBuffer, Texture* output)
+{
+	if (mNative)
+	{
+		mNative->Render(scene, naive, rayBuffer, output);
+		mLastTraceTime = mNative->GetLastTraceTime();
+		return;
+	}
+
 	size_t raysCount = output->GetWidth() * output->GetHeight();
+	cl::Kernel* kernel = SetArguments(naive, rayBuffer->GetRayBuffer(), output->GetDeviceData(), output->GetWidth(), output->GetHeight());
+
+	mContext->GetCommandQueue().enqueueNDRangeKernel(*kernel, cl::NullRange, cl::NDRange(raysCount));
+}
+
+void Renderer::Render(Scene* scene, Spatial* spatial, RayBuffer* rayBuffer, Texture* output)
+{
+	if (mNative)
+	{
+		mNative->Render(scene, spatial, rayBuffer, output);
+		mLastTraceTime = mNative->GetLastTraceTime();
+		return;
+	}
+
+	cl::Kernel* kernel = SetArguments(spatial, rayBuffer->GetRayBuffer(), output->GetDeviceData(), output->GetWidth(), output->GetHeight());
+
+	cl::Event evt;
+	auto start = std::chrono::high_resolution_clock::now();
+	//mContext->GetCommandQueue().enqueueNDRangeKernel(*kernel, cl::NullRange, cl::NDRange(output->GetWidth(), output->GetHeight()), cl::NDRange(8, 8), 0, &evt);
+	Enqueue(kernel, output->GetWidth(), output->GetHeight(), &evt);
+	evt.wait();
+	mLastTraceTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void Renderer::Render(Scene* scene, Hierarchy* hierarchy, RayBuffer* rayBuffer, Texture* output)
+{
+	if (mNative)
+	{
+		mNative->Render(scene, hierarchy, rayBuffer, output);
+		mLastTraceTime = mNative->GetLastTraceTime();
+		return;
+	}
+
+	cl::Kernel* kernel = SetArguments(hierarchy, rayBuffer->GetRayBuffer(), output->GetDeviceData(), output->GetWidth(), output->GetHeight());
+
+	cl::Event evt;
+	auto start = std::chrono::high_resolution_clock::now();
+	Enqueue(kernel, output->GetWidth(), output->GetHeight(), &evt);
+	evt.wait();
+	mLastTraceTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void Renderer::Render(Scene* scene, Instanced* instanced, RayBuffer* rayBuffer, Texture* output)
+{
+	if (mNative)
+	{
+		std::cout << "Instanced aggregate is not supported by native renderer" << std::endl;
+		return;
+	}
+
+	cl::Kernel* kernel = SetArguments(instanced, rayBuffer->GetRayBuffer(), output->GetDeviceData(), output->GetWidth(), output->GetHeight());
+
+	cl::Event evt;
+	auto start = std::chrono::high_resolution_clock::now();
+	mContext->GetCommandQueue().enqueueNDRangeKernel(*kernel, cl::NullRange, cl::NDRange(output->GetWidth(), output->GetHeight()), cl::NullRange, 0, &evt);
+	evt.wait();
+	mLastTraceTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void Renderer::Trace(cl::Kernel* kernel, RayBatch* batch)
+{
+	cl::Event evt;
+	if (kernel == mKernelNaive || kernel == mKernelOcclusionNaive)
+	{
+		mContext->GetCommandQueue().enqueueNDRangeKernel(*kernel, cl::NullRange, cl::NDRange(batch->GetCount()));
+	}
+	else
+	{
+		Enqueue(kernel, batch->GetCount(), 1, NULL);
+	}
+
+	if (batch->GetOccluded())
+	{
+		mContext->GetCommandQueue().enqueueReadBuffer(*batch->GetHitBuffer(), CL_FALSE, 0, batch->GetCount() * sizeof(unsigned char), batch->GetOccluded(), 0, &evt);
+	}
+	else
+	{
+		mContext->GetCommandQueue().enqueueReadBuffer(*batch->GetHitBuffer(), CL_FALSE, 0, batch->GetCount() * sizeof(float4), batch->GetHits(), 0, &evt);
+	}
+	batch->SetEvent(evt);
+}
+
+void Renderer::Trace(Scene* scene, Aggregate* naive, RayBatch* batch)
+{
+	if (mNative)
+	{
+		mNative->Trace(scene, naive, batch);
+		return;
+	}
+
+	if (batch->GetCount() > 0)
+	{
+		cl::Kernel* kernel = NULL;
+		if (batch->GetOccluded())
+		{
+			kernel = SetOcclusionArguments(naive, batch->GetRayBuffer(), batch->GetHitBuffer(), batch->GetCount(), 1);
+		}
+		else
+		{
+			kernel = SetArguments(naive, batch->GetRayBuffer(), batch->GetHitBuffer(), batch->GetCount(), 1);
+		}
+		Trace(kernel, batch);
+	}
+}
+
+void Renderer::Trace(Scene* scene, Spatial* spatial, RayBatch* batch)
+{
+	if (mNative)
+	{
+		mNative->Trace(scene, spatial, batch);
+		return;
+	}
+
+	if (batch->GetCount() > 0)
+	{
+		cl::Kernel* kernel = NULL;
+		if (batch->GetOccluded())
+		{
+			kernel = SetOcclusionArguments(spatial, batch->GetRayBuffer(), batch->GetHitBuffer(), batch->GetCount(), 1);
+		}
+		else
+		{
+			kernel = SetArguments(spatial, batch->GetRayBuffer(), batch->GetHitBuffer(), batch->GetCount(), 1);
+		}
+		Trace(kernel, batch);
+	}
+}
+
+void Renderer::Trace(Scene* scene, Hierarchy* hierarchy, RayBatch* batch)
+{
+	if (mNative)
+	{
+		mNative->Trace(scene, hierarchy, batch);
+		return;
+	}
+
+	if (batch->GetCount() > 0)
+	{
+		cl::Kernel* kernel = NULL;
+		if (batch->GetOccluded())
+		{
+			kernel = SetOcclusionArguments(hierarchy, batch->GetRayBuffer(), batch->GetHitBuffer(), batch->GetCount(), 1);
+		}
+		else
+		{
+			kernel = SetArguments(hierarchy, batch->GetRayBuffer(), batch->GetHitBuffer(), batch->GetCount(), 1);
+		}
+		Trace(kernel, batch);
+	}
+}
+
+void Renderer::Trace(Scene* scene, Instanced* instanced, RayBatch* batch)
+{
+	if (mNative)
+	{
+		std::cout << "Instanced aggregate is not supported by native renderer" << std::endl;
+		batch->WriteMisses();
+		return;
+	}
+
+	if (batch->GetOccluded())
+	{
+		std::cout << "Instanced aggregate is not supported by occlusion queries" << std::endl;
+		batch->WriteMisses();
+		return;
+	}
+
+	if (batch->GetCount() > 0)
+	{
+		Trace(SetArguments(instanced, batch->GetRayBuffer(), batch->GetHitBuffer(), batch->GetCount(), 1), batch);
+	}
+}
+
+cl::Kernel* Renderer::SetOcclusionArguments(Aggregate* naive, cl::Buffer* rays, cl::Buffer* results, int width, int height)
+{
+	size_t raysCount = width * height;
+	size_t trisCount = naive->GetTriangleCount();
+
+	mKernelOcclusionNaive->setArg(0, *naive->GetTriangles());
+	mKernelOcclusionNaive->setArg(1, *rays);
+	mKernelOcclusionNaive->setArg(2, *results);
+	mKernelOcclusionNaive->setArg(3, trisCount);
+	mKernelOcclusionNaive->setArg(4, raysCount);
+
+	return mKernelOcclusionNaive;
+}
+
+cl::Kernel* Renderer::SetOcclusionArguments(Spatial* spatial, cl::Buffer* rays, cl::Buffer* results, int width, int height)
+{
+	size_t raysCount = width * height;
 	size_t trisCount = spatial->GetTriangleCount();
 	cl_float4 pmin, pmax;
 	pmin.s[0] = spatial->GetBounds().mMin.x; pmin.s[1] = spatial->GetBounds().mMin.y; pmin.s[2] = spatial->GetBounds().mMin.z; pmin.s[3] = spatial->GetBounds().mMin.w;
 	pmax.s[0] = spatial->GetBounds().mMax.x; pmax.s[1] = spatial->GetBounds().mMax.y; pmax.s[2] = spatial->GetBounds().mMax.z; pmax.s[3] = spatial->GetBounds().mMax.w;
 
 	cl_int2 dimensions;
-	dimensions.s[0] = output->GetWidth();
-	dimensions.s[1] = output->GetHeight();
-
-	mKernelSpatial->setArg(0, *spatial->GetTriangles());
-	mKernelSpatial->setArg(1, *rayBuffer->GetRayBuffer());
-	mKernelSpatial->setArg(2, *output->GetDeviceData());
-	mKernelSpatial->setArg(3, *spatial->GetNodes());
-	mKernelSpatial->setArg(4, *spatial->GetIndices());
-	mKernelSpatial->setArg(5, pmin);
-	mKernelSpatial->setArg(6, pmax);
-	mKernelSpatial->setArg(7, trisCount);
-	mKernelSpatial->setArg(8, raysCount);
-	mKernelSpatial->setArg(9, dimensions);
+	dimensions.s[0] = width;
+	dimensions.s[1] = height;
+
+	// Ropes only pay off for closest hit, trees built with them are traversed with stack here
+	mKernelOcclusionSpatial->setArg(0, *spatial->GetTriangles());
+	mKernelOcclusionSpatial->setArg(1, *rays);
+	mKernelOcclusionSpatial->setArg(2, *results);
+	mKernelOcclusionSpatial->setArg(3, *spatial->GetNodes());
+	mKernelOcclusionSpatial->setArg(4, *spatial->GetIndices());
+	mKernelOcclusionSpatial->setArg(5, pmin);
+	mKernelOcclusionSpatial->setArg(6, pmax);
+	mKernelOcclusionSpatial->setArg(7, trisCount);
+	mKernelOcclusionSpatial->setArg(8, raysCount);
+	mKernelOcclusionSpatial->setArg(9, dimensions);
+	mKernelOcclusionSpatial->setArg(10, spatial->GetLayout());
+
+	return mKernelOcclusionSpatial;
+}
+
+cl::Kernel* Renderer::SetOcclusionArguments(Hierarchy* hierarchy, cl::Buffer* rays, cl::Buffer* results, int width, int height)
+{
+	size_t raysCount = width * height;
+	size_t trisCount = hierarchy->GetTriangleCount();
+	cl_float4 pmin, pmax;
+	pmin.s[0] = hierarchy->GetBounds().mMin.x; pmin.s[1] = hierarchy->GetBounds().mMin.y; pmin.s[2] = hierarchy->GetBounds().mMin.z; pmin.s[3] = hierarchy->GetBounds().mMin.w;
+	pmax.s[0] = hierarchy->GetBounds().mMax.x; pmax.s[1] = hierarchy->GetBounds().mMax.y; pmax.s[2] = hierarchy->GetBounds().mMax.z; pmax.s[3] = hierarchy->GetBounds().mMax.w;
+
+	cl_int2 dimensions;
+	dimensions.s[0] = width;
+	dimensions.s[1] = height;
+
+	cl::Kernel* kernel = hierarchy->IsCompressed() ? mKernelOcclusionBVHCompressed : mKernelOcclusionBVH;
+	kernel->setArg(0, *hierarchy->GetTriangles());
+	kernel->setArg(1, *rays);
+	kernel->setArg(2, *results);
+	kernel->setArg(3, *hierarchy->GetNodes());
+	kernel->setArg(4, *hierarchy->GetIndices());
+	kernel->setArg(5, pmin);
+	kernel->setArg(6, pmax);
+	kernel->setArg(7, trisCount);
+	kernel->setArg(8, raysCount);
+	kernel->setArg(9, dimensions);
+
+	return kernel;
+}
+
+cl::Buffer* Renderer::GetOcclusionBuffer(size_t raysCount)
+{
+	if (mOcclusionSize < raysCount)
+	{
+		delete mOcclusion;
+		mOcclusion = new cl::Buffer(mContext->GetContext(), CL_MEM_WRITE_ONLY, raysCount * sizeof(unsigned char));
+		mOcclusionSize = raysCount;
+	}
+
+	return mOcclusion;
+}
+
+void Renderer::TraceOcclusion(cl::Kernel* kernel, int width, int height, unsigned char* output)
+{
+	size_t raysCount = width * height;
+	cl::NDRange range = kernel == mKernelOcclusionNaive ? cl::NDRange(raysCount) : cl::NDRange(width, height);
 
 	cl::Event evt;
-	//mContext->GetCommandQueue().enqueueNDRangeKernel(*mKernelSpatial, cl::NullRange, cl::NDRange(output->GetWidth(), output->GetHeight()), cl::NDRange(8, 8), 0, &evt);
-	mContext->GetCommandQueue().enqueueNDRangeKernel(*mKernelSpatial, cl::NullRange, cl::NDRange(output->GetWidth(), output->GetHeight()), cl::NullRange, 0, &evt);
+	auto start = std::chrono::high_resolution_clock::now();
+	mContext->GetCommandQueue().enqueueNDRangeKernel(*kernel, cl::NullRange, range, cl::NullRange, 0, &evt);
 	evt.wait();
-}
\ No newline at end of file
+	mLastTraceTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+	mContext->GetCommandQueue().enqueueReadBuffer(*mOcclusion, CL_TRUE, 0, raysCount * sizeof(unsigned char), output);
+}
+
+void Renderer::TraceOcclusion(Scene* scene, Aggregate* naive, RayBuffer* rayBuffer, unsigned char* output)
+{
+	if (mNative)
+	{
+		mNative->TraceOcclusion(scene, naive, rayBuffer, output);
+		mLastTraceTime = mNative->GetLastTraceTime();
+		return;
+	}
+
+	size_t raysCount = rayBuffer->GetWidth() * rayBuffer->GetHeight();
+	cl::Kernel* kernel = SetOcclusionArguments(naive, rayBuffer->GetRayBuffer(), GetOcclusionBuffer(raysCount), rayBuffer->GetWidth(), rayBuffer->GetHeight());
+
+	TraceOcclusion(kernel, rayBuffer->GetWidth(), rayBuffer->GetHeight(), output);
+}
+
+void Renderer::TraceOcclusion(Scene* scene, Spatial* spatial, RayBuffer* rayBuffer, unsigned char* output)
+{
+	if (mNative)
+	{
+		mNative->TraceOcclusion(scene, spatial, rayBuffer, output);
+		mLastTraceTime = mNative->GetLastTraceTime();
+		return;
+	}
+
+	size_t raysCount = rayBuffer->GetWidth() * rayBuffer->GetHeight();
+	cl::Kernel* kernel = SetOcclusionArguments(spatial, rayBuffer->GetRayBuffer(), GetOcclusionBuffer(raysCount), rayBuffer->GetWidth(), rayBuffer->GetHeight());
+
+	TraceOcclusion(kernel, rayBuffer->GetWidth(), rayBuffer->GetHeight(), output);
+}
+
+void Renderer::TraceOcclusion(Scene* scene, Hierarchy* hierarchy, RayBuffer* rayBuffer, unsigned char* output)
+{
+	if (mNative)
+	{
+		mNative->TraceOcclusion(scene, hierarchy, rayBuffer, output);
+		mLastTraceTime = mNative->GetLastTraceTime();
+		return;
+	}
+
+	size_t raysCount = rayBuffer->GetWidth() * rayBuffer->GetHeight();
+	cl::Kernel* kernel = SetOcclusionArguments(hierarchy, rayBuffer->GetRayBuffer(), GetOcclusionBuffer(raysCount), rayBuffer->GetWidth(), rayBuffer->GetHeight());
+
+	TraceOcclusion(kernel, rayBuffer->GetWidth(), rayBuffer->GetHeight(), output);
+}
+
+void Renderer::TraceOcclusion(Scene* scene, Instanced* instanced, RayBuffer* rayBuffer, unsigned char* output)
+{
+	std::cout << "Instanced aggregate is not supported by occlusion queries" << std::endl;
+	memset(output, 0, rayBuffer->GetWidth() * rayBuffer->GetHeight());
+}
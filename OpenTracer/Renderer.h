@@ -3,8 +3,12 @@
 
 #include "Texture.h"
 #include "RayBuffer.h"
+#include "RayBatch.h"
 #include "Aggregate/Aggregate.h"
 #include "Aggregate/Spatial.h"
+#include "Aggregate/Hierarchy.h"
+#include "Aggregate/Instanced.h"
+#include "NativeRenderer.h"
 
 namespace OpenTracerCore
 {
@@ -14,13 +18,90 @@ namespace OpenTracerCore
 		static cl::Program* mProgram;
 		static cl::Kernel* mKernelNaive;
 		static cl::Kernel* mKernelSpatial;
+		static cl::Kernel* mKernelSpatialRopes;
+		static cl::Kernel* mKernelBVH;
+		static cl::Kernel* mKernelBVHCompressed;
+		static cl::Kernel* mKernelInstanced;
+		static cl::Kernel* mKernelSpatialPersistent;
+		static cl::Kernel* mKernelBVHPersistent;
+		static cl::Kernel* mKernelOcclusionNaive;
+		static cl::Kernel* mKernelOcclusionSpatial;
+		static cl::Kernel* mKernelOcclusionBVH;
+		static cl::Kernel* mKernelOcclusionBVHCompressed;
 		Context* mContext;
+		NativeRenderer* mNative;
+		bool mStackless;
+		float mLastTraceTime;
+
+		// Persistent threads fetch rays from the counter, launch size fills all compute units
+		bool mPersistent;
+		cl::Buffer* mRayCounter;
+		size_t mPersistentSize;
+
+		// Device buffer for occlusion results, grown on demand
+		cl::Buffer* mOcclusion;
+		size_t mOcclusionSize;
+
+		// Sets arguments of closest hit kernel for given aggregate and returns the kernel, rays and
+		// results are read as width x height image
+		cl::Kernel* SetArguments(Aggregate* naive, cl::Buffer* rays, cl::Buffer* results, int width, int height);
+		cl::Kernel* SetArguments(Spatial* spatial, cl::Buffer* rays, cl::Buffer* results, int width, int height);
+		cl::Kernel* SetArguments(Hierarchy* hierarchy, cl::Buffer* rays, cl::Buffer* results, int width, int height);
+		cl::Kernel* SetArguments(Instanced* instanced, cl::Buffer* rays, cl::Buffer* results, int width, int height);
+
+		// Same for any-hit kernels, results receive one byte per ray
+		cl::Kernel* SetOcclusionArguments(Aggregate* naive, cl::Buffer* rays, cl::Buffer* results, int width, int height);
+		cl::Kernel* SetOcclusionArguments(Spatial* spatial, cl::Buffer* rays, cl::Buffer* results, int width, int height);
+		cl::Kernel* SetOcclusionArguments(Hierarchy* hierarchy, cl::Buffer* rays, cl::Buffer* results, int width, int height);
+
+		// Queues closest hit kernel over width x height rays, persistent kernels get their counter
+		// reset and a launch sized to the device
+		void Enqueue(cl::Kernel* kernel, int width, int height, cl::Event* evt);
+
+		// Queues kernel and read back of batch results without waiting
+		void Trace(cl::Kernel* kernel, RayBatch* batch);
+
+		// Runs occlusion kernel over width x height rays and reads back one byte per ray into output
+		void TraceOcclusion(cl::Kernel* kernel, int width, int height, unsigned char* output);
+
+		// Returns occlusion buffer with room for given number of rays
+		cl::Buffer* GetOcclusionBuffer(size_t raysCount);
 
 	public:
 		Renderer(Context* context);
 		~Renderer();
 		void Render(Scene* scene, Aggregate* naive, RayBuffer* rayBuffer, Texture* output);
 		void Render(Scene* scene, Spatial* naive, RayBuffer* rayBuffer, Texture* output);
+		void Render(Scene* scene, Hierarchy* hierarchy, RayBuffer* rayBuffer, Texture* output);
+		void Render(Scene* scene, Instanced* instanced, RayBuffer* rayBuffer, Texture* output);
+
+		// Any-hit queries for shadow and visibility rays - traversal stops at the first hit within
+		// ray's (near, far) interval, output gets one byte per ray (1 when occluded). Instanced
+		// aggregates have no any-hit kernel, their output is cleared.
+		void TraceOcclusion(Scene* scene, Aggregate* naive, RayBuffer* rayBuffer, unsigned char* output);
+		void TraceOcclusion(Scene* scene, Spatial* spatial, RayBuffer* rayBuffer, unsigned char* output);
+		void TraceOcclusion(Scene* scene, Hierarchy* hierarchy, RayBuffer* rayBuffer, unsigned char* output);
+		void TraceOcclusion(Scene* scene, Instanced* instanced, RayBuffer* rayBuffer, unsigned char* output);
+
+		// Closest hits of arbitrary rays, or any hits when batch is an occlusion one. Work is queued
+		// and the call returns right away - batch tracks completion. Last trace time is not updated.
+		// Occlusion batches of instanced aggregates are reported as unoccluded.
+		void Trace(Scene* scene, Aggregate* naive, RayBatch* batch);
+		void Trace(Scene* scene, Spatial* spatial, RayBatch* batch);
+		void Trace(Scene* scene, Hierarchy* hierarchy, RayBatch* batch);
+		void Trace(Scene* scene, Instanced* instanced, RayBatch* batch);
+
+		// Uses rope traversal for KD-trees built with ropes, stack traversal otherwise. Off by default.
+		void SetStacklessTraversal(bool enable) { mStackless = enable; }
+
+		// Uses persistent threads kernels for stack traversal of KD-trees and uncompressed BVHs
+		void SetPersistentThreads(bool enable) { mPersistent = enable; }
+
+		// Duration of the last trace kernel in milliseconds
+		float GetLastTraceTime() { return mLastTraceTime; }
+
+		// Host backend, NULL unless the context is native
+		NativeRenderer* GetNative() { return mNative; }
 	};
 }
 
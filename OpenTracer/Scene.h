@@ -21,6 +21,13 @@ namespace OpenTracerCore
 			mVerticesCount = count;
 			mTrianglesCount = count / 3;
 			mGeometryCPU = new Triangle[mTrianglesCount];
+			mGeometryGPU = context->IsNative() ? NULL : new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(float4) * 3 * mTrianglesCount);
+			Update(context, vertices);
+		}
+
+		// Replaces vertex positions, vertex count and triangle order must stay the same
+		void Update(Context* context, float* vertices)
+		{
 			for (size_t i = 0; i < (size_t)mTrianglesCount; i++)
 			{
 				size_t a = 12 * i;
@@ -30,8 +37,10 @@ namespace OpenTracerCore
 					float4(vertices[b + 0], vertices[b + 1], vertices[b + 2], 1.0f),
 					float4(vertices[c + 0], vertices[c + 1], vertices[c + 2], 1.0f));
 			}
-			mGeometryGPU = new cl::Buffer(context->GetContext(), CL_MEM_READ_ONLY, sizeof(float4) * 3 * mTrianglesCount);
-			context->GetCommandQueue().enqueueWriteBuffer(*mGeometryGPU, CL_TRUE, 0, sizeof(float4) * 3 * mTrianglesCount, mGeometryCPU);
+			if (mGeometryGPU)
+			{
+				context->GetCommandQueue().enqueueWriteBuffer(*mGeometryGPU, CL_TRUE, 0, sizeof(float4) * 3 * mTrianglesCount, mGeometryCPU);
+			}
 		}
 
 		~Scene()
@@ -16,9 +16,9 @@ Texture::Texture(Context* context, size_t width, size_t height)
 	mWidth = width;
 	mHeight = height;
 	mData = new float4[width * height];
-	mDeviceData = new cl::Buffer(mContext->GetContext(), CL_MEM_READ_WRITE, width * height * sizeof(float4));
+	mDeviceData = mContext->IsNative() ? NULL : new cl::Buffer(mContext->GetContext(), CL_MEM_READ_WRITE, width * height * sizeof(float4));
 
-	if (!mProgram)
+	if (!mProgram && mDeviceData)
 	{
 		std::ifstream sf("C:\\Programming\\OpenTracer\\OpenTracer\\Texture.cl");
 		std::string s(std::istreambuf_iterator<char>(sf), (std::istreambuf_iterator<char>()));
@@ -41,6 +41,15 @@ void Texture::ClearColor(float r, float g, float b, float a)
 	cl_float4 color;  color.s[0] = r; color.s[1] = g; color.s[2] = b; color.s[3] = a;
 	size_t items = mWidth * mHeight;
 
+	if (!mDeviceData)
+	{
+		for (size_t i = 0; i < items; i++)
+		{
+			mData[i] = float4(r, g, b, a);
+		}
+		return;
+	}
+
 	mKernel->setArg(0, *mDeviceData);
 	mKernel->setArg(1, color);
 	mKernel->setArg(2, items);
@@ -56,11 +65,16 @@ void Texture::Resize(size_t width, size_t height)
 	mWidth = width;
 	mHeight = height;
 	mData = new float4[width * height];
-	mDeviceData = new cl::Buffer(mContext->GetContext(), CL_MEM_READ_WRITE, width * height * sizeof(float4));
+	mDeviceData = mContext->IsNative() ? NULL : new cl::Buffer(mContext->GetContext(), CL_MEM_READ_WRITE, width * height * sizeof(float4));
 }
 
 void* Texture::GetData()
 {
+	if (!mDeviceData)
+	{
+		return mData;
+	}
+
 	cl::Event evt;
 	mContext->GetCommandQueue().enqueueReadBuffer(*mDeviceData, CL_TRUE, 0, mWidth * mHeight * sizeof(float4), mData, 0, &evt);
 	evt.wait();
@@ -28,10 +28,17 @@ namespace OpenTracerCore
 		size_t		GetHeight() { return mHeight; }
 		void		SetData(cl::Buffer* data)
 		{
+			if (!mDeviceData)
+			{
+				return;
+			}
 			mContext->GetCommandQueue().enqueueCopyBuffer(*data, *mDeviceData, 0, 0, sizeof(float4) * mWidth * mHeight);
 		}
 		void*		GetData();
 		cl::Buffer*	GetDeviceData()	{ return mDeviceData; }
+
+		// Host copy written directly by native renderer (device buffer is NULL in native context)
+		float4*		GetHostData()	{ return mData; }
 	};
 }
 
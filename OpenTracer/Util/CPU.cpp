@@ -0,0 +1,125 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CPU.cpp
+//
+// Following file implements methods defined in CPU.h.
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Log:
+// - Initial file created
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Header section
+
+#include "CPU.h"
+#include "../Math/Numeric/Float16.h"
+#include <intrin.h>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Declaration section
+
+using namespace OpenTracerCore;
+
+static int gSimdIsa = -1;		// Cached result of detection, -1 until first query
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Definition section
+
+/// <summary>Queries CPUID and XCR0 register</summary>
+/// <return>Widest supported instruction set</return>
+static SimdIsa DetectSimdIsa()
+{
+	int info[4];
+	__cpuid(info, 0);
+	int leaves = info[0];
+	if (leaves < 7)
+	{
+		return SIMD_ISA_SSE4;
+	}
+
+	// AVX needs OSXSAVE, XMM and YMM state enabled by the OS
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	bool fma = (info[2] & (1 << 12)) != 0;
+	if (!osxsave || !avx || !fma)
+	{
+		return SIMD_ISA_SSE4;
+	}
+
+	unsigned long long xcr0 = _xgetbv(0);
+	if ((xcr0 & 0x6) != 0x6)
+	{
+		return SIMD_ISA_SSE4;
+	}
+
+	__cpuidex(info, 7, 0);
+	bool avx2 = (info[1] & (1 << 5)) != 0;
+	bool avx512f = (info[1] & (1 << 16)) != 0;
+	if (!avx2)
+	{
+		return SIMD_ISA_SSE4;
+	}
+
+	// AVX-512 also needs opmask and both halves of ZMM state
+	if (avx512f && (xcr0 & 0xE6) == 0xE6)
+	{
+		return SIMD_ISA_AVX512;
+	}
+
+	return SIMD_ISA_AVX2;
+}
+
+/// <summary>Detects widest supported instruction set</summary>
+/// <return>Widest supported instruction set</return>
+SimdIsa OpenTracerCore::GetSimdIsa()
+{
+	// Racing threads compute the same value, no locking needed
+	if (gSimdIsa < 0)
+	{
+		gSimdIsa = (int)DetectSimdIsa();
+	}
+
+	return (SimdIsa)gSimdIsa;
+}
+
+/// <summary>Number of float lanes CPU kernels should use</summary>
+/// <return>4, 8 or 16</return>
+unsigned int OpenTracerCore::GetSimdWidth()
+{
+	switch (GetSimdIsa())
+	{
+	case SIMD_ISA_AVX512:
+#ifdef FLOAT16_USE_AVX512
+		return 16;
+#else
+		return 8;
+#endif
+
+	case SIMD_ISA_AVX2:
+		return 8;
+
+	default:
+		return 4;
+	}
+}
+
+/// <summary>Name of instruction set for logs</summary>
+/// <param name="isa">Instruction set</param>
+const char* OpenTracerCore::GetSimdIsaName(SimdIsa isa)
+{
+	switch (isa)
+	{
+	case SIMD_ISA_AVX512:
+		return "AVX-512";
+
+	case SIMD_ISA_AVX2:
+		return "AVX2";
+
+	default:
+		return "SSE4";
+	}
+}
@@ -0,0 +1,52 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CPU.h
+//
+// Following file contains runtime detection of SIMD instruction sets used by CPU kernels
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Log:
+// - Initial file created
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __CPU_H__
+#define __CPU_H__
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Class & Structures definition
+
+namespace OpenTracerCore
+{
+	/// <summary>Widest SIMD instruction set usable on this machine</summary>
+	enum SimdIsa
+	{
+		SIMD_ISA_SSE4 = 0,			// 4 floats, required by float4
+		SIMD_ISA_AVX2 = 1,			// 8 floats, float8
+		SIMD_ISA_AVX512 = 2			// 16 floats, float16
+	};
+
+	/// <summary>
+	/// Detects instruction set supported by both CPU and operating system (which has to save the
+	/// extended registers on context switch). Result is computed once and cached.
+	/// </summary>
+	/// <return>Widest supported instruction set</return>
+	SimdIsa GetSimdIsa();
+
+	/// <summary>
+	/// Number of float lanes CPU kernels should use. AVX-512 counts only when the compiler emits
+	/// AVX-512 code for float16 (see Float16.h), emulated float16 is not faster than float8.
+	/// </summary>
+	/// <return>4, 8 or 16</return>
+	unsigned int GetSimdWidth();
+
+	/// <summary>Name of instruction set for logs</summary>
+	/// <param name="isa">Instruction set</param>
+	const char* GetSimdIsaName(SimdIsa isa);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// EOH
+
+#endif
@@ -248,6 +248,23 @@ namespace OpenTracerCore
 				return GetDefault<T>();
 			}
 		}
+
+		/// <summary>
+		/// Gets float constant, values written without decimal point are parsed as integers - they
+		/// are converted with a warning rather than reinterpreted
+		/// </summary>
+		/// <param name="name">Constant name</param>
+		float GetFloat(const std::string& name)
+		{
+			std::map<std::string, sConstant*>::iterator it = mData.find(name);
+			if (it != mData.end() && it->second->type == CONSTANT_INT)
+			{
+				std::cout << "Warning: " << name << " is an integer, write it as float (e.g. 1.0)" << std::endl;
+				return (float)*((int*)it->second->data);
+			}
+
+			return Get<float>(name);
+		}
 	};
 }
 
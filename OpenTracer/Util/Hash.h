@@ -0,0 +1,88 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Hash.h
+//
+// Following file contains non-cryptographic hash used to key cached data
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Log:
+// - Initial file created
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __HASH_H__
+#define __HASH_H__
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Header section
+
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Class & Structures definition
+
+namespace OpenTracerCore
+{
+	/// <summary>Initial value of FNV-1a hash</summary>
+	const unsigned long long HASH_SEED = 14695981039346656037ULL;
+
+	/// <summary>
+	/// Finalizer of MurmurHash3, every input bit affects every output bit
+	/// </summary>
+	/// <param name="w">Value to mix</param>
+	inline unsigned long long Mix(unsigned long long w)
+	{
+		w ^= w >> 33;
+		w *= 0xff51afd7ed558ccdULL;
+		w ^= w >> 33;
+		w *= 0xc4ceb9fe1a85ec53ULL;
+		w ^= w >> 33;
+		return w;
+	}
+
+	/// <summary>
+	/// FNV-1a variant consuming 8 bytes per step, so hashing whole scene geometry stays far cheaper
+	/// than building anything from it. Words are mixed before combining - multiplication alone only
+	/// moves bits upwards, so flips of high bits (e.g. float signs) in two words would cancel out.
+	/// Hashes can be chained by passing previous result as seed.
+	/// </summary>
+	/// <param name="data">Data to hash</param>
+	/// <param name="size">Size of data in bytes</param>
+	/// <param name="seed">Initial value, HASH_SEED or result of previous call</param>
+	inline unsigned long long Hash(const void* data, size_t size, unsigned long long seed = HASH_SEED)
+	{
+		const unsigned long long prime = 1099511628211ULL;
+		const unsigned char* bytes = (const unsigned char*)data;
+		unsigned long long h = seed;
+
+		size_t words = size / 8;
+		for (size_t i = 0; i < words; i++)
+		{
+			unsigned long long w;
+			memcpy(&w, bytes + 8 * i, 8);
+			h = (h ^ Mix(w)) * prime;
+		}
+
+		for (size_t i = 8 * words; i < size; i++)
+		{
+			h = (h ^ Mix(bytes[i])) * prime;
+		}
+
+		return h;
+	}
+
+	/// <summary>Hashes single value</summary>
+	/// <param name="value">Value to hash</param>
+	/// <param name="seed">Initial value, HASH_SEED or result of previous call</param>
+	template<typename T>
+	unsigned long long Hash(const T& value, unsigned long long seed)
+	{
+		return Hash(&value, sizeof(T), seed);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// EOH
+
+#endif
@@ -0,0 +1,149 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// MappedFile.cpp
+//
+// Following file contains read-only memory mapped file
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Log:
+// - Initial file created
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Header section
+
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace OpenTracerCore;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Definition section
+
+/// <summary>Creates closed file</summary>
+MappedFile::MappedFile()
+{
+	mFile = NULL;
+	mMapping = NULL;
+	mData = NULL;
+	mSize = 0;
+}
+
+/// <summary>Unmaps and closes the file</summary>
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+/// <summary>Opens and maps the file, previously opened file is closed</summary>
+/// <param name="filename">Path to file</param>
+bool MappedFile::Open(const std::string& filename)
+{
+	Close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	mFile = file;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		Close();
+		return false;
+	}
+	mSize = (size_t)size.QuadPart;
+
+	mMapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mMapping == NULL)
+	{
+		Close();
+		return false;
+	}
+
+	mData = MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+	if (mData == NULL)
+	{
+		Close();
+		return false;
+	}
+#else
+	int file = open(filename.c_str(), O_RDONLY);
+	if (file < 0)
+	{
+		return false;
+	}
+	mFile = (void*)(size_t)(file + 1);
+
+	struct stat info;
+	if (fstat(file, &info) != 0 || info.st_size == 0)
+	{
+		Close();
+		return false;
+	}
+	mSize = (size_t)info.st_size;
+
+	void* data = mmap(NULL, mSize, PROT_READ, MAP_PRIVATE, file, 0);
+	if (data == MAP_FAILED)
+	{
+		Close();
+		return false;
+	}
+	mData = data;
+#endif
+
+	return true;
+}
+
+/// <summary>Unmaps and closes the file</summary>
+void MappedFile::Close()
+{
+#ifdef _WIN32
+	if (mData)
+	{
+		UnmapViewOfFile(mData);
+	}
+
+	if (mMapping)
+	{
+		CloseHandle(mMapping);
+	}
+
+	if (mFile)
+	{
+		CloseHandle(mFile);
+	}
+#else
+	if (mData)
+	{
+		munmap(mData, mSize);
+	}
+
+	// Descriptor is stored off by one, so that NULL marks closed file
+	if (mFile)
+	{
+		close((int)((size_t)mFile - 1));
+	}
+#endif
+
+	mFile = NULL;
+	mMapping = NULL;
+	mData = NULL;
+	mSize = 0;
+}
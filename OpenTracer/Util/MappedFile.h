@@ -0,0 +1,68 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// MappedFile.h
+//
+// Following file contains read-only memory mapped file
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Log:
+// - Initial file created
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Header section
+
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Class & Structures definition
+
+namespace OpenTracerCore
+{
+	/// <summary>
+	/// Maps whole file into address space for reading. Pages are loaded by the OS on first access,
+	/// so data can be handed straight to a copy (e.g. buffer upload) without reading it first.
+	/// </summary>
+	class MappedFile
+	{
+	private:
+		void* mFile;			// File handle (descriptor on POSIX systems)
+		void* mMapping;			// File mapping handle, unused on POSIX systems
+		void* mData;			// Mapped view
+		size_t mSize;			// Size of file in bytes
+
+		MappedFile(const MappedFile&);
+		MappedFile& operator=(const MappedFile&);
+
+	public:
+		/// <summary>Creates closed file</summary>
+		MappedFile();
+
+		/// <summary>Unmaps and closes the file</summary>
+		~MappedFile();
+
+		/// <summary>Opens and maps the file, previously opened file is closed</summary>
+		/// <param name="filename">Path to file</param>
+		/// <return>False if file does not exist, is empty or could not be mapped</return>
+		bool Open(const std::string& filename);
+
+		/// <summary>Unmaps and closes the file</summary>
+		void Close();
+
+		/// <summary>Mapped data, NULL if no file is open</summary>
+		const void* GetData() const { return mData; }
+
+		/// <summary>Size of mapped data in bytes</summary>
+		size_t GetSize() const { return mSize; }
+	};
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// EOH
+
+#endif
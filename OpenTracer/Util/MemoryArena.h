@@ -0,0 +1,144 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// MemoryArena.h
+//
+// Following file contains bump allocator for short-lived scratch memory
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Log:
+// - Initial file created
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __MEMORY_ARENA_H__
+#define __MEMORY_ARENA_H__
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Header section
+
+#include <vector>
+#include <malloc.h>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Class & Structures definition
+
+namespace OpenTracerCore
+{
+	/// <summary>
+	/// Bump allocator working as a stack of memory blocks. Allocation only moves a pointer, memory
+	/// is returned by rewinding to a previously taken marker, which releases everything allocated
+	/// after it. Blocks are kept after rewinding, so repeated allocate/release cycles (e.g. one per
+	/// tree node) stop touching the system allocator once the arena has grown to its peak size.
+	/// Arena is not thread safe, use one arena per thread.
+	/// </summary>
+	class MemoryArena
+	{
+	public:
+		/// <summary>Position in arena, allocations made after it are released by Release</summary>
+		struct Marker
+		{
+			size_t mBlock;
+			size_t mUsed;
+		};
+
+	private:
+		/// <summary>Memory block</summary>
+		struct Block
+		{
+			unsigned char* mData;
+			size_t mSize;
+		};
+
+		std::vector<Block> mBlocks;		// Allocated blocks, blocks after current one are free
+		size_t mCurrent;				// Index of block used for allocation
+		size_t mUsed;					// Number of bytes used in current block
+		size_t mBlockSize;				// Default size of new block
+
+	public:
+		/// <summary>Creates empty arena</summary>
+		/// <param name="block_size">Default size of block in bytes</param>
+		MemoryArena(size_t block_size = 4 * 1024 * 1024)
+		{
+			mCurrent = 0;
+			mUsed = 0;
+			mBlockSize = block_size;
+		}
+
+		/// <summary>Frees all blocks</summary>
+		~MemoryArena()
+		{
+			for (size_t i = 0; i < mBlocks.size(); i++)
+			{
+				_aligned_free(mBlocks[i].mData);
+			}
+			mBlocks.clear();
+		}
+
+		/// <summary>Allocates memory from arena</summary>
+		/// <param name="size">Size in bytes</param>
+		/// <return>Pointer aligned to 16 bytes</return>
+		void* Allocate(size_t size)
+		{
+			size = (size + 15) & ~(size_t)15;
+
+			if (mBlocks.size() == 0 || mUsed + size > mBlocks[mCurrent].mSize)
+			{
+				// Continue in next block, replacing it when it is too small for this request
+				size_t next = mBlocks.size() == 0 ? 0 : mCurrent + 1;
+
+				if (next < mBlocks.size() && mBlocks[next].mSize < size)
+				{
+					_aligned_free(mBlocks[next].mData);
+					mBlocks.erase(mBlocks.begin() + next);
+				}
+
+				if (next == mBlocks.size() || mBlocks[next].mSize < size)
+				{
+					Block b;
+					b.mSize = size > mBlockSize ? size : mBlockSize;
+					b.mData = (unsigned char*)_aligned_malloc(b.mSize, 16);
+					mBlocks.insert(mBlocks.begin() + next, b);
+				}
+
+				mCurrent = next;
+				mUsed = 0;
+			}
+
+			void* ptr = mBlocks[mCurrent].mData + mUsed;
+			mUsed += size;
+
+			return ptr;
+		}
+
+		/// <summary>Allocates array from arena, elements are not constructed</summary>
+		/// <param name="count">Number of elements</param>
+		template<typename T>
+		T* Allocate(size_t count)
+		{
+			return (T*)Allocate(sizeof(T) * count);
+		}
+
+		/// <summary>Gets current position in arena</summary>
+		Marker GetMarker() const
+		{
+			Marker m;
+			m.mBlock = mCurrent;
+			m.mUsed = mUsed;
+			return m;
+		}
+
+		/// <summary>Releases all allocations made after marker was taken</summary>
+		/// <param name="m">Marker</param>
+		void Release(const Marker& m)
+		{
+			mCurrent = m.mBlock;
+			mUsed = m.mUsed;
+		}
+	};
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// EOH
+
+#endif
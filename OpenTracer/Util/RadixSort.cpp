@@ -0,0 +1,150 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// RadixSort.cpp
+//
+// Following file implements functions defined in RadixSort.h.
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Log:
+// - Initial file created
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Header section
+
+#include "RadixSort.h"
+#include <vector>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Declaration section
+
+using namespace OpenTracerCore;
+
+static const unsigned int RADIX_BITS = 8;
+static const unsigned int RADIX_SIZE = 1 << RADIX_BITS;
+static const size_t RADIX_MIN_CHUNK = 16384;	// Smaller chunks cost more in offsets than they save
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Definition section
+
+/// <summary>Sorts key-value pairs by the lowest bits of the key</summary>
+/// <param name="scheduler">Scheduler running the passes, NULL sorts on calling thread</param>
+/// <param name="keys">Keys, sorted on return</param>
+/// <param name="values">Values, permuted together with keys</param>
+/// <param name="temp_keys">Scratch buffer of count keys</param>
+/// <param name="temp_values">Scratch buffer of count values</param>
+/// <param name="count">Number of pairs</param>
+/// <param name="bits">Number of significant key bits</param>
+void OpenTracerCore::RadixSort(TaskScheduler* scheduler,
+	unsigned long long* keys,
+	unsigned int* values,
+	unsigned long long* temp_keys,
+	unsigned int* temp_values,
+	size_t count,
+	unsigned int bits)
+{
+	size_t workers = scheduler ? scheduler->GetWorkerCount() : 1;
+	size_t chunk = (count + workers - 1) / workers;
+	chunk = chunk > RADIX_MIN_CHUNK ? chunk : RADIX_MIN_CHUNK;
+	size_t chunks = count > 0 ? (count + chunk - 1) / chunk : 0;
+
+	// Histogram of chunk c is stored at [c * RADIX_SIZE], turned into scatter offsets in place
+	std::vector<size_t> offsets(chunks * RADIX_SIZE);
+
+	unsigned long long* src_keys = keys;
+	unsigned int* src_values = values;
+	unsigned long long* dst_keys = temp_keys;
+	unsigned int* dst_values = temp_values;
+
+	for (unsigned int shift = 0; shift < bits; shift += RADIX_BITS)
+	{
+		auto histogram = [&](size_t c)
+		{
+			size_t* h = &offsets[c * RADIX_SIZE];
+			for (unsigned int d = 0; d < RADIX_SIZE; d++)
+			{
+				h[d] = 0;
+			}
+
+			size_t last = (c + 1) * chunk < count ? (c + 1) * chunk : count;
+			for (size_t i = c * chunk; i < last; i++)
+			{
+				h[(src_keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+			}
+		};
+
+		auto scatter = [&](size_t c)
+		{
+			size_t* o = &offsets[c * RADIX_SIZE];
+			size_t last = (c + 1) * chunk < count ? (c + 1) * chunk : count;
+			for (size_t i = c * chunk; i < last; i++)
+			{
+				size_t dst = o[(src_keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+				dst_keys[dst] = src_keys[i];
+				dst_values[dst] = src_values[i];
+			}
+		};
+
+		if (scheduler && chunks > 1)
+		{
+			scheduler->ParallelFor(0, chunks, 1, [&](size_t first, size_t last) { for (size_t c = first; c < last; c++) histogram(c); });
+		}
+		else
+		{
+			for (size_t c = 0; c < chunks; c++)
+			{
+				histogram(c);
+			}
+		}
+
+		// Digits are ordered first, chunks of the same digit follow in input order (keeps sort stable)
+		size_t sum = 0;
+		bool skip = false;
+		for (unsigned int d = 0; d < RADIX_SIZE && !skip; d++)
+		{
+			size_t digit_count = 0;
+			for (size_t c = 0; c < chunks; c++)
+			{
+				size_t n = offsets[c * RADIX_SIZE + d];
+				offsets[c * RADIX_SIZE + d] = sum;
+				sum += n;
+				digit_count += n;
+			}
+			skip = digit_count == count;
+		}
+
+		if (skip)
+		{
+			continue;
+		}
+
+		if (scheduler && chunks > 1)
+		{
+			scheduler->ParallelFor(0, chunks, 1, [&](size_t first, size_t last) { for (size_t c = first; c < last; c++) scatter(c); });
+		}
+		else
+		{
+			for (size_t c = 0; c < chunks; c++)
+			{
+				scatter(c);
+			}
+		}
+
+		unsigned long long* tk = src_keys;
+		src_keys = dst_keys;
+		dst_keys = tk;
+
+		unsigned int* tv = src_values;
+		src_values = dst_values;
+		dst_values = tv;
+	}
+
+	if (src_keys != keys)
+	{
+		memcpy(keys, src_keys, sizeof(unsigned long long) * count);
+		memcpy(values, src_values, sizeof(unsigned int) * count);
+	}
+}
@@ -0,0 +1,52 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// RadixSort.h
+//
+// Following file contains parallel LSD radix sort of 64-bit keys with 32-bit values
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Log:
+// - Initial file created
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __RADIX_SORT_H__
+#define __RADIX_SORT_H__
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Header section
+
+#include <stddef.h>
+#include "TaskScheduler.h"
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Function definition
+
+namespace OpenTracerCore
+{
+	/// <summary>
+	/// Stable sort of key-value pairs by the lowest bits of the key, 8 bits per pass. Every pass
+	/// counts digits per chunk in parallel, computes chunk offsets and scatters in parallel. Passes
+	/// where all keys share the digit are skipped.
+	/// </summary>
+	/// <param name="scheduler">Scheduler running the passes, NULL sorts on calling thread</param>
+	/// <param name="keys">Keys, sorted on return</param>
+	/// <param name="values">Values, permuted together with keys</param>
+	/// <param name="temp_keys">Scratch buffer of count keys</param>
+	/// <param name="temp_values">Scratch buffer of count values</param>
+	/// <param name="count">Number of pairs</param>
+	/// <param name="bits">Number of significant key bits</param>
+	void RadixSort(TaskScheduler* scheduler,
+		unsigned long long* keys,
+		unsigned int* values,
+		unsigned long long* temp_keys,
+		unsigned int* temp_values,
+		size_t count,
+		unsigned int bits);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// EOH
+
+#endif
@@ -0,0 +1,211 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// TaskScheduler.cpp
+//
+// Following file implements methods defined in TaskScheduler.h.
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Log:
+// - Initial file created
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Header section
+
+#include "TaskScheduler.h"
+#include <chrono>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Declaration section
+
+using namespace OpenTracerCore;
+
+static __declspec(thread) const TaskScheduler* gCurrentScheduler = NULL;	// Scheduler owning calling thread
+static __declspec(thread) unsigned int gCurrentWorker = 0;					// Worker index of calling thread
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Definition section
+
+/// <summary>Creates scheduler and starts worker threads</summary>
+/// <param name="threads">Number of workers including calling thread, 0 uses all hardware threads</param>
+TaskScheduler::TaskScheduler(unsigned int threads)
+{
+	if (threads == 0)
+	{
+		threads = std::thread::hardware_concurrency();
+	}
+
+	if (threads == 0)
+	{
+		threads = 1;
+	}
+
+	mRunning = true;
+	mQueued = 0;
+
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		mWorkers.push_back(new Worker());
+	}
+
+	for (unsigned int i = 1; i < threads; i++)
+	{
+		mThreads.push_back(std::thread(&TaskScheduler::WorkerLoop, this, i));
+	}
+}
+
+/// <summary>Stops and joins worker threads, all groups must be waited for beforehand</summary>
+TaskScheduler::~TaskScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mRunning = false;
+	}
+	mSleep.notify_all();
+
+	for (auto& t : mThreads)
+	{
+		t.join();
+	}
+	mThreads.clear();
+
+	for (auto w : mWorkers)
+	{
+		delete w;
+	}
+	mWorkers.clear();
+}
+
+/// <summary>Worker thread entry point</summary>
+/// <param name="index">Worker index</param>
+void TaskScheduler::WorkerLoop(unsigned int index)
+{
+	gCurrentScheduler = this;
+	gCurrentWorker = index;
+
+	while (mRunning)
+	{
+		if (!RunTask(index))
+		{
+			// Timeout guards against missed notification between the check and the wait
+			std::unique_lock<std::mutex> lock(mSleepMutex);
+			mSleep.wait_for(lock, std::chrono::milliseconds(1), [this]() { return mQueued > 0 || !mRunning; });
+		}
+	}
+}
+
+/// <summary>Pops own task or steals one from other worker and executes it</summary>
+/// <param name="index">Worker index</param>
+/// <return>False when there was no task to execute</return>
+bool TaskScheduler::RunTask(unsigned int index)
+{
+	std::pair<Task, TaskGroup*> task;
+	bool found = false;
+
+	{
+		Worker* w = mWorkers[index];
+		std::lock_guard<std::mutex> lock(w->mMutex);
+		if (!w->mQueue.empty())
+		{
+			task = w->mQueue.back();
+			w->mQueue.pop_back();
+			found = true;
+		}
+	}
+
+	for (unsigned int i = 1; i < mWorkers.size() && !found; i++)
+	{
+		Worker* w = mWorkers[(index + i) % mWorkers.size()];
+		std::lock_guard<std::mutex> lock(w->mMutex);
+		if (!w->mQueue.empty())
+		{
+			task = w->mQueue.front();
+			w->mQueue.pop_front();
+			found = true;
+		}
+	}
+
+	if (!found)
+	{
+		return false;
+	}
+
+	mQueued--;
+	task.first();
+	task.second->mPending--;
+
+	return true;
+}
+
+/// <summary>Queues task into calling worker's deque</summary>
+/// <param name="group">Group the task belongs to</param>
+/// <param name="task">Task to execute</param>
+void TaskScheduler::Spawn(TaskGroup& group, const Task& task)
+{
+	group.mPending++;
+
+	Worker* w = mWorkers[GetWorkerIndex()];
+	{
+		std::lock_guard<std::mutex> lock(w->mMutex);
+		w->mQueue.push_back(std::make_pair(task, &group));
+	}
+
+	mQueued++;
+	mSleep.notify_one();
+}
+
+/// <summary>Executes queued tasks until all tasks in group are finished</summary>
+/// <param name="group">Group to wait for</param>
+void TaskScheduler::Wait(TaskGroup& group)
+{
+	unsigned int index = GetWorkerIndex();
+
+	while (group.mPending > 0)
+	{
+		if (!RunTask(index))
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+/// <summary>Splits range into chunks executed as tasks and waits for all of them</summary>
+/// <param name="begin">First index</param>
+/// <param name="end">One past last index</param>
+/// <param name="grain">Minimal number of indices in one chunk</param>
+/// <param name="body">Function processing chunk [first, last)</param>
+void TaskScheduler::ParallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body)
+{
+	if (end <= begin)
+	{
+		return;
+	}
+
+	// Few chunks per worker leave room for stealing when chunks take uneven time
+	size_t count = end - begin;
+	size_t chunks = mWorkers.size() * 4;
+	size_t chunk = (count + chunks - 1) / chunks;
+	chunk = chunk > grain ? chunk : grain;
+
+	if (chunk >= count)
+	{
+		body(begin, end);
+		return;
+	}
+
+	TaskGroup group;
+	for (size_t first = begin; first < end; first += chunk)
+	{
+		size_t last = first + chunk < end ? first + chunk : end;
+		Spawn(group, [&body, first, last]() { body(first, last); });
+	}
+	Wait(group);
+}
+
+/// <summary>Index of calling worker, 0 for any thread outside of the pool</summary>
+unsigned int TaskScheduler::GetWorkerIndex() const
+{
+	return gCurrentScheduler == this ? gCurrentWorker : 0;
+}
@@ -0,0 +1,117 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// TaskScheduler.h
+//
+// Following file contains work-stealing task scheduler used by parallel builders
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Log:
+// - Initial file created
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __TASK_SCHEDULER_H__
+#define __TASK_SCHEDULER_H__
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Header section
+
+#include <vector>
+#include <deque>
+#include <utility>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Class & Structures definition
+
+namespace OpenTracerCore
+{
+	/// <summary>
+	/// Thread pool executing tasks from per-worker deques. Worker pushes and pops its own tasks at
+	/// the back of its deque (depth-first), idle workers steal from the front of other deques
+	/// (largest tasks first). The thread that creates the scheduler acts as worker 0 and executes
+	/// tasks while it waits, so only one external thread may drive the scheduler at a time.
+	/// </summary>
+	class TaskScheduler
+	{
+	public:
+		/// <summary>Task function</summary>
+		typedef std::function<void()> Task;
+
+		/// <summary>Group of tasks that can be waited for</summary>
+		class TaskGroup
+		{
+		public:
+			std::atomic<int> mPending;	// Number of spawned, not yet finished tasks
+
+			TaskGroup()
+			{
+				mPending = 0;
+			}
+		};
+
+	private:
+		/// <summary>Worker task queue</summary>
+		struct Worker
+		{
+			std::mutex mMutex;
+			std::deque<std::pair<Task, TaskGroup*> > mQueue;
+		};
+
+		std::vector<Worker*> mWorkers;			// Per-worker queues, index 0 belongs to the owner thread
+		std::vector<std::thread> mThreads;		// Worker threads (workers 1 .. N-1)
+		std::atomic<bool> mRunning;				// Cleared when scheduler shuts down
+		std::atomic<int> mQueued;				// Number of queued tasks across all workers
+		std::mutex mSleepMutex;					// Guards idle workers sleeping
+		std::condition_variable mSleep;			// Wakes idle workers when new task is queued
+
+		/// <summary>Worker thread entry point</summary>
+		/// <param name="index">Worker index</param>
+		void WorkerLoop(unsigned int index);
+
+		/// <summary>Pops own task or steals one from other worker and executes it</summary>
+		/// <param name="index">Worker index</param>
+		/// <return>False when there was no task to execute</return>
+		bool RunTask(unsigned int index);
+
+	public:
+		/// <summary>Creates scheduler and starts worker threads</summary>
+		/// <param name="threads">Number of workers including calling thread, 0 uses all hardware threads</param>
+		TaskScheduler(unsigned int threads = 0);
+
+		/// <summary>Stops and joins worker threads, all groups must be waited for beforehand</summary>
+		~TaskScheduler();
+
+		/// <summary>Queues task into calling worker's deque</summary>
+		/// <param name="group">Group the task belongs to</param>
+		/// <param name="task">Task to execute</param>
+		void Spawn(TaskGroup& group, const Task& task);
+
+		/// <summary>Executes queued tasks until all tasks in group are finished</summary>
+		/// <param name="group">Group to wait for</param>
+		void Wait(TaskGroup& group);
+
+		/// <summary>Splits range into chunks executed as tasks and waits for all of them</summary>
+		/// <param name="begin">First index</param>
+		/// <param name="end">One past last index</param>
+		/// <param name="grain">Minimal number of indices in one chunk</param>
+		/// <param name="body">Function processing chunk [first, last)</param>
+		void ParallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body);
+
+		/// <summary>Index of calling worker, 0 for any thread outside of the pool</summary>
+		unsigned int GetWorkerIndex() const;
+
+		/// <summary>Number of workers including the owner thread</summary>
+		unsigned int GetWorkerCount() const { return (unsigned int)mWorkers.size(); }
+	};
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// EOH
+
+#endif
@@ -47,6 +47,7 @@ int main()
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
 	float time = 0.0f;
+	bool stackless = false;
 
 	bool run = true;
 	while (run)
@@ -58,6 +59,12 @@ int main()
 			{
 				run = false;
 			}
+			else if (e.type == sf::Event::KeyPressed && e.key.code == sf::Keyboard::R)
+			{
+				// Switches between rope and stack KD-tree traversal for comparison, needs KDTree.Ropes = 1
+				stackless = !stackless;
+				renderer->SetStacklessTraversal(stackless);
+			}
 			else if (e.type == sf::Event::Resized)
 			{
 				glViewport(0, 0, e.size.width, e.size.height);
@@ -108,7 +115,8 @@ int main()
 		{
 			std::cout << "FPS: " << 1000000 / us_i <<
 				" Time: " << us_i / 1000 << "ms " <<
-				"Rays: " << image->GetWidth() * image->GetHeight() * 1.0 / (double)us_i << "Mrays/s" << std::endl;
+				"Rays: " << image->GetWidth() * image->GetHeight() * 1.0 / (double)us_i << "Mrays/s " <<
+				"Trace (" << (stackless ? "ropes" : "stack") << "): " << renderer->GetLastTraceTime() << "ms" << std::endl;
 		}
 
 		window.display();